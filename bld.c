@@ -9,7 +9,13 @@ Nob_Cmd cmd = { 0 };
 #define BUILD_DIR "build/"
 #define SRC_DIR "src/"
 #define RT_DIR "rt/arch/Darwin/arm64/"
+#if defined(__x86_64__)
+#define TRAMPOLINE_DIR "rt/arch/Linux/x86_64/"
+#else
+#define TRAMPOLINE_DIR RT_DIR
+#endif
 #define TEST_DIR "test/"
+#define BENCH_DIR "bench/"
 
 #define STB_HEADERS(S)  \
     S(slice, SLICE)     \
@@ -28,21 +34,29 @@ Nob_Cmd cmd = { 0 };
     S(elrondlexer)     \
     S(ir)              \
     S(native)          \
+    S(intrinsics)      \
     S(node)            \
     S(parser)          \
     S(operators)       \
     S(type)            \
     S(value)           \
-    S(interpreter)
+    S(interpreter)     \
+    S(regvm)
 
 #define APP_SOURCES(S) \
     S(elrond)          \
     S(arm64)           \
     S(arm64_binop)     \
+    S(arm64_regalloc)  \
+    S(arm64_peephole)  \
+    S(arm64_objfile)   \
     S(generate)        \
+    S(optimize)        \
+    S(link)            \
     S(parser)          \
     S(operators)       \
     S(native)          \
+    S(intrinsics)      \
     S(node)            \
     S(typespec)        \
     S(normalize)       \
@@ -51,7 +65,12 @@ Nob_Cmd cmd = { 0 };
     S(bind)            \
     S(stack)           \
     S(interpreter)     \
-    S(execute)
+    S(execute)         \
+    S(regvm)           \
+    S(jit)             \
+    S(sequences)       \
+    S(profile)         \
+    S(cache)
 
 #define RT_SOURCES(S) \
     S(divzero)        \
@@ -63,16 +82,27 @@ Nob_Cmd cmd = { 0 };
     S(strlen)         \
     S(to_string)
 
-#define TEST_SOURCES(S) \
-    S(01_helloworld)    \
-    S(02_comptime)      \
-    S(03_binexp)        \
-    S(04_variable)      \
-    S(05_add_variables) \
-    S(06_assignment)    \
-    S(07_while)         \
-    S(08_modulo)        \
-    S(09_if_else)
+#define TEST_SOURCES(S)   \
+    S(01_helloworld)      \
+    S(02_comptime)        \
+    S(03_binexp)          \
+    S(04_variable)        \
+    S(05_add_variables)   \
+    S(06_assignment)      \
+    S(07_while)           \
+    S(08_modulo)          \
+    S(09_if_else)         \
+    S(11_comptime_fib)    \
+    S(12_comptime_loops)  \
+    S(13_comptime_widths) \
+    S(14_comptime_blocks) \
+    S(15_comptime_libc)   \
+    S(16_registers)
+
+#define BENCH_SOURCES(S) \
+    S(01_interpreter)
+
+#define BENCH_RUNS 5
 
 int format_sources()
 {
@@ -105,6 +135,200 @@ int format_sources()
     return 0;
 }
 
+// Builds a second compiler in build/switch/ with the interpreters
+// dispatching through their portable switch loops, so that `bench` can
+// compare those with the threaded loops.
+bool build_switch_dispatch(char const *cc, bool rebuild)
+{
+    if (!mkdir_if_not_exists(BUILD_DIR "switch")) {
+        return false;
+    }
+    char const *sources[] = {
+        "",
+#undef S
+#define S(H) SRC_DIR #H ".h",
+        APP_HEADERS(S)
+    };
+
+    bool sources_updated = rebuild;
+#undef S
+#define S(SRC)                                                                                                    \
+    sources[0] = SRC_DIR #SRC ".c";                                                                               \
+    if (rebuild || nob_needs_rebuild(BUILD_DIR "switch/" #SRC ".o", sources, sizeof(sources) / sizeof(char *))) { \
+        cmd_append(&cmd, cc, "-Wall", "-Wextra", "-c", "-g", "-DELROND_SWITCH_DISPATCH",                          \
+            "-o", BUILD_DIR "switch/" #SRC ".o", SRC_DIR #SRC ".c");                                              \
+        if (!cmd_run(&cmd)) {                                                                                     \
+            return false;                                                                                         \
+        }                                                                                                         \
+        sources_updated = true;                                                                                   \
+    }
+    APP_SOURCES(S)
+    if (sources_updated || !nob_file_exists(BUILD_DIR "switch/elrond")) {
+        cmd_append(&cmd, cc, "-o", BUILD_DIR "switch/elrond",
+#undef S
+#define S(SRC) BUILD_DIR "switch/" #SRC ".o",
+            APP_SOURCES(S) "-Lbuild", "-ltrampoline", "-lm");
+        if (!cmd_run(&cmd)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Times compiling a benchmark program with the compiler `elrond`, passing
+// `flag` to it if it isn't NULL. The comptime cache is bypassed so every
+// run executes the comptime code. Returns the best of BENCH_RUNS runs in
+// nanoseconds, or 0 if compiling failed.
+uint64_t time_benchmark(char const *elrond, char const *bench, char const *flag)
+{
+    uint64_t best = UINT64_MAX;
+    for (int run = 0; run < BENCH_RUNS; ++run) {
+        uint64_t start = nanos_since_unspecified_epoch();
+        cmd_append(&cmd, elrond, "--no-comptime-cache");
+        if (flag != NULL) {
+            cmd_append(&cmd, flag);
+        }
+        cmd_append(&cmd, bench);
+        if (!cmd_run(&cmd)) {
+            return 0;
+        }
+        uint64_t elapsed = nanos_since_unspecified_epoch() - start;
+        best = (elapsed < best) ? elapsed : best;
+    }
+    return best;
+}
+
+// Times compiling each benchmark program, with comptime code running on
+// the stack VM with threaded and with switch dispatch, and on the register
+// VM. The benchmarks do their work at comptime, so this measures the IR
+// interpreters.
+int run_benchmarks()
+{
+    nob_set_current_dir(BENCH_DIR);
+#undef S
+#define S(B)                                                                                         \
+    {                                                                                                \
+        uint64_t stack_vm = time_benchmark("../" BUILD_DIR "elrond", #B ".elr", NULL);               \
+        uint64_t switch_vm = time_benchmark("../" BUILD_DIR "switch/elrond", #B ".elr", NULL);       \
+        uint64_t register_vm = time_benchmark("../" BUILD_DIR "elrond", #B ".elr", "--register-vm"); \
+        if (stack_vm == 0 || switch_vm == 0 || register_vm == 0) {                                   \
+            return 1;                                                                                \
+        }                                                                                            \
+        nob_log(INFO, "%-20s stack VM threaded %8.3f ms, switch %8.3f ms, %5.2fx (best of %d)", #B,  \
+            (double) stack_vm / 1000000.0, (double) switch_vm / 1000000.0,                           \
+            (double) switch_vm / (double) stack_vm, BENCH_RUNS);                                     \
+        nob_log(INFO, "%-20s register VM       %8.3f ms, %5.2fx faster than the stack VM", #B,       \
+            (double) register_vm / 1000000.0, (double) stack_vm / (double) register_vm);             \
+    }
+    BENCH_SOURCES(S)
+    return 0;
+}
+
+// Compiles `test` with the comptime code running on the stack VM, and
+// with it compiled to native code from its first call, bypassing the
+// comptime cache. Returns the generated assembly in `sb`.
+bool compile_test(char const *test, bool jit, String_Builder *sb)
+{
+    cmd_append(&cmd, "../" BUILD_DIR "elrond", "--no-comptime-cache", "--keep-assembly");
+    if (jit) {
+        cmd_append(&cmd, "--jit", "--jit-threshold", "0");
+    }
+    cmd_append(&cmd, temp_sprintf("%s.elr", test));
+    if (!cmd_run(&cmd)) {
+        return false;
+    }
+    sb->count = 0;
+    return read_entire_file(temp_sprintf(".elrond/%s.s", test), sb);
+}
+
+// Checks that the code generated for every test program is the same with
+// and without the JIT. The comptime results end up in the assembly.
+int compare_jit()
+{
+    nob_set_current_dir(TEST_DIR);
+    String_Builder interpreted = { 0 };
+    String_Builder compiled = { 0 };
+    int            failed = 0;
+#undef S
+#define S(T)                                                                                                     \
+    if (!compile_test(#T, false, &interpreted) || !compile_test(#T, true, &compiled)) {                          \
+        return 1;                                                                                                \
+    }                                                                                                            \
+    if (interpreted.count != compiled.count || memcmp(interpreted.items, compiled.items, compiled.count) != 0) { \
+        nob_log(ERROR, "%-20s JIT and interpreter results differ", #T);                                          \
+        ++failed;                                                                                                \
+    } else {                                                                                                     \
+        nob_log(INFO, "%-20s OK", #T);                                                                           \
+    }
+    TEST_SOURCES(S)
+    sb_free(interpreted);
+    sb_free(compiled);
+    return (failed > 0) ? 1 : 0;
+}
+
+// Compiles `test`, passing `flag` to the compiler if it isn't NULL, and
+// counts the instructions in the generated assembly. Returns SIZE_MAX if
+// compiling failed.
+size_t count_instructions(char const *test, char const *flag)
+{
+    cmd_append(&cmd, "../" BUILD_DIR "elrond", "--no-comptime-cache", "--keep-assembly");
+    if (flag != NULL) {
+        cmd_append(&cmd, flag);
+    }
+    cmd_append(&cmd, temp_sprintf("%s.elr", test));
+    if (!cmd_run(&cmd)) {
+        return SIZE_MAX;
+    }
+    String_Builder sb = { 0 };
+    if (!read_entire_file(temp_sprintf(".elrond/%s.s", test), &sb)) {
+        return SIZE_MAX;
+    }
+    size_t count = 0;
+    for (size_t ix = 0; ix + 1 < sb.count; ++ix) {
+        if ((ix == 0 || sb.items[ix - 1] == '\n') && sb.items[ix] == '\t' && islower(sb.items[ix + 1])) {
+            ++count;
+        }
+    }
+    sb_free(sb);
+    return count;
+}
+
+// Checks the number of instructions generated for every test program,
+// without and with the arm64 peephole optimizer, against the counts in
+// test/peephole.golden. The actual counts are written to
+// test/.elrond/peephole.golden, to be copied over the golden file when the
+// code generator improves.
+int compare_peephole()
+{
+    nob_set_current_dir(TEST_DIR);
+    String_Builder actual = { 0 };
+    String_Builder golden = { 0 };
+#undef S
+#define S(T)                                                                          \
+    {                                                                                 \
+        size_t unoptimized = count_instructions(#T, "--no-peephole");                 \
+        size_t optimized = count_instructions(#T, NULL);                              \
+        if (unoptimized == SIZE_MAX || optimized == SIZE_MAX) {                       \
+            return 1;                                                                 \
+        }                                                                             \
+        sb_appendf(&actual, "%-20s %5zu %5zu\n", #T, unoptimized, optimized);         \
+        nob_log(INFO, "%-20s %5zu -> %5zu instructions", #T, unoptimized, optimized); \
+    }
+    TEST_SOURCES(S)
+    if (!write_entire_file(".elrond/peephole.golden", actual.items, actual.count)
+        || !read_entire_file("peephole.golden", &golden)) {
+        return 1;
+    }
+    int ret = 0;
+    if (golden.count != actual.count || memcmp(golden.items, actual.items, actual.count) != 0) {
+        nob_log(ERROR, "Instruction counts differ from peephole.golden. The actual counts are in .elrond/peephole.golden");
+        ret = 1;
+    }
+    sb_free(actual);
+    sb_free(golden);
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
     NOB_GO_REBUILD_URSELF(argc, argv);
@@ -113,6 +337,10 @@ int main(int argc, char **argv)
     char const *script = "helloworld.elr";
     bool        run = true;
     bool        format = false;
+    bool        bench = false;
+    bool        jit = false;
+    bool        peephole = false;
+    char const *vm_flag = NULL;
 
     for (int ix = 1; ix < argc; ++ix) {
         if (strcmp(argv[ix], "-B") == 0) {
@@ -127,6 +355,18 @@ int main(int argc, char **argv)
         if (strcmp(argv[ix], "format") == 0) {
             format = true;
         }
+        if (strcmp(argv[ix], "bench") == 0) {
+            bench = true;
+        }
+        if (strcmp(argv[ix], "jit") == 0) {
+            jit = true;
+        }
+        if (strcmp(argv[ix], "peephole") == 0) {
+            peephole = true;
+        }
+        if (strcmp(argv[ix], "--register-vm") == 0) {
+            vm_flag = argv[ix];
+        }
     }
 
     if (format) {
@@ -152,8 +392,8 @@ int main(int argc, char **argv)
         }
     }
 
-    if (rebuild || nob_needs_rebuild1(BUILD_DIR "libtrampoline.a", RT_DIR "trampoline.s")) {
-        cmd_append(&cmd, "as", RT_DIR "trampoline.s", "-o", BUILD_DIR "trampoline.o");
+    if (rebuild || nob_needs_rebuild1(BUILD_DIR "libtrampoline.a", TRAMPOLINE_DIR "trampoline.s")) {
+        cmd_append(&cmd, "as", TRAMPOLINE_DIR "trampoline.s", "-o", BUILD_DIR "trampoline.o");
         if (!cmd_run(&cmd)) {
             return 1;
         }
@@ -246,13 +486,32 @@ int main(int argc, char **argv)
         }
     }
 
+    if (bench) {
+        if (!build_switch_dispatch(cc, headers_updated)) {
+            return 1;
+        }
+        return run_benchmarks();
+    }
+
+    if (jit) {
+        return compare_jit();
+    }
+
+    if (peephole) {
+        return compare_peephole();
+    }
+
     if (run) {
         nob_set_current_dir(TEST_DIR);
         // putenv("DYLD_LIBRARY_PATH=../" BUILD_DIR);
         int exit_code;
 #undef S
 #define S(T)                                               \
-    cmd_append(&cmd, "../" BUILD_DIR "elrond", #T ".elr"); \
+    cmd_append(&cmd, "../" BUILD_DIR "elrond");            \
+    if (vm_flag != NULL) {                                 \
+        cmd_append(&cmd, vm_flag, "--no-comptime-cache");  \
+    }                                                      \
+    cmd_append(&cmd, #T ".elr");                           \
     if (!cmd_run(&cmd)) {                                  \
         return 1;                                          \
     }                                                      \
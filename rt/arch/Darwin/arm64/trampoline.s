@@ -33,12 +33,16 @@ trampoline:
         ldr     d6, [x12, 120]
         ldr     d7, [x12, 128]
 
+        ldr     x8, [x12, 168]      // Load indirect result address
+
         str     x12, [sp, #-16]!    // Save x12 (caller saved)
         ldr     x16, [x12]          // Load function pointer in x16
         blr     x16                 // Call function pointer
         ldr     x12, [sp], #16      // Restore x12
         str     x0, [x12, 136]      // Store x0 to int_return_value
         str     d0, [x12, 144]      // Store d0 to float_return_value
+        str     x1, [x12, 152]      // Store x1 to int_return_value_2
+        str     d1, [x12, 160]      // Store d1 to float_return_value_2
         mov     x0, xzr             // Return all good
         mov     sp, fp              // Restore SP, FP, and LR
         ldp     fp, lr, [sp], 16
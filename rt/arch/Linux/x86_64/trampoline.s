@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+.global _trampoline
+.global trampoline
+
+.text
+.align 16
+
+_trampoline:
+trampoline:
+        pushq   %rbp                    # Set up frame
+        movq    %rsp, %rbp
+        pushq   %rbx                    # rbx is callee saved and holds
+        subq    $8, %rsp                # *Trampoline. Keep rsp 16-byte aligned
+        movq    %rdi, %rbx
+
+        movq    184(%rbx), %rcx         # Number of stack words
+        testq   $1, %rcx                # Pad an odd number of words so rsp
+        jz      1f                      # is 16-byte aligned at the call
+        subq    $8, %rsp
+1:
+        movq    176(%rbx), %rsi         # Push the stack words, last one first
+2:
+        testq   %rcx, %rcx
+        jz      3f
+        decq    %rcx
+        pushq   (%rsi,%rcx,8)
+        jmp     2b
+3:
+        movq    8(%rbx), %rdi           # Load general purpose registers
+        movq    16(%rbx), %rsi
+        movq    24(%rbx), %rdx
+        movq    32(%rbx), %rcx
+        movq    40(%rbx), %r8
+        movq    48(%rbx), %r9
+
+        movsd   72(%rbx), %xmm0         # Load SSE registers
+        movsd   80(%rbx), %xmm1
+        movsd   88(%rbx), %xmm2
+        movsd   96(%rbx), %xmm3
+        movsd   104(%rbx), %xmm4
+        movsd   112(%rbx), %xmm5
+        movsd   120(%rbx), %xmm6
+        movsd   128(%rbx), %xmm7
+
+        movl    $8, %eax                # Upper bound of SSE registers used,
+        callq   *(%rbx)                 # for variadic functions
+        movq    %rax, 136(%rbx)         # Store rax to int_return_value
+        movsd   %xmm0, 144(%rbx)        # Store xmm0 to double_return_value
+        movq    %rdx, 152(%rbx)         # Store rdx to int_return_value_2
+        movsd   %xmm1, 160(%rbx)        # Store xmm1 to double_return_value_2
+
+        xorl    %eax, %eax              # Return all good
+        movq    -8(%rbp), %rbx          # Restore rbx, rsp and rbp
+        leave
+        ret
+
+.section .note.GNU-stack,"",@progbits
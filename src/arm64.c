@@ -5,6 +5,8 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
@@ -20,114 +22,150 @@
 #include "process.h"
 #include "type.h"
 
-void arm64_add_line(arm64_function_t *f, slice_t line)
-{
-    if (line.len == 0) {
-        sb_append_char(f->sections + f->active, '\n');
-        return;
-    }
-    if (line.items[0] == ';') {
-        sb_append_char(f->sections + f->active, '\t');
-        sb_append(f->sections + f->active, line);
-        sb_append_char(f->sections + f->active, '\n');
-        return;
-    }
-    if ((line.items[0] == '.') || line.items[line.len - 1] == ':') {
-        sb_append(f->sections + f->active, line);
-        sb_append_cstr(f->sections + f->active, " ; label \n");
-        return;
-    }
-
-    opt_size_t sp = slice_first_of(line, C(" \t"));
-    while (sp.ok) {
-        slice_t p = slice_first(line, sp.value);
-        line = slice_ltrim(slice_tail(line, sp.value + 1));
-        sb_append_char(f->sections + f->active, '\t');
-        sb_append(f->sections + f->active, p);
-        sp = slice_first_of(line, C(" \t"));
-    }
-    if (line.len > 0) {
-        sb_append_char(f->sections + f->active, '\t');
-        sb_append(f->sections + f->active, line);
-    }
-    sb_append_char(f->sections + f->active, '\n');
-}
+#undef S
+#define S(O, T) void generate_##O(arm64_function_t *f, operation_t *op);
+IROPERATIONTYPES(S)
+#undef S
 
-void arm64_add_instruction(arm64_function_t *f, slice_t mnemonic, char const *param_fmt, ...)
-{
-    va_list args;
-    va_start(args, param_fmt);
-    sb_append_char(f->sections + f->active, '\t');
-    sb_append(f->sections + f->active, mnemonic);
-    sb_append_char(f->sections + f->active, '\t');
-    sb_vprintf(f->sections + f->active, param_fmt, args);
-    sb_append_char(f->sections + f->active, '\n');
-    va_end(args);
-}
+static char const *arm64_opcode_names[] = {
+    [AO_Label] = "",
+    [AO_Comment] = "",
+#undef S
+#define S(O) [AO_##O] = #O,
+    ARM64_OPCODES(S)
+#undef S
+};
 
-void arm64_add_instruction_param(arm64_function_t *f, slice_t mnemonic, slice_t param)
-{
-    arm64_add_text(f, SL " " SL, SLARG(mnemonic), SLARG(param));
-}
+static char const *arm64_condition_names[] = {
+#undef S
+#define S(C) #C,
+    ARM64_CONDITIONS(S)
+#undef S
+};
 
-void arm64_add_simple_instruction(arm64_function_t *f, slice_t mnemonic)
+void arm64_emit_instr(arm64_function_t *f, arm64_instr_t instr)
 {
-    arm64_add_line(f, mnemonic);
+    dynarr_append(f->sections + f->active, instr);
 }
 
-void arm64_add_vtext(arm64_function_t *f, char const *fmt, va_list args)
+// The comment isn't copied, and has to live until the function is written.
+void arm64_add_comment(arm64_function_t *f, slice_t comment)
 {
-    static sb_t text_buffer = { 0 };
-    sb_vprintf(&text_buffer, fmt, args);
-
-    slice_t text = sb_as_slice(text_buffer);
-    if (text.len == 0) {
+    if (comment.len == 0) {
         return;
     }
-    text = slice_trim(text);
-    opt_size_t nl = slice_indexof(text, '\n');
-    while (nl.ok) {
-        slice_t line = slice_trim(slice_first(text, nl.value));
-        text = slice_tail(text, nl.value + 1);
-        arm64_add_line(f, line);
-        nl = slice_indexof(text, '\n');
-    }
-    if (text.len > 0) {
-        arm64_add_line(f, text);
-    }
-    sb_clear(&text_buffer);
+    arm64_emit_instr(f, (arm64_instr_t) { .opcode = AO_Comment, .comment = comment });
 }
 
-void arm64_add_text(arm64_function_t *f, char const *fmt, ...)
+static void arm64_reg_write(int reg, bool w, FILE *file)
 {
-    va_list args;
-    va_start(args, fmt);
-    arm64_add_vtext(f, fmt, args);
-    va_end(args);
+    switch (reg) {
+    case ARM64_FP:
+        fputs("fp", file);
+        break;
+    case ARM64_LR:
+        fputs("lr", file);
+        break;
+    case ARM64_SP:
+        fputs((w) ? "wsp" : "sp", file);
+        break;
+    case ARM64_ZR:
+        fputs((w) ? "wzr" : "xzr", file);
+        break;
+    default:
+        fprintf(file, "%c%d", (w) ? 'w' : 'x', reg);
+        break;
+    }
 }
 
-void arm64_add_label(arm64_function_t *f, slice_t label)
+static void arm64_label_write(arm64_label_t *label, FILE *file)
 {
-    arm64_add_text(f, "\n" SL ":", SLARG(label));
+    switch (label->kind) {
+    case ALK_IR:
+        fprintf(file, "lbl_%llu", (unsigned long long) label->id);
+        break;
+    case ALK_Local:
+        fprintf(file, "%llu", (unsigned long long) label->id);
+        break;
+    case ALK_String:
+        fprintf(file, "str_%llu", (unsigned long long) label->id);
+        break;
+    case ALK_Symbol:
+        fprintf(file, SL, SLARG(label->symbol));
+        break;
+    }
 }
 
-void arm64_add_directive_f(arm64_function_t *f, slice_t directive, slice_t args)
+static void arm64_operand_write(arm64_operand_t *operand, FILE *file)
 {
-    arm64_add_text(f, SL "\t" SL, SLARG(directive), SLARG(args));
+    switch (operand->kind) {
+    case AOK_None:
+        break;
+    case AOK_Reg:
+        arm64_reg_write(operand->reg, operand->w, file);
+        break;
+    case AOK_Imm:
+        fprintf(file, "#%lld", (long long) operand->imm);
+        break;
+    case AOK_Mem:
+        fputc('[', file);
+        arm64_reg_write(operand->reg, false, file);
+        switch (operand->mode) {
+        case AM_Offset:
+            fprintf(file, ",#%lld]", (long long) operand->imm);
+            break;
+        case AM_PreIndex:
+            fprintf(file, ",#%lld]!", (long long) operand->imm);
+            break;
+        case AM_PostIndex:
+            fprintf(file, "],#%lld", (long long) operand->imm);
+            break;
+        }
+        break;
+    case AOK_Label:
+        arm64_label_write(&operand->label, file);
+        if (operand->label.kind == ALK_Local) {
+            fputc((operand->label.forward) ? 'f' : 'b', file);
+        }
+        break;
+    }
 }
 
-void arm64_add_comment(arm64_function_t *f, slice_t comment)
+void arm64_instr_write(arm64_instr_t *instr, FILE *file)
 {
-    if (comment.len == 0) {
-        return;
-    }
-    arm64_add_text(f, "; " SL "\n", SLARG(comment));
-    opt_size_t nl = slice_indexof(comment, '\n');
-    while (nl.ok) {
-        slice_t line = slice_trim(slice_first(comment, nl.value));
-        comment = slice_tail(comment, nl.value + 1);
-        sb_printf(f->sections + f->active, "\t; " SL "\n", SLARG(line));
-        nl = slice_indexof(comment, '\n');
+    switch (instr->opcode) {
+    case AO_Label:
+        arm64_label_write(&instr->operands[0].label, file);
+        fputs(":\n", file);
+        break;
+    case AO_Comment: {
+        slice_t    comment = instr->comment;
+        opt_size_t nl = slice_indexof(comment, '\n');
+        while (nl.ok) {
+            fprintf(file, "\t; " SL "\n", SLARG(slice_trim(slice_first(comment, nl.value))));
+            comment = slice_tail(comment, nl.value + 1);
+            nl = slice_indexof(comment, '\n');
+        }
+        if (comment.len > 0) {
+            fprintf(file, "\t; " SL "\n", SLARG(slice_trim(comment)));
+        }
+    } break;
+    default:
+        fputc('\t', file);
+        if (instr->opcode == AO_b_cond) {
+            fprintf(file, "b.%s", arm64_condition_names[instr->cond]);
+        } else {
+            fputs(arm64_opcode_names[instr->opcode], file);
+        }
+        for (size_t ix = 0; ix < 3 && instr->operands[ix].kind != AOK_None; ++ix) {
+            fputc((ix == 0) ? '\t' : ',', file);
+            arm64_operand_write(instr->operands + ix, file);
+        }
+        if (instr->opcode == AO_cset) {
+            fprintf(file, ",%s", arm64_condition_names[instr->cond]);
+        }
+        fputc('\n', file);
+        break;
     }
 }
 
@@ -143,12 +181,14 @@ bool arm64_has_text(arm64_function_t *f)
 
 void arm64_analyze(arm64_function_t *f, ir_generator_t *gen, operations_t *operations)
 {
+    size_t num_params = 0;
     if (f->function.ok) {
         ir_node_t *func = gen->ir_nodes.items + f->function.value;
+        num_params = func->function.parameters.len;
         for (size_t ix = 0; ix < func->function.parameters.len; ++ix) {
             name_t *name = func->function.parameters.items + ix;
             f->stack_depth += align_at(16, type_size_of(name->type));
-            dynarr_append_s(arm64_variable_t, &f->variables, .name = name->name, .depth = f->stack_depth)
+            dynarr_append_s(arm64_variable_t, &f->variables, .name = name->name, .type = name->type, .depth = f->stack_depth)
         }
     }
 
@@ -159,10 +199,10 @@ void arm64_analyze(arm64_function_t *f, ir_generator_t *gen, operations_t *opera
         switch (op->type) {
         case IRO_ScopeBegin:
             dynarr_append(&depths, depth);
-            for (size_t iix = 0; iix < op->ScopeBegin.len; ++iix) {
-                name_t *name = op->ScopeBegin.items + iix;
+            for (size_t iix = 0; iix < op->ScopeBegin.variables.len; ++iix) {
+                name_t *name = op->ScopeBegin.variables.items + iix;
                 depth += align_at(16, type_size_of(name->type));
-                dynarr_append_s(arm64_variable_t, &f->variables, .name = name->name, .depth = depth);
+                dynarr_append_s(arm64_variable_t, &f->variables, .name = name->name, .type = name->type, .depth = depth);
             }
             f->stack_depth = MAX(f->stack_depth, depth);
             break;
@@ -174,13 +214,15 @@ void arm64_analyze(arm64_function_t *f, ir_generator_t *gen, operations_t *opera
             break;
         }
     }
+    dynarr_free(&depths);
+    arm64_allocate_registers(f, num_params, operations);
 }
 
 void arm64_emit_return(arm64_function_t *f)
 {
-    arm64_add_instruction_param(f, C("mov"), C("sp,fp"));
-    arm64_add_instruction_param(f, C("ldp"), C("fp,lr,[sp],16"));
-    arm64_add_simple_instruction(f, C("ret"));
+    arm64_emit(f, mov, ARM64_X(ARM64_SP), ARM64_X(ARM64_FP));
+    arm64_emit(f, ldp, ARM64_X(ARM64_FP), ARM64_X(ARM64_LR), ARM64_POST(ARM64_SP, 16));
+    arm64_emit(f, ret);
 }
 
 void push_to_stack(arm64_function_t *f, size_t size, int from_reg)
@@ -189,14 +231,14 @@ void push_to_stack(arm64_function_t *f, size_t size, int from_reg)
         return;
     }
     int num_regs = words_needed(8, size);
-    arm64_add_instruction(f, C("sub"), "sp,sp,%zu", align_at(16, num_regs * 8));
+    arm64_emit(f, sub, ARM64_X(ARM64_SP), ARM64_X(ARM64_SP), ARM64_IMM(align_at(16, num_regs * 8)));
 
     for (int ix = 0; ix < num_regs; ++ix) {
         if (ix < num_regs - 1) {
-            arm64_add_instruction(f, C("stp"), "x%d,x%d,[sp,%d]", from_reg + ix, from_reg + ix + 1, ix * 8);
+            arm64_emit(f, stp, ARM64_X(from_reg + ix), ARM64_X(from_reg + ix + 1), ARM64_MEM(ARM64_SP, ix * 8));
             ++ix;
         } else {
-            arm64_add_instruction(f, C("str"), "x%d,[sp,%d]", from_reg + ix, ix * 8);
+            arm64_emit(f, str, ARM64_X(from_reg + ix), ARM64_MEM(ARM64_SP, ix * 8));
         }
     }
 }
@@ -209,13 +251,13 @@ void pop_from_stack(arm64_function_t *f, size_t size, int to_reg)
     int num_regs = words_needed(8, size);
     for (int ix = 0; ix < num_regs; ++ix) {
         if (ix < num_regs - 1) {
-            arm64_add_instruction(f, C("ldp"), "x%d,x%d,[sp,%d]", to_reg + ix, to_reg + ix + 1, ix * 8);
+            arm64_emit(f, ldp, ARM64_X(to_reg + ix), ARM64_X(to_reg + ix + 1), ARM64_MEM(ARM64_SP, ix * 8));
             ++ix;
         } else {
-            arm64_add_instruction(f, C("ldr"), "x%d,[sp,%d]", to_reg + ix, ix * 8);
+            arm64_emit(f, ldr, ARM64_X(to_reg + ix), ARM64_MEM(ARM64_SP, ix * 8));
         }
     }
-    arm64_add_instruction(f, C("add"), "sp,sp,%zu", align_at(16, num_regs * 8));
+    arm64_emit(f, add, ARM64_X(ARM64_SP), ARM64_X(ARM64_SP), ARM64_IMM(align_at(16, num_regs * 8)));
 }
 
 int move_into_stack(arm64_function_t *f, size_t size, int from_reg, uint64_t to_pos)
@@ -226,41 +268,78 @@ int move_into_stack(arm64_function_t *f, size_t size, int from_reg, uint64_t to_
     int num_regs = words_needed(8, size);
     for (int ix = 0; ix < num_regs; ++ix) {
         if (ix < num_regs - 1) {
-            arm64_add_instruction(f, C("stp"), "x%d,x%d,[fp,-%llu]", from_reg + ix, from_reg + ix + 1, to_pos - ix * 8);
+            arm64_emit(f, stp, ARM64_X(from_reg + ix), ARM64_X(from_reg + ix + 1), ARM64_MEM(ARM64_FP, -(int64_t) (to_pos - ix * 8)));
             ++ix;
         } else {
-            arm64_add_instruction(f, C("str"), "x%d,[fp,-%llu]", from_reg + ix, to_pos - ix * 8);
+            arm64_emit(f, str, ARM64_X(from_reg + ix), ARM64_MEM(ARM64_FP, -(int64_t) (to_pos - ix * 8)));
         }
     }
     return from_reg + num_regs;
 }
 
+// Writes the prolog and the epilog. This runs after the code is generated,
+// when it's known which callee-saved registers the function uses. These are
+// saved below the variables, and the epilog restores them relative to fp
+// because the value stack may have left sp anywhere.
 void arm64_skeleton(arm64_function_t *f, ir_generator_t *gen)
 {
+    int    saved[10];
+    size_t num_saved = 0;
+    for (int ix = 19; ix < 29; ++ix) {
+        if (f->save_regs & (1u << ix)) {
+            saved[num_saved++] = ix;
+        }
+    }
+
     f->active = CS_Prolog;
-    sb_printf(f->sections + CS_Prolog, SL ":\n_" SL ":\n", SLARG(f->name), SLARG(f->name));
-    arm64_add_instruction_param(f, C("stp"), C("fp,lr,[sp,#-16]!"));
-    arm64_add_instruction_param(f, C("mov"), C("fp,sp"));
+    arm64_emit(f, Label, ARM64_SYMBOL(f->name));
+    arm64_emit(f, Label, ARM64_SYMBOL(sb_as_slice(sb_format("_" SL, SLARG(f->name)))));
+    arm64_emit(f, stp, ARM64_X(ARM64_FP), ARM64_X(ARM64_LR), ARM64_PRE(ARM64_SP, -16));
+    arm64_emit(f, mov, ARM64_X(ARM64_FP), ARM64_X(ARM64_SP));
     if (f->stack_depth > 0) {
-        arm64_add_instruction(f, C("sub"), "sp,sp,#%llu", f->stack_depth);
+        arm64_emit(f, sub, ARM64_X(ARM64_SP), ARM64_X(ARM64_SP), ARM64_IMM(f->stack_depth));
+    }
+    for (size_t ix = 0; ix < num_saved; ix += 2) {
+        if (ix + 1 < num_saved) {
+            arm64_emit(f, stp, ARM64_X(saved[ix]), ARM64_X(saved[ix + 1]), ARM64_PRE(ARM64_SP, -16));
+        } else {
+            arm64_emit(f, str, ARM64_X(saved[ix]), ARM64_PRE(ARM64_SP, -16));
+        }
     }
     if (f->function.ok) {
         int        reg = 0;
         ir_node_t *func = gen->ir_nodes.items + f->function.value;
         for (size_t ix = 0; ix < func->function.parameters.len; ++ix) {
-            name_t *param = func->function.parameters.items + ix;
-            int     pos = -1;
+            name_t           *param = func->function.parameters.items + ix;
+            arm64_variable_t *var = NULL;
             for (size_t iix = 0; iix < f->variables.len; ++iix) {
                 if (slice_eq(f->variables.items[iix].name, param->name)) {
-                    pos = f->variables.items[iix].depth;
+                    var = f->variables.items + iix;
                     break;
                 }
             }
-            assert(pos >= 0);
-            reg = move_into_stack(f, type_size_of(param->type), reg, pos);
+            assert(var != NULL);
+            if (var->reg > 0) {
+                arm64_emit(f, mov, ARM64_X(var->reg), ARM64_X(reg));
+                reg += words_needed(8, type_size_of(param->type));
+            } else {
+                reg = move_into_stack(f, type_size_of(param->type), reg, var->depth);
+            }
         }
     }
+
     f->active = CS_Epilog;
+    if (f->save_regs & (1u << 21)) {
+        arm64_emit(f, mov, ARM64_X(0), ARM64_X(21));
+    }
+    for (size_t ix = 0; ix < num_saved; ix += 2) {
+        int64_t pos = f->stack_depth + 8 * (ix + 2);
+        if (ix + 1 < num_saved) {
+            arm64_emit(f, ldp, ARM64_X(saved[ix]), ARM64_X(saved[ix + 1]), ARM64_MEM(ARM64_FP, -pos));
+        } else {
+            arm64_emit(f, ldr, ARM64_X(saved[ix]), ARM64_MEM(ARM64_FP, -pos));
+        }
+    }
     arm64_emit_return(f);
     f->active = CS_Code;
 }
@@ -274,7 +353,7 @@ bool check_reg(arm64_function_t *f, int num, int reg)
 {
     bool available = true;
     for (int ix = reg; ix < reg + num; ++ix) {
-        if (f->regs & (1 << ix)) {
+        if ((f->regs | f->var_regs) & (1 << ix)) {
             available = false;
             break;
         }
@@ -346,16 +425,16 @@ void arm64_push(arm64_function_t *f, size_t size)
     arm64_register_allocation_t dest = arm64_push_reg(f, size);
     if (dest.reg > 0) {
         for (int i = 0; i < dest.num_regs; ++i) {
-            arm64_add_instruction(f, C("mov"), "x%d,x%d", dest.reg + i, i);
+            arm64_emit(f, mov, ARM64_X(dest.reg + i), ARM64_X(i));
         }
     } else {
         int num = dest.num_regs;
         while (num > 0) {
             if (num > 1) {
-                arm64_add_instruction(f, C("stp"), "x%zu,x%zu,[sp,#16]!", dest.num_regs - num, dest.num_regs - num + 1);
+                arm64_emit(f, stp, ARM64_X(dest.num_regs - num), ARM64_X(dest.num_regs - num + 1), ARM64_PRE(ARM64_SP, -16));
                 num -= 2;
             } else {
-                arm64_add_instruction(f, C("str"), "x%zu,[sp,#16]!", dest.num_regs - num);
+                arm64_emit(f, str, ARM64_X(dest.num_regs - num), ARM64_PRE(ARM64_SP, -16));
                 --num;
             }
         }
@@ -383,22 +462,23 @@ int arm64_pop(arm64_function_t *f, size_t size, int target)
         arm64_register_allocation_t src = arm64_pop_reg(f);
         if (src.reg > 0) {
             for (int i = 0; i < src.num_regs; ++i) {
-                arm64_add_instruction(f, C("mov"), "x%d,x%d", target + i, src.reg + i);
+                arm64_emit(f, mov, ARM64_X(target + i), ARM64_X(src.reg + i));
             }
         } else {
             int num = src.num_regs;
             while (num > 0) {
                 if (num > 1) {
-                    arm64_add_instruction(f, C("ldp"), "x%zu,x%zu,[sp],#16", target + src.num_regs - num, target + src.num_regs - num + 1);
+                    arm64_emit(f, ldp, ARM64_X(target + src.num_regs - num), ARM64_X(target + src.num_regs - num + 1), ARM64_POST(ARM64_SP, 16));
                     num -= 2;
                 } else {
-                    arm64_add_instruction(f, C("str"), "x%zu,[sp],#16", target + src.num_regs - num);
+                    arm64_emit(f, ldr, ARM64_X(target + src.num_regs - num), ARM64_POST(ARM64_SP, 16));
                     --num;
                 }
             }
         }
     } break;
     case VSE_VarPointer:
+    case VSE_VarRegister:
         arm64_deref(f, size, target);
         break;
     }
@@ -415,33 +495,68 @@ arm64_var_pointer_t arm64_deref_by_type(arm64_function_t *f, nodeptr type, int t
     return arm64_deref(f, type_size_of(type), target);
 }
 
-arm64_var_pointer_t arm64_deref(arm64_function_t *f, size_t size, int target)
+// Moves the value of the variable referenced by var into target...
+static void arm64_load_var(arm64_function_t *f, arm64_value_stack_entry_t *var, int num_regs, int target)
 {
-    if (size == 0) {
-        return 0;
+    if (var->type == VSE_VarRegister) {
+        if (target != var->var_register) {
+            arm64_emit(f, mov, ARM64_X(target), ARM64_X(var->var_register));
+        }
+        return;
     }
-    assert(f->stack.len > 0);
-    arm64_value_stack_entry_t *e = dynarr_back(&f->stack);
-    assert(e->type == VSE_VarPointer);
-    arm64_var_pointer_t ptr = e->var_pointer;
-    arm64_var_pointer_t ret = ptr;
-    int                 num_regs = words_needed(8, size);
+    arm64_var_pointer_t ptr = var->var_pointer;
     int                 num = num_regs;
     while (num > 0) {
         if (num > 1) {
-            arm64_add_instruction(f, C("ldp"), "x%d,x%d,[fp,-%llu]", target + num_regs - num, target + num_regs - num + 1, ptr);
+            arm64_emit(f, ldp, ARM64_X(target + num_regs - num), ARM64_X(target + num_regs - num + 1), ARM64_MEM(ARM64_FP, -(int64_t) ptr));
             num -= 2;
             ptr += 2;
         } else {
-            arm64_add_instruction(f, C("ldr"), "x%d,[fp,-%llu]", target + num_regs - num, ptr);
+            arm64_emit(f, ldr, ARM64_X(target + num_regs - num), ARM64_MEM(ARM64_FP, -(int64_t) ptr));
             --num;
             ++ptr;
         }
     }
+}
+
+arm64_var_pointer_t arm64_deref(arm64_function_t *f, size_t size, int target)
+{
+    if (size == 0) {
+        return 0;
+    }
+    assert(f->stack.len > 0);
+    arm64_value_stack_entry_t *e = dynarr_back(&f->stack);
+    assert(e->type == VSE_VarPointer || e->type == VSE_VarRegister);
+    arm64_var_pointer_t ret = (e->type == VSE_VarPointer) ? e->var_pointer : 0;
+    arm64_load_var(f, e, words_needed(8, size), target);
     dynarr_pop(&f->stack);
     return ret;
 }
 
+// Pops the variable reference off the value stack and pushes the value of
+// the variable. The value is loaded straight into the register allocated
+// for it, if there is one.
+void arm64_push_deref_by_type(arm64_function_t *f, nodeptr type)
+{
+    if (type_kind(type) == TYPK_VoidType) {
+        return;
+    }
+    size_t size = type_size_of(type);
+    assert(f->stack.len > 0);
+    arm64_value_stack_entry_t var = *dynarr_back(&f->stack);
+    assert(var.type == VSE_VarPointer || var.type == VSE_VarRegister);
+    dynarr_pop(&f->stack);
+    arm64_register_allocation_t dest = arm64_push_reg(f, size);
+    if (dest.reg > 0) {
+        arm64_load_var(f, &var, dest.num_regs, dest.reg);
+        return;
+    }
+    arm64_pop_reg(f);
+    dynarr_append(&f->stack, var);
+    arm64_deref(f, size, 0);
+    arm64_push(f, size);
+}
+
 // Pops the variable reference off the value stack, then pops an allocation
 // and moves x0... into the variable
 arm64_var_pointer_t arm64_assign_by_type(arm64_function_t *f, nodeptr type)
@@ -461,7 +576,15 @@ arm64_var_pointer_t arm64_assign(arm64_function_t *f, size_t size)
     // Pop the variable reference:
     assert(f->stack.len > 0);
     arm64_value_stack_entry_t *e = dynarr_back(&f->stack);
-    assert(e->type == VSE_VarPointer);
+    assert(e->type == VSE_VarPointer || e->type == VSE_VarRegister);
+    if (e->type == VSE_VarRegister) {
+        // Pop the top of the value stack straight into the register:
+        int reg = e->var_register;
+        dynarr_pop(&f->stack);
+        arm64_pop(f, size, reg);
+        dynarr_pop(&f->stack);
+        return 0;
+    }
     arm64_var_pointer_t ptr = e->var_pointer;
     arm64_var_pointer_t ret = ptr;
     dynarr_pop(&f->stack);
@@ -474,11 +597,11 @@ arm64_var_pointer_t arm64_assign(arm64_function_t *f, size_t size)
     int num = num_regs;
     while (num > 0) {
         if (num > 1) {
-            arm64_add_instruction(f, C("stp"), "x%d,x%d,[fp,-%llu]", num_regs - num, num_regs - num + 1, ptr);
+            arm64_emit(f, stp, ARM64_X(num_regs - num), ARM64_X(num_regs - num + 1), ARM64_MEM(ARM64_FP, -(int64_t) ptr));
             num -= 2;
             ptr += 2;
         } else {
-            arm64_add_instruction(f, C("str"), "x%d,[fp,-%llu]", num_regs - num, ptr);
+            arm64_emit(f, str, ARM64_X(num_regs - num), ARM64_MEM(ARM64_FP, -(int64_t) ptr));
             --num;
             ++ptr;
         }
@@ -489,9 +612,21 @@ arm64_var_pointer_t arm64_assign(arm64_function_t *f, size_t size)
 
 void arm64_function_write(arm64_function_t *func, FILE *f)
 {
-    slice_fwrite(sb_as_slice(func->sections[CS_Prolog]), f);
-    slice_fwrite(sb_as_slice(func->sections[CS_Code]), f);
-    slice_fwrite(sb_as_slice(func->sections[CS_Epilog]), f);
+    dynarr_foreach(arm64_instr_t, instr, func->sections + CS_Prolog)
+    {
+        arm64_instr_write(instr, f);
+    }
+    fputc('\n', f);
+    dynarr_foreach(arm64_instr_t, instr, func->sections + CS_Code)
+    {
+        arm64_instr_write(instr, f);
+    }
+    fputc('\n', f);
+    dynarr_foreach(arm64_instr_t, instr, func->sections + CS_Epilog)
+    {
+        arm64_instr_write(instr, f);
+    }
+    fputc('\n', f);
 }
 
 void generate_default(arm64_function_t *f, operation_t *op)
@@ -514,6 +649,21 @@ void generate_AssignValue(arm64_function_t *f, operation_t *op)
     // debug_stack(function, "AssignValue");
 }
 
+void generate_AssignVar(arm64_function_t *f, operation_t *op)
+{
+    generate_PushVarAddress(f, &(operation_t) { .type = IRO_PushVarAddress, .PushVarAddress = op->AssignVar.var });
+    arm64_assign_by_type(f, op->AssignVar.type);
+}
+
+void generate_AssignVarKeep(arm64_function_t *f, operation_t *op)
+{
+    var_path_t var = op->AssignVarKeep.var;
+    generate_PushVarAddress(f, &(operation_t) { .type = IRO_PushVarAddress, .PushVarAddress = var });
+    arm64_assign_by_type(f, op->AssignVarKeep.type);
+    var.type = op->AssignVarKeep.type;
+    generate_PushValue(f, &(operation_t) { .type = IRO_PushValue, .PushValue = var });
+}
+
 void generate_BinaryOperator(arm64_function_t *f, operation_t *op)
 {
     (void) f;
@@ -521,13 +671,47 @@ void generate_BinaryOperator(arm64_function_t *f, operation_t *op)
     arm64_binop(f, op->BinaryOperator.lhs, op->BinaryOperator.op, op->BinaryOperator.rhs);
 }
 
+// The opcodes specialized by operand type only matter to the
+// interpreter. Their payload is the original binary operation.
+#undef S
+#define S(O, T)                                             \
+    void generate_##O(arm64_function_t *f, operation_t *op) \
+    {                                                       \
+        generate_BinaryOperator(f, op);                     \
+    }
+INTTYPES(IRINTOPCODES)
+FLOATTYPES(IRFLOATOPCODES)
+#undef S
+
+void generate_BinaryOperatorVarConst(arm64_function_t *f, operation_t *op)
+{
+    var_const_op_t *fused = &op->BinaryOperatorVarConst;
+    generate_PushValue(f, &(operation_t) { .type = IRO_PushValue, .PushValue = fused->var });
+    generate_PushConstant(f, &(operation_t) { .type = IRO_PushConstant, .PushConstant = fused->constant });
+    arm64_binop(f, fused->op.lhs, fused->op.op, fused->op.rhs);
+}
+
+void generate_BinaryOperatorVarConstJumpF(arm64_function_t *f, operation_t *op)
+{
+    generate_BinaryOperatorVarConst(f, &(operation_t) { .type = IRO_BinaryOperatorVarConst, .BinaryOperatorVarConst = op->BinaryOperatorVarConstJumpF.cond });
+    generate_JumpF(f, &(operation_t) { .type = IRO_JumpF, .JumpF = op->BinaryOperatorVarConstJumpF.jump });
+}
+
+void generate_BinaryOperatorVarVar(arm64_function_t *f, operation_t *op)
+{
+    var_var_op_t *fused = &op->BinaryOperatorVarVar;
+    generate_PushValue(f, &(operation_t) { .type = IRO_PushValue, .PushValue = fused->lhs });
+    generate_PushValue(f, &(operation_t) { .type = IRO_PushValue, .PushValue = fused->rhs });
+    arm64_binop(f, fused->op.lhs, fused->op.op, fused->op.rhs);
+}
+
 void generate_Break(arm64_function_t *f, operation_t *op)
 {
     if (op->Break.label != op->Break.scope_end) {
         f->save_regs |= 3 << 19; // reg 19 and 20
-                                 //        arm64_add_instruction(f, C("mov"), "x19,%llu", op->Break.depth);
-                                 //        arm64_add_instruction(f, C("adr"), "x20,lbl_%llu", op->Break.label);
-        arm64_add_instruction(f, C("b"), "lbl_%llu", op->Break.scope_end);
+                                 //        arm64_emit(f, mov, ARM64_X(19), ARM64_IMM(op->Break.depth));
+                                 //        arm64_emit(f, adr, ARM64_X(20), ARM64_LABEL(op->Break.label));
+        arm64_emit(f, b, ARM64_LABEL(op->Break.scope_end));
     }
 }
 
@@ -551,7 +735,7 @@ void generate_CallOp(arm64_function_t *f, call_op_t *call)
     if (colon.ok) {
         name = slice_tail(name, colon.value + 1);
     }
-    arm64_add_instruction(f, C("bl"), "_" SL, SLARG(name));
+    arm64_emit_instr(f, (arm64_instr_t) { .opcode = AO_bl, .arg_regs = reg, .operands = { ARM64_SYMBOL(sb_as_slice(sb_format("_" SL, SLARG(name)))) } });
     arm64_push_by_type(f, call->return_type);
 }
 
@@ -568,8 +752,7 @@ void generate_DeclVar(arm64_function_t *f, operation_t *op)
 
 void generate_Dereference(arm64_function_t *f, operation_t *op)
 {
-    arm64_deref_by_type(f, op->Dereference, 0);
-    arm64_push_by_type(f, op->Dereference);
+    arm64_push_deref_by_type(f, op->Dereference);
 }
 
 void generate_Discard(arm64_function_t *f, operation_t *op)
@@ -580,35 +763,35 @@ void generate_Discard(arm64_function_t *f, operation_t *op)
     while (f->stack.len != 0) {
         arm64_register_allocation_t reg = arm64_pop_reg(f);
         if (reg.reg < 0) {
-            arm64_add_instruction(f, C("add"), "sp,%ld", align_at(16, reg.num_regs * 8));
+            arm64_emit(f, add, ARM64_X(ARM64_SP), ARM64_X(ARM64_SP), ARM64_IMM(align_at(16, reg.num_regs * 8)));
         }
     }
 }
 
 void generate_Jump(arm64_function_t *f, operation_t *op)
 {
-    arm64_add_instruction(f, C("b"), "lbl_%llu", op->Jump);
+    arm64_emit(f, b, ARM64_LABEL(op->Jump.label));
 }
 
 void generate_JumpF(arm64_function_t *f, operation_t *op)
 {
     arm64_pop_by_type(f, Boolean, 0);
-    arm64_add_instruction_param(f, C("mov"), C("x1,xzr"));
-    arm64_add_instruction_param(f, C("cmp"), C("x0,x1"));
-    arm64_add_instruction(f, C("b.eq"), "lbl_%llu", op->JumpF);
+    arm64_emit(f, mov, ARM64_X(1), ARM64_X(ARM64_ZR));
+    arm64_emit(f, cmp, ARM64_X(0), ARM64_X(1));
+    arm64_emit_b_cond(f, eq, ARM64_LABEL(op->JumpF.label));
 }
 
 void generate_JumpT(arm64_function_t *f, operation_t *op)
 {
     arm64_pop_by_type(f, Boolean, 0);
-    arm64_add_instruction_param(f, C("mov"), C("x1,xzr"));
-    arm64_add_instruction_param(f, C("cmp"), C("x0,x1"));
-    arm64_add_instruction(f, C("b.ne"), "lbl_%llu", op->JumpT);
+    arm64_emit(f, mov, ARM64_X(1), ARM64_X(ARM64_ZR));
+    arm64_emit(f, cmp, ARM64_X(0), ARM64_X(1));
+    arm64_emit_b_cond(f, ne, ARM64_LABEL(op->JumpT.label));
 }
 
 void generate_Label(arm64_function_t *f, operation_t *op)
 {
-    sb_printf(f->sections + f->active, "lbl_%llu:\n", op->Label);
+    arm64_emit(f, Label, ARM64_LABEL(op->Label));
 }
 
 void generate_NativeCall(arm64_function_t *f, operation_t *op)
@@ -620,11 +803,11 @@ void generate_Pop(arm64_function_t *f, operation_t *op)
 {
     f->save_regs |= 1 << 21;
     arm64_pop_by_type(f, op->Pop, 0);
-    arm64_add_instruction_param(f, C("mov"), C("x21,x0"));
+    arm64_emit(f, mov, ARM64_X(21), ARM64_X(0));
     while (f->stack.len > 0) {
         arm64_register_allocation_t reg = arm64_pop_reg(f);
         if (reg.reg < 0) {
-            arm64_add_instruction(f, C("add"), "sp,%ld", align_at(16, reg.num_regs * 8));
+            arm64_emit(f, add, ARM64_X(ARM64_SP), ARM64_X(ARM64_SP), ARM64_IMM(align_at(16, reg.num_regs * 8)));
         }
     }
 }
@@ -641,24 +824,20 @@ void generate_PushConstant(arm64_function_t *f, operation_t *op)
         int                         r = (reg.reg > 0) ? reg.reg : 0;
         switch (t->int_type.width_bits) {
         case 8:
-            arm64_add_instruction(f, C("mov"), "w%d,#%d", r, (t->int_type.is_signed) ? (int) v->i8 : (int) v->u8);
+            arm64_emit(f, mov, ARM64_W(r), ARM64_IMM((t->int_type.is_signed) ? (int) v->i8 : (int) v->u8));
             break;
         case 16:
-            arm64_add_instruction(f, C("mov"), "w%d,#%d", r, (t->int_type.is_signed) ? (int) v->i16 : (int) v->u16);
+            arm64_emit(f, mov, ARM64_W(r), ARM64_IMM((t->int_type.is_signed) ? (int) v->i16 : (int) v->u16));
             break;
         case 32:
-            arm64_add_instruction(f, C("mov"), "w%d,#%lld", r, (t->int_type.is_signed) ? (int64_t) v->i32 : (int64_t) v->u16);
+            arm64_emit(f, mov, ARM64_W(r), ARM64_IMM((t->int_type.is_signed) ? (int64_t) v->i32 : (int64_t) v->u16));
             break;
         case 64:
-            if (t->int_type.is_signed) {
-                arm64_add_instruction(f, C("mov"), "x%d,#%lld", r, v->i64);
-            } else {
-                arm64_add_instruction(f, C("mov"), "x%d,#%llu", r, v->u64);
-            }
+            arm64_emit(f, mov, ARM64_X(r), ARM64_IMM(v->i64));
             break;
         }
         if (reg.reg < 0) {
-            arm64_add_instruction(f, C("str"), "x0,[sp,#-16]!");
+            arm64_emit(f, str, ARM64_X(0), ARM64_PRE(ARM64_SP, -16));
         }
     } break;
     case TYPK_SliceType: {
@@ -667,12 +846,12 @@ void generate_PushConstant(arm64_function_t *f, operation_t *op)
             int                         str_id = arm64_add_string(f->object, slice);
             arm64_register_allocation_t reg = arm64_push_reg_by_type(f, v->type);
             if (reg.reg > 0) {
-                arm64_add_instruction(f, C("adr"), "x%d,str_%d", reg.reg, str_id);
-                arm64_add_instruction(f, C("mov"), "x%d,#%zu", reg.reg + 1, slice.len);
+                arm64_emit(f, adr, ARM64_X(reg.reg), ARM64_STRING(str_id));
+                arm64_emit(f, mov, ARM64_X(reg.reg + 1), ARM64_IMM(slice.len));
             } else {
-                arm64_add_instruction(f, C("adr"), "x0,str_%d", str_id);
-                arm64_add_instruction(f, C("mov"), "x1,#%zu", slice.len);
-                arm64_add_instruction(f, C("stp"), "x%d,x%d,[sp,#-16]!", reg.reg, reg.reg + 1);
+                arm64_emit(f, adr, ARM64_X(0), ARM64_STRING(str_id));
+                arm64_emit(f, mov, ARM64_X(1), ARM64_IMM(slice.len));
+                arm64_emit(f, stp, ARM64_X(0), ARM64_X(1), ARM64_PRE(ARM64_SP, -16));
             }
         } else {
             arm64_add_comment(f, sb_as_slice(sb_format("PushConstant " SL, SLARG(type_to_string(v->type)))));
@@ -684,19 +863,29 @@ void generate_PushConstant(arm64_function_t *f, operation_t *op)
     }
 }
 
+void arm64_push_var_address(arm64_function_t *f, var_path_t *var)
+{
+    for (size_t ix = 0; ix < f->variables.len; ++ix) {
+        arm64_variable_t *v = f->variables.items + ix;
+        if (slice_eq(var->name, v->name)) {
+            if (v->reg > 0) {
+                dynarr_append_s(arm64_value_stack_entry_t, &f->stack, .var_register = v->reg, .type = VSE_VarRegister);
+            } else {
+                dynarr_append_s(arm64_value_stack_entry_t, &f->stack, .var_pointer = v->depth + var->offset, .type = VSE_VarPointer);
+            }
+        }
+    }
+}
+
 void generate_PushValue(arm64_function_t *f, operation_t *op)
 {
-    (void) f;
-    (void) op;
+    arm64_push_var_address(f, &op->PushValue);
+    arm64_push_deref_by_type(f, op->PushValue.type);
 }
 
 void generate_PushVarAddress(arm64_function_t *f, operation_t *op)
 {
-    for (size_t ix = 0; ix < f->variables.len; ++ix) {
-        if (slice_eq(op->PushVarAddress.name, f->variables.items[ix].name)) {
-            dynarr_append_s(arm64_value_stack_entry_t, &f->stack, .var_pointer = f->variables.items[ix].depth + op->PushVarAddress.offset, .type = VSE_VarPointer);
-        }
-    }
+    arm64_push_var_address(f, &op->PushVarAddress);
     // debug_stack(function, std::format("PushVarAddress {}+{}", as_utf8(impl.payload.name), impl.payload.offset));
 }
 
@@ -706,29 +895,29 @@ void generate_ScopeBegin(arm64_function_t *f, operation_t *op)
     (void) f;
     dynarr_foreach(arm64_variable_t, var, &f->variables)
     {
-        int cp = temp_save();
-        arm64_add_comment(f, C(temp_sprintf(SL "@%llu", SLARG(var->name), var->depth)));
-        temp_rewind(cp);
+        if (var->reg > 0) {
+            arm64_add_comment(f, sb_as_slice(sb_format(SL "@x%d", SLARG(var->name), var->reg)));
+        } else {
+            arm64_add_comment(f, sb_as_slice(sb_format(SL "@%llu", SLARG(var->name), var->depth)));
+        }
     }
     f->save_regs |= 3 << 19;
-    //    arm64_add_instruction(f, C("mov"), "x19,xzr");
-    //    arm64_add_instruction(f, C("mov"), "x20,xzr");
+    //    arm64_emit(f, mov, ARM64_X(19), ARM64_X(ARM64_ZR));
+    //    arm64_emit(f, mov, ARM64_X(20), ARM64_X(ARM64_ZR));
 }
 
 void generate_ScopeEnd(arm64_function_t *f, operation_t *op)
 {
     if (op->ScopeEnd.has_defers) {
-        arm64_add_text(f,
-            "cmp x19,xzr\n"
-            "b.ne 1f\n"
-            "cmp  x20,xzr\n"
-            "b.eq 2f\n"
-            "br   x20\n"
-            "1:\n"
-            "sub  x19,x19,1\n"
-            "b    lbl_%llu\n"
-            "2:",
-            op->ScopeEnd.enclosing_end);
+        arm64_emit(f, cmp, ARM64_X(19), ARM64_X(ARM64_ZR));
+        arm64_emit_b_cond(f, ne, ARM64_FORWARD(1));
+        arm64_emit(f, cmp, ARM64_X(20), ARM64_X(ARM64_ZR));
+        arm64_emit_b_cond(f, eq, ARM64_FORWARD(2));
+        arm64_emit(f, br, ARM64_X(20));
+        arm64_emit(f, Label, ARM64_LOCAL(1));
+        arm64_emit(f, sub, ARM64_X(19), ARM64_X(19), ARM64_IMM(1));
+        arm64_emit(f, b, ARM64_LABEL(op->ScopeEnd.enclosing_end));
+        arm64_emit(f, Label, ARM64_LOCAL(2));
     }
 }
 
@@ -741,11 +930,11 @@ void generate_UnaryOperator(arm64_function_t *f, operation_t *op)
 
 void arm64_function_generate(arm64_function_t *f, ir_generator_t *gen, operations_t *operations)
 {
-    arm64_analyze(f, gen, operations);
-    arm64_add_directive_o(f->object, C(".global"), f->name);
-    arm64_skeleton(f, gen);
     f->regs = 0;
+    f->var_regs = 0;
     f->save_regs = 0;
+    arm64_analyze(f, gen, operations);
+    arm64_add_directive_o(f->object, C(".global"), f->name);
 
     for (size_t ix = 0; ix < operations->len; ++ix) {
         operation_t *op = operations->items + ix;
@@ -764,26 +953,11 @@ void arm64_function_generate(arm64_function_t *f, ir_generator_t *gen, operation
             UNREACHABLE();
         }
     }
-
-    static sb_t pop_saved_regs = { 0 };
-    f->active = CS_Prolog;
-    for (int ix = 19; ix < 29; ++ix) {
-        if (f->save_regs &= 1 << ix) {
-            if (f->save_regs &= 1 << (ix + 1)) {
-                arm64_add_instruction(f, C("stp"), "x%d,x%d,[sp,-16]!", ix, ix + 1);
-                sb_printf(&pop_saved_regs, "ldp x%d,x%d,[sp],16\n", ix, ix + 1);
-                ++ix;
-            } else {
-                arm64_add_instruction(f, C("str"), "x%d,[sp,-16]!", ix);
-                sb_printf(&pop_saved_regs, "ldr x%d,[sp],16\n", ix);
-            }
-        }
-    }
-    f->active = CS_Code;
-    if (pop_saved_regs.len > 0) {
-        arm64_add_instruction(f, C("mov"), "x0,x21");
-        arm64_add_text(f, SL, SLARG(sb_as_slice(pop_saved_regs)));
+    if (!cmdline_is_set("no-peephole")) {
+        size_t removed = arm64_peephole(f->sections + CS_Code);
+        trace("Peephole optimizer removed %zu instructions", removed);
     }
+    arm64_skeleton(f, gen);
 }
 
 void arm64_add_data(arm64_object_t *o, slice_t label, bool global, slice_t type, bool is_static, slice_t data)
@@ -811,6 +985,8 @@ void arm64_add_directive_o(arm64_object_t *o, slice_t directive, slice_t args)
     sb_printf(o->sections + CS_Prolog, SL "\t" SL "\n", SLARG(directive), SLARG(args));
     if (slice_eq(directive, C(".global"))) {
         sb_printf(o->sections + CS_Prolog, ".global\t_" SL "\n", SLARG(args));
+        dynarr_append(&o->globals, args);
+        dynarr_append(&o->globals, sb_as_slice(sb_format("_" SL, SLARG(args))));
         o->has_exports = true;
         if (slice_eq(args, C("main"))) {
             o->has_main = true;
@@ -879,12 +1055,18 @@ bool arm64_save_and_assemble(arm64_object_t *o, ir_generator_t *gen)
     path_t dot_elrond = path_make_relative(".elrond");
     path_t path = path_extend(dot_elrond, o->file_name);
     path_replace_extension(&path, C("s"));
-    FILE *f = fopen(path.path.items, "wb+");
-    if (f == NULL) {
-        return false;
+
+    // The object file writer doesn't know the data directives
+    // arm64_add_data emits, so those objects go through the assembler.
+    bool system_assembler = cmdline_is_set("system-assembler") || o->sections[CS_Data].len > 0;
+    if (system_assembler || cmdline_is_set("keep-assembly")) {
+        FILE *f = fopen(path.path.items, "wb+");
+        if (f == NULL) {
+            return false;
+        }
+        arm64_object_write(o, f);
+        fclose(f);
     }
-    arm64_object_write(o, f);
-    fclose(f);
 
     if (cmdline_is_set("dump-ir")) {
         path_t ir_path = path_extend(dot_elrond, o->file_name);
@@ -899,15 +1081,21 @@ bool arm64_save_and_assemble(arm64_object_t *o, ir_generator_t *gen)
 
     path_t o_file = path_parse(sb_as_slice(path.path));
     path_replace_extension(&o_file, C("o"));
-    if (o->module.ok) {
-        ir_node_t *mod = gen->ir_nodes.items + o->module.value;
-        if (cmdline_is_set("verbose")) {
-            fprintf(stderr, "[ARM64] Assembling `" SL "`\n", SLARG(mod->module.name));
+    if (cmdline_is_set("verbose")) {
+        char const *action = (system_assembler) ? "Assembling" : "Writing object file for";
+        if (o->module.ok) {
+            ir_node_t *mod = gen->ir_nodes.items + o->module.value;
+            fprintf(stderr, "[ARM64] %s `" SL "`\n", action, SLARG(mod->module.name));
+        } else {
+            fprintf(stderr, "[ARM64] %s root module\n", action);
         }
-    } else {
-        if (cmdline_is_set("verbose")) {
-            fprintf(stderr, "[ARM64] Assembling root module\n");
+    }
+
+    if (!system_assembler) {
+        if (!arm64_write_object_file(o, o_file.path.items)) {
+            fatal("Error writing `%s`: %s\n", o_file.path.items, strerror(errno));
         }
+        return true;
     }
 
     process_t as = process_create("as", path.path.items, "-o", o_file.path.items);
@@ -918,12 +1106,47 @@ bool arm64_save_and_assemble(arm64_object_t *o, ir_generator_t *gen)
     } else if (res.success != 0) {
         fatal("Assembler failed:\n" SL, SLARG(as.out_pipes.pipes[1].text));
     }
-    //    if (!cmdline_is_set("keep-assembly")) {
-    //        unlink(path.path.items);
-    //    }
     return true;
 }
 
+// The modules of an executable are generated on up to `jobs` threads. A
+// thread takes the next module nobody has started on, and writes and
+// assembles the module's object as soon as its code is generated, so the
+// assembler runs for one module while the code for the next is generated.
+// Codegen only reads the IR and the type registry.
+typedef struct _arm64_codegen {
+    arm64_executable_t *exe;
+    ir_generator_t     *gen;
+    _Atomic size_t      next;
+    _Atomic bool        failed;
+} arm64_codegen_t;
+
+static void *arm64_codegen_worker(void *arg)
+{
+    arm64_codegen_t *codegen = (arm64_codegen_t *) arg;
+    while (true) {
+        size_t ix = atomic_fetch_add(&codegen->next, 1);
+        if (ix >= codegen->exe->objects.len) {
+            break;
+        }
+        arm64_object_t *obj = codegen->exe->objects.items + ix;
+        arm64_object_generate(obj, codegen->gen);
+        if (obj->has_exports && !arm64_save_and_assemble(obj, codegen->gen)) {
+            codegen->failed = true;
+        }
+    }
+    return NULL;
+}
+
+static size_t arm64_codegen_jobs()
+{
+    if (do_trace) {
+        // Keep the trace of one module together.
+        return 1;
+    }
+    return cmdline_jobs("jobs", ARM64_MAX_JOBS);
+}
+
 bool arm64_executable_generate(arm64_executable_t *exe, ir_generator_t *gen)
 {
     path_t dot_elrond = path_make_relative(".elrond");
@@ -932,24 +1155,41 @@ bool arm64_executable_generate(arm64_executable_t *exe, ir_generator_t *gen)
     ir_node_t *prog = gen->ir_nodes.items + exe->program.value;
 
     for (size_t ix = 0; ix < prog->program.modules.len; ++ix) {
-        nodeptr        mod_ptr = prog->program.modules.items[ix];
-        ir_node_t     *mod = gen->ir_nodes.items + mod_ptr.value;
-        arm64_object_t obj = {
-            .file_name = mod->module.name,
-            .module = mod_ptr,
-        };
+        nodeptr    mod_ptr = prog->program.modules.items[ix];
+        ir_node_t *mod = gen->ir_nodes.items + mod_ptr.value;
         // prog_init.add_instruction(f, C("bl"), std::format(L"_{}_init", name));
-        arm64_object_generate(&obj, gen);
-        dynarr_append(&exe->objects, obj);
+        dynarr_append_s(arm64_object_t, &exe->objects, .file_name = mod->module.name, .module = mod_ptr);
+    }
+
+    arm64_codegen_t codegen = {
+        .exe = exe,
+        .gen = gen,
+    };
+    size_t jobs = arm64_codegen_jobs();
+    size_t workers = MIN(jobs, exe->objects.len);
+    type_registry_freeze(true);
+    if (workers <= 1) {
+        arm64_codegen_worker(&codegen);
+    } else {
+        pthread_t threads[ARM64_MAX_JOBS];
+        for (size_t ix = 0; ix < workers; ++ix) {
+            if ((errno = pthread_create(threads + ix, NULL, arm64_codegen_worker, &codegen)) != 0) {
+                fatal("arm64_executable_generate: pthread_create: %s", strerror(errno));
+            }
+        }
+        for (size_t ix = 0; ix < workers; ++ix) {
+            pthread_join(threads[ix], NULL);
+        }
+    }
+    type_registry_freeze(false);
+    if (codegen.failed) {
+        return false;
     }
 
     slices_t o_files = { 0 };
     for (size_t ix = 0; ix < exe->objects.len; ++ix) {
         arm64_object_t *obj = exe->objects.items + ix;
         if (obj->has_exports) {
-            if (!arm64_save_and_assemble(obj, gen)) {
-                return false;
-            }
             path_t path = path_extend(dot_elrond, obj->file_name);
             path_replace_extension(&path, C("o"));
             dynarr_append(&o_files, sb_as_slice(path.path))
@@ -28,10 +28,12 @@ typedef struct _value_stack_entry {
     enum {
         VSE_RegisterAllocation,
         VSE_VarPointer,
+        VSE_VarRegister,
     } type;
     union {
         arm64_register_allocation_t register_allocation;
         arm64_var_pointer_t         var_pointer;
+        int                         var_register;
     };
 } arm64_value_stack_entry_t;
 
@@ -39,7 +41,9 @@ typedef DA(arm64_value_stack_entry_t) arm64_value_stack_entries_t;
 
 typedef struct _arm64_variable {
     slice_t  name;
+    nodeptr  type;
     uint64_t depth;
+    int      reg; // Register holding the variable, 0 if it lives in the frame
 } arm64_variable_t;
 
 typedef DA(arm64_variable_t) arm64_variables_t;
@@ -53,33 +57,159 @@ typedef enum {
     CS_Max,
 } arm64_code_section_t;
 
+// In the order of their encoding. The inverse of a condition differs in
+// the lowest bit.
+#define ARM64_CONDITIONS(S) \
+    S(eq)                   \
+    S(ne)                   \
+    S(hs)                   \
+    S(lo)                   \
+    S(mi)                   \
+    S(pl)                   \
+    S(vs)                   \
+    S(vc)                   \
+    S(hi)                   \
+    S(ls)                   \
+    S(ge)                   \
+    S(lt)                   \
+    S(gt)                   \
+    S(le)
+
+typedef enum {
+#undef S
+#define S(C) AC_##C,
+    ARM64_CONDITIONS(S)
+#undef S
+} arm64_condition_t;
+
+#define ARM64_OPCODES(S) \
+    S(add)               \
+    S(adr)               \
+    S(and)               \
+    S(b)                 \
+    S(b_cond)            \
+    S(bl)                \
+    S(br)                \
+    S(cmp)               \
+    S(cset)              \
+    S(eor)               \
+    S(ldp)               \
+    S(ldr)               \
+    S(mov)               \
+    S(mul)               \
+    S(mvn)               \
+    S(neg)               \
+    S(orr)               \
+    S(ret)               \
+    S(sdiv)              \
+    S(smull)             \
+    S(stp)               \
+    S(str)               \
+    S(sub)               \
+    S(udiv)              \
+    S(umull)
+
+typedef enum {
+    AO_Label,
+    AO_Comment,
+#undef S
+#define S(O) AO_##O,
+    ARM64_OPCODES(S)
+#undef S
+} arm64_opcode_t;
+
+#define ARM64_FP 29
+#define ARM64_LR 30
+#define ARM64_SP 31
+#define ARM64_ZR 32
+
+typedef enum {
+    ALK_IR,     // lbl_<id>, the labels of the IR
+    ALK_Local,  // <id>, a numeric local label
+    ALK_String, // str_<id>, a string in the text section
+    ALK_Symbol,
+} arm64_label_kind_t;
+
+typedef struct _arm64_label {
+    arm64_label_kind_t kind;
+    bool               forward; // A reference to a local label looks forward
+    union {
+        uint64_t id;
+        slice_t  symbol;
+    };
+} arm64_label_t;
+
+typedef enum {
+    AOK_None,
+    AOK_Reg,
+    AOK_Imm,
+    AOK_Mem,
+    AOK_Label,
+} arm64_operand_kind_t;
+
+typedef enum {
+    AM_Offset,   // [base,#imm]
+    AM_PreIndex, // [base,#imm]!
+    AM_PostIndex // [base],#imm
+} arm64_addressing_t;
+
+typedef struct _arm64_operand {
+    arm64_operand_kind_t kind;
+    int                  reg; // The register, or the base register of a memory operand
+    bool                 w;   // Use the 32 bit view of the register
+    arm64_addressing_t   mode;
+    union {
+        int64_t       imm; // The immediate, or the offset of a memory operand
+        arm64_label_t label;
+    };
+} arm64_operand_t;
+
+#define ARM64_X(r) ((arm64_operand_t) { .kind = AOK_Reg, .reg = (r) })
+#define ARM64_W(r) ((arm64_operand_t) { .kind = AOK_Reg, .reg = (r), .w = true })
+#define ARM64_IMM(v) ((arm64_operand_t) { .kind = AOK_Imm, .imm = (int64_t) (v) })
+#define ARM64_MEM(r, offset) ((arm64_operand_t) { .kind = AOK_Mem, .reg = (r), .mode = AM_Offset, .imm = (int64_t) (offset) })
+#define ARM64_PRE(r, offset) ((arm64_operand_t) { .kind = AOK_Mem, .reg = (r), .mode = AM_PreIndex, .imm = (int64_t) (offset) })
+#define ARM64_POST(r, offset) ((arm64_operand_t) { .kind = AOK_Mem, .reg = (r), .mode = AM_PostIndex, .imm = (int64_t) (offset) })
+#define ARM64_LABEL(l) ((arm64_operand_t) { .kind = AOK_Label, .label = { .kind = ALK_IR, .id = (l) } })
+#define ARM64_LOCAL(l) ((arm64_operand_t) { .kind = AOK_Label, .label = { .kind = ALK_Local, .id = (l) } })
+#define ARM64_FORWARD(l) ((arm64_operand_t) { .kind = AOK_Label, .label = { .kind = ALK_Local, .forward = true, .id = (l) } })
+#define ARM64_STRING(l) ((arm64_operand_t) { .kind = AOK_Label, .label = { .kind = ALK_String, .id = (l) } })
+#define ARM64_SYMBOL(s) ((arm64_operand_t) { .kind = AOK_Label, .label = { .kind = ALK_Symbol, .symbol = (s) } })
+
+typedef struct _arm64_instr {
+    arm64_opcode_t    opcode;
+    arm64_condition_t cond;     // AO_b_cond, AO_cset
+    int               arg_regs; // AO_bl: x0-x<arg_regs - 1> hold the arguments
+    arm64_operand_t   operands[3];
+    slice_t           comment; // AO_Comment
+} arm64_instr_t;
+
+typedef DA(arm64_instr_t) arm64_instrs_t;
+
 typedef struct _arm64_function {
     slice_t                     name;
     nodeptr                     function;
     struct _arm64_object       *object;
     uint64_t                    stack_depth;
     arm64_variables_t           variables;
-    sb_t                        sections[CS_Max];
+    arm64_instrs_t              sections[CS_Max];
     int                         active;
     uint32_t                    regs;
+    uint32_t                    var_regs;
     uint32_t                    save_regs;
     arm64_value_stack_entries_t stack;
 } arm64_function_t;
 
 typedef DA(arm64_function_t) arm64_functions_t;
 
-void arm64_add_instruction(arm64_function_t *f, slice_t mnemonic, char const *param_fmt, ...)
-    __attribute__((__format__(printf, 3, 4)));
-void                        arm64_add_instruction_param(arm64_function_t *f, slice_t mnemonic, slice_t param);
-void                        arm64_add_simple_instruction(arm64_function_t *f, slice_t mnemonic);
-void                        arm64_add_vtext(arm64_function_t *f, char const *fmt, va_list args);
-void                        arm64_add_text(arm64_function_t *f, char const *fmt, ...);
-void                        arm64_add_label(arm64_function_t *f, slice_t label);
-void                        arm64_add_directive_f(arm64_function_t *f, slice_t directive, slice_t args);
+void                        arm64_emit_instr(arm64_function_t *f, arm64_instr_t instr);
 void                        arm64_add_comment(arm64_function_t *f, slice_t comment);
+void                        arm64_instr_write(arm64_instr_t *instr, FILE *file);
 bool                        arm64_empty(arm64_function_t *f);
 bool                        arm64_has_text(arm64_function_t *f);
 void                        arm64_analyze(arm64_function_t *f, ir_generator_t *gen, operations_t *operations);
+void                        arm64_allocate_registers(arm64_function_t *f, size_t num_params, operations_t *operations);
+size_t                      arm64_peephole(arm64_instrs_t *code);
 void                        arm64_emit_return(arm64_function_t *f);
 void                        arm64_skeleton(arm64_function_t *f, ir_generator_t *gen);
 arm64_register_allocation_t arm64_push_reg_by_type(arm64_function_t *f, nodeptr type);
@@ -91,11 +221,15 @@ int                         arm64_pop_by_type(arm64_function_t *f, nodeptr type,
 int                         arm64_pop(arm64_function_t *f, size_t size, int target);
 arm64_var_pointer_t         arm64_deref_by_type(arm64_function_t *f, nodeptr type, int target);
 arm64_var_pointer_t         arm64_deref(arm64_function_t *f, size_t, int target);
+void                        arm64_push_deref_by_type(arm64_function_t *f, nodeptr type);
 arm64_var_pointer_t         arm64_assign_by_type(arm64_function_t *f, nodeptr type);
 arm64_var_pointer_t         arm64_assign(arm64_function_t *f, size_t);
+void                        arm64_push_var_address(arm64_function_t *f, var_path_t *var);
 void                        arm64_function_generate(arm64_function_t *f, ir_generator_t *gen, operations_t *operations);
 void                        arm64_function_write(arm64_function_t *func, FILE *file);
 
+#define arm64_emit(f, op, ...) arm64_emit_instr((f), (arm64_instr_t) { .opcode = AO_##op, .operands = { __VA_ARGS__ } })
+#define arm64_emit_b_cond(f, c, target) arm64_emit_instr((f), (arm64_instr_t) { .opcode = AO_b_cond, .cond = AC_##c, .operands = { (target) } })
 #define pop_value(T, f, target) (arm64_pop((f), sizeof(T), (target)))
 #define push_value(T, f) (arm64_push((f), sizeof(T)))
 
@@ -106,6 +240,7 @@ typedef struct _arm64_object {
     sb_t              sections[CS_Max];
     int               active;
     slices_t          strings;
+    slices_t          globals;
     bool              has_exports;
     bool              has_main;
 } arm64_object_t;
@@ -118,8 +253,14 @@ void arm64_object_generate(arm64_object_t *o, ir_generator_t *gen);
 bool arm64_save_and_assemble(arm64_object_t *o, ir_generator_t *gen);
 void arm64_add_data(arm64_object_t *o, slice_t label, bool global, slice_t type, bool is_static, slice_t data);
 void arm64_object_write(arm64_object_t *o, FILE *f);
+bool arm64_write_object_file(arm64_object_t *o, char const *file_name);
 void arm64_binop(arm64_function_t *f, nodeptr lhs, operator_t op, nodeptr rhs);
 
+// Most threads generating and assembling modules at the same time.
+#ifndef ARM64_MAX_JOBS
+#define ARM64_MAX_JOBS 64
+#endif
+
 typedef struct _arm64_executable {
     nodeptr         program;
     arm64_objects_t objects;
@@ -23,7 +23,7 @@ void gen_int_BinaryInvert(arm64_function_t *function, nodeptr lhs, nodeptr rhs)
     (void) lhs;
     (void) rhs;
     pop_value(bool, function, 0);
-    arm64_add_instruction_param(function, C("mvn"), C("x0,x0"));
+    arm64_emit(function, mvn, ARM64_X(0), ARM64_X(0));
     push_value(bool, function);
 }
 
@@ -32,7 +32,7 @@ void gen_bool_LogicalInvert(arm64_function_t *function, nodeptr lhs, nodeptr rhs
     (void) lhs;
     (void) rhs;
     pop_value(bool, function, 0);
-    arm64_add_instruction_param(function, C("eor"), C("w0,w0,#0x01")); // a is 0b00000001 (a was true) or 0b00000000 (a was false
+    arm64_emit(function, eor, ARM64_W(0), ARM64_W(0), ARM64_IMM(0x01)); // a is 0b00000001 (a was true) or 0b00000000 (a was false
     push_value(bool, function);
 }
 
@@ -41,10 +41,34 @@ void gen_int_Negate(arm64_function_t *function, nodeptr lhs, nodeptr rhs)
     (void) lhs;
     (void) rhs;
     pop_value(bool, function, 0);
-    arm64_add_instruction_param(function, C("neg"), C("x0,x0"));
+    arm64_emit(function, neg, ARM64_X(0), ARM64_X(0));
     push_value(bool, function);
 }
 
+static void gen_int_compare(arm64_function_t *f, arm64_condition_t cond)
+{
+    pop_value(int64_t, f, 1);
+    pop_value(int64_t, f, 0);
+    arm64_emit(f, cmp, ARM64_X(0), ARM64_X(1));
+    arm64_emit_instr(f, (arm64_instr_t) { .opcode = AO_b_cond, .cond = cond, .operands = { ARM64_FORWARD(1) } });
+    arm64_emit(f, mov, ARM64_W(0), ARM64_W(ARM64_ZR));
+    arm64_emit(f, b, ARM64_FORWARD(2));
+    arm64_emit(f, Label, ARM64_LOCAL(1));
+    arm64_emit(f, mov, ARM64_W(0), ARM64_IMM(0x01));
+    arm64_emit(f, Label, ARM64_LOCAL(2));
+    push_value(bool, f);
+}
+
+// A conditional branch can't target a symbol in another object, so jump
+// over an unconditional one.
+static void gen_divide_by_zero_check(arm64_function_t *f)
+{
+    arm64_emit(f, cmp, ARM64_X(1), ARM64_X(ARM64_ZR));
+    arm64_emit_b_cond(f, ne, ARM64_FORWARD(1));
+    arm64_emit(f, b, ARM64_SYMBOL(C("_$divide_by_zero")));
+    arm64_emit(f, Label, ARM64_LOCAL(1));
+}
+
 #define INT_OP(opname, opcode)                                           \
     void gen_int_##opname(arm64_function_t *f, nodeptr lhs, nodeptr rhs) \
     {                                                                    \
@@ -52,31 +76,15 @@ void gen_int_Negate(arm64_function_t *function, nodeptr lhs, nodeptr rhs)
         (void) rhs;                                                      \
         pop_value(int64_t, f, 1);                                        \
         pop_value(int64_t, f, 0);                                        \
-        arm64_add_instruction_param(f, C(opcode), C("x0,x0,x1"));        \
+        arm64_emit(f, opcode, ARM64_X(0), ARM64_X(0), ARM64_X(1));       \
         push_value(int64_t, f);                                          \
     }
 
-#define NEQ ""
-#define EQ "b.eq    1f"
-
-#define INT_CMP_OP(opname, BSigned, BUnsigned, Eq)                       \
-    void gen_int_##opname(arm64_function_t *f, nodeptr lhs, nodeptr rhs) \
-    {                                                                    \
-        (void) lhs;                                                      \
-        (void) rhs;                                                      \
-        pop_value(int64_t, f, 1);                                        \
-        pop_value(int64_t, f, 0);                                        \
-        arm64_add_text(f,                                                \
-            "    cmp     x0,x1\n"                                        \
-            "    %s      1f\n"                                           \
-            "    " Eq "\n"                                               \
-            "    mov     w0,wzr\n"                                       \
-            "    b       2f\n"                                           \
-            "1:\n"                                                       \
-            "    mov     w0,#0x01\n"                                     \
-            "2:\n",                                                      \
-            (get_type(lhs)->int_type.is_signed) ? BSigned : BUnsigned);  \
-        push_value(bool, f);                                             \
+#define INT_CMP_OP(opname, CSigned, CUnsigned)                                                   \
+    void gen_int_##opname(arm64_function_t *f, nodeptr lhs, nodeptr rhs)                         \
+    {                                                                                            \
+        (void) rhs;                                                                              \
+        gen_int_compare(f, (get_type(lhs)->int_type.is_signed) ? AC_##CSigned : AC_##CUnsigned); \
     }
 
 #define BOOL_OP(opname, opcode)                                           \
@@ -86,34 +94,32 @@ void gen_int_Negate(arm64_function_t *function, nodeptr lhs, nodeptr rhs)
         (void) rhs;                                                       \
         pop_value(bool, f, 1);                                            \
         pop_value(bool, f, 0);                                            \
-        arm64_add_instruction_param(f, C(opcode), C("x0,x0,x1"));         \
+        arm64_emit(f, opcode, ARM64_X(0), ARM64_X(0), ARM64_X(1));        \
         push_value(bool, f);                                              \
     }
 
-INT_OP(Add, "add")
-INT_OP(BinaryAnd, "and")
-INT_OP(BinaryOr, "orr")
-INT_OP(BinaryXor, "eor")
-INT_CMP_OP(Equals, "b.eq", "b.eq", NEQ)
-INT_CMP_OP(Greater, "b.gt", "b.hi", NEQ)
-INT_CMP_OP(GreaterEqual, "b.gt", "b.hi", EQ)
-INT_CMP_OP(Less, "b.lt", "b.lo", NEQ)
-INT_CMP_OP(LessEqual, "b.lt", "b.lo", EQ)
-BOOL_OP(LogicalAnd, "and")
-BOOL_OP(LogicalOr, "orr")
-INT_CMP_OP(NotEqual, "b.neq", "b.neq", NEQ)
-INT_OP(Subtract, "sub")
+INT_OP(Add, add)
+INT_OP(BinaryAnd, and)
+INT_OP(BinaryOr, orr)
+INT_OP(BinaryXor, eor)
+INT_CMP_OP(Equals, eq, eq)
+INT_CMP_OP(Greater, gt, hi)
+INT_CMP_OP(GreaterEqual, ge, hs)
+INT_CMP_OP(Less, lt, lo)
+INT_CMP_OP(LessEqual, le, ls)
+BOOL_OP(LogicalAnd, and)
+BOOL_OP(LogicalOr, orr)
+INT_CMP_OP(NotEqual, ne, ne)
+INT_OP(Subtract, sub)
 
 void gen_int_Divide(arm64_function_t *f, nodeptr lhs, nodeptr rhs)
 {
     (void) lhs;
     (void) rhs;
     pop_value(int64_t, f, 1);
-    arm64_add_text(f,
-        "    cmp     x1,xzr\n"
-        "    b.eq    _$divide_by_zero\n");
+    gen_divide_by_zero_check(f);
     pop_value(int64_t, f, 0);
-    arm64_add_instruction_param(f, C("sdiv"), C("x0,x0,x1"));
+    arm64_emit(f, sdiv, ARM64_X(0), ARM64_X(0), ARM64_X(1));
     push_value(int64_t, f);
 }
 
@@ -122,7 +128,7 @@ void gen_uint_Multiply(arm64_function_t *f, nodeptr lhs, nodeptr rhs)
     (void) lhs;
     (void) rhs;
     pop_value(int64_t, f, 1);
-    arm64_add_instruction_param(f, C("umull"), C("x0,x0,x1"));
+    arm64_emit(f, mul, ARM64_X(0), ARM64_X(0), ARM64_X(1));
     push_value(int64_t, f);
 }
 
@@ -131,11 +137,9 @@ void gen_int_Multiply(arm64_function_t *f, nodeptr lhs, nodeptr rhs)
     (void) lhs;
     (void) rhs;
     pop_value(int64_t, f, 1);
-    arm64_add_text(f,
-        "    cmp     x1,xzr\n"
-        "    b.eq    _$divide_by_zero\n");
+    gen_divide_by_zero_check(f);
     pop_value(int64_t, f, 0);
-    arm64_add_instruction_param(f, C("smull"), C("x0,x0,x1"));
+    arm64_emit(f, mul, ARM64_X(0), ARM64_X(0), ARM64_X(1));
     push_value(int64_t, f);
 }
 
@@ -144,13 +148,9 @@ void gen_uint_Divide(arm64_function_t *f, nodeptr lhs, nodeptr rhs)
     (void) lhs;
     (void) rhs;
     pop_value(int64_t, f, 1);
-    arm64_add_text(f,
-        "    cmp     x1,xzr\n"
-        "    b.ne    1f\n"
-        "    b       _$divide_by_zero\n"
-        "1:\n");
+    gen_divide_by_zero_check(f);
     pop_value(int64_t, f, 0);
-    arm64_add_instruction_param(f, C("udiv"), C("x0,x0,x1"));
+    arm64_emit(f, udiv, ARM64_X(0), ARM64_X(0), ARM64_X(1));
     push_value(int64_t, f);
 }
 
@@ -159,16 +159,11 @@ void gen_int_Modulo(arm64_function_t *f, nodeptr lhs, nodeptr rhs)
     (void) lhs;
     (void) rhs;
     pop_value(int64_t, f, 1);
-    arm64_add_text(f,
-        "    cmp     x1,xzr\n"
-        "    b.ne    1f\n"
-        "    b       _$divide_by_zero\n"
-        "1:\n");
+    gen_divide_by_zero_check(f);
     pop_value(int64_t, f, 0);
-    arm64_add_text(f,
-        "    sdiv     x2,x0,x1\n"
-        "    smull    x3,w2,w1\n"
-        "    sub      x0,x0,x3\n");
+    arm64_emit(f, sdiv, ARM64_X(2), ARM64_X(0), ARM64_X(1));
+    arm64_emit(f, smull, ARM64_X(3), ARM64_W(2), ARM64_W(1));
+    arm64_emit(f, sub, ARM64_X(0), ARM64_X(0), ARM64_X(3));
     push_value(int64_t, f);
 }
 
@@ -177,14 +172,11 @@ void gen_uint_Modulo(arm64_function_t *f, nodeptr lhs, nodeptr rhs)
     (void) lhs;
     (void) rhs;
     pop_value(uint64_t, f, 1);
-    arm64_add_text(f,
-        "    cmp      x1,xzr\n"
-        "    b.eq     _$divide_by_zero\n");
+    gen_divide_by_zero_check(f);
     pop_value(uint64_t, f, 0);
-    arm64_add_text(f,
-        "    udiv     x2,x0,x1\n"
-        "    umull    x3,w2,w1\n"
-        "    sub      x0,x0,x3\n");
+    arm64_emit(f, udiv, ARM64_X(2), ARM64_X(0), ARM64_X(1));
+    arm64_emit(f, umull, ARM64_X(3), ARM64_W(2), ARM64_W(1));
+    arm64_emit(f, sub, ARM64_X(0), ARM64_X(0), ARM64_X(3));
     push_value(int64_t, f);
 }
 
@@ -0,0 +1,851 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arm64.h"
+#include "da.h"
+
+// Encodes the instructions of an arm64_object_t and writes them straight to
+// a relocatable object file, so that a module doesn't have to go through
+// the assembly text and the system assembler.
+//
+// Everything goes in a single text section: the functions, in the order
+// arm64_object_write writes them, followed by the string literals. Labels
+// and string references are resolved here. Branches to symbols that aren't
+// defined in the object get a relocation, which the linker resolves.
+//
+// The object file is Mach-O on Darwin and ELF elsewhere, unless the build
+// defines ARM64_OBJECT_FORMAT.
+
+#ifndef ARM64_OBJECT_FORMAT
+#ifdef __APPLE__
+#define ARM64_OBJECT_FORMAT AOF_MachO
+#else
+#define ARM64_OBJECT_FORMAT AOF_ELF
+#endif
+#endif
+
+typedef enum _arm64_object_format {
+    AOF_ELF,
+    AOF_MachO,
+} arm64_object_format_t;
+
+typedef DA(uint8_t) arm64_bytes_t;
+
+typedef struct _arm64_symbol {
+    slice_t  name;
+    uint64_t offset;
+    bool     defined;
+    bool     global;
+    uint32_t index; // In the symbol table of the object file
+} arm64_symbol_t;
+
+typedef DA(arm64_symbol_t) arm64_symbols_t;
+
+typedef struct _arm64_reloc {
+    uint64_t offset;
+    size_t   symbol;
+    bool     call; // bl, otherwise b
+} arm64_reloc_t;
+
+typedef DA(arm64_reloc_t) arm64_relocs_t;
+
+typedef struct _arm64_placed_instr {
+    arm64_instr_t *instr;
+    uint64_t       offset;
+} arm64_placed_instr_t;
+
+typedef DA(arm64_placed_instr_t) arm64_placed_instrs_t;
+
+typedef struct _arm64_image {
+    arm64_object_t *object;
+    arm64_bytes_t   text;
+    arm64_symbols_t symbols;
+    arm64_relocs_t  relocs;
+    uint64s         labels;  // Offset of IR label lbl_<n>, or UINT64_MAX
+    uint64s         strings; // Offset of string str_<n>
+} arm64_image_t;
+
+static void arm64_u8(arm64_bytes_t *bytes, uint8_t b)
+{
+    dynarr_append(bytes, b);
+}
+
+static void arm64_u16(arm64_bytes_t *bytes, uint16_t value)
+{
+    for (int ix = 0; ix < 2; ++ix) {
+        arm64_u8(bytes, (value >> (8 * ix)) & 0xFF);
+    }
+}
+
+static void arm64_u32(arm64_bytes_t *bytes, uint32_t value)
+{
+    for (int ix = 0; ix < 4; ++ix) {
+        arm64_u8(bytes, (value >> (8 * ix)) & 0xFF);
+    }
+}
+
+static void arm64_u64(arm64_bytes_t *bytes, uint64_t value)
+{
+    for (int ix = 0; ix < 8; ++ix) {
+        arm64_u8(bytes, (value >> (8 * ix)) & 0xFF);
+    }
+}
+
+static void arm64_align(arm64_bytes_t *bytes, size_t alignment)
+{
+    while (bytes->len % alignment != 0) {
+        arm64_u8(bytes, 0);
+    }
+}
+
+// Writes `name` in a fixed-size, zero-padded field.
+static void arm64_fixed_name(arm64_bytes_t *bytes, char const *name, size_t size)
+{
+    size_t len = strlen(name);
+    for (size_t ix = 0; ix < size; ++ix) {
+        arm64_u8(bytes, (ix < len) ? name[ix] : 0);
+    }
+}
+
+// Appends `name` to a string table and returns its offset.
+static uint32_t arm64_add_name(arm64_bytes_t *strtab, slice_t name)
+{
+    uint32_t ret = strtab->len;
+    for (size_t ix = 0; ix < name.len; ++ix) {
+        arm64_u8(strtab, name.items[ix]);
+    }
+    arm64_u8(strtab, 0);
+    return ret;
+}
+
+#define arm64_encode_error(instr, why)                 \
+    do {                                               \
+        arm64_instr_write((instr), stderr);            \
+        fatal("Cannot encode instruction: %s", (why)); \
+    } while (0)
+
+static uint32_t arm64_regnum(arm64_operand_t *operand)
+{
+    return (operand->reg >= ARM64_SP) ? 31 : operand->reg;
+}
+
+static uint32_t arm64_sf(arm64_operand_t *operand)
+{
+    return (operand->w) ? 0 : (1u << 31);
+}
+
+// The 16-bit chunks of `value` that a mov of it has to set, as movz, movn
+// or movz followed by movks. Returns the number of instructions.
+static int arm64_mov_imm_parts(arm64_instr_t *instr, uint32_t parts[4])
+{
+    arm64_operand_t *dst = instr->operands;
+    int              chunks = (dst->w) ? 2 : 4;
+    uint64_t         mask = (dst->w) ? 0xFFFFFFFFull : UINT64_MAX;
+    uint64_t         value = (uint64_t) instr->operands[1].imm & mask;
+    uint64_t         inverted = ~value & mask;
+    int              nonzero = 0;
+    int              nonzero_inverted = 0;
+    for (int hw = 0; hw < chunks; ++hw) {
+        nonzero += ((value >> (16 * hw)) & 0xFFFF) != 0;
+        nonzero_inverted += ((inverted >> (16 * hw)) & 0xFFFF) != 0;
+    }
+    uint32_t base = arm64_sf(dst) | arm64_regnum(dst);
+    if (nonzero_inverted < 1 || (nonzero_inverted == 1 && nonzero > 1)) {
+        int hw = 0;
+        while (inverted != 0 && ((inverted >> (16 * hw)) & 0xFFFF) == 0) {
+            ++hw;
+        }
+        parts[0] = base | 0x12800000 | (hw << 21) | (((inverted >> (16 * hw)) & 0xFFFF) << 5); // movn
+        return 1;
+    }
+    int count = 0;
+    for (int hw = 0; hw < chunks; ++hw) {
+        uint64_t chunk = (value >> (16 * hw)) & 0xFFFF;
+        if (chunk != 0 || (value == 0 && hw == 0)) {
+            parts[count] = base | ((count == 0) ? 0x52800000 : 0x72800000) | (hw << 21) | (chunk << 5); // movz, movk
+            ++count;
+        }
+    }
+    return count;
+}
+
+static size_t arm64_instr_size(arm64_instr_t *instr)
+{
+    uint32_t parts[4];
+    switch (instr->opcode) {
+    case AO_Label:
+    case AO_Comment:
+        return 0;
+    case AO_mov:
+        if (instr->operands[1].kind == AOK_Imm) {
+            return 4 * arm64_mov_imm_parts(instr, parts);
+        }
+        return 4;
+    default:
+        return 4;
+    }
+}
+
+// Encodes the 12-bit immediate of add, sub and cmp, possibly shifted left
+// by 12 bits.
+static uint32_t arm64_imm12(arm64_instr_t *instr, int64_t value)
+{
+    if (value >= 0 && value <= 0xFFF) {
+        return (uint32_t) value << 10;
+    }
+    if (value > 0 && (value & 0xFFF) == 0 && (value >> 12) <= 0xFFF) {
+        return (1u << 22) | (uint32_t) (value >> 12) << 10;
+    }
+    arm64_encode_error(instr, "immediate out of range");
+}
+
+static uint32_t arm64_encode_add_sub(arm64_instr_t *instr, bool sub, bool set_flags)
+{
+    arm64_operand_t *ops = instr->operands;
+    uint32_t         rd = (set_flags) ? 31 : arm64_regnum(ops);
+    arm64_operand_t *rn = (set_flags) ? ops : ops + 1;
+    arm64_operand_t *rm = rn + 1;
+    uint32_t         base = arm64_sf(ops) | ((set_flags) ? (1u << 29) : 0) | arm64_regnum(rn) << 5 | rd;
+    if (rm->kind == AOK_Imm) {
+        int64_t value = rm->imm;
+        if (value < 0) {
+            value = -value;
+            sub = !sub;
+        }
+        return base | 0x11000000 | ((sub) ? (1u << 30) : 0) | arm64_imm12(instr, value);
+    }
+    if (rm->kind != AOK_Reg) {
+        arm64_encode_error(instr, "invalid operand");
+    }
+    base |= ((sub) ? (1u << 30) : 0) | arm64_regnum(rm) << 16;
+    if (rn->reg == ARM64_SP || (!set_flags && ops->reg == ARM64_SP)) {
+        // Extended register form, which takes sp instead of xzr
+        return base | 0x0B200000 | ((ops->w) ? 2u : 3u) << 13;
+    }
+    return base | 0x0B000000;
+}
+
+static uint32_t arm64_encode_load_store(arm64_instr_t *instr, bool load)
+{
+    arm64_operand_t *rt = instr->operands;
+    arm64_operand_t *mem = instr->operands + 1;
+    if (mem->kind != AOK_Mem) {
+        arm64_encode_error(instr, "invalid operand");
+    }
+    uint32_t size = (rt->w) ? 2 : 3;
+    uint32_t base = size << 30 | 0x38000000 | ((load) ? (1u << 22) : 0) | arm64_regnum(mem) << 5 | arm64_regnum(rt);
+    int64_t  offset = mem->imm;
+    if (mem->mode == AM_Offset && offset >= 0 && offset % (1 << size) == 0 && (offset >> size) <= 0xFFF) {
+        return base | 0x01000000 | (uint32_t) (offset >> size) << 10;
+    }
+    if (offset < -256 || offset > 255) {
+        arm64_encode_error(instr, "offset out of range");
+    }
+    uint32_t mode = (mem->mode == AM_PreIndex) ? 0xC00 : (mem->mode == AM_PostIndex) ? 0x400 : 0;
+    return base | mode | ((uint32_t) offset & 0x1FF) << 12;
+}
+
+static uint32_t arm64_encode_pair(arm64_instr_t *instr, bool load)
+{
+    arm64_operand_t *rt = instr->operands;
+    arm64_operand_t *rt2 = instr->operands + 1;
+    arm64_operand_t *mem = instr->operands + 2;
+    if (mem->kind != AOK_Mem) {
+        arm64_encode_error(instr, "invalid operand");
+    }
+    int     scale = (rt->w) ? 4 : 8;
+    int64_t offset = mem->imm;
+    if (offset % scale != 0 || offset / scale < -64 || offset / scale > 63) {
+        arm64_encode_error(instr, "offset out of range");
+    }
+    uint32_t mode = (mem->mode == AM_PreIndex) ? 0x01800000 : (mem->mode == AM_PostIndex) ? 0x00800000 : 0x01000000;
+    return ((rt->w) ? 0 : (2u << 30)) | 0x28000000 | mode | ((load) ? (1u << 22) : 0)
+        | ((uint32_t) (offset / scale) & 0x7F) << 15 | arm64_regnum(rt2) << 10 | arm64_regnum(mem) << 5 | arm64_regnum(rt);
+}
+
+static uint64_t arm64_find_symbol(arm64_image_t *image, slice_t name)
+{
+    for (size_t ix = 0; ix < image->symbols.len; ++ix) {
+        if (slice_eq(image->symbols.items[ix].name, name)) {
+            return ix;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Returns the offset of the label the operand refers to. Local labels are
+// looked up in the instructions of the function, the way the assembler
+// resolves 1f and 1b. A symbol not defined in the object returns
+// UINT64_MAX.
+static uint64_t arm64_label_offset(arm64_image_t *image, arm64_placed_instrs_t *function, size_t ix, arm64_label_t *label)
+{
+    switch (label->kind) {
+    case ALK_IR:
+        if (label->id < image->labels.len && image->labels.items[label->id] != UINT64_MAX) {
+            return image->labels.items[label->id];
+        }
+        break;
+    case ALK_String:
+        if (label->id < image->strings.len) {
+            return image->strings.items[label->id];
+        }
+        break;
+    case ALK_Symbol: {
+        size_t symbol = arm64_find_symbol(image, label->symbol);
+        return (symbol != SIZE_MAX && image->symbols.items[symbol].defined) ? image->symbols.items[symbol].offset : UINT64_MAX;
+    }
+    case ALK_Local:
+        while ((label->forward) ? ++ix < function->len : ix-- > 0) {
+            arm64_instr_t *instr = function->items[ix].instr;
+            if (instr->opcode == AO_Label && instr->operands[0].label.kind == ALK_Local && instr->operands[0].label.id == label->id) {
+                return function->items[ix].offset;
+            }
+        }
+        break;
+    }
+    fatal("Undefined label");
+    return UINT64_MAX;
+}
+
+// Encodes a branch. Returns the displacement in instructions, or adds a
+// relocation and returns 0 if the target is a symbol defined elsewhere.
+static int64_t arm64_branch(arm64_image_t *image, arm64_placed_instrs_t *function, size_t ix, int bits)
+{
+    arm64_placed_instr_t *placed = function->items + ix;
+    arm64_label_t        *label = &placed->instr->operands[0].label;
+    uint64_t              target = arm64_label_offset(image, function, ix, label);
+    if (target == UINT64_MAX) {
+        if (placed->instr->opcode == AO_b_cond) {
+            arm64_encode_error(placed->instr, "conditional branch to undefined symbol");
+        }
+        size_t symbol = arm64_find_symbol(image, label->symbol);
+        if (symbol == SIZE_MAX) {
+            symbol = image->symbols.len;
+            dynarr_append_s(arm64_symbol_t, &image->symbols, .name = label->symbol);
+        }
+        dynarr_append_s(arm64_reloc_t, &image->relocs, .offset = placed->offset, .symbol = symbol, .call = placed->instr->opcode == AO_bl);
+        return 0;
+    }
+    int64_t displacement = ((int64_t) target - (int64_t) placed->offset) / 4;
+    if (displacement < -(1ll << (bits - 1)) || displacement >= (1ll << (bits - 1))) {
+        arm64_encode_error(placed->instr, "branch target out of range");
+    }
+    return displacement & ((1ll << bits) - 1);
+}
+
+static void arm64_encode(arm64_image_t *image, arm64_placed_instrs_t *function, size_t ix)
+{
+    arm64_instr_t   *instr = function->items[ix].instr;
+    arm64_operand_t *ops = instr->operands;
+    arm64_bytes_t   *text = &image->text;
+    switch (instr->opcode) {
+    case AO_Label:
+    case AO_Comment:
+        return;
+    case AO_add:
+    case AO_sub:
+        arm64_u32(text, arm64_encode_add_sub(instr, instr->opcode == AO_sub, false));
+        return;
+    case AO_cmp:
+        arm64_u32(text, arm64_encode_add_sub(instr, true, true));
+        return;
+    case AO_adr: {
+        uint64_t target = arm64_label_offset(image, function, ix, &ops[1].label);
+        if (target == UINT64_MAX) {
+            arm64_encode_error(instr, "address of undefined symbol");
+        }
+        int64_t displacement = (int64_t) target - (int64_t) function->items[ix].offset;
+        if (displacement < -(1 << 20) || displacement >= (1 << 20)) {
+            arm64_encode_error(instr, "address out of range");
+        }
+        arm64_u32(text, 0x10000000 | ((uint32_t) displacement & 3) << 29 | ((uint32_t) (displacement >> 2) & 0x7FFFF) << 5 | arm64_regnum(ops));
+        return;
+    }
+    case AO_and:
+    case AO_eor:
+    case AO_orr: {
+        if (ops[2].kind != AOK_Reg) {
+            arm64_encode_error(instr, "logical immediates are not supported");
+        }
+        uint32_t opc = (instr->opcode == AO_and) ? 0x0A000000 : (instr->opcode == AO_orr) ? 0x2A000000 : 0x4A000000;
+        arm64_u32(text, arm64_sf(ops) | opc | arm64_regnum(ops + 2) << 16 | arm64_regnum(ops + 1) << 5 | arm64_regnum(ops));
+        return;
+    }
+    case AO_b:
+        arm64_u32(text, 0x14000000 | (uint32_t) arm64_branch(image, function, ix, 26));
+        return;
+    case AO_bl:
+        arm64_u32(text, 0x94000000 | (uint32_t) arm64_branch(image, function, ix, 26));
+        return;
+    case AO_b_cond:
+        arm64_u32(text, 0x54000000 | (uint32_t) arm64_branch(image, function, ix, 19) << 5 | instr->cond);
+        return;
+    case AO_br:
+        arm64_u32(text, 0xD61F0000 | arm64_regnum(ops) << 5);
+        return;
+    case AO_ret:
+        arm64_u32(text, 0xD65F0000 | ((ops[0].kind == AOK_Reg) ? arm64_regnum(ops) : ARM64_LR) << 5);
+        return;
+    case AO_cset:
+        arm64_u32(text, arm64_sf(ops) | 0x1A9F07E0 | (instr->cond ^ 1) << 12 | arm64_regnum(ops));
+        return;
+    case AO_mov:
+        if (ops[1].kind == AOK_Imm) {
+            uint32_t parts[4];
+            int      count = arm64_mov_imm_parts(instr, parts);
+            for (int part = 0; part < count; ++part) {
+                arm64_u32(text, parts[part]);
+            }
+        } else if (ops[0].reg == ARM64_SP || ops[1].reg == ARM64_SP) {
+            arm64_u32(text, arm64_sf(ops) | 0x11000000 | arm64_regnum(ops + 1) << 5 | arm64_regnum(ops)); // add xd,xn,#0
+        } else {
+            arm64_u32(text, arm64_sf(ops) | 0x2A0003E0 | arm64_regnum(ops + 1) << 16 | arm64_regnum(ops)); // orr xd,xzr,xm
+        }
+        return;
+    case AO_mvn:
+        arm64_u32(text, arm64_sf(ops) | 0x2A2003E0 | arm64_regnum(ops + 1) << 16 | arm64_regnum(ops));
+        return;
+    case AO_neg:
+        arm64_u32(text, arm64_sf(ops) | 0x4B0003E0 | arm64_regnum(ops + 1) << 16 | arm64_regnum(ops));
+        return;
+    case AO_mul:
+    case AO_sdiv:
+    case AO_smull:
+    case AO_udiv:
+    case AO_umull: {
+        uint32_t opc = 0;
+        switch (instr->opcode) {
+        case AO_mul:
+            opc = arm64_sf(ops) | 0x1B007C00;
+            break;
+        case AO_sdiv:
+            opc = arm64_sf(ops) | 0x1AC00C00;
+            break;
+        case AO_udiv:
+            opc = arm64_sf(ops) | 0x1AC00800;
+            break;
+        case AO_smull:
+            opc = 0x9B207C00;
+            break;
+        default:
+            opc = 0x9BA07C00;
+            break;
+        }
+        arm64_u32(text, opc | arm64_regnum(ops + 2) << 16 | arm64_regnum(ops + 1) << 5 | arm64_regnum(ops));
+        return;
+    }
+    case AO_ldr:
+        arm64_u32(text, arm64_encode_load_store(instr, true));
+        return;
+    case AO_str:
+        arm64_u32(text, arm64_encode_load_store(instr, false));
+        return;
+    case AO_ldp:
+        arm64_u32(text, arm64_encode_pair(instr, true));
+        return;
+    case AO_stp:
+        arm64_u32(text, arm64_encode_pair(instr, false));
+        return;
+    }
+    UNREACHABLE();
+}
+
+static void arm64_place_function(arm64_image_t *image, arm64_function_t *function, arm64_placed_instrs_t *placed, uint64_t *offset)
+{
+    arm64_code_section_t sections[] = { CS_Prolog, CS_Code, CS_Epilog };
+    for (size_t s = 0; s < sizeof(sections) / sizeof(arm64_code_section_t); ++s) {
+        dynarr_foreach(arm64_instr_t, instr, function->sections + sections[s])
+        {
+            dynarr_append_s(arm64_placed_instr_t, placed, .instr = instr, .offset = *offset);
+            if (instr->opcode == AO_Label) {
+                arm64_label_t *label = &instr->operands[0].label;
+                switch (label->kind) {
+                case ALK_IR:
+                    while (image->labels.len <= label->id) {
+                        dynarr_append(&image->labels, UINT64_MAX);
+                    }
+                    image->labels.items[label->id] = *offset;
+                    break;
+                case ALK_Symbol: {
+                    bool global = false;
+                    dynarr_foreach(slice_t, name, &image->object->globals)
+                    {
+                        global |= slice_eq(*name, label->symbol);
+                    }
+                    dynarr_append_s(arm64_symbol_t, &image->symbols, .name = label->symbol, .offset = *offset, .defined = true, .global = global);
+                } break;
+                default:
+                    break;
+                }
+            }
+            *offset += arm64_instr_size(instr);
+        }
+    }
+}
+
+// Lays out the functions and strings of the object, then encodes them.
+static void arm64_image_build(arm64_image_t *image)
+{
+    arm64_object_t        *o = image->object;
+    arm64_placed_instrs_t *functions = (arm64_placed_instrs_t *) allocator_alloc(o->functions.len * sizeof(arm64_placed_instrs_t));
+    uint64_t               offset = 0;
+    for (size_t ix = 0; ix < o->functions.len; ++ix) {
+        functions[ix] = (arm64_placed_instrs_t) { 0 };
+        arm64_place_function(image, o->functions.items + ix, functions + ix, &offset);
+    }
+    dynarr_foreach(slice_t, str, &o->strings)
+    {
+        offset = align_at(4, offset);
+        dynarr_append(&image->strings, offset);
+        offset += str->len;
+    }
+
+    for (size_t ix = 0; ix < o->functions.len; ++ix) {
+        for (size_t instr = 0; instr < functions[ix].len; ++instr) {
+            assert(image->text.len == functions[ix].items[instr].offset);
+            arm64_encode(image, functions + ix, instr);
+        }
+        dynarr_free(functions + ix);
+    }
+    allocator_free((char *) functions);
+    for (size_t ix = 0; ix < o->strings.len; ++ix) {
+        arm64_align(&image->text, 4);
+        slice_t str = o->strings.items[ix];
+        for (size_t c = 0; c < str.len; ++c) {
+            arm64_u8(&image->text, str.items[c]);
+        }
+    }
+}
+
+static int arm64_symbol_cmp(void const *a, void const *b)
+{
+    arm64_symbol_t const *s1 = *(arm64_symbol_t const **) a;
+    arm64_symbol_t const *s2 = *(arm64_symbol_t const **) b;
+    int                   rank1 = (!s1->defined) ? 2 : (s1->global) ? 1 : 0;
+    int                   rank2 = (!s2->defined) ? 2 : (s2->global) ? 1 : 0;
+    if (rank1 != rank2) {
+        return rank1 - rank2;
+    }
+    // slice_cmp orders by length first
+    int ret = memcmp(s1->name.items, s2->name.items, MIN(s1->name.len, s2->name.len));
+    return (ret != 0) ? ret : (int) s1->name.len - (int) s2->name.len;
+}
+
+typedef DA(arm64_symbol_t *) arm64_symbol_ptrs_t;
+
+// Sorts the symbols into locals, defined globals and undefined symbols,
+// the order both formats want them in, and assigns their indexes, starting
+// at `first`.
+static arm64_symbol_ptrs_t arm64_sorted_symbols(arm64_image_t *image, uint32_t first, size_t counts[3])
+{
+    arm64_symbol_ptrs_t sorted = { 0 };
+    dynarr_foreach(arm64_symbol_t, symbol, &image->symbols)
+    {
+        dynarr_append(&sorted, symbol);
+    }
+    qsort(sorted.items, sorted.len, sizeof(arm64_symbol_t *), arm64_symbol_cmp);
+    counts[0] = counts[1] = counts[2] = 0;
+    for (size_t ix = 0; ix < sorted.len; ++ix) {
+        arm64_symbol_t *symbol = sorted.items[ix];
+        symbol->index = first + ix;
+        ++counts[(!symbol->defined) ? 2 : (symbol->global) ? 1 : 0];
+    }
+    return sorted;
+}
+
+#define MH_MAGIC_64 0xFEEDFACF
+#define MH_OBJECT 0x1
+#define CPU_TYPE_ARM64 0x0100000C
+#define LC_SEGMENT_64 0x19
+#define LC_SYMTAB 0x2
+#define LC_DYSYMTAB 0xB
+#define LC_BUILD_VERSION 0x32
+#define PLATFORM_MACOS 1
+#define N_EXT 0x01
+#define N_SECT 0x0E
+#define ARM64_RELOC_BRANCH26 2
+
+static void arm64_write_macho(arm64_image_t *image, arm64_bytes_t *out)
+{
+    size_t              counts[3];
+    arm64_symbol_ptrs_t sorted = arm64_sorted_symbols(image, 0, counts);
+    arm64_bytes_t       strtab = { 0 };
+    arm64_u8(&strtab, 0);
+    uint64s names = { 0 };
+    dynarr_foreach(arm64_symbol_t *, symbol, &sorted)
+    {
+        dynarr_append(&names, arm64_add_name(&strtab, (*symbol)->name));
+    }
+    arm64_align(&strtab, 8);
+
+    uint32_t sizeofcmds = (72 + 80) + 24 + 24 + 80;
+    uint64_t text_offset = 32 + sizeofcmds;
+    uint64_t reloc_offset = align_at(8, text_offset + image->text.len);
+    uint64_t symtab_offset = reloc_offset + 8 * image->relocs.len;
+    uint64_t strtab_offset = symtab_offset + 16 * sorted.len;
+
+    arm64_u32(out, MH_MAGIC_64);
+    arm64_u32(out, CPU_TYPE_ARM64);
+    arm64_u32(out, 0); // CPU_SUBTYPE_ARM64_ALL
+    arm64_u32(out, MH_OBJECT);
+    arm64_u32(out, 4);
+    arm64_u32(out, sizeofcmds);
+    arm64_u32(out, 0);
+    arm64_u32(out, 0);
+
+    arm64_u32(out, LC_SEGMENT_64);
+    arm64_u32(out, 72 + 80);
+    arm64_fixed_name(out, "", 16);
+    arm64_u64(out, 0);
+    arm64_u64(out, image->text.len);
+    arm64_u64(out, text_offset);
+    arm64_u64(out, image->text.len);
+    arm64_u32(out, 7); // rwx
+    arm64_u32(out, 7);
+    arm64_u32(out, 1);
+    arm64_u32(out, 0);
+    arm64_fixed_name(out, "__text", 16);
+    arm64_fixed_name(out, "__TEXT", 16);
+    arm64_u64(out, 0);
+    arm64_u64(out, image->text.len);
+    arm64_u32(out, text_offset);
+    arm64_u32(out, 2); // 2^2 alignment
+    arm64_u32(out, (image->relocs.len > 0) ? reloc_offset : 0);
+    arm64_u32(out, image->relocs.len);
+    arm64_u32(out, 0x80000400); // S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS
+    arm64_u32(out, 0);
+    arm64_u32(out, 0);
+    arm64_u32(out, 0);
+
+    arm64_u32(out, LC_BUILD_VERSION);
+    arm64_u32(out, 24);
+    arm64_u32(out, PLATFORM_MACOS);
+    arm64_u32(out, 11 << 16); // Minimum OS version 11.0, the first one on arm64
+    arm64_u32(out, 0);
+    arm64_u32(out, 0);
+
+    arm64_u32(out, LC_SYMTAB);
+    arm64_u32(out, 24);
+    arm64_u32(out, symtab_offset);
+    arm64_u32(out, sorted.len);
+    arm64_u32(out, strtab_offset);
+    arm64_u32(out, strtab.len);
+
+    arm64_u32(out, LC_DYSYMTAB);
+    arm64_u32(out, 80);
+    arm64_u32(out, 0);
+    arm64_u32(out, counts[0]);
+    arm64_u32(out, counts[0]);
+    arm64_u32(out, counts[1]);
+    arm64_u32(out, counts[0] + counts[1]);
+    arm64_u32(out, counts[2]);
+    for (int ix = 0; ix < 12; ++ix) {
+        arm64_u32(out, 0);
+    }
+
+    assert(out->len == text_offset);
+    dynarr_foreach(uint8_t, b, &image->text)
+    {
+        arm64_u8(out, *b);
+    }
+    arm64_align(out, 8);
+    dynarr_foreach(arm64_reloc_t, reloc, &image->relocs)
+    {
+        arm64_u32(out, reloc->offset);
+        arm64_u32(out, image->symbols.items[reloc->symbol].index | 1u << 24 | 2u << 25 | 1u << 27 | ARM64_RELOC_BRANCH26 << 28);
+    }
+    for (size_t ix = 0; ix < sorted.len; ++ix) {
+        arm64_symbol_t *symbol = sorted.items[ix];
+        arm64_u32(out, names.items[ix]);
+        arm64_u8(out, (symbol->defined ? N_SECT : 0) | ((symbol->global || !symbol->defined) ? N_EXT : 0));
+        arm64_u8(out, symbol->defined ? 1 : 0);
+        arm64_u16(out, 0);
+        arm64_u64(out, symbol->offset);
+    }
+    dynarr_foreach(uint8_t, b, &strtab)
+    {
+        arm64_u8(out, *b);
+    }
+    dynarr_free(&sorted);
+    dynarr_free(&names);
+    dynarr_free(&strtab);
+}
+
+#define EM_AARCH64 183
+#define ET_REL 1
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB 2
+#define SHT_STRTAB 3
+#define SHT_RELA 4
+#define SHF_ALLOC 0x2
+#define SHF_EXECINSTR 0x4
+#define SHF_INFO_LINK 0x40
+#define STB_LOCAL 0
+#define STB_GLOBAL 1
+#define STT_NOTYPE 0
+#define STT_FUNC 2
+#define R_AARCH64_JUMP26 282
+#define R_AARCH64_CALL26 283
+
+typedef struct _arm64_elf_section {
+    uint32_t name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+    uint32_t info;
+    uint64_t alignment;
+    uint64_t entsize;
+} arm64_elf_section_t;
+
+// Sections: null, .text, .rela.text, .symtab, .strtab, .shstrtab and an
+// empty .note.GNU-stack, which marks the stack as not executable.
+static void arm64_write_elf(arm64_image_t *image, arm64_bytes_t *out)
+{
+    size_t              counts[3];
+    arm64_symbol_ptrs_t sorted = arm64_sorted_symbols(image, 1, counts);
+    arm64_bytes_t       strtab = { 0 };
+    arm64_bytes_t       shstrtab = { 0 };
+    arm64_u8(&strtab, 0);
+    arm64_u8(&shstrtab, 0);
+
+    arm64_elf_section_t sections[7] = { 0 };
+    sections[1] = (arm64_elf_section_t) { arm64_add_name(&shstrtab, C(".text")), SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 0, image->text.len, 0, 0, 4, 0 };
+    sections[2] = (arm64_elf_section_t) { arm64_add_name(&shstrtab, C(".rela.text")), SHT_RELA, SHF_INFO_LINK, 0, 24 * image->relocs.len, 3, 1, 8, 24 };
+    sections[3] = (arm64_elf_section_t) { arm64_add_name(&shstrtab, C(".symtab")), SHT_SYMTAB, 0, 0, 24 * (sorted.len + 1), 4, 1 + counts[0], 8, 24 };
+    sections[4] = (arm64_elf_section_t) { arm64_add_name(&shstrtab, C(".strtab")), SHT_STRTAB, 0, 0, 0, 0, 0, 1, 0 };
+    sections[5] = (arm64_elf_section_t) { arm64_add_name(&shstrtab, C(".shstrtab")), SHT_STRTAB, 0, 0, 0, 0, 0, 1, 0 };
+    sections[6] = (arm64_elf_section_t) { arm64_add_name(&shstrtab, C(".note.GNU-stack")), SHT_PROGBITS, 0, 0, 0, 0, 0, 1, 0 };
+
+    arm64_bytes_t symtab = { 0 };
+    for (int ix = 0; ix < 24; ++ix) {
+        arm64_u8(&symtab, 0);
+    }
+    dynarr_foreach(arm64_symbol_t *, it, &sorted)
+    {
+        arm64_symbol_t *symbol = *it;
+        arm64_u32(&symtab, arm64_add_name(&strtab, symbol->name));
+        arm64_u8(&symtab, (symbol->defined) ? ((symbol->global) ? STB_GLOBAL : STB_LOCAL) << 4 | STT_FUNC : STB_GLOBAL << 4 | STT_NOTYPE);
+        arm64_u8(&symtab, 0);
+        arm64_u16(&symtab, (symbol->defined) ? 1 : 0);
+        arm64_u64(&symtab, symbol->offset);
+        arm64_u64(&symtab, 0);
+    }
+    sections[4].size = strtab.len;
+    sections[5].size = shstrtab.len;
+
+    arm64_u8(out, 0x7F);
+    arm64_u8(out, 'E');
+    arm64_u8(out, 'L');
+    arm64_u8(out, 'F');
+    arm64_u8(out, 2); // 64-bit
+    arm64_u8(out, 1); // Little endian
+    arm64_u8(out, 1); // Version
+    for (int ix = 7; ix < 16; ++ix) {
+        arm64_u8(out, 0);
+    }
+    arm64_u16(out, ET_REL);
+    arm64_u16(out, EM_AARCH64);
+    arm64_u32(out, 1);
+    arm64_u64(out, 0);
+    arm64_u64(out, 0);
+    size_t shoff_at = out->len;
+    arm64_u64(out, 0); // Section header offset, patched below
+    arm64_u32(out, 0);
+    arm64_u16(out, 64);
+    arm64_u16(out, 0);
+    arm64_u16(out, 0);
+    arm64_u16(out, 64);
+    arm64_u16(out, 7);
+    arm64_u16(out, 5);
+
+    sections[1].offset = out->len;
+    dynarr_foreach(uint8_t, b, &image->text)
+    {
+        arm64_u8(out, *b);
+    }
+    arm64_align(out, 8);
+    sections[2].offset = out->len;
+    dynarr_foreach(arm64_reloc_t, reloc, &image->relocs)
+    {
+        arm64_u64(out, reloc->offset);
+        arm64_u64(out, (uint64_t) image->symbols.items[reloc->symbol].index << 32 | ((reloc->call) ? R_AARCH64_CALL26 : R_AARCH64_JUMP26));
+        arm64_u64(out, 0);
+    }
+    sections[3].offset = out->len;
+    dynarr_foreach(uint8_t, b, &symtab)
+    {
+        arm64_u8(out, *b);
+    }
+    sections[4].offset = out->len;
+    dynarr_foreach(uint8_t, b, &strtab)
+    {
+        arm64_u8(out, *b);
+    }
+    sections[5].offset = out->len;
+    dynarr_foreach(uint8_t, b, &shstrtab)
+    {
+        arm64_u8(out, *b);
+    }
+    sections[6].offset = out->len;
+    arm64_align(out, 8);
+
+    uint64_t shoff = out->len;
+    for (int ix = 0; ix < 8; ++ix) {
+        out->items[shoff_at + ix] = (shoff >> (8 * ix)) & 0xFF;
+    }
+    for (size_t ix = 0; ix < sizeof(sections) / sizeof(arm64_elf_section_t); ++ix) {
+        arm64_elf_section_t *section = sections + ix;
+        arm64_u32(out, section->name);
+        arm64_u32(out, section->type);
+        arm64_u64(out, section->flags);
+        arm64_u64(out, 0);
+        arm64_u64(out, section->offset);
+        arm64_u64(out, section->size);
+        arm64_u32(out, section->link);
+        arm64_u32(out, section->info);
+        arm64_u64(out, section->alignment);
+        arm64_u64(out, section->entsize);
+    }
+    dynarr_free(&sorted);
+    dynarr_free(&symtab);
+    dynarr_free(&strtab);
+    dynarr_free(&shstrtab);
+}
+
+bool arm64_write_object_file(arm64_object_t *o, char const *file_name)
+{
+    arm64_image_t image = { .object = o };
+    arm64_image_build(&image);
+
+    arm64_bytes_t out = { 0 };
+    switch (ARM64_OBJECT_FORMAT) {
+    case AOF_ELF:
+        arm64_write_elf(&image, &out);
+        break;
+    case AOF_MachO:
+        arm64_write_macho(&image, &out);
+        break;
+    }
+    FILE *f = fopen(file_name, "wb+");
+    bool  ok = f != NULL && fwrite(out.items, 1, out.len, f) == out.len;
+    if (f != NULL) {
+        ok &= fclose(f) == 0;
+    }
+    dynarr_free(&out);
+    dynarr_free(&image.text);
+    dynarr_free(&image.symbols);
+    dynarr_free(&image.relocs);
+    dynarr_free(&image.labels);
+    dynarr_free(&image.strings);
+    return ok;
+}
@@ -0,0 +1,653 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arm64.h"
+#include "da.h"
+
+// Peephole optimizer for the code of an arm64 function. The code generator
+// works like a stack machine and moves every value through x0 and the
+// value stack registers. The passes below clean up after it:
+//
+// - a compare diamond materializing the flags in a register becomes cset;
+// - a branch to the next instruction is dropped;
+// - a load from the slot that was just stored to becomes a mov;
+// - register copies and small constants are propagated forward within a
+//   basic block;
+// - instructions without side effects whose results are never read are
+//   dropped, using a liveness analysis of the whole function;
+// - a cset tested by a cmp with zero and a b.eq or b.ne becomes a single
+//   b.cond.
+//
+// The passes are repeated until nothing changes. Dropped instructions are
+// first turned into empty comments, which arm64_add_comment never adds,
+// and removed at the end of every round.
+
+#define ARM64_FLAGS 33
+#define REG_BIT(r) (1ull << (r))
+#define ARM64_ALL_REGS ((REG_BIT(ARM64_FLAGS + 1) - 1) & ~REG_BIT(ARM64_ZR))
+#define ARM64_ALWAYS_LIVE (REG_BIT(ARM64_FP) | REG_BIT(ARM64_LR) | REG_BIT(ARM64_SP))
+#define ARM64_CALL_CLOBBERS ((REG_BIT(19) - 1) | REG_BIT(ARM64_LR) | REG_BIT(ARM64_FLAGS))
+#define ARM64_LIVE_AT_EXIT (REG_BIT(0) | (REG_BIT(29) - REG_BIT(19)) | ARM64_ALWAYS_LIVE)
+
+typedef struct _arm64_effects {
+    uint64_t defs;
+    uint64_t uses;
+} arm64_effects_t;
+
+static uint64_t arm64_reg_bit(arm64_operand_t *operand)
+{
+    return (operand->kind == AOK_Reg && operand->reg != ARM64_ZR) ? REG_BIT(operand->reg) : 0;
+}
+
+static uint64_t arm64_base_bit(arm64_operand_t *operand)
+{
+    return (operand->kind == AOK_Mem) ? REG_BIT(operand->reg) : 0;
+}
+
+static uint64_t arm64_writeback_bit(arm64_operand_t *operand)
+{
+    return (operand->kind == AOK_Mem && operand->mode != AM_Offset) ? REG_BIT(operand->reg) : 0;
+}
+
+static arm64_effects_t arm64_effects(arm64_instr_t *instr)
+{
+    arm64_operand_t *ops = instr->operands;
+    switch (instr->opcode) {
+    case AO_Label:
+    case AO_Comment:
+    case AO_b:
+        return (arm64_effects_t) { 0 };
+    case AO_adr:
+    case AO_mov:
+    case AO_mvn:
+    case AO_neg:
+        return (arm64_effects_t) { .defs = arm64_reg_bit(ops), .uses = arm64_reg_bit(ops + 1) };
+    case AO_add:
+    case AO_and:
+    case AO_eor:
+    case AO_mul:
+    case AO_orr:
+    case AO_sdiv:
+    case AO_smull:
+    case AO_sub:
+    case AO_udiv:
+    case AO_umull:
+        return (arm64_effects_t) { .defs = arm64_reg_bit(ops), .uses = arm64_reg_bit(ops + 1) | arm64_reg_bit(ops + 2) };
+    case AO_cset:
+        return (arm64_effects_t) { .defs = arm64_reg_bit(ops), .uses = REG_BIT(ARM64_FLAGS) };
+    case AO_cmp:
+        return (arm64_effects_t) { .defs = REG_BIT(ARM64_FLAGS), .uses = arm64_reg_bit(ops) | arm64_reg_bit(ops + 1) };
+    case AO_b_cond:
+        return (arm64_effects_t) { .uses = REG_BIT(ARM64_FLAGS) };
+    case AO_br:
+        return (arm64_effects_t) { .uses = arm64_reg_bit(ops) };
+    case AO_bl:
+        // The callee can clobber x0-x18.
+        return (arm64_effects_t) { .defs = ARM64_CALL_CLOBBERS, .uses = REG_BIT(instr->arg_regs) - 1 };
+    case AO_ret:
+        return (arm64_effects_t) { .uses = ARM64_ALL_REGS };
+    case AO_ldr:
+        return (arm64_effects_t) { .defs = arm64_reg_bit(ops) | arm64_writeback_bit(ops + 1), .uses = arm64_base_bit(ops + 1) };
+    case AO_ldp:
+        return (arm64_effects_t) { .defs = arm64_reg_bit(ops) | arm64_reg_bit(ops + 1) | arm64_writeback_bit(ops + 2), .uses = arm64_base_bit(ops + 2) };
+    case AO_str:
+        return (arm64_effects_t) { .defs = arm64_writeback_bit(ops + 1), .uses = arm64_reg_bit(ops) | arm64_base_bit(ops + 1) };
+    case AO_stp:
+        return (arm64_effects_t) { .defs = arm64_writeback_bit(ops + 2), .uses = arm64_reg_bit(ops) | arm64_reg_bit(ops + 1) | arm64_base_bit(ops + 2) };
+    }
+    UNREACHABLE();
+}
+
+// Instructions that only compute their result, and can be dropped if
+// nothing reads it.
+static bool arm64_is_pure(arm64_instr_t *instr)
+{
+    switch (instr->opcode) {
+    case AO_add:
+    case AO_adr:
+    case AO_and:
+    case AO_cmp:
+    case AO_cset:
+    case AO_eor:
+    case AO_mov:
+    case AO_mul:
+    case AO_mvn:
+    case AO_neg:
+    case AO_orr:
+    case AO_sdiv:
+    case AO_smull:
+    case AO_sub:
+    case AO_udiv:
+    case AO_umull:
+        return true;
+    case AO_ldr:
+        return instr->operands[1].mode == AM_Offset;
+    case AO_ldp:
+        return instr->operands[2].mode == AM_Offset;
+    default:
+        return false;
+    }
+}
+
+static bool arm64_ends_block(arm64_instr_t *instr)
+{
+    switch (instr->opcode) {
+    case AO_Label:
+    case AO_b:
+    case AO_b_cond:
+    case AO_bl:
+    case AO_br:
+    case AO_ret:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool arm64_is_reg(arm64_operand_t *operand, int reg)
+{
+    return operand->kind == AOK_Reg && operand->reg == reg;
+}
+
+static bool arm64_same_label(arm64_label_t *l1, arm64_label_t *l2)
+{
+    if (l1->kind != l2->kind) {
+        return false;
+    }
+    if (l1->kind == ALK_Symbol) {
+        return slice_eq(l1->symbol, l2->symbol);
+    }
+    return l1->id == l2->id;
+}
+
+static void arm64_drop(arm64_instr_t *instr)
+{
+    *instr = (arm64_instr_t) { .opcode = AO_Comment };
+}
+
+
+// The next instruction after ix that isn't a comment.
+static size_t arm64_next(arm64_instrs_t *code, size_t ix)
+{
+    for (++ix; ix < code->len && code->items[ix].opcode == AO_Comment; ++ix)
+        ;
+    return ix;
+}
+
+// Gives every local label definition its own number, so that labels can
+// be told apart and dropped without rebinding references to other ones.
+static void arm64_number_local_labels(arm64_instrs_t *code)
+{
+    uint64s defs = { 0 };
+    for (size_t ix = 0; ix < code->len; ++ix) {
+        dynarr_append(&defs, 0);
+    }
+    uint64_t next = 1;
+    for (size_t ix = 0; ix < code->len; ++ix) {
+        arm64_instr_t *instr = code->items + ix;
+        if (instr->opcode == AO_Label && instr->operands[0].label.kind == ALK_Local) {
+            defs.items[ix] = next++;
+        }
+    }
+    for (size_t ix = 0; ix < code->len; ++ix) {
+        arm64_instr_t *instr = code->items + ix;
+        if (instr->opcode == AO_Label) {
+            continue;
+        }
+        for (size_t op = 0; op < 3; ++op) {
+            arm64_label_t *label = &instr->operands[op].label;
+            if (instr->operands[op].kind != AOK_Label || label->kind != ALK_Local) {
+                continue;
+            }
+            size_t def = ix;
+            while ((label->forward) ? ++def < code->len : def-- > 0) {
+                arm64_instr_t *d = code->items + def;
+                if (d->opcode == AO_Label && d->operands[0].label.kind == ALK_Local && d->operands[0].label.id == label->id) {
+                    break;
+                }
+            }
+            assert(def < code->len);
+            label->id = defs.items[def];
+        }
+    }
+    for (size_t ix = 0; ix < code->len; ++ix) {
+        if (defs.items[ix] != 0) {
+            code->items[ix].operands[0].label.id = defs.items[ix];
+        }
+    }
+    dynarr_free(&defs);
+}
+
+// Where the IR and local labels of the code are defined, and how many
+// instructions refer to them. Labels of one kind are indexed by the offset
+// of their id in the range of ids of that kind, like the label table of
+// the linker. The table is built at the start of every round of the
+// optimizer, and arm64_compact keeps the definitions up to date.
+typedef struct _arm64_label_range {
+    uint64_t base;
+    uint64s  defs; // Index of the definition, or SIZE_MAX
+    uint64s  refs;
+} arm64_label_range_t;
+
+typedef struct _arm64_label_table {
+    arm64_label_range_t ranges[ALK_String]; // ALK_IR and ALK_Local
+} arm64_label_table_t;
+
+static bool arm64_label_indexed(arm64_label_t *label)
+{
+    return label->kind == ALK_IR || label->kind == ALK_Local;
+}
+
+static arm64_label_table_t arm64_label_table_build(arm64_instrs_t *code)
+{
+    arm64_label_table_t ret = { 0 };
+    uint64_t            top[ALK_String] = { 0 };
+    for (size_t kind = 0; kind < ALK_String; ++kind) {
+        ret.ranges[kind].base = UINT64_MAX;
+    }
+    dynarr_foreach(arm64_instr_t, instr, code)
+    {
+        for (size_t op = 0; op < 3; ++op) {
+            arm64_label_t *label = &instr->operands[op].label;
+            if (instr->operands[op].kind == AOK_Label && arm64_label_indexed(label)) {
+                ret.ranges[label->kind].base = MIN(ret.ranges[label->kind].base, label->id);
+                top[label->kind] = MAX(top[label->kind], label->id);
+            }
+        }
+    }
+    for (size_t kind = 0; kind < ALK_String; ++kind) {
+        arm64_label_range_t *range = ret.ranges + kind;
+        for (uint64_t id = range->base; id <= top[kind]; ++id) {
+            dynarr_append(&range->defs, SIZE_MAX);
+            dynarr_append(&range->refs, 0);
+        }
+    }
+    for (size_t ix = 0; ix < code->len; ++ix) {
+        arm64_instr_t *instr = code->items + ix;
+        for (size_t op = 0; op < 3; ++op) {
+            arm64_label_t *label = &instr->operands[op].label;
+            if (instr->operands[op].kind != AOK_Label || !arm64_label_indexed(label)) {
+                continue;
+            }
+            arm64_label_range_t *range = ret.ranges + label->kind;
+            if (instr->opcode == AO_Label) {
+                range->defs.items[label->id - range->base] = ix;
+            } else {
+                ++range->refs.items[label->id - range->base];
+            }
+        }
+    }
+    return ret;
+}
+
+static void arm64_label_table_free(arm64_label_table_t *table)
+{
+    for (size_t kind = 0; kind < ALK_String; ++kind) {
+        dynarr_free(&table->ranges[kind].defs);
+        dynarr_free(&table->ranges[kind].refs);
+    }
+}
+
+// The offset of the label in the range of its kind, or SIZE_MAX if the
+// table doesn't know it.
+static size_t arm64_label_offset(arm64_label_table_t *table, arm64_label_t *label)
+{
+    if (!arm64_label_indexed(label)) {
+        return SIZE_MAX;
+    }
+    arm64_label_range_t *range = table->ranges + label->kind;
+    if (label->id < range->base || label->id - range->base >= range->defs.len) {
+        return SIZE_MAX;
+    }
+    return label->id - range->base;
+}
+
+static size_t arm64_label_refs(arm64_label_table_t *table, arm64_label_t *label)
+{
+    size_t offset = arm64_label_offset(table, label);
+    return (offset == SIZE_MAX) ? 0 : table->ranges[label->kind].refs.items[offset];
+}
+
+// The index of the definition of the label the branch at ix jumps to, or
+// SIZE_MAX if it leaves the function.
+static size_t arm64_branch_target(arm64_instrs_t *code, arm64_label_table_t *table, size_t ix)
+{
+    arm64_label_t *label = &code->items[ix].operands[0].label;
+    size_t         offset = arm64_label_offset(table, label);
+    return (offset == SIZE_MAX) ? SIZE_MAX : table->ranges[label->kind].defs.items[offset];
+}
+
+// Removes the dropped instructions, and moves the definitions in the label
+// table along with the labels.
+static size_t arm64_compact(arm64_instrs_t *code, arm64_label_table_t *table)
+{
+    for (size_t kind = 0; kind < ALK_String; ++kind) {
+        dynarr_foreach(uint64_t, def, &table->ranges[kind].defs)
+        {
+            *def = SIZE_MAX;
+        }
+    }
+    size_t len = 0;
+    dynarr_foreach(arm64_instr_t, instr, code)
+    {
+        if (instr->opcode != AO_Comment || instr->comment.len > 0) {
+            size_t offset = (instr->opcode == AO_Label) ? arm64_label_offset(table, &instr->operands[0].label) : SIZE_MAX;
+            if (offset != SIZE_MAX) {
+                table->ranges[instr->operands[0].label.kind].defs.items[offset] = len;
+            }
+            code->items[len++] = *instr;
+        }
+    }
+    size_t removed = code->len - len;
+    code->len = len;
+    return removed;
+}
+
+// Computes the registers live out of every instruction. At the end of the
+// code, where the epilog takes over, x0 and the callee-saved registers are
+// live. Everything is live after a jump out of the function.
+static uint64_t *arm64_liveness(arm64_instrs_t *code, arm64_label_table_t *labels)
+{
+    size_t    n = code->len;
+    uint64_t *live_in = (uint64_t *) allocator_alloc((2 * n + 1) * sizeof(uint64_t));
+    uint64_t *live_out = live_in + n + 1;
+    uint64s   targets = { 0 };
+    for (size_t ix = 0; ix < n; ++ix) {
+        arm64_opcode_t opcode = code->items[ix].opcode;
+        dynarr_append(&targets, (opcode == AO_b || opcode == AO_b_cond) ? arm64_branch_target(code, labels, ix) : SIZE_MAX);
+    }
+    live_in[n] = ARM64_LIVE_AT_EXIT;
+    bool changed;
+    do {
+        changed = false;
+        for (size_t ix = n; ix-- > 0;) {
+            arm64_instr_t *instr = code->items + ix;
+            uint64_t       out = live_in[ix + 1];
+            uint64_t       target = (targets.items[ix] == SIZE_MAX) ? ARM64_ALL_REGS : live_in[targets.items[ix]];
+            switch (instr->opcode) {
+            case AO_b:
+                out = target;
+                break;
+            case AO_b_cond:
+                out |= target;
+                break;
+            case AO_br:
+            case AO_ret:
+                out = ARM64_ALL_REGS;
+                break;
+            default:
+                break;
+            }
+            arm64_effects_t effects = arm64_effects(instr);
+            uint64_t        in = effects.uses | (out & ~effects.defs);
+            if (in != live_in[ix] || out != live_out[ix]) {
+                live_in[ix] = in;
+                live_out[ix] = out;
+                changed = true;
+            }
+        }
+    } while (changed);
+    dynarr_free(&targets);
+    return live_in;
+}
+
+// cmp ...; b.<cond> 1f; mov w0,wzr; b 2f; 1: mov w0,#1; 2:
+static bool arm64_fold_diamonds(arm64_instrs_t *code, arm64_label_table_t *labels)
+{
+    bool changed = false;
+    for (size_t ix = 0; ix < code->len; ++ix) {
+        size_t i[6] = { ix };
+        for (size_t n = 1; n < 6; ++n) {
+            i[n] = arm64_next(code, i[n - 1]);
+            if (i[n] >= code->len) {
+                return changed;
+            }
+        }
+        arm64_instr_t *b_cond = code->items + i[0];
+        arm64_instr_t *mov_false = code->items + i[1];
+        arm64_instr_t *b = code->items + i[2];
+        arm64_instr_t *l_true = code->items + i[3];
+        arm64_instr_t *mov_true = code->items + i[4];
+        arm64_instr_t *l_end = code->items + i[5];
+        if (b_cond->opcode != AO_b_cond || b_cond->operands[0].label.kind != ALK_Local
+            || mov_false->opcode != AO_mov || mov_false->operands[0].kind != AOK_Reg || !arm64_is_reg(mov_false->operands + 1, ARM64_ZR)
+            || b->opcode != AO_b || b->operands[0].label.kind != ALK_Local
+            || l_true->opcode != AO_Label || !arm64_same_label(&l_true->operands[0].label, &b_cond->operands[0].label)
+            || mov_true->opcode != AO_mov || !arm64_is_reg(mov_true->operands, mov_false->operands[0].reg)
+            || mov_true->operands[1].kind != AOK_Imm || mov_true->operands[1].imm != 1
+            || l_end->opcode != AO_Label || !arm64_same_label(&l_end->operands[0].label, &b->operands[0].label)
+            || arm64_label_refs(labels, &l_true->operands[0].label) != 1
+            || arm64_label_refs(labels, &l_end->operands[0].label) != 1) {
+            continue;
+        }
+        *b_cond = (arm64_instr_t) { .opcode = AO_cset, .cond = b_cond->cond, .operands = { ARM64_W(mov_false->operands[0].reg) } };
+        for (size_t n = 1; n < 6; ++n) {
+            arm64_drop(code->items + i[n]);
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+// Drops branches to the label following them.
+static bool arm64_drop_branches_to_next(arm64_instrs_t *code)
+{
+    bool changed = false;
+    for (size_t ix = 0; ix < code->len; ++ix) {
+        arm64_instr_t *instr = code->items + ix;
+        if ((instr->opcode != AO_b && instr->opcode != AO_b_cond) || instr->operands[0].label.kind == ALK_Symbol) {
+            continue;
+        }
+        for (size_t next = arm64_next(code, ix); next < code->len && code->items[next].opcode == AO_Label; next = arm64_next(code, next)) {
+            if (arm64_same_label(&code->items[next].operands[0].label, &instr->operands[0].label)) {
+                arm64_drop(instr);
+                changed = true;
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+// str xA,[base,#o]; ldr xB,[base,#o] => str xA,[base,#o]; mov xB,xA
+static bool arm64_forward_stores(arm64_instrs_t *code)
+{
+    bool changed = false;
+    for (size_t ix = 0; ix < code->len; ++ix) {
+        arm64_instr_t *str = code->items + ix;
+        size_t         next = arm64_next(code, ix);
+        if (str->opcode != AO_str || next >= code->len) {
+            continue;
+        }
+        arm64_instr_t   *ldr = code->items + next;
+        arm64_operand_t *st = str->operands + 1;
+        arm64_operand_t *ld = ldr->operands + 1;
+        if (ldr->opcode != AO_ldr || st->mode != AM_Offset || ld->mode != AM_Offset || st->reg != ld->reg || st->imm != ld->imm
+            || str->operands[0].w || ldr->operands[0].w || st->reg == str->operands[0].reg) {
+            continue;
+        }
+        if (ldr->operands[0].reg == str->operands[0].reg) {
+            arm64_drop(ldr);
+        } else {
+            *ldr = (arm64_instr_t) { .opcode = AO_mov, .operands = { ldr->operands[0], str->operands[0] } };
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+// Whether the operand at position op of the instruction is read and may be
+// replaced by a copy of src. xzr can't replace a base register or the
+// first source of most instructions, where register 31 is sp, and a small
+// immediate only fits a mov and the last source of cmp, add and sub.
+static bool arm64_can_substitute(arm64_instr_t *instr, size_t op, arm64_operand_t *src)
+{
+    bool zr = arm64_is_reg(src, ARM64_ZR);
+    bool imm = src->kind == AOK_Imm;
+    switch (instr->opcode) {
+    case AO_mov:
+        return op == 1;
+    case AO_mvn:
+    case AO_neg:
+        return op == 1 && !imm && !zr;
+    case AO_cmp:
+        return op == 1 || (op == 0 && !imm && !zr);
+    case AO_add:
+    case AO_sub:
+        return op == 2 || (op == 1 && !imm && !zr);
+    case AO_and:
+    case AO_eor:
+    case AO_orr:
+        return (op == 2 && !imm) || (op == 1 && !imm && !zr);
+    case AO_mul:
+    case AO_sdiv:
+    case AO_smull:
+    case AO_udiv:
+    case AO_umull:
+        return (op == 1 || op == 2) && !imm && !zr;
+    case AO_str:
+        return op == 0 && !imm;
+    case AO_stp:
+        return (op == 0 || op == 1) && !imm;
+    default:
+        return false;
+    }
+}
+
+// mov xA,xB; ...; op ...,xA => mov xA,xB; ...; op ...,xB
+// mov xA,#imm; ...; op ...,xA => mov xA,#imm; ...; op ...,#imm
+static bool arm64_propagate_copies(arm64_instrs_t *code)
+{
+    bool changed = false;
+    for (size_t ix = 0; ix < code->len; ++ix) {
+        arm64_instr_t *mov = code->items + ix;
+        if (mov->opcode != AO_mov || mov->operands[0].kind != AOK_Reg) {
+            continue;
+        }
+        arm64_operand_t dst = mov->operands[0];
+        arm64_operand_t src = mov->operands[1];
+        if (dst.reg >= ARM64_FP) {
+            continue;
+        }
+        if (src.kind == AOK_Reg && (dst.w || src.w || src.reg == ARM64_SP || src.reg == dst.reg)) {
+            continue;
+        }
+        if (src.kind == AOK_Imm && (src.imm < 0 || src.imm > 4095)) {
+            continue;
+        }
+        uint64_t clobbers = REG_BIT(dst.reg) | ((src.kind == AOK_Reg) ? arm64_reg_bit(&src) : 0);
+        for (size_t next = arm64_next(code, ix); next < code->len; next = arm64_next(code, next)) {
+            arm64_instr_t *instr = code->items + next;
+            if (arm64_ends_block(instr)) {
+                break;
+            }
+            for (size_t op = 0; op < 3; ++op) {
+                arm64_operand_t *operand = instr->operands + op;
+                if (operand->kind == AOK_Reg && operand->reg == dst.reg && arm64_can_substitute(instr, op, &src)) {
+                    if (src.kind == AOK_Reg) {
+                        operand->reg = src.reg;
+                    } else {
+                        *operand = src;
+                    }
+                    changed = true;
+                }
+                if (operand->kind == AOK_Mem && operand->mode == AM_Offset && operand->reg == dst.reg && src.kind == AOK_Reg && src.reg != ARM64_ZR) {
+                    operand->reg = src.reg;
+                    changed = true;
+                }
+            }
+            if (arm64_effects(instr).defs & clobbers) {
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+// Drops instructions whose results are never read, and uses the liveness
+// information for two more patterns:
+//
+// op xA,...; mov xB,xA => op xB,...                   if xA is dead
+// cset wR,<cond>; cmp xR,xzr; b.eq/b.ne L => b.<!cond>/b.<cond> L
+//                                                     if xR and the flags are dead
+static bool arm64_drop_dead_code(arm64_instrs_t *code, arm64_label_table_t *labels)
+{
+    bool      changed = false;
+    uint64_t *live_in = arm64_liveness(code, labels);
+    uint64_t *live_out = live_in + code->len + 1;
+    for (size_t ix = 0; ix < code->len; ++ix) {
+        arm64_instr_t  *instr = code->items + ix;
+        arm64_effects_t effects = arm64_effects(instr);
+        if (instr->opcode == AO_mov && arm64_is_reg(instr->operands + 1, instr->operands[0].reg) && !instr->operands[0].w) {
+            arm64_drop(instr);
+            changed = true;
+            continue;
+        }
+        if (arm64_is_pure(instr) && effects.defs != 0 && (effects.defs & (live_out[ix] | ARM64_ALWAYS_LIVE)) == 0) {
+            arm64_drop(instr);
+            changed = true;
+            continue;
+        }
+        size_t next = arm64_next(code, ix);
+        if (next < code->len && arm64_is_pure(instr) && instr->opcode != AO_cmp && instr->opcode != AO_ldp) {
+            arm64_instr_t *mov = code->items + next;
+            int            reg = instr->operands[0].reg;
+            if (mov->opcode == AO_mov && arm64_is_reg(mov->operands + 1, reg) && !mov->operands[1].w
+                && mov->operands[0].kind == AOK_Reg && !mov->operands[0].w && mov->operands[0].reg < ARM64_FP
+                && (live_out[next] & REG_BIT(reg)) == 0) {
+                instr->operands[0].reg = mov->operands[0].reg;
+                arm64_drop(mov);
+                changed = true;
+                continue;
+            }
+        }
+        if (instr->opcode != AO_cset) {
+            continue;
+        }
+        size_t cmp_ix = next;
+        size_t b_ix = (cmp_ix < code->len) ? arm64_next(code, cmp_ix) : code->len;
+        if (b_ix >= code->len) {
+            continue;
+        }
+        arm64_instr_t *cmp = code->items + cmp_ix;
+        arm64_instr_t *b_cond = code->items + b_ix;
+        int            reg = instr->operands[0].reg;
+        bool           zero = arm64_is_reg(cmp->operands + 1, ARM64_ZR) || (cmp->operands[1].kind == AOK_Imm && cmp->operands[1].imm == 0);
+        if (cmp->opcode == AO_cmp && arm64_is_reg(cmp->operands, reg) && zero
+            && b_cond->opcode == AO_b_cond && (b_cond->cond == AC_eq || b_cond->cond == AC_ne)
+            && (live_out[b_ix] & (REG_BIT(reg) | REG_BIT(ARM64_FLAGS))) == 0) {
+            b_cond->cond = (b_cond->cond == AC_eq) ? instr->cond ^ 1 : instr->cond;
+            arm64_drop(instr);
+            arm64_drop(cmp);
+            changed = true;
+        }
+    }
+    allocator_free((char *) live_in);
+    return changed;
+}
+
+size_t arm64_peephole(arm64_instrs_t *code)
+{
+    size_t removed = 0;
+    arm64_number_local_labels(code);
+    bool changed;
+    do {
+        arm64_label_table_t labels = arm64_label_table_build(code);
+        changed = arm64_fold_diamonds(code, &labels);
+        changed |= arm64_drop_branches_to_next(code);
+        changed |= arm64_forward_stores(code);
+        changed |= arm64_propagate_copies(code);
+        removed += arm64_compact(code, &labels);
+        changed |= arm64_drop_dead_code(code, &labels);
+        removed += arm64_compact(code, &labels);
+        arm64_label_table_free(&labels);
+    } while (changed);
+    return removed;
+}
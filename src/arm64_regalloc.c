@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arm64.h"
+#include "da.h"
+#include "ir.h"
+#include "type.h"
+
+// Linear scan register allocation for the variables of a function.
+//
+// The live interval of a variable runs from the first to the last operation
+// accessing it. An interval overlapping a loop, i.e. the operations from a
+// label up to a jump back to it, is stretched over the whole loop, so that
+// the value survives the back edge. The intervals are assigned registers in
+// order of their start:
+//
+// - an interval spanning a call gets one of the callee-saved x22-x28;
+// - other intervals get one of the caller-saved x12-x15 if there is one
+//   free, so they don't cost a save in the prolog;
+// - if there is no register free, the interval that ends last is spilled.
+//   A spilled variable lives in the slot in the frame arm64_analyze gave it.
+//
+// Only scalars that are always accessed as a whole are candidates. Variables
+// accessed at an offset, larger than a register, or with a name declared
+// twice in the function live in the frame.
+//
+// x9-x11 are left for the value stack, which also gets the registers from
+// the pools not given to a variable. x19-x21 are used for breaks, defers
+// and the return value.
+
+static int const arm64_caller_saved[] = { 15, 14, 13, 12 };
+static int const arm64_callee_saved[] = { 28, 27, 26, 25, 24, 23, 22 };
+
+#define ARM64_CALLEE_SAVED_MASK (0x7Fu << 22)
+
+typedef struct _arm64_interval {
+    size_t variable;
+    size_t start;
+    size_t end;
+    bool   candidate;
+    bool   spans_call;
+} arm64_interval_t;
+
+typedef DA(arm64_interval_t) arm64_intervals_t;
+typedef DA(arm64_interval_t *) arm64_interval_ptrs_t;
+
+typedef struct _arm64_loop {
+    size_t begin;
+    size_t end;
+} arm64_loop_t;
+
+typedef DA(arm64_loop_t) arm64_loops_t;
+
+static int arm64_interval_cmp(void const *a, void const *b)
+{
+    arm64_interval_t const *i1 = *(arm64_interval_t const **) a;
+    arm64_interval_t const *i2 = *(arm64_interval_t const **) b;
+    if (i1->start != i2->start) {
+        return (i1->start < i2->start) ? -1 : 1;
+    }
+    return (i1->variable < i2->variable) ? -1 : 1;
+}
+
+// Returns the variables accessed by the operation in vars.
+static size_t arm64_operation_vars(operation_t *op, var_path_t *vars[2])
+{
+    switch (op->type) {
+    case IRO_AssignVar:
+    case IRO_AssignVarKeep:
+        vars[0] = &op->AssignVar.var;
+        return 1;
+    case IRO_BinaryOperatorVarConst:
+        vars[0] = &op->BinaryOperatorVarConst.var;
+        return 1;
+    case IRO_BinaryOperatorVarConstJumpF:
+        vars[0] = &op->BinaryOperatorVarConstJumpF.cond.var;
+        return 1;
+    case IRO_BinaryOperatorVarVar:
+        vars[0] = &op->BinaryOperatorVarVar.lhs;
+        vars[1] = &op->BinaryOperatorVarVar.rhs;
+        return 2;
+    case IRO_PushValue:
+        vars[0] = &op->PushValue;
+        return 1;
+    case IRO_PushVarAddress:
+        vars[0] = &op->PushVarAddress;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static opt_size_t arm64_jump_label(operation_t *op)
+{
+    switch (op->type) {
+    case IRO_Jump:
+        return OPTVAL(size_t, op->Jump.label);
+    case IRO_JumpF:
+        return OPTVAL(size_t, op->JumpF.label);
+    case IRO_JumpT:
+        return OPTVAL(size_t, op->JumpT.label);
+    case IRO_BinaryOperatorVarConstJumpF:
+        return OPTVAL(size_t, op->BinaryOperatorVarConstJumpF.jump.label);
+    case IRO_Break:
+        return OPTVAL(size_t, op->Break.scope_end);
+    default:
+        return OPTNULL(size_t);
+    }
+}
+
+static opt_size_t arm64_find_variable(arm64_function_t *f, slice_t name)
+{
+    for (size_t ix = 0; ix < f->variables.len; ++ix) {
+        if (slice_eq(f->variables.items[ix].name, name)) {
+            return OPTVAL(size_t, ix);
+        }
+    }
+    return OPTNULL(size_t);
+}
+
+static void arm64_intervals_build(arm64_function_t *f, size_t num_params, operations_t *operations, arm64_intervals_t *intervals)
+{
+    for (size_t ix = 0; ix < f->variables.len; ++ix) {
+        arm64_variable_t *var = f->variables.items + ix;
+        size_t            size = type_size_of(var->type);
+        bool              candidate = size > 0 && size <= 8;
+        for (size_t iix = 0; iix < ix; ++iix) {
+            if (slice_eq(f->variables.items[iix].name, var->name)) {
+                candidate = false;
+                intervals->items[iix].candidate = false;
+            }
+        }
+        dynarr_append_s(arm64_interval_t, intervals, .variable = ix, .start = SIZE_MAX, .end = 0, .candidate = candidate);
+    }
+
+    uint64s       calls = { 0 };
+    arm64_loops_t loops = { 0 };
+    for (size_t ix = 0; ix < operations->len; ++ix) {
+        operation_t *op = operations->items + ix;
+        var_path_t  *vars[2];
+        size_t       num_vars = arm64_operation_vars(op, vars);
+        for (size_t v = 0; v < num_vars; ++v) {
+            opt_size_t var = arm64_find_variable(f, vars[v]->name);
+            if (!var.ok) {
+                continue;
+            }
+            arm64_interval_t *interval = intervals->items + var.value;
+            if (vars[v]->offset != 0) {
+                interval->candidate = false;
+            }
+            interval->start = MIN(interval->start, ix);
+            interval->end = MAX(interval->end, ix);
+        }
+        if (op->type == IRO_Call || op->type == IRO_NativeCall) {
+            dynarr_append(&calls, ix);
+        }
+        opt_size_t label = arm64_jump_label(op);
+        if (label.ok) {
+            for (size_t target = 0; target <= ix; ++target) {
+                operation_t *l = operations->items + target;
+                if (l->type == IRO_Label && l->Label == label.value) {
+                    dynarr_append_s(arm64_loop_t, &loops, .begin = target, .end = ix);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Parameters arrive in registers at the start of the function:
+    for (size_t ix = 0; ix < num_params; ++ix) {
+        if (intervals->items[ix].start != SIZE_MAX) {
+            intervals->items[ix].start = 0;
+        }
+    }
+
+    // Stretch the intervals over the loops they overlap. Stretching an
+    // interval can make it overlap an enclosing loop, so repeat until
+    // nothing changes.
+    bool changed;
+    do {
+        changed = false;
+        dynarr_foreach(arm64_interval_t, interval, intervals)
+        {
+            if (interval->start == SIZE_MAX) {
+                continue;
+            }
+            dynarr_foreach(arm64_loop_t, loop, &loops)
+            {
+                if (interval->start <= loop->end && interval->end >= loop->begin
+                    && (interval->start > loop->begin || interval->end < loop->end)) {
+                    interval->start = MIN(interval->start, loop->begin);
+                    interval->end = MAX(interval->end, loop->end);
+                    changed = true;
+                }
+            }
+        }
+    } while (changed);
+
+    dynarr_foreach(arm64_interval_t, interval, intervals)
+    {
+        dynarr_foreach(uint64_t, call, &calls)
+        {
+            if (*call > interval->start && *call < interval->end) {
+                interval->spans_call = true;
+                break;
+            }
+        }
+    }
+    dynarr_free(&calls);
+    dynarr_free(&loops);
+}
+
+static int arm64_take_register(uint32_t *free_regs, int const *pool, size_t pool_size)
+{
+    for (size_t ix = 0; ix < pool_size; ++ix) {
+        if (*free_regs & (1u << pool[ix])) {
+            *free_regs &= ~(1u << pool[ix]);
+            return pool[ix];
+        }
+    }
+    return 0;
+}
+
+void arm64_allocate_registers(arm64_function_t *f, size_t num_params, operations_t *operations)
+{
+    arm64_intervals_t intervals = { 0 };
+    arm64_intervals_build(f, num_params, operations, &intervals);
+
+    arm64_interval_ptrs_t sorted = { 0 };
+    dynarr_foreach(arm64_interval_t, interval, &intervals)
+    {
+        if (interval->candidate && interval->start != SIZE_MAX) {
+            dynarr_append(&sorted, interval);
+        }
+    }
+    qsort(sorted.items, sorted.len, sizeof(arm64_interval_t *), arm64_interval_cmp);
+
+    uint32_t free_regs = 0;
+    for (size_t ix = 0; ix < sizeof(arm64_caller_saved) / sizeof(int); ++ix) {
+        free_regs |= 1u << arm64_caller_saved[ix];
+    }
+    for (size_t ix = 0; ix < sizeof(arm64_callee_saved) / sizeof(int); ++ix) {
+        free_regs |= 1u << arm64_callee_saved[ix];
+    }
+
+    arm64_interval_ptrs_t active = { 0 }; // Sorted by end
+    dynarr_foreach(arm64_interval_t *, it, &sorted)
+    {
+        arm64_interval_t *interval = *it;
+        size_t            expired = 0;
+        while (expired < active.len && active.items[expired]->end < interval->start) {
+            free_regs |= 1u << f->variables.items[active.items[expired]->variable].reg;
+            ++expired;
+        }
+        memmove(active.items, active.items + expired, (active.len - expired) * sizeof(arm64_interval_t *));
+        active.len -= expired;
+
+        int reg = 0;
+        if (!interval->spans_call) {
+            reg = arm64_take_register(&free_regs, arm64_caller_saved, sizeof(arm64_caller_saved) / sizeof(int));
+        }
+        if (reg == 0) {
+            reg = arm64_take_register(&free_regs, arm64_callee_saved, sizeof(arm64_callee_saved) / sizeof(int));
+        }
+        if (reg == 0) {
+            // Spill the interval ending last. That's the new one unless an
+            // active interval holding a register the new one can use ends
+            // later.
+            size_t victim = active.len;
+            while (victim > 0) {
+                --victim;
+                int victim_reg = f->variables.items[active.items[victim]->variable].reg;
+                if (!interval->spans_call || (ARM64_CALLEE_SAVED_MASK & (1u << victim_reg))) {
+                    break;
+                }
+            }
+            if (victim < active.len && active.items[victim]->end > interval->end) {
+                arm64_variable_t *spilled = f->variables.items + active.items[victim]->variable;
+                reg = spilled->reg;
+                spilled->reg = 0;
+                memmove(active.items + victim, active.items + victim + 1, (active.len - victim - 1) * sizeof(arm64_interval_t *));
+                --active.len;
+            } else {
+                continue;
+            }
+        }
+        f->variables.items[interval->variable].reg = reg;
+
+        size_t pos = active.len;
+        while (pos > 0 && active.items[pos - 1]->end > interval->end) {
+            --pos;
+        }
+        dynarr_append(&active, interval);
+        memmove(active.items + pos + 1, active.items + pos, (active.len - 1 - pos) * sizeof(arm64_interval_t *));
+        active.items[pos] = interval;
+    }
+
+    dynarr_foreach(arm64_variable_t, var, &f->variables)
+    {
+        if (var->reg > 0) {
+            f->var_regs |= 1u << var->reg;
+            f->save_regs |= (1u << var->reg) & ARM64_CALLEE_SAVED_MASK;
+        }
+    }
+    dynarr_free(&intervals);
+    dynarr_free(&sorted);
+    dynarr_free(&active);
+}
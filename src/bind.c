@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -295,12 +296,12 @@ nodeptr Comptime_bind(parser_t *parser, nodeptr n)
         return nullptr;
     }
     if (!node->comptime.output.ok) {
-        ir_generator_t gen = generate_ir(parser, stmts);
-        value_t        output = execute_ir(&gen, nodeptr_ptr(0));
-        if (output.type.value == String.value) {
-            node->comptime.output = OPTVAL(slice_t, output.slice);
-        } else {
-            node->comptime.output = OPTVAL(slice_t, (slice_t) { 0 });
+        // The block runs after this pass, together with the other blocks
+        // that are ready. Its output is spliced in during the next pass.
+        comptime_submit(parser, n);
+        node = N(n);
+        if (!node->comptime.output.ok) {
+            return nullptr;
         }
     }
     if (node->comptime.output.value.len > 0) {
@@ -336,7 +337,8 @@ nodeptr Constant_bind(parser_t *parser, nodeptr n)
 nodeptr Call_bind(parser_t *parser, nodeptr n)
 {
     node_t *node = N(n);
-    type_t *sig = get_type(bind(parser, node->function_call.callable));
+    nodeptr sig_type = bind(parser, node->function_call.callable);
+    type_t *sig = get_type(sig_type);
     if (sig->kind != TYPK_Signature) {
         return parser_bind_error(
             parser,
@@ -346,6 +348,9 @@ nodeptr Call_bind(parser_t *parser, nodeptr n)
     }
     type_t *args = get_type(bind(parser, node->function_call.arguments));
     assert(args->kind == TYPK_TypeList);
+    // Binding the arguments can add nodes and types.
+    node = N(n);
+    sig = get_type(sig_type);
     size_t ix;
     for (ix = 0; ix < MIN(args->type_list_types.len, sig->signature_type.parameters.len); ++ix) {
         nodeptr param_type = type_value_type(sig->signature_type.parameters.items[ix]);
@@ -596,8 +601,8 @@ nodeptr WhileStatement_bind(parser_t *parser, nodeptr n)
     S(Void)                \
     S(WhileStatement)
 
-static bool     bind_initialized = false;
-static bind_fnc bind_fncs[] = {
+static pthread_once_t bind_initialized = PTHREAD_ONCE_INIT;
+static bind_fnc       bind_fncs[] = {
 #undef S
 #define S(T) [NT_##T] = default_bind,
     NODETYPES(S)
@@ -610,14 +615,11 @@ void initialize_bind()
 #define S(T) bind_fncs[NT_##T] = T##_bind;
     BINDOVERRIDES(S)
 #undef S
-    bind_initialized = true;
 }
 
 nodeptr node_bind(parser_t *parser, nodeptr ix)
 {
-    if (!bind_initialized) {
-        initialize_bind();
-    }
+    pthread_once(&bind_initialized, initialize_bind);
     node_t *node = N(ix);
     if (node->bound_type.ok) {
         return node->bound_type;
@@ -627,7 +629,7 @@ nodeptr node_bind(parser_t *parser, nodeptr ix)
         dynarr_append(&parser->namespaces, ix);
     }
     nodeptr ret = bind_fncs[parser_node(parser, ix)->node_type](parser, ix);
-    if (node->namespace.ok) {
+    if (N(ix)->namespace.ok) {
         dynarr_pop(&parser->namespaces);
     }
     if (ret.ok) {
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+
+#include "cmdline.h"
+#include "da.h"
+#include "fs.h"
+#include "interpreter.h"
+#include "io.h"
+#include "ir.h"
+
+// On-disk cache of the output of @comptime blocks. A block's output is
+// stored in .elrond/comptime/<key>, where the key is a hash of:
+//
+// - the modification time and size of the compiler executable, standing
+//   in for a compiler version, so that rebuilding the compiler discards
+//   the cache;
+// - the text of the block;
+// - the listing of the IR generated for the block, which includes the
+//   functions it declares and the names and signatures of the functions
+//   it calls.
+//
+// Labels are numbered from a counter shared by the whole compilation, so
+// the listing renumbers them from the first label of the block. A block
+// then keeps its key when the blocks before it change.
+//
+// The cache only stores the output string. Side effects of running the
+// block, like output printed by foreign functions, don't happen on a hit.
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static uint64_t hash_bytes(uint64_t hash, void const *bytes, size_t len)
+{
+    for (size_t ix = 0; ix < len; ++ix) {
+        hash ^= ((uint8_t const *) bytes)[ix];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t hash_slice(uint64_t hash, slice_t s)
+{
+    hash = hash_bytes(hash, &s.len, sizeof(s.len));
+    return hash_bytes(hash, s.items, s.len);
+}
+
+static uint64_t hash_compiler(uint64_t hash)
+{
+    char exe[PATH_MAX];
+#ifdef __APPLE__
+    uint32_t size = sizeof(exe);
+    if (_NSGetExecutablePath(exe, &size) != 0) {
+        return hash;
+    }
+#else
+    strcpy(exe, "/proc/self/exe");
+#endif
+    struct stat st;
+    if (stat(exe, &st) != 0) {
+        return hash;
+    }
+    int64_t stamp[2] = { (int64_t) st.st_mtime, (int64_t) st.st_size };
+    return hash_bytes(hash, stamp, sizeof(stamp));
+}
+
+static uint64_t rebase_label(uint64_t label, uint64_t base)
+{
+    return (label >= base) ? label - base : label;
+}
+
+static void rebase_labels(operation_t *op, uint64_t base)
+{
+    switch (op->type) {
+    case IRO_Label:
+        op->Label = rebase_label(op->Label, base);
+        break;
+    case IRO_Jump:
+    case IRO_JumpF:
+    case IRO_JumpT:
+        op->Jump.label = rebase_label(op->Jump.label, base);
+        break;
+    case IRO_Break:
+        op->Break.scope_end = rebase_label(op->Break.scope_end, base);
+        op->Break.label = rebase_label(op->Break.label, base);
+        break;
+    case IRO_BinaryOperatorVarConstJumpF:
+        op->BinaryOperatorVarConstJumpF.jump.label = rebase_label(op->BinaryOperatorVarConstJumpF.jump.label, base);
+        break;
+    default:
+        break;
+    }
+}
+
+static path_t cache_path(comptime_cache_key_t key)
+{
+    path_t dot_elrond = path_make_relative(".elrond");
+    mkdir(dot_elrond.path.items, 0777);
+    path_t dir = path_extend(dot_elrond, C("comptime"));
+    mkdir(dir.path.items, 0777);
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long) key);
+    return path_extend(dir, C(name));
+}
+
+bool comptime_cache_enabled()
+{
+    return !cmdline_is_set("no-comptime-cache")
+        && !cmdline_is_set("mine-sequences")
+        && !cmdline_is_set("profile-comptime")
+        && !cmdline_is_set("sample-comptime");
+}
+
+comptime_cache_key_t comptime_cache_key(ir_generator_t *gen, nodeptr first, slice_t text)
+{
+    uint64_t hash = hash_compiler(FNV_OFFSET_BASIS);
+    hash = hash_slice(hash, text);
+
+    uint64_t base = UINT64_MAX;
+    for (size_t ix = first.value; ix < gen->ir_nodes.len; ++ix) {
+        dynarr_foreach(operation_t, op, ir_node_operations(gen->ir_nodes.items + ix))
+        {
+            if (op->type == IRO_Label && op->Label < base) {
+                base = op->Label;
+            }
+        }
+    }
+    sb_t list = { 0 };
+    for (size_t ix = first.value; ix < gen->ir_nodes.len; ++ix) {
+        dynarr_foreach(operation_t, op, ir_node_operations(gen->ir_nodes.items + ix))
+        {
+            operation_t rebased = *op;
+            rebase_labels(&rebased, base);
+            operation_list(&list, &rebased);
+            sb_append_char(&list, '\n');
+        }
+        sb_append_char(&list, '\n');
+    }
+    hash = hash_slice(hash, sb_as_slice(list));
+    sb_free(&list);
+    return hash;
+}
+
+opt_slice_t comptime_cache_lookup(comptime_cache_key_t key)
+{
+    path_t   path = cache_path(key);
+    opt_sb_t contents = slurp_file(sb_as_slice(path.path));
+    path_free(&path);
+    if (!contents.ok) {
+        return OPTNULL(slice_t);
+    }
+    if (cmdline_is_set("verbose")) {
+        fprintf(stderr, "[CACHE] Using cached comptime output %016llx\n", (unsigned long long) key);
+    }
+    return OPTVAL(slice_t, sb_as_slice(contents.value));
+}
+
+void comptime_cache_store(comptime_cache_key_t key, slice_t output)
+{
+    path_t path = cache_path(key);
+    // Write to a file of our own and rename it, so that a concurrent
+    // compile never reads a partial entry.
+    sb_t tmp = { 0 };
+    sb_printf(&tmp, SL ".%d", SLARG(path.path), (int) getpid());
+    FILE *f = fopen(tmp.items, "wb");
+    if (f != NULL) {
+        bool written = fwrite(output.items, 1, output.len, f) == output.len;
+        if (fclose(f) == 0 && written && rename(tmp.items, path.path.items) == 0) {
+            tmp.len = 0;
+        }
+    }
+    if (tmp.len > 0) {
+        unlink(tmp.items);
+    }
+    sb_free(&tmp);
+    path_free(&path);
+}
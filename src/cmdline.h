@@ -13,6 +13,8 @@
 #ifndef __CMDLINE_H__
 #define __CMDLINE_H__
 
+#include <unistd.h>
+
 #include "da.h"
 #include "slice.h"
 
@@ -83,6 +85,7 @@ void     parse_cmdline_args(app_description_t *descr, int argc, char const **arg
 slice_t  cmdline_value(char *opt);
 bool     cmdline_is_set(char *opt);
 slices_t cmdline_arguments();
+size_t   cmdline_jobs(char *opt, size_t max);
 
 #endif /* __CMDLINE_H__ */
 
@@ -330,6 +333,23 @@ slices_t cmdline_arguments()
     return _cmdline_args.arguments;
 }
 
+// Number of threads asked for with the option `opt`, or the number of
+// processors if it isn't given. At least 1 and at most `max`.
+size_t cmdline_jobs(char *opt, size_t max)
+{
+    long    processors = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t  jobs = (processors > 0) ? (size_t) processors : 1;
+    slice_t value = cmdline_value(opt);
+    if (value.len > 0) {
+        opt_ulong j = slice_to_ulong(value, 10);
+        if (!j.ok || j.value == 0) {
+            fatal("Invalid number of jobs `" SL "`", SLARG(value));
+        }
+        jobs = (size_t) j.value;
+    }
+    return MAX(1, MIN(jobs, max));
+}
+
 #define CMDLINE_IMPLEMENTED
 #endif /* !CMDLINE_IMPLEMENTED */
 
@@ -387,6 +407,15 @@ int main(int argc, char const **argv)
     assert(args.option_values.len == 1);
     assert(args.option_values.items[0].opt_def->option == 'y');
     assert(args.option_values.items[0].bool_value);
+
+    char const *jobs_argv[] = {
+        "cmdline",
+        "-x",
+        "3",
+    };
+    parse_cmdline_args(&app_descr, 3, jobs_argv);
+    assert(cmdline_jobs("longx", 8) == 3);
+    assert(cmdline_jobs("longx", 2) == 2);
 }
 
 #endif
@@ -15,6 +15,8 @@
 #define WS_IGNORE
 #define COMMENT_IGNORE
 
+#include <sys/stat.h>
+
 #include "cmdline.h"
 #include "da.h"
 #include "fs.h"
@@ -23,7 +25,9 @@
 #include "slice.h"
 
 #include "arm64.h"
+#include "interpreter.h"
 #include "ir.h"
+#include "native.h"
 #include "operators.h"
 #include "parser.h"
 #include "type.h"
@@ -71,9 +75,38 @@ static app_description_t app_descr = {
                    "https:://www.elrond-lang.com\n",
     .legal = "(c) finiandarcy.com",
     .options = {
+        {
+            .longopt = "jit",
+            .description = "Compile hot comptime functions to native code. Implies --register-vm",
+            .value_required = false,
+            .cardinality = COC_Set,
+            .type = COT_Boolean,
+        },
+        {
+            .longopt = "jit-threshold",
+            .description = "Number of calls after which a comptime function is compiled with --jit",
+            .value_required = true,
+            .cardinality = COC_Single,
+            .type = COT_Int,
+        },
+        {
+            .longopt = "jobs",
+            .option = 'j',
+            .description = "Number of threads running @comptime blocks and generating code. Defaults to the number of processors",
+            .value_required = true,
+            .cardinality = COC_Single,
+            .type = COT_Int,
+        },
         {
             .longopt = "keep-assembly",
-            .description = "Do not remove intermediate assembler files",
+            .description = "Write the generated assembly to .elrond/<module>.s",
+            .value_required = false,
+            .cardinality = COC_Set,
+            .type = COT_Boolean,
+        },
+        {
+            .longopt = "keep-objects",
+            .description = "Do not remove the object files in .elrond after linking",
             .value_required = false,
             .cardinality = COC_Set,
             .type = COT_Boolean,
@@ -86,6 +119,70 @@ static app_description_t app_descr = {
             .cardinality = COC_Set,
             .type = COT_Boolean,
         },
+        {
+            .longopt = "mine-sequences",
+            .description = "Report operation sequences executed at comptime that are candidates for superinstructions",
+            .value_required = false,
+            .cardinality = COC_Set,
+            .type = COT_Boolean,
+        },
+        {
+            .longopt = "no-comptime-cache",
+            .description = "Run all @comptime blocks instead of using their cached output from .elrond/comptime",
+            .value_required = false,
+            .cardinality = COC_Set,
+            .type = COT_Boolean,
+        },
+        {
+            .longopt = "no-peephole",
+            .description = "Do not run the peephole optimizer on the generated arm64 code",
+            .value_required = false,
+            .cardinality = COC_Set,
+            .type = COT_Boolean,
+        },
+        {
+            .longopt = "optimize",
+            .option = 'O',
+            .description = "Run the IR peephole optimizer",
+            .value_required = false,
+            .cardinality = COC_Set,
+            .type = COT_Boolean,
+        },
+        {
+            .longopt = "preload-foreign",
+            .description = "Resolve all foreign functions before running @comptime blocks, and fail if any are missing",
+            .value_required = false,
+            .cardinality = COC_Set,
+            .type = COT_Boolean,
+        },
+        {
+            .longopt = "profile-comptime",
+            .description = "Profile comptime code and write the call stacks to .elrond/<name>.folded",
+            .value_required = false,
+            .cardinality = COC_Set,
+            .type = COT_Boolean,
+        },
+        {
+            .longopt = "register-vm",
+            .description = "Run comptime code on the register VM",
+            .value_required = false,
+            .cardinality = COC_Set,
+            .type = COT_Boolean,
+        },
+        {
+            .longopt = "sample-comptime",
+            .description = "Sample the comptime call stack and write it to .elrond/<name>.folded",
+            .value_required = false,
+            .cardinality = COC_Set,
+            .type = COT_Boolean,
+        },
+        {
+            .longopt = "system-assembler",
+            .description = "Write assembly and run the system assembler instead of writing object files directly",
+            .value_required = false,
+            .cardinality = COC_Set,
+            .type = COT_Boolean,
+        },
         {
             .longopt = "trace",
             .option = 't',
@@ -110,6 +207,10 @@ int main(int argc, char const **argv)
     parse_cmdline_args(&app_descr, argc, argv);
     do_trace = cmdline_is_set("trace");
     do_list = cmdline_is_set("list");
+    if (cmdline_is_set("mine-sequences") + cmdline_is_set("profile-comptime") + cmdline_is_set("sample-comptime") > 1) {
+        fprintf(stderr, "Only one of --mine-sequences, --profile-comptime and --sample-comptime can be given\n");
+        exit(1);
+    }
     slices_t args = cmdline_arguments();
     assert(args.len > 0);
     slice_t  file_name = C(args.items[0].items);
@@ -128,10 +229,36 @@ int main(int argc, char const **argv)
     report("Parsing", &parser);
     parser_normalize(&parser);
     report("Normalizing", &parser);
+    if (cmdline_is_set("preload-foreign") && native_preload(parser.nodes) > 0) {
+        exit(1);
+    }
     do {
         parser_bind(&parser);
+        parser.bound += comptime_run_pending();
     } while (!parser_bound_type(&parser, parser.root).ok && parser.bound != 0);
     report("Binding", &parser);
+    comptime_session_end();
+    // Every @comptime block has run. Report now, so that the reports don't
+    // depend on code generation succeeding.
+    if (cmdline_is_set("mine-sequences")) {
+        sequences_report(stdout);
+    }
+    if (cmdline_is_set("profile-comptime") || cmdline_is_set("sample-comptime")) {
+        profile_report(stdout);
+        path_t source = path_parse(file_name);
+        path_t dot_elrond = path_make_relative(".elrond");
+        mkdir(dot_elrond.path.items, 0777);
+        path_t folded = path_extend(dot_elrond, *dynarr_back(&source.components));
+        path_replace_extension(&folded, C("folded"));
+        FILE *f = fopen(folded.path.items, "wb+");
+        if (f == NULL) {
+            fprintf(stderr, "Error writing `%s`\n", folded.path.items);
+            exit(1);
+        }
+        profile_write_folded(f);
+        fclose(f);
+    }
+    fflush(stdout);
 
     ir_generator_t gen = generate_ir(&parser, parser.root);
     if (do_trace) {
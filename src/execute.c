@@ -4,8 +4,12 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <math.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "interpreter.h"
@@ -16,276 +20,547 @@
 #include "value.h"
 
 #undef S
-#define S(O, T) static void execute_##O(interpreter_t *interpreter, operation_t *op);
+#define S(O, T) static size_t execute_##O(interpreter_t *interpreter, operation_t *op, size_t ip);
 IROPERATIONTYPES(S)
 #undef S
 
-uint64_t ip_for_label(interpreter_t *interpreter, uint64_t label)
-{
-    interpreter_context_t *ctx = dynarr_back(&interpreter->call_stack);
-    for (size_t ix = 0; ix < interpreter->labels.len; ++ix) {
-        if (interpreter->labels.items[ix].ir_node.value == ctx->ir.value) {
-            interpreter_labels_t labels = interpreter->labels.items[ix].labels;
-            for (size_t ix = 0; ix < labels.len; ++ix) {
-                if (labels.items[ix].label == label) {
-                    return labels.items[ix].operation_index;
-                }
-            }
-        }
-    }
-    UNREACHABLE();
-}
-
-void execute_default(interpreter_t *interpreter, operation_t *op)
+size_t execute_default(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
+    (void) interpreter;
     printf("execute_op(" SL ")\n", SLARG(operation_type_name(op->type)));
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_AssignFromRef(interpreter_t *interpreter, operation_t *op)
+size_t execute_AssignFromRef(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
     uint64_t var_ref = stack_pop_T(uint64_t, &interpreter->stack);
     uint64_t val_ref = stack_pop_T(uint64_t, &interpreter->stack);
     stack_copy(&interpreter->stack, var_ref, val_ref, type_size_of(op->AssignFromRef));
-    stack_push_T(uint64_t, &interpreter->stack, var_ref);
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_AssignValue(interpreter_t *interpreter, operation_t *op)
+size_t execute_AssignValue(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
     uint64_t var_ref = stack_pop_T(uint64_t, &interpreter->stack);
     stack_copy_and_pop(&interpreter->stack, var_ref, type_size_of(op->AssignValue));
-    stack_push_T(uint64_t, &interpreter->stack, var_ref);
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
+}
+
+size_t execute_AssignVar(interpreter_t *interpreter, operation_t *op, size_t ip)
+{
+    intptr_t address = interpreter_variable_address(interpreter, &op->AssignVar.var);
+    stack_copy_and_pop(&interpreter->stack, address, type_size_of(op->AssignVar.type));
+    return ip + 1;
 }
 
-void execute_BinaryOperator(interpreter_t *interpreter, operation_t *op)
+size_t execute_AssignVarKeep(interpreter_t *interpreter, operation_t *op, size_t ip)
+{
+    // The assigned value stays on the stack as the value of the
+    // assignment.
+    intptr_t address = interpreter_variable_address(interpreter, &op->AssignVarKeep.var);
+    size_t   size = type_size_of(op->AssignVarKeep.type);
+    stack_copy(&interpreter->stack, address, stack_size(&interpreter->stack) - align_at(8, size), size);
+    return ip + 1;
+}
+
+size_t execute_BinaryOperator(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
     stack_evaluate(&interpreter->stack, op->BinaryOperator.lhs, op->BinaryOperator.op, op->BinaryOperator.rhs);
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_Break(interpreter_t *interpreter, operation_t *op)
+// Handlers of the opcodes specialized by operand type. Both operands take
+// one stack word, and the result replaces the lhs. The arithmetic is done
+// in 64 bits and checked the same way stack_evaluate does it, only
+// without looking at the types.
+
+static void integer_overflow()
 {
-    uint64_t depth = (op->Break.scope_end != 0) ? op->Break.depth : 0;
-    uint64_t ip = ip_for_label(interpreter, op->Break.label);
-    interpreter_move_in(interpreter, &depth, sizeof(uint64_t), 18);
-    interpreter_move_in(interpreter, &ip, sizeof(uint64_t), 17);
-    dynarr_back(&interpreter->call_stack)->ip = ip_for_label(interpreter, op->Break.scope_end);
+    fprintf(stderr, "Integer overflow\n");
+    abort();
 }
 
-ir_node_t *find_function(ir_generator_t *gen, nodeptr ir, slice_t name)
+static void division_by_zero()
 {
-    ir_node_t *node = gen->ir_nodes.items + ir.value;
-    switch (node->type) {
-    case IRN_Module: {
-        for (size_t ix = 0; ix < node->module.functions.len; ++ix) {
-            nodeptr    func = node->module.functions.items[ix];
-            ir_node_t *f = gen->ir_nodes.items + func.value;
-            if (slice_eq(f->function.name, name)) {
-                return f;
-            }
-        }
-        return find_function(gen, node->module.program, name);
+    fprintf(stderr, "Division by zero\n");
+    abort();
+}
+
+#define SPECIALIZED_OPERANDS(T)                               \
+    interp_stack_t *stack = &interpreter->stack;              \
+    char           *slot = stack->top - 2 * sizeof(intptr_t); \
+    T               lhs;                                      \
+    T               rhs;                                      \
+    (void) op;                                                \
+    assert(stack_size(stack) >= 2 * sizeof(intptr_t));        \
+    memcpy(&lhs, slot, sizeof(T));                            \
+    memcpy(&rhs, slot + sizeof(intptr_t), sizeof(T));
+
+#define SPECIALIZED_RESULT(T, RES)         \
+    {                                      \
+        T __res = (T) (RES);               \
+        memset(slot, 0, sizeof(intptr_t)); \
+        memcpy(slot, &__res, sizeof(T));   \
+        stack->top -= sizeof(intptr_t);    \
+        return ip + 1;                     \
     }
-    case IRN_Program: {
-        for (size_t ix = 0; ix < node->program.functions.len; ++ix) {
-            nodeptr    func = node->program.functions.items[ix];
-            ir_node_t *f = gen->ir_nodes.items + func.value;
-            if (slice_eq(f->function.name, name)) {
-                return f;
-            }
-        }
-        return NULL;
+
+// Signed operands are added, subtracted or multiplied as uint64_t so that
+// an i64 wraps around like it does in stack_evaluate.
+#define SPECIALIZED_INT_ARITH(O, OPER, W, T)                                      \
+    size_t execute_##O##W(interpreter_t *interpreter, operation_t *op, size_t ip) \
+    {                                                                             \
+        SPECIALIZED_OPERANDS(T)                                                   \
+        if (IC_##W & 1) {                                                         \
+            int64_t res = (int64_t) ((uint64_t) lhs OPER (uint64_t) rhs);         \
+            if (res != (int64_t) (T) res) {                                       \
+                integer_overflow();                                               \
+            }                                                                     \
+            SPECIALIZED_RESULT(T, res);                                           \
+        }                                                                         \
+        uint64_t res = (uint64_t) lhs OPER (uint64_t) rhs;                        \
+        if (res != (uint64_t) (T) res) {                                          \
+            integer_overflow();                                                   \
+        }                                                                         \
+        SPECIALIZED_RESULT(T, res);                                               \
+    }
+
+#define SPECIALIZED_INT_DIVIDE(O, OPER, W, T)                                     \
+    size_t execute_##O##W(interpreter_t *interpreter, operation_t *op, size_t ip) \
+    {                                                                             \
+        SPECIALIZED_OPERANDS(T)                                                   \
+        if (rhs == 0) {                                                           \
+            division_by_zero();                                                   \
+        }                                                                         \
+        if (IC_##W & 1) {                                                         \
+            int64_t res = (int64_t) lhs OPER (int64_t) rhs;                       \
+            if (res != (int64_t) (T) res) {                                       \
+                integer_overflow();                                               \
+            }                                                                     \
+            SPECIALIZED_RESULT(T, res);                                           \
+        }                                                                         \
+        SPECIALIZED_RESULT(T, (uint64_t) lhs OPER (uint64_t) rhs);                \
+    }
+
+// Comparisons push a bool, whatever the operand type: JumpF only looks at
+// the low byte, which for a float 1.0 is zero.
+#define SPECIALIZED_COMPARE(O, OPER, W, T)                                        \
+    size_t execute_##O##W(interpreter_t *interpreter, operation_t *op, size_t ip) \
+    {                                                                             \
+        SPECIALIZED_OPERANDS(T)                                                   \
+        SPECIALIZED_RESULT(bool, lhs OPER rhs);                                   \
+    }
+
+#define SPECIALIZED_INT_OPS(W, T)               \
+    SPECIALIZED_INT_ARITH(Add, +, W, T)         \
+    SPECIALIZED_INT_ARITH(Subtract, -, W, T)    \
+    SPECIALIZED_INT_ARITH(Multiply, *, W, T)    \
+    SPECIALIZED_INT_DIVIDE(Divide, /, W, T)     \
+    SPECIALIZED_INT_DIVIDE(Modulo, %, W, T)     \
+    SPECIALIZED_COMPARE(Equals, ==, W, T)       \
+    SPECIALIZED_COMPARE(NotEqual, !=, W, T)     \
+    SPECIALIZED_COMPARE(Less, <, W, T)          \
+    SPECIALIZED_COMPARE(LessEqual, <=, W, T)    \
+    SPECIALIZED_COMPARE(Greater, >, W, T)       \
+    SPECIALIZED_COMPARE(GreaterEqual, >=, W, T)
+
+INTTYPES(SPECIALIZED_INT_OPS)
+
+#define SPECIALIZED_FLOAT_ARITH(O, OPER, W, T)                                       \
+    size_t execute_##O##F##W(interpreter_t *interpreter, operation_t *op, size_t ip) \
+    {                                                                                \
+        SPECIALIZED_OPERANDS(T)                                                      \
+        SPECIALIZED_RESULT(T, (double) lhs OPER (double) rhs);                       \
     }
-    default:
-        return NULL;
+
+size_t execute_DivideF32(interpreter_t *interpreter, operation_t *op, size_t ip)
+{
+    SPECIALIZED_OPERANDS(float)
+    if (rhs == 0) {
+        division_by_zero();
     }
+    SPECIALIZED_RESULT(float, (double) lhs / (double) rhs);
 }
 
-void execute_Call(interpreter_t *interpreter, operation_t *op)
-{
-    nodeptr scope_ix = nodeptr_ptr(interpreter->scopes.len - 1);
-    do {
-        scope_t   *s = interpreter->scopes.items + scope_ix.value;
-        ir_node_t *func = find_function(interpreter->gen, s->ir, op->Call.name);
-        if (func != NULL) {
-            nodeptr f = nodeptr_ptr(func->ix);
-            interpreter_emplace_scope(interpreter, f, op->Call.parameters);
-            dynarr_append_s(
-                interpreter_context_t,
-                &interpreter->call_stack,
-                .ir = f, .ip = 0);
-            interpreter_execute_operations(interpreter, f);
-            dynarr_pop(&interpreter->call_stack);
-            interpreter_drop_scope(interpreter);
-            value_t return_value = make_value_from_buffer(op->Call.return_type, interpreter->registers);
-            stack_push_value(&interpreter->stack, return_value);
-            dynarr_back(&interpreter->call_stack)->ip++;
-            return;
-        }
-        scope_ix = s->parent;
-    } while (scope_ix.ok);
-    UNREACHABLE();
+size_t execute_DivideF64(interpreter_t *interpreter, operation_t *op, size_t ip)
+{
+    SPECIALIZED_OPERANDS(double)
+    if (rhs == 0) {
+        division_by_zero();
+    }
+    SPECIALIZED_RESULT(double, lhs / rhs);
+}
+
+size_t execute_ModuloF32(interpreter_t *interpreter, operation_t *op, size_t ip)
+{
+    SPECIALIZED_OPERANDS(float)
+    if (rhs == 0) {
+        division_by_zero();
+    }
+    SPECIALIZED_RESULT(float, fmod(lhs, rhs));
+}
+
+size_t execute_ModuloF64(interpreter_t *interpreter, operation_t *op, size_t ip)
+{
+    SPECIALIZED_OPERANDS(double)
+    if (rhs == 0) {
+        division_by_zero();
+    }
+    SPECIALIZED_RESULT(double, fmod(lhs, rhs));
+}
+
+#define SPECIALIZED_FLOAT_OPS(W, T)                \
+    SPECIALIZED_FLOAT_ARITH(Add, +, W, T)          \
+    SPECIALIZED_FLOAT_ARITH(Subtract, -, W, T)     \
+    SPECIALIZED_FLOAT_ARITH(Multiply, *, W, T)     \
+    SPECIALIZED_COMPARE(Equals##F, ==, W, T)       \
+    SPECIALIZED_COMPARE(NotEqual##F, !=, W, T)     \
+    SPECIALIZED_COMPARE(Less##F, <, W, T)          \
+    SPECIALIZED_COMPARE(LessEqual##F, <=, W, T)    \
+    SPECIALIZED_COMPARE(Greater##F, >, W, T)       \
+    SPECIALIZED_COMPARE(GreaterEqual##F, >=, W, T)
+
+FLOATTYPES(SPECIALIZED_FLOAT_OPS)
+
+static size_t (*const specialized_handlers[])(interpreter_t *, operation_t *, size_t) = {
+#undef S
+#define S(O, T) [IRO_##O] = execute_##O,
+    INTTYPES(IRINTOPCODES)
+    FLOATTYPES(IRFLOATOPCODES)
+#undef S
+};
+
+// Evaluates a binary operation whose operands are on the stack, using the
+// handler of its specialized opcode if it has one.
+static void evaluate_binary_operator(interpreter_t *interpreter, binary_op_t *binop)
+{
+    if (binop->specialized != 0) {
+        specialized_handlers[binop->specialized](interpreter, NULL, 0);
+        return;
+    }
+    stack_evaluate(&interpreter->stack, binop->lhs, binop->op, binop->rhs);
+}
+
+size_t execute_BinaryOperatorVarConst(interpreter_t *interpreter, operation_t *op, size_t ip)
+{
+    var_const_op_t *fused = &op->BinaryOperatorVarConst;
+    intptr_t        address = interpreter_variable_address(interpreter, &fused->var);
+    stack_push_copy(&interpreter->stack, address, type_size_of(fused->var.type));
+    stack_push_value(&interpreter->stack, fused->constant);
+    evaluate_binary_operator(interpreter, &fused->op);
+    return ip + 1;
+}
+
+size_t execute_BinaryOperatorVarConstJumpF(interpreter_t *interpreter, operation_t *op, size_t ip)
+{
+    var_const_op_t *cond = &op->BinaryOperatorVarConstJumpF.cond;
+    intptr_t        address = interpreter_variable_address(interpreter, &cond->var);
+    stack_push_copy(&interpreter->stack, address, type_size_of(cond->var.type));
+    stack_push_value(&interpreter->stack, cond->constant);
+    evaluate_binary_operator(interpreter, &cond->op);
+    if (!stack_pop_T(bool, &interpreter->stack)) {
+        return op->BinaryOperatorVarConstJumpF.jump.target;
+    }
+    return ip + 1;
+}
+
+size_t execute_BinaryOperatorVarVar(interpreter_t *interpreter, operation_t *op, size_t ip)
+{
+    var_var_op_t *fused = &op->BinaryOperatorVarVar;
+    stack_push_copy(&interpreter->stack, interpreter_variable_address(interpreter, &fused->lhs), type_size_of(fused->lhs.type));
+    stack_push_copy(&interpreter->stack, interpreter_variable_address(interpreter, &fused->rhs), type_size_of(fused->rhs.type));
+    evaluate_binary_operator(interpreter, &fused->op);
+    return ip + 1;
 }
 
-void execute_DeclVar(interpreter_t *interpreter, operation_t *op)
+size_t execute_Break(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
+    (void) ip;
+    uint64_t depth = (op->Break.scope_end != 0) ? op->Break.depth : 0;
+    uint64_t label_ip = op->Break.label_ip;
+    interpreter_move_in(interpreter, &depth, sizeof(uint64_t), 18);
+    interpreter_move_in(interpreter, &label_ip, sizeof(uint64_t), 17);
+    return op->Break.scope_end_ip;
+}
+
+size_t execute_Call(interpreter_t *interpreter, operation_t *op, size_t ip)
+{
+    nodeptr f = op->Call.function;
+    if (!f.ok) {
+        fatal("Call to unresolved function `" SL "`", SLARG(op->Call.name));
+    }
+    if (interpreter->call_stack.len >= INTERPRETER_MAX_CALL_DEPTH) {
+        fatal("Interpreter call stack overflow calling `" SL "`", SLARG(op->Call.name));
+    }
+    size_t pushed = 0;
+    for (size_t ix = 0; ix < op->Call.parameters.len; ++ix) {
+        pushed += align_at(8, type_size_of(op->Call.parameters.items[ix].type));
+    }
+    if (interpreter->regvm != NULL && regvm_execute_function(interpreter, f, pushed)) {
+        return ip + 1;
+    }
+    interpreter_call(interpreter, f, pushed);
+    value_t return_value = make_value_from_buffer(op->Call.return_type, interpreter->registers);
+    stack_push_value(&interpreter->stack, return_value);
+    return ip + 1;
+}
+
+size_t execute_DeclVar(interpreter_t *interpreter, operation_t *op, size_t ip)
+{
+    (void) interpreter;
     (void) op;
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_Dereference(interpreter_t *interpreter, operation_t *op)
+size_t execute_Dereference(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
     uint64_t ref = stack_pop_T(uint64_t, &interpreter->stack);
     stack_push_copy(&interpreter->stack, ref, type_size_of(op->Dereference));
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_Discard(interpreter_t *interpreter, operation_t *op)
+size_t execute_Discard(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
     stack_discard(&interpreter->stack, align_at(8, type_size_of(op->Discard)));
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_Jump(interpreter_t *interpreter, operation_t *op)
+size_t execute_Jump(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
-    dynarr_back(&interpreter->call_stack)->ip = ip_for_label(interpreter, op->Jump);
+    (void) interpreter;
+    (void) ip;
+    return op->Jump.target;
 }
 
-void execute_JumpF(interpreter_t *interpreter, operation_t *op)
+size_t execute_JumpF(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
     if (!stack_pop_T(bool, &interpreter->stack)) {
-        dynarr_back(&interpreter->call_stack)->ip = ip_for_label(interpreter, op->JumpF);
-        return;
+        return op->JumpF.target;
     }
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_JumpT(interpreter_t *interpreter, operation_t *op)
+size_t execute_JumpT(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
     if (stack_pop_T(bool, &interpreter->stack)) {
-        dynarr_back(&interpreter->call_stack)->ip = ip_for_label(interpreter, op->JumpT);
-        return;
+        return op->JumpT.target;
     }
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_Label(interpreter_t *interpreter, operation_t *op)
+size_t execute_Label(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
     (void) interpreter;
     (void) op;
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_NativeCall(interpreter_t *interpreter, operation_t *op)
+// Returns the marshalling plan of the native call `call`, making it on
+// the first call. Blocks running on other threads can make it at the same
+// time, and only one of the plans is kept.
+static native_plan_t *native_call_plan(call_op_t *call)
 {
-    intptr_t depth = 0;
+    native_plan_t *plan = atomic_load(&call->plan);
+    if (plan != NULL) {
+        return plan;
+    }
     nodeptrs types = { 0 };
-    for (size_t ix = 0; ix < op->NativeCall.parameters.len; ++ix) {
-        name_t *param = op->NativeCall.parameters.items + ix;
-        depth += align_at(8, type_size_of(param->type)) / sizeof(intptr_t);
-        dynarr_append(&types, param->type);
+    for (size_t ix = 0; ix < call->parameters.len; ++ix) {
+        dynarr_append(&types, call->parameters.items[ix].type);
     }
-    void *ptr = interpreter->stack.items + (interpreter->stack.len - depth);
-    if (native_call(op->NativeCall.name, ptr, types, interpreter->registers, op->NativeCall.return_type)) {
-        value_t return_value = make_value_from_buffer(op->Call.return_type, interpreter->registers);
-        stack_discard(&interpreter->stack, depth);
-        stack_push_value(&interpreter->stack, return_value);
-        dynarr_back(&interpreter->call_stack)->ip++;
-        return;
+    native_plan_t *made = native_plan(call->name, types, call->return_type);
+    dynarr_free(&types);
+    if (!atomic_compare_exchange_strong(&call->plan, &plan, made)) {
+        native_plan_free(made);
+        return plan;
     }
-    fprintf(stderr, "Error executing native function `" SL "`", SLARG(op->NativeCall.name));
-    abort();
+    return made;
 }
 
-void execute_Pop(interpreter_t *interpreter, operation_t *op)
+size_t execute_NativeCall(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
-    value_t return_value = interpreter_pop(interpreter, op->Pop);
-    interpreter_move_in_value(interpreter, return_value, 0);
-    dynarr_back(&interpreter->call_stack)->ip++;
+    native_plan_t *plan = native_call_plan(&op->NativeCall);
+    void          *ptr = interpreter->stack.top - plan->depth * sizeof(intptr_t);
+    native_plan_call(plan, ptr, interpreter->registers);
+    value_t return_value = make_value_from_buffer(op->NativeCall.return_type, interpreter->registers);
+    stack_discard(&interpreter->stack, plan->depth * sizeof(intptr_t));
+    stack_push_value(&interpreter->stack, return_value);
+    return ip + 1;
 }
 
-void execute_PushConstant(interpreter_t *interpreter, operation_t *op)
+size_t execute_Pop(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
-    stack_push_value(&interpreter->stack, op->PushConstant);
-    dynarr_back(&interpreter->call_stack)->ip++;
+    value_t return_value = interpreter_pop(interpreter, op->Pop);
+    interpreter_move_in_value(interpreter, return_value, 0);
+    return ip + 1;
 }
 
-scope_variable_t *get_variable(interpreter_t *interpreter, slice_t name)
+size_t execute_PushConstant(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
-    nodeptr ix = nodeptr_ptr(interpreter->scopes.len - 1);
-    do {
-        scope_t *s = interpreter->scopes.items + ix.value;
-        for (size_t ix = 0; ix < s->variables.len; ++ix) {
-            scope_variable_t *v = s->variables.items + ix;
-            if (slice_eq(v->name, name)) {
-                return v;
-            }
-        }
-        ix = s->parent;
-    } while (ix.ok);
-    UNREACHABLE();
+    stack_push_value(&interpreter->stack, op->PushConstant);
+    return ip + 1;
 }
 
-void execute_PushValue(interpreter_t *interpreter, operation_t *op)
+size_t execute_PushValue(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
-    scope_variable_t *var = get_variable(interpreter, op->PushValue.name);
-    stack_push_copy(&interpreter->stack, var->address + op->PushValue.offset, type_size_of(op->PushValue.type));
-    dynarr_back(&interpreter->call_stack)->ip++;
+    intptr_t address = interpreter_variable_address(interpreter, &op->PushValue);
+    stack_push_copy(&interpreter->stack, address, type_size_of(op->PushValue.type));
+    return ip + 1;
 }
 
-void execute_PushVarAddress(interpreter_t *interpreter, operation_t *op)
+size_t execute_PushVarAddress(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
-    scope_variable_t *var = get_variable(interpreter, op->PushValue.name);
-    stack_push_T(uint64_t, &interpreter->stack, var->address + op->PushVarAddress.offset);
-    dynarr_back(&interpreter->call_stack)->ip++;
+    intptr_t address = interpreter_variable_address(interpreter, &op->PushVarAddress);
+    stack_push_T(uint64_t, &interpreter->stack, address);
+    return ip + 1;
 }
 
-void execute_ScopeBegin(interpreter_t *interpreter, operation_t *op)
+size_t execute_ScopeBegin(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
-    interpreter_new_scope(interpreter, nullptr, op->ScopeBegin);
+    // Block variables live in the function's frame, so there is nothing
+    // to allocate. Blocks share slots, so clear the block's slots to start
+    // its variables at zero, and reset the unwind state.
+    scope_t *scope = dynarr_back(&interpreter->scopes);
+    memset(interpreter->stack.base + scope->bp + op->ScopeBegin.base, 0, op->ScopeBegin.size);
     uint64_t zero = 0;
     interpreter_move_in(interpreter, &zero, sizeof(uint64_t), 17); // TODO defines for magic reg numbers.
     interpreter_move_in(interpreter, &zero, sizeof(uint64_t), 18); // or even make magic regs interpreter fields
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_ScopeEnd(interpreter_t *interpreter, operation_t *op)
+size_t execute_ScopeEnd(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
-    interpreter_drop_scope(interpreter);
     uint64_t depth = interpreter_move_out_reg(interpreter, 18);
     if (depth > 0) {
         --depth;
         interpreter_move_in(interpreter, &depth, sizeof(uint64_t), 18);
-        dynarr_back(&interpreter->call_stack)->ip = ip_for_label(interpreter, op->ScopeEnd.enclosing_end);
-        return;
+        return op->ScopeEnd.enclosing_end_ip;
     }
     uint64_t jump = interpreter_move_out_reg(interpreter, 17);
     if (jump != 0) {
-        dynarr_back(&interpreter->call_stack)->ip = jump;
-        return;
+        uint64_t zero = 0;
+        interpreter_move_in(interpreter, &zero, sizeof(uint64_t), 17);
+        return jump;
     }
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_UnaryOperator(interpreter_t *interpreter, operation_t *op)
+size_t execute_UnaryOperator(interpreter_t *interpreter, operation_t *op, size_t ip)
 {
     stack_evaluate_unary(&interpreter->stack, op->UnaryOperator.operand, op->UnaryOperator.op);
-    dynarr_back(&interpreter->call_stack)->ip++;
+    return ip + 1;
 }
 
-void execute_op(operation_t *op, interpreter_t *interpreter)
+// Runs the operations like execute_operations, reporting every operation
+// to the interpreter's callback. The current context's ip is kept up to
+// date for the callback.
+static size_t execute_operations_traced(interpreter_t *interpreter, operations_t *ops, size_t ip)
 {
-    switch (op->type) {
+    while (ip < ops->len) {
+        operation_t *op = ops->items + ip;
+        dynarr_back(&interpreter->call_stack)->ip = ip;
+        interpreter->callback(ICT_BeforeOperation, interpreter, (interpreter_callback_payload_t) { .op = *op });
+        switch (op->type) {
 #undef S
-#define S(O, T)                       \
-    case IRO_##O:                     \
-        execute_##O(interpreter, op); \
+#define S(O, T)                                \
+    case IRO_##O:                              \
+        ip = execute_##O(interpreter, op, ip); \
         break;
+            IROPERATIONTYPES(S)
+#undef S
+        default:
+            UNREACHABLE();
+        }
+        interpreter->callback(ICT_AfterOperation, interpreter, (interpreter_callback_payload_t) { .op = *op });
+    }
+    return ip;
+}
+
+#ifdef THREADED_DISPATCH
+#define THREADED_LABEL(O, T) [IRO_##O] = &&do_##O,
+#define THREADED_HANDLER(O, T)                    \
+    do_##O:                                       \
+    ip = execute_##O(interpreter, code + ip, ip); \
+    NEXT();
+
+// Runs the operations like execute_operations, storing the ip in the
+// current context before every operation so that the sampling profiler
+// can see where the interpreter is.
+static size_t execute_operations_sampled(interpreter_t *interpreter, operations_t *ops, size_t ip)
+{
+    uint64_t volatile *current_ip = &dynarr_back(&interpreter->call_stack)->ip;
+    operation_t       *code = ops->items;
+    size_t             len = ops->len;
+    static void       *dispatch[] = {
+#undef S
+#define S THREADED_LABEL
         IROPERATIONTYPES(S)
 #undef S
-    default:
-        UNREACHABLE();
+    };
+#define NEXT()                         \
+    do {                               \
+        if (ip >= len) {               \
+            return ip;                 \
+        }                              \
+        *current_ip = ip;              \
+        goto *dispatch[code[ip].type]; \
+    } while (0)
+
+    NEXT();
+#define S THREADED_HANDLER
+    IROPERATIONTYPES(S)
+#undef S
+#undef NEXT
+}
+#endif
+
+size_t execute_operations(interpreter_t *interpreter, operations_t *ops, size_t ip)
+{
+    if (interpreter->callback != NULL) {
+        return execute_operations_traced(interpreter, ops, ip);
+    }
+    operation_t *code = ops->items;
+    size_t       len = ops->len;
+#ifdef THREADED_DISPATCH
+    if (interpreter->sampling) {
+        return execute_operations_sampled(interpreter, ops, ip);
+    }
+    static void *dispatch[] = {
+#undef S
+#define S THREADED_LABEL
+        IROPERATIONTYPES(S)
+#undef S
+    };
+#define NEXT()                         \
+    do {                               \
+        if (ip >= len) {               \
+            return ip;                 \
+        }                              \
+        goto *dispatch[code[ip].type]; \
+    } while (0)
+
+    NEXT();
+#define S THREADED_HANDLER
+    IROPERATIONTYPES(S)
+#undef S
+#undef NEXT
+#else
+    uint64_t volatile *current_ip = interpreter->sampling ? &dynarr_back(&interpreter->call_stack)->ip : &(uint64_t) { 0 };
+    while (ip < len) {
+        operation_t *op = code + ip;
+        *current_ip = ip;
+        switch (op->type) {
+#undef S
+#define S(O, T)                                \
+    case IRO_##O:                              \
+        ip = execute_##O(interpreter, op, ip); \
+        break;
+            IROPERATIONTYPES(S)
+#undef S
+        default:
+            UNREACHABLE();
+        }
     }
+    return ip;
+#endif
 }
@@ -5,12 +5,15 @@
  */
 
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "cmdline.h"
 #include "ir.h"
 #include "node.h"
 #include "operators.h"
@@ -47,8 +50,8 @@ static void generate_default(ir_generator_t *gen, nodeptr n);
 GENERATEOVERRIDES(S)
 #undef S
 
-static bool         generate_initialized = false;
-static generate_fnc generate_fncs[] = {
+static pthread_once_t generate_initialized = PTHREAD_ONCE_INIT;
+static generate_fnc   generate_fncs[] = {
 #undef S
 #define S(T) [NT_##T] = generate_default,
     NODETYPES(S)
@@ -57,8 +60,8 @@ static generate_fnc generate_fncs[] = {
 
 uint64_t next_label()
 {
-    static uint64_t label = 0;
-    return label++;
+    static _Atomic uint64_t label = 0;
+    return atomic_fetch_add(&label, 1);
 }
 
 slice_t operation_type_name(ir_operation_type_t type)
@@ -83,7 +86,7 @@ void operation_list(sb_t *sb, operation_t const *op)
     }
     slice_t type_name = operation_type_name(op->type);
     sb_printf(sb, "    " SL, SLARG(type_name));
-    sb_printf(sb, "%*s", 15 - (int) type_name.len, "");
+    sb_printf(sb, "%*s", MAX(1, 15 - (int) type_name.len), "");
     switch (op->type) {
     case IRO_BinaryOperator:
         sb_printf(
@@ -93,9 +96,50 @@ void operation_list(sb_t *sb, operation_t const *op)
             operator_name(op->BinaryOperator.op),
             SLARG(type_to_string(op->BinaryOperator.rhs)));
         break;
+    case IRO_BinaryOperatorVarConst:
+        sb_printf(
+            sb,
+            SL " + %lu " SL " %s ",
+            SLARG(op->BinaryOperatorVarConst.var.name),
+            op->BinaryOperatorVarConst.var.offset,
+            SLARG(type_to_string(op->BinaryOperatorVarConst.op.lhs)),
+            operator_name(op->BinaryOperatorVarConst.op.op));
+        value_print(sb, op->BinaryOperatorVarConst.constant);
+        break;
+    case IRO_BinaryOperatorVarConstJumpF:
+        sb_printf(
+            sb,
+            SL " + %lu " SL " %s ",
+            SLARG(op->BinaryOperatorVarConstJumpF.cond.var.name),
+            op->BinaryOperatorVarConstJumpF.cond.var.offset,
+            SLARG(type_to_string(op->BinaryOperatorVarConstJumpF.cond.op.lhs)),
+            operator_name(op->BinaryOperatorVarConstJumpF.cond.op.op));
+        value_print(sb, op->BinaryOperatorVarConstJumpF.cond.constant);
+        sb_printf(sb, " %llu", op->BinaryOperatorVarConstJumpF.jump.label);
+        break;
+    case IRO_BinaryOperatorVarVar:
+        sb_printf(
+            sb,
+            SL " + %lu " SL " %s " SL " + %lu",
+            SLARG(op->BinaryOperatorVarVar.lhs.name),
+            op->BinaryOperatorVarVar.lhs.offset,
+            SLARG(type_to_string(op->BinaryOperatorVarVar.op.lhs)),
+            operator_name(op->BinaryOperatorVarVar.op.op),
+            SLARG(op->BinaryOperatorVarVar.rhs.name),
+            op->BinaryOperatorVarVar.rhs.offset);
+        break;
+    case IRO_AssignVar:
+    case IRO_AssignVarKeep:
+        sb_printf(sb, SL " + %lu " SL, SLARG(op->AssignVar.var.name), op->AssignVar.var.offset, SLARG(type_to_string(op->AssignVar.type)));
+        break;
     case IRO_Break:
         sb_printf(sb, "scope_end %llu depth %llu label %llu exit_type %zu", op->Break.scope_end, op->Break.depth, op->Break.label, op->Break.exit_type.value);
         break;
+    case IRO_Jump:
+    case IRO_JumpF:
+    case IRO_JumpT:
+        sb_printf(sb, "%llu", op->Jump.label);
+        break;
     case IRO_PushConstant:
         value_print(sb, op->PushConstant);
         break;
@@ -113,6 +157,9 @@ void operation_list(sb_t *sb, operation_t const *op)
     case IRO_Pop:
         sb_printf(sb, SL, SLARG(type_to_string(op->Pop)));
         break;
+    case IRO_PushValue:
+        sb_printf(sb, SL " + %lu " SL, SLARG(op->PushValue.name), op->PushValue.offset, SLARG(type_to_string(op->PushValue.type)));
+        break;
     case IRO_PushVarAddress:
         trace("%p %zu", op->PushVarAddress.name.items, op->PushVarAddress.name.len);
         if (op->PushVarAddress.name.items == NULL) {
@@ -184,6 +231,20 @@ void list(FILE *f, ir_generator_t *gen, nodeptr ir)
     fprintf(f, SL "\n", SLARG(list));
 }
 
+operations_t *ir_node_operations(ir_node_t *node)
+{
+    switch (node->type) {
+    case IRN_Function:
+        return &node->function.operations;
+    case IRN_Module:
+        return &node->module.operations;
+    case IRN_Program:
+        return &node->program.operations;
+    default:
+        UNREACHABLE();
+    }
+}
+
 void generator_add_operation(ir_generator_t *gen, operation_t op)
 {
     for (int ix = gen->ctxs.len - 1; ix >= 0; --ix) {
@@ -191,20 +252,7 @@ void generator_add_operation(ir_generator_t *gen, operation_t op)
         if (!ctx->ir_node.ok) {
             continue;
         }
-        ir_node_t    *node = gen->ir_nodes.items + ctx->ir_node.value;
-        operations_t *ops = NULL;
-        switch (node->type) {
-        case IRN_Function:
-            ops = &node->function.operations;
-            break;
-        case IRN_Module:
-            ops = &node->module.operations;
-            break;
-        case IRN_Program:
-            ops = &node->program.operations;
-            break;
-        }
-        assert(ops != NULL);
+        operations_t *ops = ir_node_operations(gen->ir_nodes.items + ctx->ir_node.value);
         if (ops->len > 0) {
             operation_t const *b = ops->items + (ops->len - 1);
             if (op.type == IRO_Discard && (b->type == IRO_PushConstant || b->type == IRO_PushValue)) {
@@ -212,6 +260,7 @@ void generator_add_operation(ir_generator_t *gen, operation_t op)
                 return;
             }
         }
+        op.node = gen->current_node;
         sb_t op_string = { 0 };
         operation_list(&op_string, &op);
         trace("Appending op " SL, SLARG(op_string));
@@ -231,20 +280,8 @@ operation_t *last_op(ir_generator_t *gen)
         if (!ctx->ir_node.ok) {
             continue;
         }
-        ir_node_t    *node = gen->ir_nodes.items + ctx->ir_node.value;
-        operations_t *ops = NULL;
-        switch (node->type) {
-        case IRN_Function:
-            ops = &node->function.operations;
-            break;
-        case IRN_Module:
-            ops = &node->module.operations;
-            break;
-        case IRN_Program:
-            ops = &node->program.operations;
-            break;
-        }
-        if (ops == NULL || ops->len == 0) {
+        operations_t *ops = ir_node_operations(gen->ir_nodes.items + ctx->ir_node.value);
+        if (ops->len == 0) {
             return NULL;
         }
         return ops->items + (ops->len - 1);
@@ -430,12 +467,17 @@ void generate_IfStatement(ir_generator_t *gen, nodeptr n)
     }
     int else_label = next_label();
     int done_label = next_label();
-    generator_add_op(gen, JumpF, else_label);
+    generator_add_op(gen, JumpF, { .label = else_label });
     generate(gen, node->if_statement.if_branch);
-    generator_add_op(gen, Jump, done_label);
+    generator_add_op(gen, Jump, { .label = done_label });
     generator_add_op(gen, Label, else_label);
     if (node->if_statement.else_branch.ok) {
         generate(gen, node->if_statement.else_branch);
+    } else if (type_kind(node->bound_type) != TYPK_VoidType) {
+        // Leave a value on the stack on both paths.
+        uint64_t zero[4] = { 0 };
+        assert((size_t) type_size_of(node->bound_type) <= sizeof(zero));
+        generator_add_op(gen, PushConstant, make_value_from_buffer(node->bound_type, zero));
     }
     generator_add_op(gen, Label, done_label);
 }
@@ -447,8 +489,7 @@ void generate_Module(ir_generator_t *gen, nodeptr n)
     if (gen->ctxs.len != 0) {
         program_ptr = gen->ctxs.items[0].ir_node;
     }
-    ir_node_t *program = gen->ir_nodes.items + program_ptr.value;
-    assert(program->type == IRN_Program);
+    assert(gen->ir_nodes.items[program_ptr.value].type == IRN_Program);
 
     ir_node_t module = {
         .type = IRN_Module,
@@ -465,6 +506,8 @@ void generate_Module(ir_generator_t *gen, nodeptr n)
     };
     dynarr_append(&gen->ir_nodes, module);
     dynarr_append_s(ir_context_t, &gen->ctxs, .ir_node = OPTVAL(size_t, module.ix));
+    // Appending the module can move the program node.
+    ir_node_t *program = gen->ir_nodes.items + program_ptr.value;
     dynarr_append(&program->program.modules, OPTVAL(size_t, module.ix));
 
     nodeptr discard = nullptr;
@@ -593,7 +636,7 @@ void generate_StatementBlock(ir_generator_t *gen, nodeptr n)
     for (size_t ix = 0; ix < node->namespace.value.len; ++ix) {
         dynarr_append(&variables, node->namespace.value.items[ix]);
     }
-    generator_add_op(gen, ScopeBegin, variables);
+    generator_add_op(gen, ScopeBegin, { .variables = variables });
     uint64_t scope_end = next_label();
     // uint64_t end_block = next_label();
     generator_add_op(gen, PushConstant, make_value_void());
@@ -622,6 +665,7 @@ void generate_StatementBlock(ir_generator_t *gen, nodeptr n)
     }
     generator_add_op(gen, Label, scope_end);
     block_descriptor_t *bd = &gen->ctxs.items[gen->ctxs.len - 1].block;
+    (void) bd;
     //    for (size_t ix = 0; ix < bd->defer_stmts.len; ++ix) {
     //        ir_defer_statement_t ds = bd->defer_stmts.items[ix];
     //        has_defered = true;
@@ -632,13 +676,13 @@ void generate_StatementBlock(ir_generator_t *gen, nodeptr n)
     dynarr_pop(&gen->ctxs);
 
     uint64_t enclosing_end = 0;
-    for (size_t ix = gen->ctxs.len - 1; ix >= 0; --ix) {
-        ir_context_t *ctx = gen->ctxs.items + ix;
+    for (size_t ix = gen->ctxs.len; ix > 0; --ix) {
+        ir_context_t *ctx = gen->ctxs.items + (ix - 1);
         bool          quit = false;
         switch (ctx->unwind_type) {
         case USET_Block: {
             if (ctx->block.defer_stmts.len != 0) {
-                enclosing_end = ctx->block.defer_stmts.items[bd->defer_stmts.len - 1].label;
+                enclosing_end = ctx->block.defer_stmts.items[ctx->block.defer_stmts.len - 1].label;
                 quit = true;
             }
         } break;
@@ -715,10 +759,10 @@ void generate_WhileStatement(ir_generator_t *gen, nodeptr n)
     if (value_type.value != cond_type.value) {
         generator_add_op(gen, Dereference, value_type);
     }
-    generator_add_op(gen, JumpF, ld.loop.loop_end);
+    generator_add_op(gen, JumpF, { .label = ld.loop.loop_end });
     generator_add_op(gen, Discard, GN(node->while_statement.statement)->bound_type);
     generate(gen, node->while_statement.statement);
-    generator_add_op(gen, Jump, ld.loop.loop_begin);
+    generator_add_op(gen, Jump, { .label = ld.loop.loop_begin });
     generator_add_op(gen, Label, ld.loop.loop_end);
     dynarr_pop(&gen->ctxs);
 }
@@ -867,24 +911,37 @@ void initialize_generate()
 #define S(T) generate_fncs[NT_##T] = generate_##T;
     GENERATEOVERRIDES(S)
 #undef S
-    generate_initialized = true;
 }
 
 void generate(ir_generator_t *gen, nodeptr n)
 {
-    if (!generate_initialized) {
-        initialize_generate();
-    }
+    pthread_once(&generate_initialized, initialize_generate);
     node_t *node = GN(n);
     trace("generate %zu = %s", n.value, node_type_name(node->node_type));
+    nodeptr enclosing = gen->current_node;
+    gen->current_node = n;
     generate_fncs[node->node_type](gen, n);
+    gen->current_node = enclosing;
+}
+
+// Adds the IR for `node` to `gen`, which can already hold linked IR, and
+// returns the first IR node generated for it.
+nodeptr generate_ir_into(ir_generator_t *gen, nodeptr node)
+{
+    size_t first = gen->ir_nodes.len;
+    generate(gen, node);
+    assert(gen->ctxs.len == 0);
+    if (cmdline_is_set("optimize")) {
+        optimize_ir(gen);
+    }
+    link_ir(gen);
+    return nodeptr_ptr(first);
 }
 
 ir_generator_t generate_ir(parser_t *parser, nodeptr node)
 {
     ir_generator_t generator = { 0 };
     generator.parser = parser;
-    generate(&generator, node);
-    assert(generator.ctxs.len == 0);
+    generate_ir_into(&generator, node);
     return generator;
 }
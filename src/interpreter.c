@@ -4,58 +4,41 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
+#include "cmdline.h"
 #include "interpreter.h"
 #include "ir.h"
 #include "node.h"
 #include "type.h"
 #include "value.h"
 
-scope_t scope_initialize(interpreter_t *interpreter, nodeptr ir, namespace_t variables, nodeptr parent)
+scope_t scope_initialize(interpreter_t *interpreter, nodeptr ir, nodeptr parent)
 {
-    scope_t ret = {
+    return (scope_t) {
         .interpreter = interpreter,
         .ir = ir,
         .parent = parent,
+        .size = interpreter->gen->ir_nodes.items[ir.value].frame_size,
     };
-    for (size_t ix = 0; ix < variables.len; ++ix) {
-        name_t *var = variables.items + ix;
-        dynarr_append_s(
-            scope_variable_t,
-            &ret.variables,
-            .name = var->name,
-            .address = 0,
-            .type = var->type);
-    }
-    return ret;
 }
 
 void scope_allocate(scope_t *scope)
 {
-    scope->bp = scope->interpreter->stack.len;
-    for (size_t ix = 0; ix < scope->variables.len; ++ix) {
-        scope_variable_t *var = scope->variables.items + ix;
-        var->address = stack_reserve(&scope->interpreter->stack, type_size_of(var->type));
-    }
+    scope->bp = stack_reserve(&scope->interpreter->stack, scope->size);
 }
 
-void scope_setup(scope_t *scope)
+// Sets up a frame whose first `pushed` bytes, the parameters, are already
+// on the stack.
+void scope_setup(scope_t *scope, size_t pushed)
 {
-    intptr_t depth = 0;
-    for (size_t ix = 0; ix < scope->variables.len; ++ix) {
-        scope_variable_t *var = scope->variables.items + ix;
-        depth += align_at(8, type_size_of(var->type));
-    }
-    scope->bp = scope->interpreter->stack.len - depth;
-    uint64_t offset = scope->bp;
-    for (size_t ix = 0; ix < scope->variables.len; ++ix) {
-        scope_variable_t *var = scope->variables.items + ix;
-        var->address = offset;
-        offset += align_at(8, type_size_of(var->type));
-    }
+    scope->bp = stack_size(&scope->interpreter->stack) - pushed;
+    stack_reserve(&scope->interpreter->stack, scope->size - pushed);
 }
 
 void scope_release(scope_t *scope)
@@ -64,7 +47,8 @@ void scope_release(scope_t *scope)
     if (node->type == IRN_Program || node->type == IRN_Module) {
         return;
     }
-    stack_discard(&scope->interpreter->stack, scope->bp);
+    interp_stack_t *stack = &scope->interpreter->stack;
+    stack_discard(stack, stack_size(stack) - scope->bp);
 }
 
 scope_t *interpreter_current_scope(interpreter_t *interpreter)
@@ -72,7 +56,7 @@ scope_t *interpreter_current_scope(interpreter_t *interpreter)
     return dynarr_back(&interpreter->scopes);
 }
 
-static void create_scope(interpreter_t *interpreter, nodeptr ir, namespace_t variables)
+static void create_scope(interpreter_t *interpreter, nodeptr ir)
 {
     nodeptr parent = { 0 };
     if (interpreter->scopes.len != 0) {
@@ -88,9 +72,8 @@ static void create_scope(interpreter_t *interpreter, nodeptr ir, namespace_t var
         } break;
         case IRN_Function: {
             for (size_t ix = 0; ix < interpreter->scopes.len; ++ix) {
-                scope_t   *s = interpreter->scopes.items + ix;
-                ir_node_t *s_node = interpreter->gen->ir_nodes.items + s->ir.value;
-                if (s_node->type == IRN_Module && s->ir.value == ir_node->function.module.value) {
+                scope_t *s = interpreter->scopes.items + ix;
+                if (s->ir.value == ir_node->function.module.value) {
                     parent = nodeptr_ptr(ix);
                     break;
                 }
@@ -98,18 +81,18 @@ static void create_scope(interpreter_t *interpreter, nodeptr ir, namespace_t var
             assert(parent.ok);
         } break;
         default:
-            parent = nodeptr_ptr(interpreter->scopes.len - 1);
+            UNREACHABLE();
         }
     }
-    dynarr_append(&interpreter->scopes, scope_initialize(interpreter, ir, variables, parent));
+    dynarr_append(&interpreter->scopes, scope_initialize(interpreter, ir, parent));
 }
 
-scope_t *interpreter_new_scope(interpreter_t *interpreter, nodeptr ir, namespace_t variables)
+scope_t *interpreter_new_scope(interpreter_t *interpreter, nodeptr ir)
 {
     if (interpreter->callback != NULL) {
         interpreter->callback(ICT_OnScopeStart, interpreter, (interpreter_callback_payload_t) { 0 });
     }
-    create_scope(interpreter, ir, variables);
+    create_scope(interpreter, ir);
     scope_t *back = dynarr_back(&interpreter->scopes);
     scope_allocate(back);
     if (interpreter->callback != NULL) {
@@ -118,11 +101,11 @@ scope_t *interpreter_new_scope(interpreter_t *interpreter, nodeptr ir, namespace
     return back;
 }
 
-scope_t *interpreter_emplace_scope(interpreter_t *interpreter, nodeptr ir, namespace_t variables)
+scope_t *interpreter_emplace_scope(interpreter_t *interpreter, nodeptr ir, size_t pushed)
 {
-    create_scope(interpreter, ir, variables);
+    create_scope(interpreter, ir);
     scope_t *back = dynarr_back(&interpreter->scopes);
-    scope_setup(back);
+    scope_setup(back, pushed);
     return back;
 }
 
@@ -139,13 +122,25 @@ void interpreter_drop_scope(interpreter_t *interpreter)
     }
 }
 
+// Returns the stack address of a variable resolved by the linker. The
+// variable lives `depth` scopes up from the current one.
+intptr_t interpreter_variable_address(interpreter_t *interpreter, var_path_t *var)
+{
+    if (!var->resolved) {
+        fatal("Reference to unresolved variable `" SL "`", SLARG(var->name));
+    }
+    scope_t *s = dynarr_back(&interpreter->scopes);
+    for (uint32_t depth = var->depth; depth > 0; --depth) {
+        assert(s->parent.ok);
+        s = interpreter->scopes.items + s->parent.value;
+    }
+    return s->bp + var->slot + var->offset;
+}
+
 value_t interpreter_pop(interpreter_t *interpreter, nodeptr type)
 {
-    size_t  aligned = align_at(8, type_size_of(type));
-    size_t  offset = interpreter->stack.len - aligned / sizeof(intptr_t);
-    value_t ret = make_value_from_buffer(type, (void *) (interpreter->stack.items + offset));
-    stack_discard(&interpreter->stack, aligned);
-    return ret;
+    stack_discard(&interpreter->stack, type_size_of(type));
+    return make_value_from_buffer(type, interpreter->stack.top);
 }
 
 void interpreter_move_in(interpreter_t *interpreter, void *ptr, size_t size, uint8_t reg)
@@ -213,6 +208,29 @@ value_t interpreter_move_out(interpreter_t *interpreter, nodeptr type, uint8_t r
     return make_value_from_buffer(type, interpreter->registers + reg);
 }
 
+// Pushes a context for `ir` onto the call stack. The SIGPROF handler of
+// the sampling profiler reads the call stack, and must not see the new
+// depth before the context is written.
+static void interpreter_push_context(interpreter_t *interpreter, nodeptr ir)
+{
+    dynarr_append_s(
+        interpreter_context_t,
+        &interpreter->call_stack,
+        .ir = ir,
+        .ip = 0);
+    if (interpreter->sampling) {
+        atomic_store_explicit(&interpreter->sampled_depth, interpreter->call_stack.len, memory_order_release);
+    }
+}
+
+static void interpreter_pop_context(interpreter_t *interpreter)
+{
+    if (interpreter->sampling) {
+        atomic_store_explicit(&interpreter->sampled_depth, interpreter->call_stack.len - 1, memory_order_release);
+    }
+    dynarr_pop(&interpreter->call_stack);
+}
+
 void interpreter_execute_operations(interpreter_t *interpreter, nodeptr ir)
 {
     ir_node_t    *ir_node = interpreter->gen->ir_nodes.items + ir.value;
@@ -231,34 +249,32 @@ void interpreter_execute_operations(interpreter_t *interpreter, nodeptr ir)
         list(stderr, interpreter->gen, ir);
     }
     assert(ops != NULL);
-    bool must_analyze = true;
-    for (size_t ix = 0; ix < interpreter->labels.len; ++ix) {
-        if (interpreter->labels.items[ix].ir_node.value == ir.value) {
-            must_analyze = false;
-            break;
-        }
+    // Calls push onto the call stack, which may move it.
+    size_t ip = execute_operations(interpreter, ops, dynarr_back(&interpreter->call_stack)->ip);
+    dynarr_back(&interpreter->call_stack)->ip = ip;
+}
+
+// Calls `function` with the `pushed` bytes of arguments on top of the
+// stack. The return value is left in the registers.
+void interpreter_call(interpreter_t *interpreter, nodeptr function, size_t pushed)
+{
+    if (interpreter->callback != NULL) {
+        interpreter->callback(ICT_StartFunction, interpreter, (interpreter_callback_payload_t) { .function = function });
     }
-    if (must_analyze) {
-        interpreter_labels_t labels = { 0 };
-        for (size_t ix = 0; ix < ops->len; ++ix) {
-            operation_t *op = ops->items + ix;
-            if (op->type == IRO_Label) {
-                dynarr_append_s(
-                    interpreter_label_t,
-                    &labels,
-                    .label = op->Label,
-                    .operation_index = ix, );
-            }
-            dynarr_append_s(
-                interpreter_node_labels_t,
-                &interpreter->labels,
-                .ir_node = ir,
-                .labels = labels);
-        }
+    if (interpreter->sampling) {
+        profile_sampling_drain(interpreter);
     }
-    interpreter_context_t *ctx = dynarr_back(&interpreter->call_stack);
-    while (ctx->ip < ops->len) {
-        execute_op(ops->items + ctx->ip, interpreter);
+    interpreter_emplace_scope(interpreter, function, pushed);
+    interpreter_push_context(interpreter, function);
+    interpreter_execute_operations(interpreter, function);
+    interpreter_pop_context(interpreter);
+    interpreter_drop_scope(interpreter);
+    // Don't let the callee's pending break leak into the caller.
+    uint64_t zero = 0;
+    interpreter_move_in(interpreter, &zero, sizeof(uint64_t), 17);
+    interpreter_move_in(interpreter, &zero, sizeof(uint64_t), 18);
+    if (interpreter->callback != NULL) {
+        interpreter->callback(ICT_EndFunction, interpreter, (interpreter_callback_payload_t) { .function = function });
     }
 }
 
@@ -279,11 +295,8 @@ value_t interpreter_execute(interpreter_t *interpreter, nodeptr ir)
 
 value_t execute_program(interpreter_t *interpreter, nodeptr program)
 {
-    interpreter_new_scope(interpreter, program, (namespace_t) { 0 });
-    dynarr_append_s(
-        interpreter_context_t,
-        &interpreter->call_stack,
-        .ir = program);
+    interpreter_new_scope(interpreter, program);
+    interpreter_push_context(interpreter, program);
     nodeptr    main = { 0 };
     ir_node_t *prog = interpreter->gen->ir_nodes.items + program.value;
     for (size_t ix = 0; ix < prog->program.modules.len; ++ix) {
@@ -311,17 +324,12 @@ value_t execute_module(interpreter_t *interpreter, nodeptr module)
         interpreter->callback(ICT_StartModule, interpreter, (interpreter_callback_payload_t) { .module = module });
     }
     ir_node_t *mod = interpreter->gen->ir_nodes.items + module.value;
-    dynarr_append_s(
-        interpreter_context_t,
-        &interpreter->call_stack,
-        .ir = module,
-        .ip = 0);
-    interpreter_new_scope(
-        interpreter,
-        module,
-        mod->module.variables);
-    interpreter_execute_operations(interpreter, module);
-    dynarr_pop(&interpreter->call_stack);
+    interpreter_push_context(interpreter, module);
+    interpreter_new_scope(interpreter, module);
+    if (interpreter->regvm == NULL || !regvm_execute_module(interpreter, module)) {
+        interpreter_execute_operations(interpreter, module);
+    }
+    interpreter_pop_context(interpreter);
     if (interpreter->callback != NULL) {
         interpreter->callback(ICT_EndModule, interpreter, (interpreter_callback_payload_t) { .module = module });
     }
@@ -334,15 +342,11 @@ value_t execute_function(interpreter_t *interpreter, nodeptr function)
         interpreter->callback(ICT_StartFunction, interpreter, (interpreter_callback_payload_t) { .function = function });
     }
     ir_node_t *func = interpreter->gen->ir_nodes.items + function.value;
-    scope_t   *param_scope = interpreter_new_scope(interpreter, function, func->function.parameters);
+    scope_t   *param_scope = interpreter_new_scope(interpreter, function);
     (void) param_scope;
-    dynarr_append_s(
-        interpreter_context_t,
-        &interpreter->call_stack,
-        .ir = function,
-        .ip = 0);
+    interpreter_push_context(interpreter, function);
     interpreter_execute_operations(interpreter, function);
-    dynarr_pop(&interpreter->call_stack);
+    interpreter_pop_context(interpreter);
     interpreter_drop_scope(interpreter);
     if (interpreter->callback != NULL) {
         interpreter->callback(ICT_EndFunction, interpreter, (interpreter_callback_payload_t) { .function = function });
@@ -350,9 +354,220 @@ value_t execute_function(interpreter_t *interpreter, nodeptr function)
     return interpreter_move_out(interpreter, func->function.return_type, 0);
 }
 
+// Sets up an interpreter for the IR in `gen` as the command line asks for.
+static void interpreter_initialize(interpreter_t *interpreter, ir_generator_t *gen)
+{
+    *interpreter = (interpreter_t) { 0 };
+    interpreter->gen = gen;
+    interpreter->stack = stack_create(INTERPRETER_STACK_SIZE);
+    if (cmdline_is_set("profile-comptime")) {
+        // Only the stack VM reports the operations it executes.
+        interpreter->callback = profile_callback;
+    } else if (cmdline_is_set("sample-comptime")) {
+        // The sampler reads the stack VM's call stack.
+        dynarr_ensure(&interpreter->call_stack, INTERPRETER_MAX_CALL_DEPTH + 2);
+        interpreter->sampling = true;
+    } else if (cmdline_is_set("register-vm") || cmdline_is_set("jit")) {
+        interpreter->regvm = regvm_create(gen);
+    }
+    if (interpreter->regvm != NULL && cmdline_is_set("jit")) {
+        // Native code is compiled from the register VM's code.
+        uint64_t threshold = INTERPRETER_JIT_THRESHOLD;
+        slice_t  value = cmdline_value("jit-threshold");
+        if (value.len > 0) {
+            opt_ulong t = slice_to_ulong(value, 10);
+            if (!t.ok) {
+                fatal("Invalid JIT threshold `" SL "`", SLARG(value));
+            }
+            threshold = t.value;
+        }
+        regvm_enable_jit(interpreter->regvm, threshold);
+    }
+    if (cmdline_is_set("mine-sequences")) {
+        interpreter->callback = sequences_callback;
+    }
+}
+
+static value_t interpreter_run(interpreter_t *interpreter, nodeptr ir)
+{
+    if (interpreter->sampling) {
+        profile_sampling_start(interpreter);
+    }
+    value_t ret = interpreter_execute(interpreter, ir);
+    if (interpreter->sampling) {
+        profile_sampling_stop(interpreter);
+    }
+    return ret;
+}
+
+static void interpreter_release(interpreter_t *interpreter)
+{
+    if (interpreter->regvm != NULL) {
+        regvm_free(interpreter->regvm);
+    }
+    stack_free(&interpreter->stack);
+    dynarr_free(&interpreter->scopes);
+    dynarr_free(&interpreter->call_stack);
+}
+
 value_t execute_ir(ir_generator_t *gen, nodeptr ir)
 {
-    interpreter_t interpreter = { 0 };
-    interpreter.gen = gen;
-    return interpreter_execute(&interpreter, ir);
+    interpreter_t interpreter;
+    interpreter_initialize(&interpreter, gen);
+    value_t ret = interpreter_run(&interpreter, ir);
+    interpreter_release(&interpreter);
+    return ret;
+}
+
+// A @comptime block waiting to run, and its output once it has.
+typedef struct _comptime_block {
+    nodeptr              comptime;
+    nodeptr              ir;
+    comptime_cache_key_t key;
+    slice_t              output;
+} comptime_block_t;
+
+typedef DA(comptime_block_t) comptime_blocks_t;
+
+// The IR and the interpreters shared by the comptime blocks of a
+// compilation. Every block adds its module to the IR. A bind pass queues
+// the blocks it finds ready, and comptime_run_pending runs them on up to
+// `jobs` threads, each with its own value stack and register VM. The setup
+// is paid once per thread, and the code the register VMs lowered and
+// compiled stays around.
+//
+// While the blocks run the IR, the parse tree and the type registry are
+// only read.
+static struct {
+    bool              active;
+    bool              cache;
+    size_t            jobs;
+    ir_generator_t    gen;
+    interpreter_t     interpreters[INTERPRETER_MAX_JOBS];
+    size_t            initialized;
+    comptime_blocks_t pending;
+    _Atomic size_t    next;
+} comptime_session = { 0 };
+
+static void comptime_session_start(parser_t *parser)
+{
+    comptime_session.gen.parser = parser;
+    comptime_session.cache = comptime_cache_enabled();
+    comptime_session.jobs = cmdline_jobs("jobs", INTERPRETER_MAX_JOBS);
+    if (cmdline_is_set("mine-sequences") || cmdline_is_set("profile-comptime") || cmdline_is_set("sample-comptime")) {
+        // The profilers keep their tables in globals.
+        comptime_session.jobs = 1;
+    }
+    comptime_session.active = true;
+}
+
+// Generates the IR for the @comptime block `comptime` and queues it for
+// comptime_run_pending. If the cache has the block's output, it is stored
+// in the block instead.
+void comptime_submit(parser_t *parser, nodeptr comptime)
+{
+    if (!comptime_session.active) {
+        comptime_session_start(parser);
+    }
+    assert(comptime_session.gen.parser == parser);
+    dynarr_foreach(comptime_block_t, block, &comptime_session.pending)
+    {
+        if (block->comptime.value == comptime.value) {
+            return;
+        }
+    }
+    nodeptr              ir = generate_ir_into(&comptime_session.gen, parser_node(parser, comptime)->comptime.statements);
+    comptime_cache_key_t key = 0;
+    if (comptime_session.cache) {
+        key = comptime_cache_key(&comptime_session.gen, ir, parser_node(parser, comptime)->comptime.raw_text);
+        opt_slice_t cached = comptime_cache_lookup(key);
+        if (cached.ok) {
+            parser_node(parser, comptime)->comptime.output = cached;
+            return;
+        }
+    }
+    dynarr_append_s(comptime_block_t, &comptime_session.pending, .comptime = comptime, .ir = ir, .key = key);
+}
+
+static void *comptime_worker(void *arg)
+{
+    interpreter_t *interpreter = (interpreter_t *) arg;
+    while (true) {
+        size_t ix = atomic_fetch_add(&comptime_session.next, 1);
+        if (ix >= comptime_session.pending.len) {
+            break;
+        }
+        comptime_block_t *block = comptime_session.pending.items + ix;
+        value_t           ret = interpreter_run(interpreter, block->ir);
+        // The frame of the block's module is still on the stack.
+        interpreter->scopes.len = 0;
+        interpreter->stack.top = interpreter->stack.base;
+        // The output can live on the value stack, which the next block on
+        // this thread reuses.
+        sb_t output = { 0 };
+        if (ret.type.value == String.value) {
+            sb_append(&output, ret.slice);
+        }
+        block->output = sb_as_slice(output);
+    }
+    return NULL;
+}
+
+// Runs the blocks queued by comptime_submit and stores their output in
+// the blocks, in the order they were queued. Returns the number of blocks
+// that ran.
+size_t comptime_run_pending()
+{
+    size_t count = comptime_session.pending.len;
+    if (count == 0) {
+        return 0;
+    }
+    size_t workers = MIN(comptime_session.jobs, count);
+    for (; comptime_session.initialized < workers; ++comptime_session.initialized) {
+        interpreter_initialize(comptime_session.interpreters + comptime_session.initialized, &comptime_session.gen);
+    }
+    comptime_session.next = 0;
+    type_registry_freeze(true);
+    if (workers == 1) {
+        comptime_worker(comptime_session.interpreters);
+    } else {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, INTERPRETER_THREAD_STACK_SIZE);
+        pthread_t threads[INTERPRETER_MAX_JOBS];
+        for (size_t ix = 0; ix < workers; ++ix) {
+            if ((errno = pthread_create(threads + ix, &attr, comptime_worker, comptime_session.interpreters + ix)) != 0) {
+                fatal("comptime_run_pending: pthread_create: %s", strerror(errno));
+            }
+        }
+        for (size_t ix = 0; ix < workers; ++ix) {
+            pthread_join(threads[ix], NULL);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    type_registry_freeze(false);
+
+    parser_t *parser = comptime_session.gen.parser;
+    dynarr_foreach(comptime_block_t, block, &comptime_session.pending)
+    {
+        parser_node(parser, block->comptime)->comptime.output = OPTVAL(slice_t, block->output);
+        if (comptime_session.cache) {
+            comptime_cache_store(block->key, block->output);
+        }
+    }
+    comptime_session.pending.len = 0;
+    return count;
+}
+
+void comptime_session_end()
+{
+    if (comptime_session.active) {
+        assert(comptime_session.pending.len == 0);
+        for (size_t ix = 0; ix < comptime_session.initialized; ++ix) {
+            interpreter_release(comptime_session.interpreters + ix);
+        }
+        dynarr_free(&comptime_session.pending);
+        comptime_session.initialized = 0;
+        comptime_session.active = false;
+    }
 }
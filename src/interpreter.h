@@ -21,21 +21,66 @@ typedef struct __stack_reference {
     nodeptr  type;
 } stack_reference_t;
 
-typedef DA(intptr_t) interp_stack_t;
-
-#define stack_ensure(stack, size) dynarr_ensure(stack, size)
-intptr_t stack_reserve(interp_stack_t *stack, size_t size);
-intptr_t stack_push(interp_stack_t *stack, void *ptr, size_t size);
-intptr_t stack_push_value(interp_stack_t *stack, value_t value);
-void     stack_store(interp_stack_t *stack, void *src, intptr_t offset, size_t size);
-void     stack_load(interp_stack_t *stack, void *dest, intptr_t offset, size_t size);
-void     stack_discard(interp_stack_t *stack, size_t bp);
-void     stack_pop(interp_stack_t *stack, void *dest, size_t size);
-void     stack_copy(interp_stack_t *stack, intptr_t dest, intptr_t src, size_t size);
-void     stack_copy_and_pop(interp_stack_t *stack, intptr_t dest, size_t size);
-void     stack_push_copy(interp_stack_t *stack, intptr_t src, size_t size);
-intptr_t stack_evaluate(interp_stack_t *stack, nodeptr lhs_type, operator_t op, nodeptr rhs_type);
-intptr_t stack_evaluate_unary(interp_stack_t *stack, nodeptr operand, operator_t op);
+// The interpreter's value stack: a fixed region with a guard page after
+// `limit`. Values are addressed by their byte offset from `base`, and
+// are aligned at 8 bytes.
+typedef struct _interp_stack {
+    char *base;
+    char *top;
+    char *limit;
+} interp_stack_t;
+
+#ifndef INTERPRETER_STACK_SIZE
+#define INTERPRETER_STACK_SIZE (16 * 1024 * 1024)
+#endif
+
+// Calls recurse on the native stack, so their depth is limited as well.
+#ifndef INTERPRETER_MAX_CALL_DEPTH
+#define INTERPRETER_MAX_CALL_DEPTH 10000
+#endif
+
+#define stack_size(stack) ((size_t) ((stack)->top - (stack)->base))
+
+interp_stack_t stack_create(size_t size);
+void           stack_free(interp_stack_t *stack);
+intptr_t       stack_reserve(interp_stack_t *stack, size_t size);
+intptr_t       stack_push(interp_stack_t *stack, void *ptr, size_t size);
+intptr_t       stack_push_value(interp_stack_t *stack, value_t value);
+void           stack_store(interp_stack_t *stack, void *src, intptr_t offset, size_t size);
+void           stack_load(interp_stack_t *stack, void *dest, intptr_t offset, size_t size);
+void           stack_discard(interp_stack_t *stack, size_t size);
+void           stack_pop(interp_stack_t *stack, void *dest, size_t size);
+void           stack_copy(interp_stack_t *stack, intptr_t dest, intptr_t src, size_t size);
+void           stack_copy_and_pop(interp_stack_t *stack, intptr_t dest, size_t size);
+void           stack_push_copy(interp_stack_t *stack, intptr_t src, size_t size);
+intptr_t       stack_evaluate(interp_stack_t *stack, nodeptr lhs_type, operator_t op, nodeptr rhs_type);
+intptr_t       stack_evaluate_unary(interp_stack_t *stack, nodeptr operand, operator_t op);
+
+typedef int64_t (*int_unary_op_fnc_t)(int64_t);
+typedef uint64_t (*uint_unary_op_fnc_t)(uint64_t);
+typedef double (*double_unary_op_fnc_t)(double);
+typedef bool (*bool_unary_op_fnc_t)(bool);
+typedef int64_t (*int_binary_op_fnc_t)(int64_t, int64_t);
+typedef uint64_t (*uint_binary_op_fnc_t)(uint64_t, uint64_t);
+typedef double (*double_binary_op_fnc_t)(double, double);
+typedef bool (*bool_binary_op_fnc_t)(bool, bool);
+
+typedef struct _unary_up_fncs {
+    int_unary_op_fnc_t    int_fnc;
+    uint_unary_op_fnc_t   uint_fnc;
+    double_unary_op_fnc_t double_fnc;
+    bool_unary_op_fnc_t   bool_fnc;
+} unary_op_fncs_t;
+
+typedef struct _binary_op_fncs {
+    int_binary_op_fnc_t    int_fnc;
+    uint_binary_op_fnc_t   uint_fnc;
+    double_binary_op_fnc_t double_fnc;
+    bool_binary_op_fnc_t   bool_fnc;
+} binary_op_fncs_t;
+
+binary_op_fncs_t const *binary_op_functions(operator_t op);
+unary_op_fncs_t const  *unary_op_functions(operator_t op);
 
 #define stack_store_T(T, stack, val, offset)                            \
     (                                                                   \
@@ -47,7 +92,7 @@ intptr_t stack_evaluate_unary(interp_stack_t *stack, nodeptr operand, operator_t
         })
 
 #define stack_push_T(T, stack, val)                          \
-    ((sizeof(T) == 0) ? (stack)->len * sizeof(intptr_t) : ({ \
+    ((sizeof(T) == 0) ? (intptr_t) stack_size(stack) : ({    \
         interp_stack_t *__stack = (stack);                   \
         T               __val = (val);                       \
         stack_push(__stack, (void *) &__val, sizeof(T));     \
@@ -99,27 +144,23 @@ intptr_t stack_evaluate_unary(interp_stack_t *stack, nodeptr operand, operator_t
 typedef intptr_t            value_address_t;
 typedef struct _interpreter interpreter_t;
 
-typedef struct _scope_variable {
-    slice_t         name;
-    value_address_t address;
-    nodeptr         type;
-} scope_variable_t;
-
-typedef DA(scope_variable_t) scope_variables_t;
-
+// The frame of a function, module or program: `size` bytes starting at
+// byte offset `bp` of the stack. The variables of blocks are part of the
+// frame of the function they are in. Variables are addressed by the slot
+// the linker assigned them, relative to `bp`.
 typedef struct _scope {
-    interpreter_t    *interpreter;
-    nodeptr           ir;
-    nodeptr           parent;
-    scope_variables_t variables;
-    size_t            bp;
+    interpreter_t *interpreter;
+    nodeptr        ir;
+    nodeptr        parent;
+    size_t         size;
+    size_t         bp;
 } scope_t;
 
 typedef DA(scope_t) scopes_t;
 
-scope_t scope_initialize(interpreter_t *interpreter, nodeptr ir, namespace_t variables, nodeptr parent);
+scope_t scope_initialize(interpreter_t *interpreter, nodeptr ir, nodeptr parent);
 void    scope_allocate(scope_t *scope);
-void    scope_setup(scope_t *scope);
+void    scope_setup(scope_t *scope, size_t pushed);
 void    scope_release(scope_t *scope);
 
 typedef struct _interpreter_context {
@@ -151,48 +192,89 @@ typedef union _interpreter_callback_payload {
 
 typedef bool (*interpreter_callback_t)(interpreter_callback_type_t, interpreter_t *, interpreter_callback_payload_t payload);
 
-typedef struct _interpreter_label {
-    uint64_t label;
-    uint64_t operation_index;
-} interpreter_label_t;
+#define INTERPRETER_NUM_REGS 20
 
-typedef DA(interpreter_label_t) interpreter_labels_t;
+// Number of times a function runs on the register VM before it is
+// compiled to native code.
+#ifndef INTERPRETER_JIT_THRESHOLD
+#define INTERPRETER_JIT_THRESHOLD 100
+#endif
 
-typedef struct _interpreter_node_labels {
-    nodeptr              ir_node;
-    interpreter_labels_t labels;
-} interpreter_node_labels_t;
+// Most threads running @comptime blocks at the same time, and the size of
+// their C stacks. Calls in comptime code recurse on the C stack.
+#ifndef INTERPRETER_MAX_JOBS
+#define INTERPRETER_MAX_JOBS 64
+#endif
 
-typedef DA(interpreter_node_labels_t) interpreter_nodes_labels_t;
+#ifndef INTERPRETER_THREAD_STACK_SIZE
+#define INTERPRETER_THREAD_STACK_SIZE (16 * 1024 * 1024)
+#endif
 
-#define INTERPRETER_NUM_REGS 20
+// The register VM: functions and modules lowered to three-address code.
+// See regvm.c.
+typedef struct _regvm regvm_t;
+
+// Key of the output of a @comptime block in the on-disk cache. See cache.c.
+typedef uint64_t comptime_cache_key_t;
 
 typedef struct _interpreter {
-    ir_generator_t            *gen;
-    interpreter_nodes_labels_t labels;
-    scopes_t                   scopes;
-    interp_stack_t             stack;
-    interpreter_contexts_t     call_stack;
-    uint64_t                   registers[INTERPRETER_NUM_REGS];
-    interpreter_callback_t     callback;
+    ir_generator_t        *gen;
+    scopes_t               scopes;
+    interp_stack_t         stack;
+    interpreter_contexts_t call_stack;
+    uint64_t               registers[INTERPRETER_NUM_REGS];
+    interpreter_callback_t callback;
+    regvm_t               *regvm;         // NULL unless running on the register VM
+    bool                   sampling;      // Keep the ip of the contexts up to date for the sampling profiler
+    _Atomic size_t         sampled_depth; // Contexts the sampling profiler may read, published after they are written
 } interpreter_t;
 
 scope_t *interpreter_current_scope(interpreter_t *interpreter);
-scope_t *interpreter_new_scope(interpreter_t *interpreter, nodeptr ir, namespace_t variables);
-scope_t *interpreter_emplace_scope(interpreter_t *interpreter, nodeptr ir, namespace_t variables);
+scope_t *interpreter_new_scope(interpreter_t *interpreter, nodeptr ir);
+scope_t *interpreter_emplace_scope(interpreter_t *interpreter, nodeptr ir, size_t pushed);
 void     interpreter_drop_scope(interpreter_t *interpreter);
+intptr_t interpreter_variable_address(interpreter_t *interpreter, var_path_t *var);
 void     interpreter_move_in(interpreter_t *interpreter, void *ptr, size_t size, uint8_t reg);
 void     interpreter_move_in_value(interpreter_t *interpreter, value_t val, uint8_t reg);
 uint64_t interpreter_move_out_reg(interpreter_t *interpreter, uint8_t reg);
 value_t  interpreter_move_out(interpreter_t *interpreter, nodeptr type, uint8_t reg);
 value_t  interpreter_pop(interpreter_t *interpreter, nodeptr type);
 void     interpreter_execute_operations(interpreter_t *interpreter, nodeptr ir);
+void     interpreter_call(interpreter_t *interpreter, nodeptr function, size_t pushed);
 value_t  interpreter_execute(interpreter_t *interpreter, nodeptr ir);
-void     execute_op(operation_t *op, interpreter_t *interpreter);
+size_t   execute_operations(interpreter_t *interpreter, operations_t *ops, size_t ip);
 value_t  execute_function(interpreter_t *interpreter, nodeptr function);
 value_t  execute_program(interpreter_t *interpreter, nodeptr program);
 value_t  execute_module(interpreter_t *interpreter, nodeptr module);
 value_t  execute_ir(ir_generator_t *gen, nodeptr ir);
+void     comptime_submit(parser_t *parser, nodeptr comptime);
+size_t   comptime_run_pending();
+void     comptime_session_end();
+regvm_t *regvm_create(ir_generator_t *gen);
+void     regvm_free(regvm_t *regvm);
+void     regvm_enable_jit(regvm_t *regvm, uint64_t threshold);
+bool     regvm_execute_function(interpreter_t *interpreter, nodeptr function, size_t pushed);
+bool     regvm_execute_module(interpreter_t *interpreter, nodeptr module);
+bool     sequences_callback(interpreter_callback_type_t type, interpreter_t *interpreter, interpreter_callback_payload_t payload);
+void     sequences_report(FILE *f);
+bool     profile_callback(interpreter_callback_type_t type, interpreter_t *interpreter, interpreter_callback_payload_t payload);
+void     profile_report(FILE *f);
+void     profile_write_folded(FILE *f);
+void     profile_sampling_start(interpreter_t *interpreter);
+void     profile_sampling_stop(interpreter_t *interpreter);
+void     profile_sampling_drain(interpreter_t *interpreter);
+
+bool                 comptime_cache_enabled();
+comptime_cache_key_t comptime_cache_key(ir_generator_t *gen, nodeptr first, slice_t text);
+opt_slice_t          comptime_cache_lookup(comptime_cache_key_t key);
+void                 comptime_cache_store(comptime_cache_key_t key, slice_t output);
+
+// With GCC and clang the operations are dispatched through a table of
+// label addresses, with a separate indirect jump at the end of every
+// handler. Define ELROND_SWITCH_DISPATCH to use the portable switch loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(ELROND_SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
 
 #define interpreter_move_in_T(T, interpreter, val, reg)               \
     do {                                                              \
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "native.h"
+
+// In-process versions of the core functions of the runtime library
+// libelrrt. A native call to one of these from comptime code runs the C
+// function directly, without loading the library and without going through
+// the trampoline.
+//
+// The functions take their arguments from t->x in the order the assembly
+// versions take them from x0, x1, ..., so a string is a pointer followed by
+// a length. Results go in t->int_return_value, and a string result also
+// uses t->int_return_value_2.
+
+#define INTRINSICS(S)                  \
+    S(alloc, "elrond$alloc")           \
+    S(endln, "elrond$endln")           \
+    S(puti, "elrond$puti")             \
+    S(putln, "elrond$putln")           \
+    S(puts, "elrond$puts")             \
+    S(strlen, "elrond$strlen")         \
+    S(string_cmp, "string_cmp")        \
+    S(string_concat, "string_concat")  \
+    S(string_eq, "string_eq")
+
+// Like the runtime, write straight to file descriptor 1 and don't buffer.
+static uint64_t write_stdout(char const *buf, size_t len)
+{
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(1, buf + written, len - written);
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    return written;
+}
+
+static void intrinsic_alloc(trampoline_t *t)
+{
+    // elrond$alloc maps fresh pages, which are zeroed
+    t->int_return_value = (uint64_t) calloc(t->x[0], 1);
+}
+
+static void intrinsic_endln(trampoline_t *t)
+{
+    t->int_return_value = write_stdout("\n", 1);
+}
+
+static void intrinsic_puti(trampoline_t *t)
+{
+    char buf[32];
+    int  len = snprintf(buf, sizeof(buf), "%" PRId64, (int64_t) t->x[0]);
+    t->int_return_value = write_stdout(buf, len);
+}
+
+static void intrinsic_puts(trampoline_t *t)
+{
+    char const *buf = (char const *) t->x[0];
+    size_t      len = t->x[1];
+    if (buf == NULL) {
+        buf = "[[null]]";
+        len = 8;
+    }
+    t->int_return_value = write_stdout(buf, len);
+}
+
+static void intrinsic_putln(trampoline_t *t)
+{
+    intrinsic_puts(t);
+    uint64_t printed = t->int_return_value;
+    intrinsic_endln(t);
+    t->int_return_value += printed;
+}
+
+static void intrinsic_strlen(trampoline_t *t)
+{
+    t->int_return_value = strlen((char const *) t->x[0]);
+}
+
+static void intrinsic_string_cmp(trampoline_t *t)
+{
+    char const *ptr1 = (char const *) t->x[0];
+    size_t      len1 = t->x[1];
+    char const *ptr2 = (char const *) t->x[2];
+    size_t      len2 = t->x[3];
+    int32_t     ret = 0;
+    if (ptr1 == NULL || ptr2 == NULL) {
+        ret = (ptr1 != NULL) - (ptr2 != NULL);
+    } else if (len1 != len2) {
+        ret = (int32_t) (len1 - len2);
+    } else {
+        ret = memcmp(ptr1, ptr2, len1);
+    }
+    t->int_return_value = (uint64_t) (int64_t) ret;
+}
+
+static void intrinsic_string_concat(trampoline_t *t)
+{
+    size_t len1 = t->x[1];
+    size_t len2 = t->x[3];
+    char  *buf = allocator_alloc(len1 + len2 + 1);
+    memcpy(buf, (char const *) t->x[0], len1);
+    memcpy(buf + len1, (char const *) t->x[2], len2);
+    t->int_return_value = (uint64_t) buf;
+    t->int_return_value_2 = len1 + len2;
+}
+
+static void intrinsic_string_eq(trampoline_t *t)
+{
+    char const *ptr1 = (char const *) t->x[0];
+    char const *ptr2 = (char const *) t->x[2];
+    if (ptr1 == NULL || ptr2 == NULL) {
+        t->int_return_value = ptr1 == ptr2;
+        return;
+    }
+    t->int_return_value = t->x[1] == t->x[3] && memcmp(ptr1, ptr2, t->x[1]) == 0;
+}
+
+typedef struct _intrinsic_def {
+    char const *name;
+    intrinsic_t intrinsic;
+} intrinsic_def_t;
+
+static intrinsic_def_t intrinsics[] = {
+#undef S
+#define S(Name, Symbol) { Symbol, intrinsic_##Name },
+    INTRINSICS(S)
+#undef S
+};
+
+// Returns the intrinsic for the native function `name`, if it's one of the
+// runtime functions above in libelrrt or, for programs that link the
+// runtime statically, in the main program image.
+intrinsic_t intrinsic_lookup(slice_t name)
+{
+    slice_t    s = slice_trim(name);
+    opt_size_t paren = slice_indexof(s, '(');
+    if (paren.ok) {
+        s = slice_first(s, paren.value);
+    }
+    opt_size_t colon = slice_indexof(s, ':');
+    if (colon.ok) {
+        slice_t lib_name = slice_first(s, colon.value);
+        if (lib_name.len > 0 && !slice_eq(lib_name, C("libelrrt"))) {
+            return NULL;
+        }
+        s = slice_tail(s, colon.value + 1);
+    }
+    for (size_t ix = 0; ix < sizeof(intrinsics) / sizeof(intrinsic_def_t); ++ix) {
+        if (slice_eq(s, C(intrinsics[ix].name))) {
+            return intrinsics[ix].intrinsic;
+        }
+    }
+    return NULL;
+}
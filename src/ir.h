@@ -14,27 +14,80 @@
 #include "slice.h"
 #include "value.h"
 
-#define IROPERATIONTYPES(S)        \
-    S(AssignFromRef, nodeptr)      \
-    S(AssignValue, nodeptr)        \
-    S(BinaryOperator, binary_op_t) \
-    S(Break, break_op_t)           \
-    S(Call, call_op_t)             \
-    S(DeclVar, name_t)             \
-    S(Dereference, nodeptr)        \
-    S(Discard, nodeptr)            \
-    S(Jump, uint64_t)              \
-    S(JumpF, uint64_t)             \
-    S(JumpT, uint64_t)             \
-    S(Label, uint64_t)             \
-    S(NativeCall, call_op_t)       \
-    S(Pop, nodeptr)                \
-    S(PushConstant, value_t)       \
-    S(PushValue, var_path_t)       \
-    S(PushVarAddress, var_path_t)  \
-    S(ScopeBegin, namespace_t)     \
-    S(ScopeEnd, scope_end_op_t)    \
-    S(UnaryOperator, unary_op_t)
+// Binary operators on two operands of the same integer or float type are
+// rewritten by the linker to an opcode specialized for that type, e.g.
+// AddI64 or LessF32, so that executing them needs no type dispatch. The
+// opcodes of one type are consecutive and follow the order of
+// IRSPECIALIZEDOPERATORS. They have a binary_op_t payload, and the
+// entries expand the macro S, so IROPERATIONTYPES must be passed a macro
+// named S.
+#define IRSPECIALIZEDOPERATORS(S) \
+    S(Add)                        \
+    S(Subtract)                   \
+    S(Multiply)                   \
+    S(Divide)                     \
+    S(Modulo)                     \
+    S(Equals)                     \
+    S(NotEqual)                   \
+    S(Less)                       \
+    S(LessEqual)                  \
+    S(Greater)                    \
+    S(GreaterEqual)
+
+#define IRINTOPCODES(W, T)          \
+    S(Add##W, binary_op_t)          \
+    S(Subtract##W, binary_op_t)     \
+    S(Multiply##W, binary_op_t)     \
+    S(Divide##W, binary_op_t)       \
+    S(Modulo##W, binary_op_t)       \
+    S(Equals##W, binary_op_t)       \
+    S(NotEqual##W, binary_op_t)     \
+    S(Less##W, binary_op_t)         \
+    S(LessEqual##W, binary_op_t)    \
+    S(Greater##W, binary_op_t)      \
+    S(GreaterEqual##W, binary_op_t)
+
+#define IRFLOATOPCODES(W, T)           \
+    S(Add##F##W, binary_op_t)          \
+    S(Subtract##F##W, binary_op_t)     \
+    S(Multiply##F##W, binary_op_t)     \
+    S(Divide##F##W, binary_op_t)       \
+    S(Modulo##F##W, binary_op_t)       \
+    S(Equals##F##W, binary_op_t)       \
+    S(NotEqual##F##W, binary_op_t)     \
+    S(Less##F##W, binary_op_t)         \
+    S(LessEqual##F##W, binary_op_t)    \
+    S(Greater##F##W, binary_op_t)      \
+    S(GreaterEqual##F##W, binary_op_t)
+
+#define IROPERATIONTYPES(S)                             \
+    S(AssignFromRef, nodeptr)                           \
+    S(AssignValue, nodeptr)                             \
+    S(AssignVar, assign_var_op_t)                       \
+    S(AssignVarKeep, assign_var_op_t)                   \
+    S(BinaryOperator, binary_op_t)                      \
+    S(BinaryOperatorVarConst, var_const_op_t)           \
+    S(BinaryOperatorVarConstJumpF, var_const_jump_op_t) \
+    S(BinaryOperatorVarVar, var_var_op_t)               \
+    S(Break, break_op_t)                                \
+    S(Call, call_op_t)                                  \
+    S(DeclVar, name_t)                                  \
+    S(Dereference, nodeptr)                             \
+    S(Discard, nodeptr)                                 \
+    S(Jump, jump_op_t)                                  \
+    S(JumpF, jump_op_t)                                 \
+    S(JumpT, jump_op_t)                                 \
+    S(Label, uint64_t)                                  \
+    S(NativeCall, call_op_t)                            \
+    S(Pop, nodeptr)                                     \
+    S(PushConstant, value_t)                            \
+    S(PushValue, var_path_t)                            \
+    S(PushVarAddress, var_path_t)                       \
+    S(ScopeBegin, scope_begin_op_t)                     \
+    S(ScopeEnd, scope_end_op_t)                         \
+    S(UnaryOperator, unary_op_t)                        \
+    INTTYPES(IRINTOPCODES)                              \
+    FLOATTYPES(IRFLOATOPCODES)
 
 typedef enum _ir_operation_type {
 #undef S
@@ -47,6 +100,9 @@ typedef struct _var_path {
     slice_t  name;
     nodeptr  type;
     intptr_t offset;
+    bool     resolved;
+    uint32_t depth;
+    intptr_t slot;
 } var_path_t;
 
 typedef struct _break_op {
@@ -54,24 +110,65 @@ typedef struct _break_op {
     uint64_t depth;
     uint64_t label;
     nodeptr  exit_type;
+    size_t   scope_end_ip;
+    size_t   label_ip;
 } break_op_t;
 
+typedef struct _jump_op {
+    uint64_t label;
+    size_t   target;
+} jump_op_t;
+
+typedef struct _native_plan native_plan_t;
+
 typedef struct _call_op {
-    slice_t     name;
-    namespace_t parameters;
-    nodeptr     return_type;
+    slice_t                name;
+    namespace_t            parameters;
+    nodeptr                return_type;
+    nodeptr                function;
+    native_plan_t *_Atomic plan; // NativeCall: made by the first call at comptime
 } call_op_t;
 
 typedef struct _binary_op {
     nodeptr    lhs;
     operator_t op;
     nodeptr    rhs;
+    int        specialized; // Specialized opcode set by the linker, 0 if there is none
 } binary_op_t;
 
+typedef struct _var_const_op {
+    var_path_t  var;
+    value_t     constant;
+    binary_op_t op;
+} var_const_op_t;
+
+typedef struct _var_var_op {
+    var_path_t  lhs;
+    var_path_t  rhs;
+    binary_op_t op;
+} var_var_op_t;
+
+typedef struct _var_const_jump_op {
+    var_const_op_t cond;
+    jump_op_t      jump;
+} var_const_jump_op_t;
+
+typedef struct _assign_var_op {
+    var_path_t var;
+    nodeptr    type;
+} assign_var_op_t;
+
+typedef struct _scope_begin_op {
+    namespace_t variables;
+    intptr_t    base; // Frame slots of the block's variables, set by the linker
+    intptr_t    size;
+} scope_begin_op_t;
+
 typedef struct _scope_end_op {
     uint64_t enclosing_end;
     bool     has_defers;
     nodeptr  exit_type;
+    size_t   enclosing_end_ip;
 } scope_end_op_t;
 
 typedef struct _unary_op {
@@ -81,6 +178,7 @@ typedef struct _unary_op {
 
 typedef struct _operation {
     ir_operation_type_t type;
+    nodeptr             node; // Syntax node the operation was generated for
     union {
 #undef S
 #define S(I, T) T I;
@@ -129,6 +227,7 @@ typedef struct _ir_node {
     ir_node_type_t type;
     size_t         ix;
     nodeptr        bound_type;
+    size_t         frame_size; // Bytes for parameters, variables and all nested blocks' variables
     union {
         ir_function_t function;
         ir_module_t   module;
@@ -183,12 +282,18 @@ typedef struct _ir_generator {
     parser_t     *parser;
     ir_nodes_t    ir_nodes;
     ir_contexts_t ctxs;
+    nodeptr       current_node;
+    size_t        linked; // IR nodes before this one have been optimized and linked
 } ir_generator_t;
 
 slice_t        operation_type_name(ir_operation_type_t type);
 void           operation_list(sb_t *sb, operation_t const *op);
+operations_t  *ir_node_operations(ir_node_t *node);
 void           generate(ir_generator_t *gen, nodeptr node);
 ir_generator_t generate_ir(parser_t *parser, nodeptr n);
+nodeptr        generate_ir_into(ir_generator_t *gen, nodeptr n);
+void           optimize_ir(ir_generator_t *gen);
+void           link_ir(ir_generator_t *gen);
 void           list(FILE *f, ir_generator_t *gen, nodeptr ir);
 
 #endif /* __IR_H__ */
@@ -0,0 +1,691 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "da.h"
+#include "regvm.h"
+
+// Compiles the three-address code of the register VM to x86-64 machine
+// code once a function or module has run often enough. The registers stay
+// in the register window, so the native code reads its operands from and
+// writes its results to memory, but it doesn't pay for dispatching every
+// instruction and calling an operator function for every operation.
+// Calls go back through the VM, which compiles or interprets the callee.
+//
+// Code using float operators stays on the register VM, as does all code
+// on other platforms.
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef enum _jit_reg {
+    JR_RAX = 0,
+    JR_RCX = 1,
+    JR_RDX = 2,
+    JR_RBX = 3, // The register window
+    JR_RSP = 4,
+    JR_RBP = 5,
+    JR_RSI = 6,
+    JR_RDI = 7,
+    JR_R12 = 12, // The frame
+} jit_reg_t;
+
+typedef enum _jit_condition {
+    JCC_B = 0x2,
+    JCC_AE = 0x3,
+    JCC_E = 0x4,
+    JCC_NE = 0x5,
+    JCC_BE = 0x6,
+    JCC_A = 0x7,
+    JCC_L = 0xC,
+    JCC_GE = 0xD,
+    JCC_LE = 0xE,
+    JCC_G = 0xF,
+} jit_condition_t;
+
+typedef enum _jit_stub {
+    JS_IntegerOverflow,
+    JS_DivisionByZero,
+    JS_Count,
+} jit_stub_t;
+
+// A rel32 to patch once the offsets of the instructions are known.
+typedef struct _jit_fixup {
+    size_t at;
+    size_t target; // Instruction index, or jit_stub_t
+    bool   stub;
+} jit_fixup_t;
+
+typedef DA(jit_fixup_t) jit_fixups_t;
+typedef DA(uint8_t) jit_bytes_t;
+
+typedef struct _jit {
+    regvm_code_t *code;
+    slice_t       name;
+    jit_bytes_t   bytes;
+    jit_fixups_t  fixups;
+    uint64s       offsets; // Code offset of every instruction
+    size_t        stubs[JS_Count];
+    bool          slices; // Registers can hold slices, so moves copy both words
+} jit_t;
+
+static void jit_integer_overflow()
+{
+    fprintf(stderr, "Integer overflow\n");
+    abort();
+}
+
+static void jit_division_by_zero()
+{
+    fprintf(stderr, "Division by zero\n");
+    abort();
+}
+
+static bool jit_unsupported(jit_t *j, char const *why)
+{
+    trace("jit: `" SL "` stays on the register VM: %s", SLARG(j->name), why);
+    return false;
+}
+
+static void jit_byte(jit_t *j, uint8_t b)
+{
+    dynarr_append(&j->bytes, b);
+}
+
+static void jit_u32(jit_t *j, uint32_t value)
+{
+    for (int ix = 0; ix < 4; ++ix) {
+        jit_byte(j, (value >> (8 * ix)) & 0xFF);
+    }
+}
+
+static void jit_u64(jit_t *j, uint64_t value)
+{
+    for (int ix = 0; ix < 8; ++ix) {
+        jit_byte(j, (value >> (8 * ix)) & 0xFF);
+    }
+}
+
+static void jit_opcode(jit_t *j, uint8_t rex, uint32_t opcode, int len)
+{
+    if (rex != 0x40) {
+        jit_byte(j, rex);
+    }
+    for (int ix = len - 1; ix >= 0; --ix) {
+        jit_byte(j, (opcode >> (8 * ix)) & 0xFF);
+    }
+}
+
+// Emits `opcode` with register operand `reg` and memory operand
+// [base + disp]. `prefix` is an operand size prefix, or 0, and `w` selects
+// 64-bit operands. For opcodes with an extension, `reg` is the extension.
+static void jit_mem(jit_t *j, uint8_t prefix, bool w, uint32_t opcode, int len, int reg, jit_reg_t base, int32_t disp)
+{
+    if (prefix != 0) {
+        jit_byte(j, prefix);
+    }
+    jit_opcode(j, 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0), opcode, len);
+    jit_byte(j, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == JR_RSP) {
+        jit_byte(j, 0x24);
+    }
+    jit_u32(j, (uint32_t) disp);
+}
+
+// Emits `opcode` with register operands `reg` and `rm`.
+static void jit_reg(jit_t *j, bool w, uint32_t opcode, int len, int reg, jit_reg_t rm)
+{
+    jit_opcode(j, 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0), opcode, len);
+    jit_byte(j, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static int32_t jit_slot(regvm_reg_t reg)
+{
+    return (int32_t) (reg * sizeof(regvm_value_t));
+}
+
+static void jit_load(jit_t *j, jit_reg_t dst, regvm_reg_t reg)
+{
+    jit_mem(j, 0, true, 0x8B, 1, dst, JR_RBX, jit_slot(reg));
+}
+
+static void jit_store(jit_t *j, regvm_reg_t reg, jit_reg_t src)
+{
+    jit_mem(j, 0, true, 0x89, 1, src, JR_RBX, jit_slot(reg));
+}
+
+// Copies the `words` words at [src + src_disp] to [dst + dst_disp].
+static void jit_copy(jit_t *j, jit_reg_t dst, int32_t dst_disp, jit_reg_t src, int32_t src_disp, int words)
+{
+    for (int ix = 0; ix < words; ++ix) {
+        jit_mem(j, 0, true, 0x8B, 1, JR_RAX, src, src_disp + 8 * ix);
+        jit_mem(j, 0, true, 0x89, 1, JR_RAX, dst, dst_disp + 8 * ix);
+    }
+}
+
+static void jit_move_imm(jit_t *j, jit_reg_t dst, uint64_t value)
+{
+    if (value <= UINT32_MAX) {
+        jit_opcode(j, 0x40 | ((dst & 8) ? 1 : 0), 0xB8 + (dst & 7), 1);
+        jit_u32(j, (uint32_t) value);
+    } else if ((int64_t) value >= INT32_MIN && (int64_t) value < 0) {
+        jit_reg(j, true, 0xC7, 1, 0, dst);
+        jit_u32(j, (uint32_t) value);
+    } else {
+        jit_opcode(j, 0x48 | ((dst & 8) ? 1 : 0), 0xB8 + (dst & 7), 1);
+        jit_u64(j, value);
+    }
+}
+
+static void jit_call(jit_t *j, uintptr_t fnc)
+{
+    jit_move_imm(j, JR_RAX, fnc);
+    jit_reg(j, false, 0xFF, 1, 2, JR_RAX);
+}
+
+// Jumps to instruction `target`, or to a stub. `cond` is a condition
+// code, or -1 for an unconditional jump.
+static void jit_jump(jit_t *j, int cond, size_t target, bool stub)
+{
+    if (cond < 0) {
+        jit_byte(j, 0xE9);
+    } else {
+        jit_byte(j, 0x0F);
+        jit_byte(j, 0x80 + cond);
+    }
+    dynarr_append_s(jit_fixup_t, &j->fixups, .at = j->bytes.len, .target = target, .stub = stub);
+    jit_u32(j, 0);
+}
+
+// Sets rax to 1 if condition `cond` holds, and to 0 otherwise.
+static void jit_set(jit_t *j, jit_condition_t cond)
+{
+    jit_reg(j, false, 0x0F90 + cond, 2, 0, JR_RAX);
+    jit_reg(j, false, 0x0FB6, 2, JR_RAX, JR_RAX);
+}
+
+static int jit_comparison(operator_t op, bool is_signed)
+{
+    switch (op) {
+    case OP_Equals:
+        return JCC_E;
+    case OP_NotEqual:
+        return JCC_NE;
+    case OP_Less:
+        return is_signed ? JCC_L : JCC_B;
+    case OP_LessEqual:
+        return is_signed ? JCC_LE : JCC_BE;
+    case OP_Greater:
+        return is_signed ? JCC_G : JCC_A;
+    case OP_GreaterEqual:
+        return is_signed ? JCC_GE : JCC_AE;
+    default:
+        return -1;
+    }
+}
+
+// Truncates rax to the width of `kind`, like regvm_normalize.
+static void jit_normalize(jit_t *j, regvm_kind_t kind)
+{
+    switch (kind) {
+    case RVK_I8:
+        jit_reg(j, true, 0x0FBE, 2, JR_RAX, JR_RAX);
+        break;
+    case RVK_U8:
+        jit_reg(j, false, 0x0FB6, 2, JR_RAX, JR_RAX);
+        break;
+    case RVK_I16:
+        jit_reg(j, true, 0x0FBF, 2, JR_RAX, JR_RAX);
+        break;
+    case RVK_U16:
+        jit_reg(j, false, 0x0FB7, 2, JR_RAX, JR_RAX);
+        break;
+    case RVK_I32:
+        jit_reg(j, true, 0x63, 1, JR_RAX, JR_RAX);
+        break;
+    case RVK_U32:
+        jit_reg(j, false, 0x89, 1, JR_RAX, JR_RAX);
+        break;
+    default:
+        break;
+    }
+}
+
+static bool jit_variable(jit_t *j, regvm_instr_t *instr, int32_t *disp)
+{
+    if (instr->var.offset < INT32_MIN || instr->var.offset > INT32_MAX) {
+        return jit_unsupported(j, "variable offset");
+    }
+    jit_mem(j, 0, true, 0x8B, 1, JR_RCX, JR_R12, (int32_t) (offsetof(regvm_frame_t, bases) + instr->var.depth * sizeof(char *)));
+    *disp = (int32_t) instr->var.offset;
+    return true;
+}
+
+static bool jit_Const(jit_t *j, regvm_instr_t *instr)
+{
+    if (instr->kind == RVK_Slice) {
+        jit_move_imm(j, JR_RAX, (uintptr_t) instr->constant.slice.items);
+        jit_mem(j, 0, true, 0x89, 1, JR_RAX, JR_RBX, jit_slot(instr->dst));
+        jit_move_imm(j, JR_RAX, instr->constant.slice.len);
+        jit_mem(j, 0, true, 0x89, 1, JR_RAX, JR_RBX, jit_slot(instr->dst) + 8);
+        return true;
+    }
+    int64_t value = instr->constant.i64;
+    if (value >= INT32_MIN && value <= INT32_MAX) {
+        jit_mem(j, 0, true, 0xC7, 1, 0, JR_RBX, jit_slot(instr->dst));
+        jit_u32(j, (uint32_t) value);
+        return true;
+    }
+    jit_move_imm(j, JR_RAX, (uint64_t) value);
+    jit_store(j, instr->dst, JR_RAX);
+    return true;
+}
+
+static bool jit_Move(jit_t *j, regvm_instr_t *instr)
+{
+    jit_copy(j, JR_RBX, jit_slot(instr->dst), JR_RBX, jit_slot(instr->lhs), (j->slices) ? 2 : 1);
+    return true;
+}
+
+static bool jit_Load(jit_t *j, regvm_instr_t *instr)
+{
+    int32_t disp;
+    if (!jit_variable(j, instr, &disp)) {
+        return false;
+    }
+    switch (instr->kind) {
+    case RVK_Bool:
+    case RVK_U8:
+        jit_mem(j, 0, false, 0x0FB6, 2, JR_RAX, JR_RCX, disp);
+        break;
+    case RVK_I8:
+        jit_mem(j, 0, true, 0x0FBE, 2, JR_RAX, JR_RCX, disp);
+        break;
+    case RVK_U16:
+        jit_mem(j, 0, false, 0x0FB7, 2, JR_RAX, JR_RCX, disp);
+        break;
+    case RVK_I16:
+        jit_mem(j, 0, true, 0x0FBF, 2, JR_RAX, JR_RCX, disp);
+        break;
+    case RVK_U32:
+        jit_mem(j, 0, false, 0x8B, 1, JR_RAX, JR_RCX, disp);
+        break;
+    case RVK_I32:
+        jit_mem(j, 0, true, 0x63, 1, JR_RAX, JR_RCX, disp);
+        break;
+    case RVK_U64:
+    case RVK_I64:
+        jit_mem(j, 0, true, 0x8B, 1, JR_RAX, JR_RCX, disp);
+        break;
+    case RVK_Slice:
+        jit_copy(j, JR_RBX, jit_slot(instr->dst), JR_RCX, disp, 2);
+        return true;
+    default:
+        return jit_unsupported(j, "load of a float");
+    }
+    jit_store(j, instr->dst, JR_RAX);
+    return true;
+}
+
+static bool jit_Store(jit_t *j, regvm_instr_t *instr)
+{
+    int32_t disp;
+    if (!jit_variable(j, instr, &disp)) {
+        return false;
+    }
+    if (instr->kind == RVK_Slice) {
+        jit_copy(j, JR_RCX, disp, JR_RBX, jit_slot(instr->lhs), 2);
+        return true;
+    }
+    jit_load(j, JR_RAX, instr->lhs);
+    switch (instr->kind) {
+    case RVK_Bool:
+        jit_reg(j, true, 0x85, 1, JR_RAX, JR_RAX);
+        jit_set(j, JCC_NE);
+        jit_mem(j, 0, false, 0x88, 1, JR_RAX, JR_RCX, disp);
+        break;
+    case RVK_U8:
+    case RVK_I8:
+        jit_mem(j, 0, false, 0x88, 1, JR_RAX, JR_RCX, disp);
+        break;
+    case RVK_U16:
+    case RVK_I16:
+        jit_mem(j, 0x66, false, 0x89, 1, JR_RAX, JR_RCX, disp);
+        break;
+    case RVK_U32:
+    case RVK_I32:
+        jit_mem(j, 0, false, 0x89, 1, JR_RAX, JR_RCX, disp);
+        break;
+    case RVK_U64:
+    case RVK_I64:
+        jit_mem(j, 0, true, 0x89, 1, JR_RAX, JR_RCX, disp);
+        break;
+    default:
+        return jit_unsupported(j, "store of a float");
+    }
+    return true;
+}
+
+// Like regvm_execute_IntOp and regvm_execute_UIntOp: the operation is
+// done on 64 bits and the result checked against the range of the type.
+static bool jit_int_op(jit_t *j, regvm_instr_t *instr, bool is_signed)
+{
+    jit_load(j, JR_RAX, instr->lhs);
+    jit_load(j, JR_RCX, instr->rhs);
+    int cond = jit_comparison(instr->op, is_signed);
+    if (cond >= 0) {
+        jit_reg(j, true, 0x39, 1, JR_RCX, JR_RAX);
+        jit_set(j, cond);
+        jit_store(j, instr->dst, JR_RAX);
+        return true;
+    }
+    switch (instr->op) {
+    case OP_Add:
+        jit_reg(j, true, 0x01, 1, JR_RCX, JR_RAX);
+        break;
+    case OP_Subtract:
+        jit_reg(j, true, 0x29, 1, JR_RCX, JR_RAX);
+        break;
+    case OP_Multiply:
+        jit_reg(j, true, 0x0FAF, 2, JR_RAX, JR_RCX);
+        break;
+    case OP_BinaryAnd:
+        jit_reg(j, true, 0x21, 1, JR_RCX, JR_RAX);
+        break;
+    case OP_BinaryOr:
+        jit_reg(j, true, 0x09, 1, JR_RCX, JR_RAX);
+        break;
+    case OP_BinaryXor:
+        jit_reg(j, true, 0x31, 1, JR_RCX, JR_RAX);
+        break;
+    case OP_Divide:
+    case OP_Modulo:
+        jit_reg(j, true, 0x85, 1, JR_RCX, JR_RCX);
+        jit_jump(j, JCC_E, JS_DivisionByZero, true);
+        if (is_signed) {
+            jit_byte(j, 0x48); // cqo
+            jit_byte(j, 0x99);
+            jit_reg(j, true, 0xF7, 1, 7, JR_RCX);
+        } else {
+            jit_reg(j, false, 0x31, 1, JR_RDX, JR_RDX);
+            jit_reg(j, true, 0xF7, 1, 6, JR_RCX);
+        }
+        if (instr->op == OP_Modulo) {
+            jit_reg(j, true, 0x89, 1, JR_RDX, JR_RAX);
+        }
+        break;
+    default:
+        jit_reg(j, true, 0x89, 1, JR_RAX, JR_RDI);
+        jit_reg(j, true, 0x89, 1, JR_RCX, JR_RSI);
+        jit_call(j, is_signed ? (uintptr_t) instr->int_op.fnc : (uintptr_t) instr->uint_op.fnc);
+        break;
+    }
+    if (is_signed) {
+        if (instr->int_op.min != INT64_MIN) {
+            jit_move_imm(j, JR_RCX, (uint64_t) instr->int_op.min);
+            jit_reg(j, true, 0x39, 1, JR_RCX, JR_RAX);
+            jit_jump(j, JCC_L, JS_IntegerOverflow, true);
+        }
+        if (instr->int_op.max < INT64_MAX) {
+            jit_move_imm(j, JR_RCX, instr->int_op.max);
+            jit_reg(j, true, 0x39, 1, JR_RCX, JR_RAX);
+            jit_jump(j, JCC_G, JS_IntegerOverflow, true);
+        }
+    } else if (instr->uint_op.max != UINT64_MAX) {
+        jit_move_imm(j, JR_RCX, instr->uint_op.max);
+        jit_reg(j, true, 0x39, 1, JR_RCX, JR_RAX);
+        jit_jump(j, JCC_A, JS_IntegerOverflow, true);
+    }
+    jit_store(j, instr->dst, JR_RAX);
+    return true;
+}
+
+static bool jit_IntOp(jit_t *j, regvm_instr_t *instr)
+{
+    return jit_int_op(j, instr, true);
+}
+
+static bool jit_UIntOp(jit_t *j, regvm_instr_t *instr)
+{
+    return jit_int_op(j, instr, false);
+}
+
+static bool jit_FloatOp(jit_t *j, regvm_instr_t *instr)
+{
+    (void) instr;
+    return jit_unsupported(j, "float operator");
+}
+
+static bool jit_BoolOp(jit_t *j, regvm_instr_t *instr)
+{
+    jit_load(j, JR_RAX, instr->lhs);
+    jit_reg(j, true, 0x85, 1, JR_RAX, JR_RAX);
+    jit_set(j, JCC_NE);
+    jit_load(j, JR_RCX, instr->rhs);
+    jit_reg(j, true, 0x85, 1, JR_RCX, JR_RCX);
+    jit_reg(j, false, 0x0F95, 2, 0, JR_RCX);
+    jit_reg(j, false, 0x0FB6, 2, JR_RCX, JR_RCX);
+    switch (instr->op) {
+    case OP_LogicalAnd:
+        jit_reg(j, false, 0x21, 1, JR_RCX, JR_RAX);
+        break;
+    case OP_LogicalOr:
+        jit_reg(j, false, 0x09, 1, JR_RCX, JR_RAX);
+        break;
+    case OP_NotEqual:
+        jit_reg(j, false, 0x31, 1, JR_RCX, JR_RAX);
+        break;
+    case OP_Equals:
+        jit_reg(j, false, 0x39, 1, JR_RCX, JR_RAX);
+        jit_set(j, JCC_E);
+        break;
+    default:
+        jit_reg(j, false, 0x89, 1, JR_RAX, JR_RDI);
+        jit_reg(j, false, 0x89, 1, JR_RCX, JR_RSI);
+        jit_call(j, (uintptr_t) instr->bool_op);
+        jit_reg(j, false, 0x0FB6, 2, JR_RAX, JR_RAX);
+        break;
+    }
+    jit_store(j, instr->dst, JR_RAX);
+    return true;
+}
+
+static bool jit_int_unary(jit_t *j, regvm_instr_t *instr, uintptr_t fnc)
+{
+    jit_load(j, JR_RAX, instr->lhs);
+    switch (instr->op) {
+    case OP_BinaryInvert:
+        jit_reg(j, true, 0xF7, 1, 2, JR_RAX);
+        break;
+    case OP_Negate:
+        jit_reg(j, true, 0xF7, 1, 3, JR_RAX);
+        break;
+    default:
+        jit_reg(j, true, 0x89, 1, JR_RAX, JR_RDI);
+        jit_call(j, fnc);
+        break;
+    }
+    jit_normalize(j, instr->kind);
+    jit_store(j, instr->dst, JR_RAX);
+    return true;
+}
+
+static bool jit_IntUnary(jit_t *j, regvm_instr_t *instr)
+{
+    return jit_int_unary(j, instr, (uintptr_t) instr->int_unary);
+}
+
+static bool jit_UIntUnary(jit_t *j, regvm_instr_t *instr)
+{
+    return jit_int_unary(j, instr, (uintptr_t) instr->uint_unary);
+}
+
+static bool jit_FloatUnary(jit_t *j, regvm_instr_t *instr)
+{
+    (void) instr;
+    return jit_unsupported(j, "float operator");
+}
+
+static bool jit_Jump(jit_t *j, regvm_instr_t *instr)
+{
+    jit_jump(j, -1, instr->target, false);
+    return true;
+}
+
+static bool jit_JumpF(jit_t *j, regvm_instr_t *instr)
+{
+    jit_mem(j, 0, true, 0x83, 1, 7, JR_RBX, jit_slot(instr->lhs));
+    jit_byte(j, 0);
+    jit_jump(j, JCC_E, instr->target, false);
+    return true;
+}
+
+static bool jit_JumpT(jit_t *j, regvm_instr_t *instr)
+{
+    jit_mem(j, 0, true, 0x83, 1, 7, JR_RBX, jit_slot(instr->lhs));
+    jit_byte(j, 0);
+    jit_jump(j, JCC_NE, instr->target, false);
+    return true;
+}
+
+static bool jit_Call(jit_t *j, regvm_instr_t *instr)
+{
+    jit_reg(j, true, 0x89, 1, JR_R12, JR_RDI);
+    jit_move_imm(j, JR_RSI, (uintptr_t) instr);
+    jit_call(j, (uintptr_t) regvm_jit_call);
+    return true;
+}
+
+static void jit_epilogue(jit_t *j)
+{
+    jit_byte(j, 0x41); // pop r12
+    jit_byte(j, 0x5C);
+    jit_byte(j, 0x5B); // pop rbx
+    jit_byte(j, 0x5D); // pop rbp
+    jit_byte(j, 0xC3); // ret
+}
+
+static bool jit_Return(jit_t *j, regvm_instr_t *instr)
+{
+    if (instr->lhs != REGVM_NO_REG) {
+        jit_copy(j, JR_R12, (int32_t) offsetof(regvm_frame_t, result), JR_RBX, jit_slot(instr->lhs), (j->slices) ? 2 : 1);
+    }
+    jit_epilogue(j);
+    return true;
+}
+
+typedef bool (*jit_fnc_t)(jit_t *, regvm_instr_t *);
+
+static jit_fnc_t jit_fncs[] = {
+#undef S
+#define S(O) [RVO_##O] = jit_##O,
+    REGVM_OPCODES(S)
+#undef S
+};
+
+static bool jit_generate(jit_t *j)
+{
+    regvm_code_t *code = j->code;
+    j->slices = code->result == RVK_Slice;
+    for (size_t ix = 0; ix < code->params.len; ++ix) {
+        j->slices |= code->params.items[ix].kind == RVK_Slice;
+    }
+    for (size_t ix = 0; ix < code->instrs.len; ++ix) {
+        j->slices |= code->instrs.items[ix].kind == RVK_Slice;
+    }
+
+    // The frame is in r12 and the register window in rbx. Pushing three
+    // registers keeps the stack aligned at 16 bytes for calls.
+    jit_byte(j, 0x55); // push rbp
+    jit_reg(j, true, 0x89, 1, JR_RSP, JR_RBP);
+    jit_byte(j, 0x53); // push rbx
+    jit_byte(j, 0x41); // push r12
+    jit_byte(j, 0x54);
+    jit_reg(j, true, 0x89, 1, JR_RDI, JR_R12);
+    jit_mem(j, 0, true, 0x8B, 1, JR_RBX, JR_R12, (int32_t) offsetof(regvm_frame_t, regs));
+
+    for (size_t ix = 0; ix < code->instrs.len; ++ix) {
+        regvm_instr_t *instr = code->instrs.items + ix;
+        dynarr_append(&j->offsets, j->bytes.len);
+        if (!jit_fncs[instr->opcode](j, instr)) {
+            return false;
+        }
+    }
+    dynarr_append(&j->offsets, j->bytes.len);
+    jit_epilogue(j);
+
+    j->stubs[JS_IntegerOverflow] = j->bytes.len;
+    jit_call(j, (uintptr_t) jit_integer_overflow);
+    j->stubs[JS_DivisionByZero] = j->bytes.len;
+    jit_call(j, (uintptr_t) jit_division_by_zero);
+
+    for (size_t ix = 0; ix < j->fixups.len; ++ix) {
+        jit_fixup_t *fixup = j->fixups.items + ix;
+        size_t       target = (fixup->stub) ? j->stubs[fixup->target] : j->offsets.items[fixup->target];
+        int32_t      rel = (int32_t) ((int64_t) target - (int64_t) (fixup->at + 4));
+        memcpy(j->bytes.items + fixup->at, &rel, sizeof(int32_t));
+    }
+    return true;
+}
+
+bool jit_compile(regvm_code_t *code, slice_t name)
+{
+    jit_t j = { .code = code, .name = name };
+    bool  ok = jit_generate(&j);
+    if (ok) {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t size = align_at(page, j.bytes.len);
+        void  *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            ok = jit_unsupported(&j, "could not map memory");
+        } else {
+            memcpy(mem, j.bytes.items, j.bytes.len);
+            if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(mem, size);
+                ok = jit_unsupported(&j, "could not make memory executable");
+            } else {
+                code->jit = (regvm_jit_fnc_t) mem;
+                code->jit_size = size;
+                trace("jit: compiled `" SL "`: %zu instructions, %zu bytes", SLARG(name), code->instrs.len, j.bytes.len);
+            }
+        }
+    }
+    dynarr_free(&j.bytes);
+    dynarr_free(&j.fixups);
+    dynarr_free(&j.offsets);
+    return ok;
+}
+
+void jit_release(regvm_code_t *code)
+{
+    if (code->jit != NULL) {
+        munmap((void *) code->jit, code->jit_size);
+        code->jit = NULL;
+    }
+}
+
+#else
+
+bool jit_compile(regvm_code_t *code, slice_t name)
+{
+    (void) code;
+    trace("jit: `" SL "` stays on the register VM: no native code generator for this platform", SLARG(name));
+    return false;
+}
+
+void jit_release(regvm_code_t *code)
+{
+    (void) code;
+}
+
+#endif
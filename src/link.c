@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "da.h"
+#include "ir.h"
+#include "slice.h"
+#include "type.h"
+
+// A scope visible while linking an IR node. The variables of nested
+// blocks are laid out in the frame of the function or module they are
+// in, starting at `base`.
+typedef struct _link_scope {
+    namespace_t variables;
+    intptr_t    base;
+    bool        frame;
+} link_scope_t;
+
+typedef DA(link_scope_t) link_scopes_t;
+
+typedef struct _label_table {
+    uint64_t base;
+    uint64s  ips;
+} label_table_t;
+
+// Labels are numbered globally, but the labels used in one IR node
+// form a dense-ish range. Index them by their offset in that range.
+static label_table_t label_table_build(operations_t *ops)
+{
+    label_table_t ret = { .base = ULLONG_MAX };
+    uint64_t      top = 0;
+    for (size_t ix = 0; ix < ops->len; ++ix) {
+        operation_t *op = ops->items + ix;
+        if (op->type == IRO_Label) {
+            ret.base = MIN(ret.base, op->Label);
+            top = MAX(top, op->Label);
+        }
+    }
+    if (ret.base == ULLONG_MAX) {
+        return ret;
+    }
+    for (uint64_t label = ret.base; label <= top; ++label) {
+        dynarr_append(&ret.ips, UINT64_MAX);
+    }
+    for (size_t ix = 0; ix < ops->len; ++ix) {
+        operation_t *op = ops->items + ix;
+        if (op->type == IRO_Label) {
+            ret.ips.items[op->Label - ret.base] = ix;
+        }
+    }
+    return ret;
+}
+
+static opt_size_t label_table_find(label_table_t *table, uint64_t label)
+{
+    if (label < table->base || label - table->base >= table->ips.len || table->ips.items[label - table->base] == UINT64_MAX) {
+        return OPTNULL(size_t);
+    }
+    return OPTVAL(size_t, table->ips.items[label - table->base]);
+}
+
+static nodeptr find_function(ir_generator_t *gen, nodeptr ir, slice_t name)
+{
+    ir_node_t *node = gen->ir_nodes.items + ir.value;
+    switch (node->type) {
+    case IRN_Function:
+        return find_function(gen, node->function.module, name);
+    case IRN_Module: {
+        for (size_t ix = 0; ix < node->module.functions.len; ++ix) {
+            nodeptr    func = node->module.functions.items[ix];
+            ir_node_t *f = gen->ir_nodes.items + func.value;
+            if (slice_eq(f->function.name, name)) {
+                return func;
+            }
+        }
+        if (!node->module.program.ok) {
+            return nullptr;
+        }
+        return find_function(gen, node->module.program, name);
+    }
+    case IRN_Program: {
+        for (size_t ix = 0; ix < node->program.functions.len; ++ix) {
+            nodeptr    func = node->program.functions.items[ix];
+            ir_node_t *f = gen->ir_nodes.items + func.value;
+            if (slice_eq(f->function.name, name)) {
+                return func;
+            }
+        }
+        return nullptr;
+    }
+    default:
+        UNREACHABLE();
+    }
+}
+
+static intptr_t variables_size(namespace_t *variables)
+{
+    intptr_t ret = 0;
+    for (size_t ix = 0; ix < variables->len; ++ix) {
+        ret += align_at(8, type_size_of(variables->items[ix].type));
+    }
+    return ret;
+}
+
+// Pushes the frames visible from the IR node `ir`, outermost first. These
+// are the frames the interpreter sets up before executing the node's
+// operations.
+static void enclosing_scopes(ir_generator_t *gen, nodeptr ir, link_scopes_t *scopes)
+{
+    ir_node_t *node = gen->ir_nodes.items + ir.value;
+    switch (node->type) {
+    case IRN_Function:
+        enclosing_scopes(gen, node->function.module, scopes);
+        dynarr_append_s(link_scope_t, scopes, .variables = node->function.parameters, .frame = true);
+        break;
+    case IRN_Module:
+        if (node->module.program.ok) {
+            enclosing_scopes(gen, node->module.program, scopes);
+        }
+        dynarr_append_s(link_scope_t, scopes, .variables = node->module.variables, .frame = true);
+        break;
+    case IRN_Program:
+        dynarr_append_s(link_scope_t, scopes, .variables = node->program.variables, .frame = true);
+        break;
+    default:
+        UNREACHABLE();
+    }
+}
+
+// Resolves a variable to the number of frames to walk up from the
+// innermost one, and the offset of the variable in that frame.
+static void resolve_variable(link_scopes_t *scopes, var_path_t *var)
+{
+    uint32_t depth = 0;
+    for (size_t ix = scopes->len; ix > 0; --ix) {
+        link_scope_t *scope = scopes->items + (ix - 1);
+        intptr_t      slot = scope->base;
+        for (size_t vix = 0; vix < scope->variables.len; ++vix) {
+            if (slice_eq(scope->variables.items[vix].name, var->name)) {
+                var->resolved = true;
+                var->depth = depth;
+                var->slot = slot;
+                return;
+            }
+            slot += align_at(8, type_size_of(scope->variables.items[vix].type));
+        }
+        if (scope->frame) {
+            ++depth;
+        }
+    }
+}
+
+static int specialized_operator_index(operator_t op)
+{
+    int ix = 0;
+#undef S
+#define S(O)            \
+    if (op == OP_##O) { \
+        return ix;      \
+    }                   \
+    ++ix;
+    IRSPECIALIZEDOPERATORS(S)
+#undef S
+    return -1;
+}
+
+// Picks the opcode specialized for the operator and operand types of a
+// binary operation, or 0 if there is none.
+static int specialized_opcode(binary_op_t *binop)
+{
+    int ix = specialized_operator_index(binop->op);
+    if (ix < 0 || binop->lhs.value != binop->rhs.value) {
+        return 0;
+    }
+    type_t *type = get_type(binop->lhs);
+    switch (type->kind) {
+    case TYPK_IntType:
+        switch (type->int_type.code) {
+#undef S
+#define S(W, T) \
+    case IC_##W: \
+        return IRO_Add##W + ix;
+            INTTYPES(S)
+#undef S
+        default:
+            UNREACHABLE();
+        }
+    case TYPK_FloatType:
+        switch (type->float_width) {
+#undef S
+#define S(W, T)  \
+    case FW_##W: \
+        return IRO_AddF##W + ix;
+            FLOATTYPES(S)
+#undef S
+        default:
+            UNREACHABLE();
+        }
+    default:
+        return 0;
+    }
+}
+
+static void link_operations(ir_generator_t *gen, nodeptr ir)
+{
+    ir_node_t    *node = gen->ir_nodes.items + ir.value;
+    operations_t *ops = ir_node_operations(node);
+    label_table_t labels = label_table_build(ops);
+    link_scopes_t scopes = { 0 };
+    enclosing_scopes(gen, ir, &scopes);
+    intptr_t top = variables_size(&dynarr_back(&scopes)->variables);
+    node->frame_size = top;
+    for (size_t ix = 0; ix < ops->len; ++ix) {
+        operation_t *op = ops->items + ix;
+        switch (op->type) {
+        case IRO_Jump:
+        case IRO_JumpF:
+        case IRO_JumpT: {
+            opt_size_t target = label_table_find(&labels, op->Jump.label);
+            if (!target.ok) {
+                fatal("Jump to undefined label %llu", op->Jump.label);
+            }
+            op->Jump.target = target.value;
+        } break;
+        case IRO_BinaryOperator:
+            op->BinaryOperator.specialized = specialized_opcode(&op->BinaryOperator);
+            if (op->BinaryOperator.specialized != 0) {
+                op->type = op->BinaryOperator.specialized;
+            }
+            break;
+        case IRO_BinaryOperatorVarConstJumpF: {
+            opt_size_t target = label_table_find(&labels, op->BinaryOperatorVarConstJumpF.jump.label);
+            if (!target.ok) {
+                fatal("Jump to undefined label %llu", op->BinaryOperatorVarConstJumpF.jump.label);
+            }
+            op->BinaryOperatorVarConstJumpF.jump.target = target.value;
+            resolve_variable(&scopes, &op->BinaryOperatorVarConstJumpF.cond.var);
+            op->BinaryOperatorVarConstJumpF.cond.op.specialized = specialized_opcode(&op->BinaryOperatorVarConstJumpF.cond.op);
+        } break;
+        case IRO_Break: {
+            // A break without a label is a return, which jumps past the
+            // last operation.
+            op->Break.label_ip = ORELSE(size_t, label_table_find(&labels, op->Break.label), ops->len);
+            op->Break.scope_end_ip = ORELSE(size_t, label_table_find(&labels, op->Break.scope_end), op->Break.label_ip);
+        } break;
+        case IRO_Call:
+            // Unresolved calls are only an error if they are executed.
+            op->Call.function = find_function(gen, ir, op->Call.name);
+            break;
+        case IRO_AssignVar:
+        case IRO_AssignVarKeep:
+            resolve_variable(&scopes, &op->AssignVar.var);
+            break;
+        case IRO_BinaryOperatorVarConst:
+            resolve_variable(&scopes, &op->BinaryOperatorVarConst.var);
+            op->BinaryOperatorVarConst.op.specialized = specialized_opcode(&op->BinaryOperatorVarConst.op);
+            break;
+        case IRO_BinaryOperatorVarVar:
+            resolve_variable(&scopes, &op->BinaryOperatorVarVar.lhs);
+            resolve_variable(&scopes, &op->BinaryOperatorVarVar.rhs);
+            op->BinaryOperatorVarVar.op.specialized = specialized_opcode(&op->BinaryOperatorVarVar.op);
+            break;
+        case IRO_PushValue:
+            resolve_variable(&scopes, &op->PushValue);
+            break;
+        case IRO_PushVarAddress:
+            resolve_variable(&scopes, &op->PushVarAddress);
+            break;
+        case IRO_ScopeBegin:
+            // Blocks that are not nested in each other share frame space.
+            op->ScopeBegin.base = top;
+            op->ScopeBegin.size = variables_size(&op->ScopeBegin.variables);
+            dynarr_append_s(link_scope_t, &scopes, .variables = op->ScopeBegin.variables, .base = top);
+            top += op->ScopeBegin.size;
+            node->frame_size = MAX(node->frame_size, (size_t) top);
+            break;
+        case IRO_ScopeEnd:
+            top = dynarr_back(&scopes)->base;
+            dynarr_pop(&scopes);
+            op->ScopeEnd.enclosing_end_ip = ORELSE(size_t, label_table_find(&labels, op->ScopeEnd.enclosing_end), ops->len);
+            break;
+        default:
+            break;
+        }
+    }
+    dynarr_free(&labels.ips);
+    dynarr_free(&scopes);
+}
+
+void link_ir(ir_generator_t *gen)
+{
+    for (size_t ix = gen->linked; ix < gen->ir_nodes.len; ++ix) {
+        link_operations(gen, nodeptr_ptr(ix));
+    }
+    gen->linked = gen->ir_nodes.len;
+}
@@ -11,14 +11,6 @@
 #include "resolve.h"
 #include "type.h"
 
-typedef struct _trampoline {
-    void_t   fnc;
-    uint64_t x[8];
-    double   d[8];
-    uint64_t int_return_value;
-    double   double_return_value;
-} trampoline_t;
-
 int trampoline(trampoline_t *tramp);
 
 #define as_T(T, ptr, offset)                                    \
@@ -35,19 +27,221 @@ int trampoline(trampoline_t *tramp);
         memcpy((char *) (ptr), &__val, sizeof(T)); \
     } while (0)
 
-bool native_call(slice_t name, void *params, nodeptrs types, void *return_value, nodeptr return_type)
+static void native_plan_arg(native_plan_t *plan, native_kind_t kind, size_t reg, intptr_t offset, size_t words)
+{
+    plan->args[plan->num_args++] = (native_arg_t) {
+        .kind = kind,
+        .reg = (uint16_t) reg,
+        .words = (uint16_t) words,
+        .offset = (uint32_t) offset,
+    };
+}
+
+#if defined(__x86_64__)
+
+static void native_plan_stack_arg(native_plan_t *plan, native_kind_t kind, intptr_t offset, size_t words)
+{
+    native_plan_arg(plan, kind, plan->stack_words, offset, words);
+    plan->args[plan->num_args - 1].stack = true;
+    plan->stack_words += words;
+}
+
+// Classifies the eightbytes of a value of at most 16 bytes, as in section
+// 3.2.3 of the System V x86-64 psABI. An eightbyte holding only floating
+// point values is SSE (NK_F64), any other is INTEGER (NK_U64). Eightbytes
+// holding nothing but padding stay NK_Void.
+static void sysv_classify(nodeptr type, intptr_t offset, native_kind_t classes[2])
 {
-    if (types.len > 8) {
-        fatal("Can't do native calls with more than 8 parameters");
+    type_t  *typ = get_type(type);
+    intptr_t size = type_size_of(type);
+    switch (typ->kind) {
+    case TYPK_FloatType:
+        if (classes[offset / 8] != NK_U64) {
+            classes[offset / 8] = NK_F64;
+        }
+        break;
+    case TYPK_StructType: {
+        intptr_t field_offset = 0;
+        dynarr_foreach(struct_field_t, fld, &typ->struct_fields)
+        {
+            field_offset = align_at(type_align_of(fld->type), field_offset);
+            sysv_classify(fld->type, offset + field_offset, classes);
+            field_offset += type_size_of(fld->type);
+        }
+    } break;
+    case TYPK_ArrayType: {
+        nodeptr  elem = typ->array_type.array_of;
+        intptr_t stride = align_at(type_align_of(elem), type_size_of(elem));
+        for (size_t ix = 0; ix < typ->array_type.size; ++ix) {
+            sysv_classify(elem, offset + ix * stride, classes);
+        }
+    } break;
+    default:
+        for (intptr_t word = offset / 8; size > 0 && word <= (offset + size - 1) / 8; ++word) {
+            classes[word] = NK_U64;
+        }
+        break;
     }
-    trampoline_t      t;
-    function_result_t res = resolve_function(name);
-    if (!res.ok || res.success == NULL) {
-        fatal("Function `" SL "` not found", SLARG(name));
-    } else {
-        t.fnc = res.success;
+}
+
+#endif
+
+// Works out how the result of a native call comes back. Composites of up
+// to two words are returned in registers, larger ones in memory provided
+// by the caller.
+static void native_plan_return(native_plan_t *plan, nodeptr return_type)
+{
+    type_t *ret = get_type(return_type);
+    switch (ret->kind) {
+    case TYPK_IntType:
+#undef S
+#define S(EType, CType)                   \
+    if (return_type.value == EType.value) \
+        plan->ret = NK_##EType;
+        INTTYPES(S)
+#undef S
+        break;
+    case TYPK_FloatType:
+        plan->ret = (ret->float_width == FW_32) ? NK_F32 : NK_F64;
+        break;
+    case TYPK_BoolType:
+        plan->ret = NK_Bool;
+        break;
+    case TYPK_PointerType:
+    case TYPK_ReferenceType:
+    case TYPK_ZeroTerminatedArray:
+        plan->ret = NK_Words;
+        plan->ret_words = 1;
+        plan->ret_class[0] = NK_U64;
+        break;
+    case TYPK_VoidType:
+        plan->ret = NK_Void;
+        break;
+    case TYPK_ArrayType:
+    case TYPK_DynArrayType:
+    case TYPK_SliceType:
+    case TYPK_StructType:
+        plan->ret = NK_Words;
+        plan->ret_words = align_at(8, type_size_of(return_type)) / 8;
+        if (plan->ret_words > 2) {
+            // The caller passes the address of the result, in x8 on arm64
+            // and as a hidden first argument on x86-64.
+            plan->ret_indirect = true;
+            break;
+        }
+#if defined(__x86_64__)
+        plan->ret_class[0] = plan->ret_class[1] = NK_Void;
+        sysv_classify(return_type, 0, plan->ret_class);
+#else
+        // TODO: HFAs are returned in v registers
+        plan->ret_class[0] = plan->ret_class[1] = NK_U64;
+#endif
+        break;
+    default:
+        UNREACHABLE();
     }
+}
+
+#if defined(__x86_64__)
+
+// Assigns the arguments to registers and stack slots as in section 3.2.3
+// of the System V x86-64 psABI. INTEGER eightbytes go in rdi, rsi, rdx,
+// rcx, r8 and r9 (x[0] to x[5] of the trampoline), SSE eightbytes in xmm0
+// to xmm7. An argument that doesn't fit in the remaining registers, and
+// any argument larger than 16 bytes, is passed on the stack.
+static void sysv_plan_args(native_plan_t *plan, nodeptrs types)
+{
+    size_t   ngrn = (plan->ret_indirect) ? 1 : 0;
+    size_t   nsrn = 0;
+    intptr_t offset = 0;
+    trace("native_plan(" SL ")", SLARG(plan->name));
+    for (size_t ix = 0; ix < types.len; ++ix) {
+        nodeptr  type = types.items[ix];
+        type_t  *typ = get_type(type);
+        intptr_t size = type_size_of(type);
+        size_t   words = align_at(8, size) / 8;
+
+        trace("native_plan param [%zu]: %zu `" SL "`", ix, type.value, SLARG(type_to_string(type)));
+        switch (typ->kind) {
+        case TYPK_IntType: {
+            native_kind_t kind = NK_I64;
+#undef S
+#define S(EType, CType)            \
+    if (type.value == EType.value) \
+        kind = NK_##EType;
+            INTTYPES(S)
+#undef S
+            if (ngrn < 6) {
+                native_plan_arg(plan, kind, ngrn++, offset, 1);
+            } else {
+                native_plan_stack_arg(plan, kind, offset, 1);
+            }
+        } break;
 
+        case TYPK_BoolType:
+            if (ngrn < 6) {
+                native_plan_arg(plan, NK_Bool, ngrn++, offset, 1);
+            } else {
+                native_plan_stack_arg(plan, NK_Bool, offset, 1);
+            }
+            break;
+
+        case TYPK_FloatType: {
+            native_kind_t kind = (typ->float_width == FW_32) ? NK_F32 : NK_F64;
+            if (nsrn < 8) {
+                native_plan_arg(plan, kind, nsrn++, offset, 1);
+            } else {
+                native_plan_stack_arg(plan, kind, offset, 1);
+            }
+        } break;
+
+        case TYPK_PointerType:
+        case TYPK_ReferenceType:
+        case TYPK_ZeroTerminatedArray:
+            if (ngrn < 6) {
+                native_plan_arg(plan, NK_Words, ngrn++, offset, 1);
+            } else {
+                native_plan_stack_arg(plan, NK_Words, offset, 1);
+            }
+            break;
+
+        default: {
+            // Composites. An argument with both INTEGER and SSE eightbytes
+            // takes one entry in the plan per eightbyte.
+            native_kind_t classes[2] = { NK_Void, NK_Void };
+            size_t        num_int = 0;
+            size_t        num_sse = 0;
+            if (words <= 2) {
+                sysv_classify(type, 0, classes);
+                for (size_t word = 0; word < words; ++word) {
+                    num_int += classes[word] == NK_U64;
+                    num_sse += classes[word] == NK_F64;
+                }
+            }
+            if (words > 2 || ngrn + num_int > 6 || nsrn + num_sse > 8) {
+                native_plan_stack_arg(plan, NK_Words, offset, words);
+                break;
+            }
+            for (size_t word = 0; word < words; ++word) {
+                if (classes[word] == NK_U64) {
+                    native_plan_arg(plan, NK_U64, ngrn++, offset + 8 * word, 1);
+                } else if (classes[word] == NK_F64) {
+                    native_plan_arg(plan, NK_F64, nsrn++, offset + 8 * word, 1);
+                }
+            }
+        } break;
+        }
+        offset += align_at(8, size);
+    }
+    plan->depth = offset / sizeof(intptr_t);
+}
+
+#else
+
+// Assigns the arguments to registers as in section 6.8.2 of the Procedure
+// Call Standard for the Arm 64-bit Architecture (AAPCS64).
+static void aapcs64_plan_args(native_plan_t *plan, nodeptrs types)
+{
     // Stage A - Initialization
     // This stage is performed exactly once, before processing of the arguments
     // commences.
@@ -67,11 +261,11 @@ bool native_call(slice_t name, void *params, nodeptrs types, void *return_value,
     (void) nprn;
 
     intptr_t offset = 0;
-    trace("native_call(" SL ")", SLARG(name));
+    trace("native_plan(" SL ")", SLARG(plan->name));
     for (size_t ix = 0; ix < types.len; ++ix) {
         nodeptr type = types.items[ix];
 
-        trace("native_call param [%zu]: %zu `" SL "`", ix, type.value, SLARG(type_to_string(type)));
+        trace("native_plan param [%zu]: %zu `" SL "`", ix, type.value, SLARG(type_to_string(type)));
         // Stage B – Pre-padding and extension of arguments
         // For each argument in the list the first matching rule from the
         // following list is applied. If no rule matches the argument is used
@@ -124,12 +318,7 @@ bool native_call(slice_t name, void *params, nodeptrs types, void *return_value,
         switch (typ->kind) {
         case TYPK_FloatType: {
             if (nsrn < 8) {
-                if (typ->float_width == FW_32) {
-                    t.d[nsrn] = as_T(float, params, offset);
-                } else {
-                    t.d[nsrn] = as_T(double, params, offset);
-                }
-                ++nsrn;
+                native_plan_arg(plan, (typ->float_width == FW_32) ? NK_F32 : NK_F64, nsrn++, offset, 1);
             }
         } break;
 
@@ -193,7 +382,7 @@ bool native_call(slice_t name, void *params, nodeptrs types, void *return_value,
 #undef S
 #define S(EType, CType)            \
     if (type.value == EType.value) \
-        t.x[ngrn] = as_T(CType, params, offset);
+        native_plan_arg(plan, NK_##EType, ngrn, offset, 1);
                 INTTYPES(S)
 #undef S
                 ++ngrn;
@@ -202,8 +391,7 @@ bool native_call(slice_t name, void *params, nodeptrs types, void *return_value,
 
         case TYPK_BoolType:
             if (ngrn < 8) {
-                t.x[ngrn] = as_T(bool, params, offset);
-                ++ngrn;
+                native_plan_arg(plan, NK_Bool, ngrn++, offset, 1);
             }
             break;
 
@@ -211,33 +399,30 @@ bool native_call(slice_t name, void *params, nodeptrs types, void *return_value,
         case TYPK_ReferenceType:
         case TYPK_ZeroTerminatedArray:
             if (ngrn < 8) {
-                t.x[ngrn] = (intptr_t) (as_T(void *, params, offset));
-                ++ngrn;
+                native_plan_arg(plan, NK_Words, ngrn++, offset, 1);
             }
             break;
 
         case TYPK_SliceType:
             if (ngrn < 7) {
-                slice_t s = as_T(slice_t, params, offset);
-                t.x[ngrn++] = (intptr_t) (s.items);
-                t.x[ngrn++] = s.len;
+                // Passed as items and len, the order of the fields of
+                // slice_t, and likewise for the other composites.
+                native_plan_arg(plan, NK_Words, ngrn, offset, 2);
+                ngrn += 2;
             }
             break;
 
         case TYPK_DynArrayType:
             if (ngrn < 6) {
-                generic_da_t da = as_T(generic_da_t, params, offset);
-                t.x[ngrn++] = (intptr_t) (da.items);
-                t.x[ngrn++] = da.len;
-                t.x[ngrn++] = da.capacity;
+                native_plan_arg(plan, NK_Words, ngrn, offset, 3);
+                ngrn += 3;
             }
             break;
 
         case TYPK_ArrayType:
             if (ngrn < 7) {
-                array_t a = as_T(array_t, params, offset);
-                t.x[ngrn++] = (intptr_t) (a.items);
-                t.x[ngrn++] = a.size;
+                native_plan_arg(plan, NK_Words, ngrn, offset, 2);
+                ngrn += 2;
             }
             break;
 
@@ -295,8 +480,93 @@ bool native_call(slice_t name, void *params, nodeptrs types, void *return_value,
             // is incremented by the size of the argument. The argument has now been
             // allocated.
         }
+        if (plan->num_args != ix + 1) {
+            fatal("Parameter %zu of native function `" SL "` does not fit in the argument registers", ix, SLARG(plan->name));
+        }
         offset += align_at(8, type_size_of(type));
     }
+    plan->depth = offset / sizeof(intptr_t);
+}
+
+#endif
+
+// Resolves the native function `name` and works out, once, how the
+// arguments of a call to it move from the parameter block to the
+// registers, and how the result comes back.
+native_plan_t *native_plan(slice_t name, nodeptrs types, nodeptr return_type)
+{
+    if (types.len > NATIVE_MAX_ARGS) {
+        fatal("Can't do native calls with more than %d parameters", NATIVE_MAX_ARGS);
+    }
+    native_plan_t *plan = (native_plan_t *) allocator_alloc(sizeof(native_plan_t));
+    plan->name = name;
+    plan->intrinsic = intrinsic_lookup(name);
+    if (plan->intrinsic == NULL) {
+        function_result_t res = resolve_function(name);
+        if (!res.ok || res.success == NULL) {
+            fatal("Function `" SL "` not found", SLARG(name));
+        }
+        plan->fnc = res.success;
+    }
+    native_plan_return(plan, return_type);
+#if defined(__x86_64__)
+    sysv_plan_args(plan, types);
+#else
+    aapcs64_plan_args(plan, types);
+#endif
+    return plan;
+}
+
+void native_plan_free(native_plan_t *plan)
+{
+    allocator_free((char *) plan);
+}
+
+void native_plan_call(native_plan_t const *plan, void *params, void *return_value)
+{
+    uint64_t     stack[plan->stack_words + 1];
+    trampoline_t t = { .fnc = plan->fnc, .stack = stack, .stack_words = plan->stack_words };
+    for (size_t ix = 0; ix < plan->num_args; ++ix) {
+        native_arg_t const *arg = plan->args + ix;
+        void               *slot = t.x + arg->reg;
+        if (arg->stack) {
+            slot = stack + arg->reg;
+        } else if (arg->kind == NK_F32 || arg->kind == NK_F64) {
+            slot = t.d + arg->reg;
+        }
+        switch (arg->kind) {
+#undef S
+#define S(EType, CType)                                                    \
+    case NK_##EType:                                                       \
+        set_T(uint64_t, slot, (uint64_t) as_T(CType, params, arg->offset)); \
+        break;
+            INTTYPES(S)
+#undef S
+        case NK_Bool:
+            set_T(uint64_t, slot, as_T(bool, params, arg->offset));
+            break;
+        case NK_F32:
+            // The float goes in the low 32 bits of the register
+            set_T(uint64_t, slot, 0);
+            set_T(float, slot, as_T(float, params, arg->offset));
+            break;
+        case NK_F64:
+            set_T(double, slot, as_T(double, params, arg->offset));
+            break;
+        case NK_Words:
+            memcpy(slot, (char *) params + arg->offset, arg->words * sizeof(uint64_t));
+            break;
+        default:
+            UNREACHABLE();
+        }
+    }
+    if (plan->ret_indirect) {
+#if defined(__x86_64__)
+        t.x[0] = (uint64_t) return_value;
+#else
+        t.result = return_value;
+#endif
+    }
 
     trace("Trampoline:");
     trace("  Function: 0x%lx", (intptr_t) (t.fnc));
@@ -305,46 +575,73 @@ bool native_call(slice_t name, void *params, nodeptrs types, void *return_value,
         trace("    %zu: 0x%zx", ix, (size_t) t.x[ix]);
     }
 
-    int trampoline_result = trampoline(&t);
-    if (trampoline_result != 0) {
-        fatal("Error executing `" SL "`. Trampoline returned %d", SLARG(name), trampoline_result);
+    if (plan->intrinsic != NULL) {
+        plan->intrinsic(&t);
+    } else {
+        int trampoline_result = trampoline(&t);
+        if (trampoline_result != 0) {
+            fatal("Error executing `" SL "`. Trampoline returned %d", SLARG(plan->name), trampoline_result);
+        }
     }
     trace("  Integer result: %zu", (size_t) t.int_return_value);
 
-    type_t *ret = get_type(return_type);
-    switch (ret->kind) {
-    case TYPK_IntType: {
+    switch (plan->ret) {
 #undef S
 #define S(EType, CType)                                         \
-    if (return_type.value == EType.value) {                     \
+    case NK_##EType:                                            \
         set_T(CType, return_value, (CType) t.int_return_value); \
-        return true;                                            \
-    }
+        break;
         INTTYPES(S)
 #undef S
-        UNREACHABLE();
-    } break;
-    case TYPK_FloatType: {
-        if (return_type.value == F32.value) {
-            set_T(float, return_value, (float) t.double_return_value);
-            return true;
+    case NK_F32:
+        set_T(float, return_value, as_T(float, &t.double_return_value, 0));
+        break;
+    case NK_F64:
+        set_T(double, return_value, t.double_return_value);
+        break;
+    case NK_Bool:
+        set_T(bool, return_value, (bool) t.int_return_value);
+        break;
+    case NK_Words: {
+        if (plan->ret_indirect) {
+            break;
         }
-        if (return_type.value == F64.value) {
-            set_T(double, return_value, (double) t.double_return_value);
-            return true;
+        uint64_t ints[2] = { t.int_return_value, t.int_return_value_2 };
+        double   doubles[2] = { t.double_return_value, t.double_return_value_2 };
+        size_t   num_int = 0;
+        size_t   num_sse = 0;
+        for (size_t word = 0; word < plan->ret_words; ++word) {
+            char *dest = (char *) return_value + word * sizeof(uint64_t);
+            if (plan->ret_class[word] == NK_U64) {
+                set_T(uint64_t, dest, ints[num_int++]);
+            } else if (plan->ret_class[word] == NK_F64) {
+                set_T(double, dest, doubles[num_sse++]);
+            }
         }
-        UNREACHABLE();
     } break;
-    case TYPK_BoolType:
-        set_T(bool, return_value, (bool) t.int_return_value);
-        return true;
-    case TYPK_PointerType:
-    case TYPK_ReferenceType:
-        set_T(void *, return_value, (void *) t.int_return_value);
-        return true;
-    case TYPK_VoidType:
-        return true;
+    case NK_Void:
+        break;
     default:
         UNREACHABLE();
     }
 }
+
+// Resolves the functions of all ForeignFunction declarations that aren't
+// intrinsics, so that the resolver's cache is filled before any of them is
+// called. Returns the number of functions that could not be found.
+size_t native_preload(nodes_t nodes)
+{
+    size_t missing = 0;
+    dynarr_foreach(node_t, n, &nodes)
+    {
+        if (n->node_type != NT_ForeignFunction || intrinsic_lookup(n->identifier.id) != NULL) {
+            continue;
+        }
+        function_result_t res = resolve_function(n->identifier.id);
+        if (!res.ok || res.success == NULL) {
+            fprintf(stderr, "Foreign function `" SL "` not found\n", SLARG(n->identifier.id));
+            ++missing;
+        }
+    }
+    return missing;
+}
@@ -5,12 +5,80 @@
  */
 
 #include "da.h"
+#include "node.h"
 #include "resolve.h"
 #include "slice.h"
+#include "type.h"
 
 #ifndef __NATIVE_H__
 #define __NATIVE_H__
 
-bool native_call(slice_t name, void *params, nodeptrs types, void *return_value, nodeptr return_type);
+#define NATIVE_MAX_ARGS 16
+
+// Shared with the trampolines in rt/arch, which use the field offsets in
+// the comments.
+typedef struct _trampoline {
+    void_t    fnc;                   // 0
+    uint64_t  x[8];                  // 8
+    double    d[8];                  // 72
+    uint64_t  int_return_value;      // 136: x0 or rax
+    double    double_return_value;   // 144: d0 or xmm0
+    uint64_t  int_return_value_2;    // 152: x1 or rdx
+    double    double_return_value_2; // 160: d1 or xmm1
+    void     *result;                // 168: x8 on arm64
+    uint64_t *stack;                 // 176: Words passed on the stack
+    uint64_t  stack_words;           // 184
+} trampoline_t;
+
+// A runtime function implemented in the compiler. It takes its arguments
+// from and returns its result in the registers of the trampoline block,
+// like the assembly version in libelrrt does.
+typedef void (*intrinsic_t)(trampoline_t *t);
+
+// How an argument is moved from the parameter block into a register or
+// stack slot, and how the result is moved out of the return registers.
+typedef enum _native_kind {
+#undef S
+#define S(EType, CType) NK_##EType,
+    INTTYPES(S)
+#undef S
+    NK_Bool,
+    NK_F32,
+    NK_F64,
+    NK_Words,
+    NK_Void,
+} native_kind_t;
+
+typedef struct _native_arg {
+    native_kind_t kind;
+    bool          stack;  // Passed on the stack, and reg is the word index there
+    uint16_t      reg;    // x register, or d register for NK_F32 and NK_F64
+    uint16_t      words;  // Number of words filled with NK_Words
+    uint32_t      offset; // Offset of the argument in the parameter block
+} native_arg_t;
+
+// The marshalling plan of a native call, made once per call site by
+// native_plan. Every argument occupies a multiple of 8 bytes in the
+// parameter block. An argument split over integer and floating point
+// registers takes an entry in args for every word.
+typedef struct _native_plan {
+    void_t        fnc;
+    intrinsic_t   intrinsic; // Called instead of fnc if not NULL
+    slice_t       name;
+    size_t        depth; // Size of the parameter block in words
+    native_kind_t ret;
+    size_t        ret_words;    // Size of an NK_Words result in words
+    native_kind_t ret_class[2]; // NK_U64 or NK_F64 for every word returned in registers
+    bool          ret_indirect; // Result is written to memory provided by the caller
+    size_t        stack_words;
+    size_t        num_args;
+    native_arg_t  args[2 * NATIVE_MAX_ARGS];
+} native_plan_t;
+
+native_plan_t *native_plan(slice_t name, nodeptrs types, nodeptr return_type);
+void           native_plan_free(native_plan_t *plan);
+void           native_plan_call(native_plan_t const *plan, void *params, void *return_value);
+size_t         native_preload(nodes_t nodes);
+intrinsic_t    intrinsic_lookup(slice_t name);
 
 #endif /* __NATIVE_H__ */
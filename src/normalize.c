@@ -250,8 +250,10 @@ nodeptr Number_normalize(parser_t *parser, nodeptr n)
 
 nodeptr Program_normalize(parser_t *parser, nodeptr n)
 {
+    // Normalizing a @comptime block parses its text as a snippet, which is
+    // appended to program.modules and can move its items.
     node_t      *program = N(n);
-    nodeptrs     mods = program->program.modules;
+    nodeptrs     mods = dynarr_copy(nodeptrs, nodeptr, program->program.modules);
     opt_nodeptrs new_block = normalize_block(parser, n, offsetof(node_t, program.statements));
 
     nodeptrs new_mods_arr = { 0 };
@@ -265,6 +267,7 @@ nodeptr Program_normalize(parser_t *parser, nodeptr n)
     if (!dynarr_eq(new_mods_arr, mods)) {
         new_mods = OPTVAL(nodeptrs, new_mods_arr);
     }
+    dynarr_free(&mods);
 
     if (new_block.ok || new_mods.ok) {
         node_t new_prog = *N(n);
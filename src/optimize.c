@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "da.h"
+#include "ir.h"
+#include "slice.h"
+#include "type.h"
+
+// Appends `op` to `ops`, folding it into the operations at the tail of
+// `ops` if possible. Returns true if anything was folded or dropped.
+static bool peephole_append(operations_t *ops, operation_t op)
+{
+    operation_t *b = (ops->len > 0) ? dynarr_back(ops) : NULL;
+    switch (op.type) {
+    case IRO_DeclVar:
+        return true;
+    case IRO_Dereference:
+        if (b != NULL && b->type == IRO_PushVarAddress) {
+            var_path_t var = b->PushVarAddress;
+            var.type = op.Dereference;
+            *b = (operation_t) { .type = IRO_PushValue, .node = b->node, .PushValue = var };
+            return true;
+        }
+        break;
+    case IRO_Discard:
+        if (b != NULL && (b->type == IRO_PushConstant || b->type == IRO_PushValue || b->type == IRO_PushVarAddress)) {
+            dynarr_pop(ops);
+            return true;
+        }
+        break;
+    case IRO_BinaryOperator:
+        if (ops->len > 1 && b->type == IRO_PushConstant && b[-1].type == IRO_PushValue) {
+            var_const_op_t fused = {
+                .var = b[-1].PushValue,
+                .constant = b->PushConstant,
+                .op = op.BinaryOperator,
+            };
+            dynarr_pop(ops);
+            *dynarr_back(ops) = (operation_t) { .type = IRO_BinaryOperatorVarConst, .node = op.node, .BinaryOperatorVarConst = fused };
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+    dynarr_append(ops, op);
+    return false;
+}
+
+static opt_size_t find_label(operations_t *ops, uint64_t label)
+{
+    for (size_t ix = 0; ix < ops->len; ++ix) {
+        if (ops->items[ix].type == IRO_Label && ops->items[ix].Label == label) {
+            return OPTVAL(size_t, ix);
+        }
+    }
+    return OPTNULL(size_t);
+}
+
+// Returns the index of the first operation at or after `ix` that isn't
+// a label.
+static size_t skip_labels(operations_t *ops, size_t ix)
+{
+    while (ix < ops->len && ops->items[ix].type == IRO_Label) {
+        ++ix;
+    }
+    return ix;
+}
+
+// Retargets jumps to jumps to the final destination.
+static bool thread_jumps(operations_t *ops)
+{
+    bool changed = false;
+    for (size_t ix = 0; ix < ops->len; ++ix) {
+        operation_t *op = ops->items + ix;
+        if (op->type != IRO_Jump && op->type != IRO_JumpF && op->type != IRO_JumpT) {
+            continue;
+        }
+        for (size_t hops = 0; hops < ops->len; ++hops) {
+            opt_size_t target = find_label(ops, op->Jump.label);
+            assert(target.ok);
+            size_t dest = skip_labels(ops, target.value);
+            if (dest >= ops->len || ops->items[dest].type != IRO_Jump || ops->items[dest].Jump.label == op->Jump.label) {
+                break;
+            }
+            op->Jump.label = ops->items[dest].Jump.label;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Returns true if the operation at `ix` is an unconditional jump to the
+// next operation that isn't a label.
+static bool is_jump_to_next(operations_t *ops, size_t ix)
+{
+    if (ops->items[ix].type != IRO_Jump) {
+        return false;
+    }
+    opt_size_t target = find_label(ops, ops->items[ix].Jump.label);
+    assert(target.ok);
+    return target.value > ix && skip_labels(ops, ix + 1) > target.value;
+}
+
+static bool is_label_referenced(operations_t *ops, uint64_t label)
+{
+    for (size_t ix = 0; ix < ops->len; ++ix) {
+        operation_t *op = ops->items + ix;
+        switch (op->type) {
+        case IRO_Jump:
+        case IRO_JumpF:
+        case IRO_JumpT:
+            if (op->Jump.label == label) {
+                return true;
+            }
+            break;
+        case IRO_Break:
+            if (op->Break.label == label || op->Break.scope_end == label) {
+                return true;
+            }
+            break;
+        case IRO_ScopeEnd:
+            if (op->ScopeEnd.enclosing_end == label) {
+                return true;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+static size_t optimize_operations(operations_t *ops)
+{
+    size_t before = ops->len;
+    bool   changed;
+    do {
+        changed = thread_jumps(ops);
+        operations_t optimized = { 0 };
+        for (size_t ix = 0; ix < ops->len; ++ix) {
+            operation_t *op = ops->items + ix;
+            if ((op->type == IRO_Label && !is_label_referenced(ops, op->Label)) || is_jump_to_next(ops, ix)) {
+                changed = true;
+                continue;
+            }
+            changed |= peephole_append(&optimized, *op);
+        }
+        dynarr_free(ops);
+        *ops = optimized;
+    } while (changed);
+    return before - ops->len;
+}
+
+static bool same_variable(var_path_t *v1, var_path_t *v2)
+{
+    return slice_eq(v1->name, v2->name) && v1->offset == v2->offset;
+}
+
+// Replaces sequences of operations that comptime loops execute a lot by
+// superinstructions, so the interpreter dispatches once for the whole
+// sequence. `elrond --mine-sequences` lists candidate sequences. This runs
+// after the other passes, which don't know the fused operations.
+static size_t fuse_superinstructions(operations_t *ops)
+{
+    size_t       before = ops->len;
+    operations_t fused = { 0 };
+    for (size_t ix = 0; ix < ops->len; ++ix) {
+        operation_t *op = ops->items + ix;
+        operation_t *next = (ix + 1 < ops->len) ? op + 1 : NULL;
+        operation_t *third = (ix + 2 < ops->len) ? op + 2 : NULL;
+        switch (op->type) {
+        case IRO_PushVarAddress:
+            if (next != NULL && next->type == IRO_AssignValue) {
+                assign_var_op_t assign = { .var = op->PushVarAddress, .type = next->AssignValue };
+                // An assignment whose value is used reads the variable
+                // right back.
+                if (third != NULL && third->type == IRO_PushValue && same_variable(&third->PushValue, &assign.var) && third->PushValue.type.value == assign.type.value) {
+                    dynarr_append_s(operation_t, &fused, .type = IRO_AssignVarKeep, .node = op->node, .AssignVarKeep = assign);
+                    ix += 2;
+                    continue;
+                }
+                dynarr_append_s(operation_t, &fused, .type = IRO_AssignVar, .node = op->node, .AssignVar = assign);
+                ix += 1;
+                continue;
+            }
+            break;
+        case IRO_PushValue:
+            if (third != NULL && next->type == IRO_PushValue && third->type == IRO_BinaryOperator) {
+                var_var_op_t binop = { .lhs = op->PushValue, .rhs = next->PushValue, .op = third->BinaryOperator };
+                dynarr_append_s(operation_t, &fused, .type = IRO_BinaryOperatorVarVar, .node = third->node, .BinaryOperatorVarVar = binop);
+                ix += 2;
+                continue;
+            }
+            break;
+        case IRO_BinaryOperatorVarConst:
+            if (next != NULL && next->type == IRO_JumpF) {
+                var_const_jump_op_t cond = { .cond = op->BinaryOperatorVarConst, .jump = next->JumpF };
+                dynarr_append_s(operation_t, &fused, .type = IRO_BinaryOperatorVarConstJumpF, .node = op->node, .BinaryOperatorVarConstJumpF = cond);
+                ix += 1;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+        dynarr_append(&fused, *op);
+    }
+    dynarr_free(ops);
+    *ops = fused;
+    return before - ops->len;
+}
+
+void optimize_ir(ir_generator_t *gen)
+{
+    for (size_t ix = gen->linked; ix < gen->ir_nodes.len; ++ix) {
+        ir_node_t *node = gen->ir_nodes.items + ix;
+        size_t     removed = optimize_operations(ir_node_operations(node));
+        removed += fuse_superinstructions(ir_node_operations(node));
+        trace("optimize_ir: removed %zu operations from IR node %zu", removed, ix);
+    }
+}
@@ -42,6 +42,7 @@ typedef struct _read_pipe {
 typedef struct _read_pipes {
     pthread_mutex_t mutex;
     pthread_cond_t  condition;
+    pthread_t       thread;
     read_pipe_t     pipes[2];
 } read_pipes_t;
 
@@ -119,6 +120,8 @@ int              process_write(process_t *proc, slice_t sv);
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #define PROCESS_PIPE_END_READ 0
@@ -130,9 +133,28 @@ void sigchld(int sig)
     (void) sig;
 }
 
+// Processes can be started from several threads at the same time. The pipe
+// ends are closed on exec, so that a child doesn't keep the pipes of
+// another thread's child open, and process_start holds process_mutex until
+// that is set up.
+static pthread_mutex_t process_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int pipe_initialize(int p[2])
+{
+    if (pipe(p) != 0) {
+        return -1;
+    }
+    for (int ix = 0; ix < 2; ++ix) {
+        if (fcntl(p[ix], F_SETFD, FD_CLOEXEC) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int read_pipe_initialize(read_pipe_t *p)
 {
-    return pipe(p->pipe);
+    return pipe_initialize(p->pipe);
 }
 
 int read_pipe_connect(read_pipe_t *p, int fd)
@@ -180,12 +202,15 @@ void *read_pipes_read(void *arg)
 {
     read_pipes_t *p = (read_pipes_t *) arg;
     struct pollfd poll_fd[2] = { 0 };
+    int           open_pipes = 2;
     for (int ix = 0; ix < 2; ++ix) {
         poll_fd[ix].fd = p->pipes[ix].fd;
         poll_fd[ix].events = POLLIN;
     }
 
-    for (bool done = false; !done;) {
+    // Read until the child has closed both stdout and stderr. poll ignores
+    // the entries with a negative fd.
+    while (open_pipes > 0) {
         if (poll(poll_fd, 2, -1) == -1) {
             if (errno == EINTR) {
                 continue;
@@ -198,9 +223,9 @@ void *read_pipes_read(void *arg)
                     fatal("read_pipes_read: drain: %s\n", strerror(errno));
                 }
             }
-            if (poll_fd[ix].revents & POLLHUP) {
-                done = true;
-                break;
+            if (poll_fd[ix].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+                poll_fd[ix].fd = -1;
+                --open_pipes;
             }
         }
     }
@@ -220,16 +245,17 @@ void read_pipes_connect_parent(read_pipes_t *p)
     if ((errno = pthread_mutex_init(&p->mutex, &attr)) != 0) {
         fatal("read_pipes_connect_parent: pthread_mutex_init: %s\n", strerror(errno));
     }
-    pthread_t thread;
+    if ((errno = pthread_cond_init(&p->condition, NULL)) != 0) {
+        fatal("read_pipes_connect_parent: pthread_cond_init: %s\n", strerror(errno));
+    }
     pthread_mutexattr_destroy(&attr);
     if ((errno = pthread_create(
-             &thread,
+             &p->thread,
              NULL,
              (threadproc_t) read_pipes_read, p))
         != 0) {
         fatal("read_pipes_connect_parent: pthread_create: %s\n", strerror(errno));
     }
-    pthread_detach(thread);
 }
 
 void read_pipes_connect_child(read_pipes_t *p, int out, int err)
@@ -302,6 +328,9 @@ int read_pipes_drain(read_pipes_t *p, channel_t channel)
         if (errno == EINTR) {
             continue;
         }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
         pthread_mutex_unlock(&p->mutex);
         return -1;
     }
@@ -317,7 +346,7 @@ int read_pipes_drain(read_pipes_t *p, channel_t channel)
 
 int write_pipe_initialize(write_pipe_t *p)
 {
-    return pipe(p->pipe);
+    return pipe_initialize(p->pipe);
 }
 
 void write_pipe_close(write_pipe_t *p)
@@ -404,17 +433,21 @@ int process_start(process_t *proc)
 
     // signal(SIGCHLD, SIG_IGN);
     int err;
+    pthread_mutex_lock(&process_mutex);
     if ((err = write_pipe_initialize(&proc->in)) != 0) {
+        pthread_mutex_unlock(&process_mutex);
         return err;
     }
     proc->out_pipes.pipes[PROCESS_PIPE_STDOUT].on_read = proc->on_stdout_read;
     proc->out_pipes.pipes[PROCESS_PIPE_STDERR].on_read = proc->on_stderr_read;
     if ((err = read_pipes_initialize(&proc->out_pipes)) != 0) {
+        pthread_mutex_unlock(&process_mutex);
         return err;
     }
 
     proc->pid = fork();
     if (proc->pid == -1) {
+        pthread_mutex_unlock(&process_mutex);
         return -1;
     }
     if (proc->pid == 0) {
@@ -424,6 +457,7 @@ int process_start(process_t *proc)
         execvp(argv[0], (char *const *) argv);
         fatal("execvp(" SL ") failed: %s\n", SLARG(proc->command), strerror(errno));
     }
+    pthread_mutex_unlock(&process_mutex);
     write_pipe_connect_parent(&proc->in);
     read_pipes_connect_parent(&proc->out_pipes);
     return 0;
@@ -440,6 +474,11 @@ process_result_t process_wait(process_t *proc)
     }
     proc->pid = 0;
     write_pipe_close(&proc->in);
+
+    // The output of the process is complete once the thread reading it has
+    // seen both pipes close.
+    pthread_join(proc->out_pipes.thread, NULL);
+    read_pipes_close(&proc->out_pipes);
     if (!WIFEXITED(exit_code)) {
         return RESERR(process_result_t, exit_code);
     }
@@ -483,6 +522,12 @@ int main()
         process_execute(&proc);
         assert(slice_eq(C(HELLO_WORLD "\n"), sb_as_slice(proc.out_pipes.pipes[0].text)));
     }
+    {
+        process_t proc = process_create("sh", "-c", "echo out; echo err >&2");
+        process_execute(&proc);
+        assert(slice_eq(C("out\n"), sb_as_slice(proc.out_pipes.pipes[PROCESS_PIPE_STDOUT].text)));
+        assert(slice_eq(C("err\n"), sb_as_slice(proc.out_pipes.pipes[PROCESS_PIPE_STDERR].text)));
+    }
     {
         process_t proc = {
             .command = C("dc"),
@@ -0,0 +1,567 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "da.h"
+#include "interpreter.h"
+#include "ir.h"
+
+// Instrumenting profiler for comptime code. With --profile-comptime the
+// interpreter reports every operation it executes, and every module and
+// function it enters and leaves, to profile_callback. Without it the
+// interpreter runs the loop without callbacks and this costs nothing.
+//
+// Time is the wall clock time between the callbacks before and after an
+// operation. An operation's own time excludes the time of the operations
+// executed by the functions it calls.
+//
+// With --sample-comptime the interpreter instead runs the operations
+// without callbacks, only keeping the ip of every context up to date. A
+// SIGPROF handler copies the call stack into a ring buffer
+// PROFILE_SAMPLE_HZ times per second of CPU time. The samples are mapped
+// to functions and source lines while the IR they refer to still exists,
+// and counted in the same tables as the instrumented profile, one
+// nanosecond per sample. The kernel may deliver fewer signals than asked
+// for, so the report spreads the CPU time measured while sampling over
+// the samples.
+
+typedef struct _profile_counter {
+    uint64_t count;
+    uint64_t nanos;
+} profile_counter_t;
+
+typedef struct _profile_function {
+    slice_t           name;
+    uint64_t          calls;
+    profile_counter_t ops;
+} profile_function_t;
+
+typedef DA(profile_function_t) profile_functions_t;
+
+typedef struct _profile_line {
+    size_t            function;
+    size_t            line;
+    profile_counter_t ops;
+} profile_line_t;
+
+typedef DA(profile_line_t) profile_lines_t;
+
+// Node in the tree of call stacks. Node 0 is the root, and has no
+// function.
+typedef struct _profile_stack {
+    size_t   parent;
+    size_t   function;
+    uint64_t nanos;
+} profile_stack_t;
+
+typedef DA(profile_stack_t) profile_stacks_t;
+
+// A module or function being executed, and when it was entered.
+typedef struct _profile_frame {
+    size_t   stack;
+    uint64_t entered;
+} profile_frame_t;
+
+typedef DA(profile_frame_t) profile_frames_t;
+
+// An operation being executed. `callees` is the time spent in the
+// functions it called.
+typedef struct _profile_timer {
+    uint64_t start;
+    uint64_t callees;
+} profile_timer_t;
+
+typedef DA(profile_timer_t) profile_timers_t;
+
+// Hash index into one of the tables above, so that finding a function, a
+// call stack or a line doesn't scan the table. The index uses open
+// addressing with linear probing, and is kept at most half full.
+typedef struct _profile_slot {
+    uint64_t hash;
+    size_t   entry; // Index into the table plus one, 0 if the slot is free
+} profile_slot_t;
+
+typedef struct _profile_index {
+    profile_slot_t *slots;
+    size_t          capacity;
+    size_t          len;
+} profile_index_t;
+
+typedef bool (*profile_match_t)(size_t entry, void const *key);
+
+#define PROFILE_REPORT_MAX 20
+#define PROFILE_SAMPLE_HZ 1000
+#define PROFILE_SAMPLE_DEPTH_MAX 256
+#define PROFILE_RING_WORDS (1ull << 20)
+
+#undef S
+#define S(O, T) +1
+enum { PROFILE_NUM_OPS = 0 IROPERATIONTYPES(S) };
+#undef S
+
+static profile_counter_t   op_counters[PROFILE_NUM_OPS] = { 0 };
+static profile_functions_t functions = { 0 };
+static profile_lines_t     lines = { 0 };
+static profile_stacks_t    stacks = { 0 };
+static profile_frames_t    frames = { 0 };
+static profile_timers_t    timers = { 0 };
+static profile_index_t     function_index = { 0 };
+static profile_index_t     stack_index = { 0 };
+static profile_index_t     line_index = { 0 };
+static bool                sampling = false;
+static uint64_t            sampling_started = 0;
+static uint64_t            sampled_cpu_nanos = 0;
+static uint64_t            samples = 0;
+
+// Single producer, single consumer ring buffer of samples. The producer
+// is the signal handler, the consumer profile_sampling_drain. A sample is
+// the number of frames n, followed by n pairs of IR node and ip,
+// innermost last. `ring_head` and `ring_tail` count words and only ever
+// increase.
+static uint64_t                ring[PROFILE_RING_WORDS];
+static _Atomic uint64_t        ring_head = 0;
+static _Atomic uint64_t        ring_tail = 0;
+static _Atomic uint64_t        samples_dropped = 0;
+static interpreter_t *_Atomic sampled_interpreter = NULL;
+
+static uint64_t profile_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t profile_cpu_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// Converts the time in the tables to nanoseconds.
+static uint64_t profile_nanos(uint64_t nanos)
+{
+    if (!sampling || samples == 0) {
+        return nanos;
+    }
+    return (uint64_t) ((double) nanos * (double) sampled_cpu_nanos / (double) samples);
+}
+
+static slice_t ir_node_name(ir_node_t *node)
+{
+    switch (node->type) {
+    case IRN_Function:
+        return node->function.name;
+    case IRN_Module:
+        return node->module.name;
+    case IRN_Program:
+        return node->program.name;
+    default:
+        UNREACHABLE();
+    }
+}
+
+static uint64_t profile_hash_name(slice_t name)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t ix = 0; ix < name.len; ++ix) {
+        hash ^= (uint8_t) name.items[ix];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static uint64_t profile_hash_pair(uint64_t a, uint64_t b)
+{
+    uint64_t hash = (a ^ (b * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+    return hash ^ (hash >> 32);
+}
+
+static void profile_index_grow(profile_index_t *index)
+{
+    size_t          capacity = (index->capacity == 0) ? 64 : 2 * index->capacity;
+    profile_slot_t *slots = (profile_slot_t *) allocator_alloc(capacity * sizeof(profile_slot_t));
+    for (size_t ix = 0; ix < index->capacity; ++ix) {
+        profile_slot_t *slot = index->slots + ix;
+        if (slot->entry != 0) {
+            size_t s = slot->hash & (capacity - 1);
+            while (slots[s].entry != 0) {
+                s = (s + 1) & (capacity - 1);
+            }
+            slots[s] = *slot;
+        }
+    }
+    allocator_free((char *) index->slots);
+    index->slots = slots;
+    index->capacity = capacity;
+}
+
+// Returns the slot of the entry `match` accepts for `key`, or the free
+// slot where it goes.
+static profile_slot_t *profile_index_slot(profile_index_t *index, uint64_t hash, profile_match_t match, void const *key)
+{
+    if (2 * (index->len + 1) > index->capacity) {
+        profile_index_grow(index);
+    }
+    size_t ix = hash & (index->capacity - 1);
+    while (index->slots[ix].entry != 0) {
+        if (index->slots[ix].hash == hash && match(index->slots[ix].entry - 1, key)) {
+            break;
+        }
+        ix = (ix + 1) & (index->capacity - 1);
+    }
+    return index->slots + ix;
+}
+
+static bool profile_function_matches(size_t entry, void const *key)
+{
+    return slice_eq(functions.items[entry].name, *(slice_t const *) key);
+}
+
+static size_t profile_function(slice_t name)
+{
+    uint64_t        hash = profile_hash_name(name);
+    profile_slot_t *slot = profile_index_slot(&function_index, hash, profile_function_matches, &name);
+    if (slot->entry == 0) {
+        dynarr_append_s(profile_function_t, &functions, .name = name);
+        *slot = (profile_slot_t) { .hash = hash, .entry = functions.len };
+        ++function_index.len;
+    }
+    return slot->entry - 1;
+}
+
+static bool profile_stack_matches(size_t entry, void const *key)
+{
+    profile_stack_t const *s = (profile_stack_t const *) key;
+    return stacks.items[entry].parent == s->parent && stacks.items[entry].function == s->function;
+}
+
+static size_t profile_stack(size_t parent, size_t function)
+{
+    if (stacks.len == 0) {
+        dynarr_append_s(profile_stack_t, &stacks, 0);
+    }
+    profile_stack_t key = { .parent = parent, .function = function };
+    uint64_t        hash = profile_hash_pair(parent, function);
+    profile_slot_t *slot = profile_index_slot(&stack_index, hash, profile_stack_matches, &key);
+    if (slot->entry == 0) {
+        dynarr_append(&stacks, key);
+        *slot = (profile_slot_t) { .hash = hash, .entry = stacks.len };
+        ++stack_index.len;
+    }
+    return slot->entry - 1;
+}
+
+static void profile_enter(interpreter_t *interpreter, nodeptr ir)
+{
+    size_t parent = (frames.len > 0) ? dynarr_back(&frames)->stack : 0;
+    size_t function = profile_function(ir_node_name(interpreter->gen->ir_nodes.items + ir.value));
+    ++functions.items[function].calls;
+    size_t stack = profile_stack(parent, function);
+    dynarr_append_s(profile_frame_t, &frames, .stack = stack, .entered = profile_now());
+}
+
+// Everything between entering and leaving a function, including the time
+// the profiler takes, is excluded from the time of the calling operation.
+static void profile_leave()
+{
+    profile_frame_t frame = dynarr_popback(profile_frame_t, &frames);
+    if (timers.len > 0) {
+        dynarr_back(&timers)->callees += profile_now() - frame.entered;
+    }
+}
+
+static bool profile_line_matches(size_t entry, void const *key)
+{
+    profile_line_t const *l = (profile_line_t const *) key;
+    return lines.items[entry].function == l->function && lines.items[entry].line == l->line;
+}
+
+static void profile_count_line(size_t function, size_t line, uint64_t nanos)
+{
+    profile_line_t  key = { .function = function, .line = line };
+    uint64_t        hash = profile_hash_pair(function, line);
+    profile_slot_t *slot = profile_index_slot(&line_index, hash, profile_line_matches, &key);
+    if (slot->entry == 0) {
+        dynarr_append(&lines, key);
+        *slot = (profile_slot_t) { .hash = hash, .entry = lines.len };
+        ++line_index.len;
+    }
+    profile_line_t *l = lines.items + (slot->entry - 1);
+    ++l->ops.count;
+    l->ops.nanos += nanos;
+}
+
+// Counts an execution or a sample of `op`, executed in the call stack
+// `stack`.
+static void profile_count(interpreter_t *interpreter, size_t stack, operation_t *op, uint64_t nanos)
+{
+    ++op_counters[op->type].count;
+    op_counters[op->type].nanos += nanos;
+    if (stack == 0) {
+        return;
+    }
+    profile_stack_t *s = stacks.items + stack;
+    s->nanos += nanos;
+    ++functions.items[s->function].ops.count;
+    functions.items[s->function].ops.nanos += nanos;
+    if (op->node.ok) {
+        profile_count_line(s->function, parser_node(interpreter->gen->parser, op->node)->location.line + 1, nanos);
+    }
+}
+
+static void profile_operation_done(interpreter_t *interpreter, operation_t *op)
+{
+    uint64_t        now = profile_now();
+    profile_timer_t timer = dynarr_popback(profile_timer_t, &timers);
+    uint64_t        elapsed = now - timer.start;
+    uint64_t        nanos = elapsed - MIN(elapsed, timer.callees);
+    profile_count(interpreter, (frames.len > 0) ? dynarr_back(&frames)->stack : 0, op, nanos);
+}
+
+// Interpreter callback counting operations and the time spent in them.
+// Install it as the interpreter's callback.
+bool profile_callback(interpreter_callback_type_t type, interpreter_t *interpreter, interpreter_callback_payload_t payload)
+{
+    switch (type) {
+    case ICT_StartModule:
+        profile_enter(interpreter, payload.module);
+        break;
+    case ICT_StartFunction:
+        profile_enter(interpreter, payload.function);
+        break;
+    case ICT_EndModule:
+    case ICT_EndFunction:
+        profile_leave();
+        break;
+    case ICT_BeforeOperation:
+        // Take the time last, so that the bookkeeping isn't included.
+        dynarr_append_s(profile_timer_t, &timers, 0);
+        dynarr_back(&timers)->start = profile_now();
+        break;
+    case ICT_AfterOperation:
+        profile_operation_done(interpreter, &payload.op);
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+// SIGPROF handler. Only touches the ring buffer and the call stack of the
+// interpreter, which doesn't move while sampling. The call stack's `len`
+// may already count a context that isn't written yet, so this reads the
+// depth the interpreter publishes after writing it.
+static void profile_sample(int sig)
+{
+    (void) sig;
+    interpreter_t *interpreter = atomic_load_explicit(&sampled_interpreter, memory_order_relaxed);
+    if (interpreter == NULL) {
+        return;
+    }
+    interpreter_contexts_t *call_stack = &interpreter->call_stack;
+    size_t                  len = atomic_load_explicit(&interpreter->sampled_depth, memory_order_acquire);
+    size_t                  depth = MIN(len, PROFILE_SAMPLE_DEPTH_MAX);
+    uint64_t                head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    uint64_t                tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    if (head - tail + 1 + 2 * depth > PROFILE_RING_WORDS) {
+        atomic_fetch_add_explicit(&samples_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    ring[head % PROFILE_RING_WORDS] = depth;
+    for (size_t ix = 0; ix < depth; ++ix) {
+        interpreter_context_t *ctx = call_stack->items + (len - depth + ix);
+        ring[(head + 1 + 2 * ix) % PROFILE_RING_WORDS] = ctx->ir.value;
+        ring[(head + 2 + 2 * ix) % PROFILE_RING_WORDS] = ctx->ip;
+    }
+    atomic_store_explicit(&ring_head, head + 1 + 2 * depth, memory_order_release);
+}
+
+// Counts the samples in the ring buffer. The IR the samples refer to must
+// still exist, so this runs before the interpreter finishes, and whenever
+// it calls a function.
+void profile_sampling_drain(interpreter_t *interpreter)
+{
+    uint64_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    while (tail != head) {
+        size_t       depth = ring[tail % PROFILE_RING_WORDS];
+        size_t       stack = 0;
+        operation_t *op = NULL;
+        for (size_t ix = 0; ix < depth; ++ix) {
+            uint64_t ir = ring[(tail + 1 + 2 * ix) % PROFILE_RING_WORDS];
+            uint64_t ip = ring[(tail + 2 + 2 * ix) % PROFILE_RING_WORDS];
+            if (ir >= interpreter->gen->ir_nodes.len) {
+                // Not a node of this generator. Drop the sample.
+                atomic_fetch_add_explicit(&samples_dropped, 1, memory_order_relaxed);
+                op = NULL;
+                break;
+            }
+            ir_node_t    *node = interpreter->gen->ir_nodes.items + ir;
+            operations_t *ops = ir_node_operations(node);
+            stack = profile_stack(stack, profile_function(ir_node_name(node)));
+            op = (ip < ops->len) ? ops->items + ip : NULL;
+        }
+        if (op != NULL) {
+            profile_count(interpreter, stack, op, 1);
+            ++samples;
+        }
+        tail += 1 + 2 * depth;
+    }
+    atomic_store_explicit(&ring_tail, tail, memory_order_release);
+}
+
+// Starts sampling the call stack of `interpreter`. The call stack must
+// have room for INTERPRETER_MAX_CALL_DEPTH contexts, so that it isn't
+// reallocated while the signal handler reads it.
+void profile_sampling_start(interpreter_t *interpreter)
+{
+    assert(atomic_load(&sampled_interpreter) == NULL);
+    assert(interpreter->call_stack.capacity > INTERPRETER_MAX_CALL_DEPTH);
+    sampling = true;
+    struct sigaction action = { .sa_handler = profile_sample, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) {
+        fatal("Could not install SIGPROF handler: %s", strerror(errno));
+    }
+    atomic_store(&sampled_interpreter, interpreter);
+    sampling_started = profile_cpu_now();
+    struct itimerval timer = {
+        .it_interval = { .tv_sec = 0, .tv_usec = 1000000 / PROFILE_SAMPLE_HZ },
+        .it_value = { .tv_sec = 0, .tv_usec = 1000000 / PROFILE_SAMPLE_HZ },
+    };
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        fatal("Could not start profiling timer: %s", strerror(errno));
+    }
+}
+
+void profile_sampling_stop(interpreter_t *interpreter)
+{
+    struct itimerval timer = { 0 };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    atomic_store(&sampled_interpreter, NULL);
+    sampled_cpu_nanos += profile_cpu_now() - sampling_started;
+    profile_sampling_drain(interpreter);
+}
+
+static int counter_cmp(profile_counter_t const *c1, profile_counter_t const *c2)
+{
+    if (c1->nanos != c2->nanos) {
+        return (c1->nanos > c2->nanos) ? -1 : 1;
+    }
+    if (c1->count != c2->count) {
+        return (c1->count > c2->count) ? -1 : 1;
+    }
+    return 0;
+}
+
+static int op_cmp(void const *a, void const *b)
+{
+    return counter_cmp(op_counters + *(size_t const *) a, op_counters + *(size_t const *) b);
+}
+
+static int function_cmp(void const *a, void const *b)
+{
+    return counter_cmp(&((profile_function_t const *) a)->ops, &((profile_function_t const *) b)->ops);
+}
+
+static int line_cmp(void const *a, void const *b)
+{
+    return counter_cmp(&((profile_line_t const *) a)->ops, &((profile_line_t const *) b)->ops);
+}
+
+static double percentage(uint64_t nanos, uint64_t total)
+{
+    return (total > 0) ? 100.0 * (double) nanos / (double) total : 0.0;
+}
+
+// Lists the operation types, functions and source lines that took the
+// most time, most expensive first.
+void profile_report(FILE *f)
+{
+    char const *counted = (sampling) ? "samples" : "executed";
+    uint64_t    total = 0;
+    size_t   ops[PROFILE_NUM_OPS];
+    size_t   num_ops = 0;
+    for (size_t ix = 0; ix < PROFILE_NUM_OPS; ++ix) {
+        total += op_counters[ix].nanos;
+        if (op_counters[ix].count > 0) {
+            ops[num_ops++] = ix;
+        }
+    }
+    qsort(ops, num_ops, sizeof(size_t), op_cmp);
+    fprintf(f, "%12s %12s %7s  %s\n", counted, "ns", "%", "operation");
+    for (size_t ix = 0; ix < num_ops && ix < PROFILE_REPORT_MAX; ++ix) {
+        profile_counter_t *c = op_counters + ops[ix];
+        fprintf(f, "%12llu %12llu %6.2f%%  " SL "\n", (unsigned long long) c->count, (unsigned long long) profile_nanos(c->nanos),
+            percentage(c->nanos, total), SLARG(operation_type_name(ops[ix])));
+    }
+
+    // The line index refers to the lines by position, so sort a copy.
+    profile_lines_t sorted_lines = dynarr_copy(profile_lines_t, profile_line_t, lines);
+    qsort(sorted_lines.items, sorted_lines.len, sizeof(profile_line_t), line_cmp);
+    fprintf(f, "\n%12s %12s %7s  %s\n", counted, "ns", "%", "line");
+    for (size_t ix = 0; ix < sorted_lines.len && ix < PROFILE_REPORT_MAX; ++ix) {
+        profile_line_t *l = sorted_lines.items + ix;
+        fprintf(f, "%12llu %12llu %6.2f%%  %zu (" SL ")\n", (unsigned long long) l->ops.count, (unsigned long long) profile_nanos(l->ops.nanos),
+            percentage(l->ops.nanos, total), l->line, SLARG(functions.items[l->function].name));
+    }
+    dynarr_free(&sorted_lines);
+
+    // The lines refer to the functions by index, so sort a copy.
+    profile_functions_t sorted = dynarr_copy(profile_functions_t, profile_function_t, functions);
+    qsort(sorted.items, sorted.len, sizeof(profile_function_t), function_cmp);
+    fprintf(f, "\n%12s %12s %12s %7s  %s\n", "calls", counted, "ns", "%", "function");
+    for (size_t ix = 0; ix < sorted.len && ix < PROFILE_REPORT_MAX; ++ix) {
+        profile_function_t *fnc = sorted.items + ix;
+        // Sampling doesn't see calls.
+        char calls[24] = "-";
+        if (!sampling) {
+            snprintf(calls, sizeof(calls), "%llu", (unsigned long long) fnc->calls);
+        }
+        fprintf(f, "%12s %12llu %12llu %6.2f%%  " SL "\n", calls, (unsigned long long) fnc->ops.count,
+            (unsigned long long) profile_nanos(fnc->ops.nanos), percentage(fnc->ops.nanos, total), SLARG(fnc->name));
+    }
+    dynarr_free(&sorted);
+    if (atomic_load(&samples_dropped) > 0) {
+        fprintf(f, "\n%llu samples dropped\n", (unsigned long long) atomic_load(&samples_dropped));
+    }
+}
+
+static void profile_write_stack(FILE *f, size_t stack)
+{
+    profile_stack_t *s = stacks.items + stack;
+    if (s->parent != 0) {
+        profile_write_stack(f, s->parent);
+        fputc(';', f);
+    }
+    fprintf(f, SL, SLARG(functions.items[s->function].name));
+}
+
+// Writes the time spent in every call stack in the collapsed stack format
+// read by flame graph tools: the names of the functions on the stack,
+// outermost first and separated by semicolons, followed by the time in
+// nanoseconds.
+void profile_write_folded(FILE *f)
+{
+    for (size_t ix = 1; ix < stacks.len; ++ix) {
+        if (stacks.items[ix].nanos == 0) {
+            continue;
+        }
+        profile_write_stack(f, ix);
+        fprintf(f, " %llu\n", (unsigned long long) profile_nanos(stacks.items[ix].nanos));
+    }
+}
@@ -0,0 +1,1606 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "da.h"
+#include "interpreter.h"
+#include "ir.h"
+#include "node.h"
+#include "regvm.h"
+#include "type.h"
+#include "value.h"
+
+// The register VM runs comptime functions and modules as three-address
+// code instead of on the value stack. The stack IR of a node is lowered
+// by keeping track of the virtual register holding every value the stack
+// machine would have pushed. A linear scan over the live ranges of the
+// virtual registers then packs them into the node's window of the
+// register file.
+//
+// Nodes using operations the lowering doesn't handle run on the stack
+// machine. Module variables stay on the value stack, where both machines
+// can get at them, and calls between the two go through the stack.
+
+#ifndef REGVM_REGISTER_FILE_SIZE
+#define REGVM_REGISTER_FILE_SIZE (64 * 1024)
+#endif
+
+struct _regvm {
+    ir_generator_t *gen;
+    regvm_codes_t   codes;         // Indexed by IR node
+    regvm_values_t  registers;     // `len` is the top of the register file
+    size_t          depth;
+    bool            jit;           // Compile code to native code
+    uint64_t        jit_threshold; // Number of runs after which code is compiled
+};
+
+static regvm_kind_t regvm_kind_of(nodeptr type)
+{
+    type_t *t = get_type(type);
+    switch (t->kind) {
+    case TYPK_VoidType:
+        return RVK_Void;
+    case TYPK_BoolType:
+        return RVK_Bool;
+    case TYPK_IntType:
+        switch (t->int_type.code) {
+#undef S
+#define S(W, T)   \
+    case IC_##W: \
+        return RVK_##W;
+            INTTYPES(S)
+#undef S
+        default:
+            UNREACHABLE();
+        }
+    case TYPK_FloatType:
+        switch (t->float_width) {
+#undef S
+#define S(W, T)   \
+    case FW_##W: \
+        return RVK_F##W;
+            FLOATTYPES(S)
+#undef S
+        default:
+            UNREACHABLE();
+        }
+    case TYPK_SliceType:
+        return RVK_Slice;
+    default:
+        return RVK_Invalid;
+    }
+}
+
+static size_t regvm_kind_size(regvm_kind_t kind)
+{
+    switch (kind) {
+    case RVK_Void:
+        return 0;
+    case RVK_Bool:
+        return sizeof(bool);
+#undef S
+#define S(W, T)    \
+    case RVK_##W: \
+        return sizeof(T);
+        INTTYPES(S)
+#undef S
+#define S(W, T)     \
+    case RVK_F##W: \
+        return sizeof(T);
+        FLOATTYPES(S)
+#undef S
+    case RVK_Slice:
+        return sizeof(slice_t);
+    default:
+        UNREACHABLE();
+    }
+}
+
+// Reads a value from its in-memory representation.
+static regvm_value_t regvm_load(regvm_kind_t kind, void const *src)
+{
+    regvm_value_t ret = { 0 };
+    switch (kind) {
+    case RVK_Void:
+        break;
+    case RVK_Bool:
+        ret.u64 = *((bool const *) src);
+        break;
+#undef S
+#define S(W, T)                                 \
+    case RVK_##W:                              \
+        ret.i64 = (int64_t) *((T const *) src); \
+        break;
+        INTTYPES(S)
+#undef S
+#define S(W, T)                                \
+    case RVK_F##W:                            \
+        ret.f64 = (double) *((T const *) src); \
+        break;
+        FLOATTYPES(S)
+#undef S
+    case RVK_Slice:
+        ret.slice = *((slice_t const *) src);
+        break;
+    default:
+        UNREACHABLE();
+    }
+    return ret;
+}
+
+static void regvm_store(regvm_kind_t kind, regvm_value_t value, void *dest)
+{
+    switch (kind) {
+    case RVK_Void:
+        break;
+    case RVK_Bool:
+        *((bool *) dest) = value.u64 != 0;
+        break;
+#undef S
+#define S(W, T)                        \
+    case RVK_##W:                     \
+        *((T *) dest) = (T) value.i64; \
+        break;
+        INTTYPES(S)
+#undef S
+#define S(W, T)                        \
+    case RVK_F##W:                    \
+        *((T *) dest) = (T) value.f64; \
+        break;
+        FLOATTYPES(S)
+#undef S
+    case RVK_Slice:
+        *((slice_t *) dest) = value.slice;
+        break;
+    default:
+        UNREACHABLE();
+    }
+}
+
+// Truncates a value to the width of its kind.
+static regvm_value_t regvm_normalize(regvm_kind_t kind, regvm_value_t value)
+{
+    regvm_value_t buf;
+    regvm_store(kind, value, &buf);
+    return regvm_load(kind, &buf);
+}
+
+static slice_t regvm_node_name(ir_generator_t *gen, nodeptr ir)
+{
+    ir_node_t *node = gen->ir_nodes.items + ir.value;
+    switch (node->type) {
+    case IRN_Function:
+        return node->function.name;
+    case IRN_Module:
+        return node->module.name;
+    case IRN_Program:
+        return node->program.name;
+    default:
+        UNREACHABLE();
+    }
+}
+
+// Lowering ------------------------------------------------------------------
+
+// What the stack machine would have on its stack: a value in a register,
+// or the address of a variable.
+typedef enum _regvm_entry_type {
+    RVE_Void,
+    RVE_Value,
+    RVE_Local,
+    RVE_Memory,
+} regvm_entry_type_t;
+
+typedef struct _regvm_entry {
+    regvm_entry_type_t type;
+    regvm_reg_t        reg;    // RVE_Value
+    uint32_t           depth;  // RVE_Memory
+    intptr_t           offset; // RVE_Local: the variable's slot. RVE_Memory: offset in the frame
+} regvm_entry_t;
+
+typedef DA(regvm_entry_t) regvm_entries_t;
+
+// The registers holding the stack at a label. Every jump to the label
+// moves its stack into these registers.
+typedef struct _regvm_label {
+    bool            referenced;
+    bool            seen;
+    regvm_entries_t entries;
+} regvm_label_t;
+
+typedef DA(regvm_label_t) regvm_labels_t;
+
+typedef struct _regvm_vreg {
+    bool         local;
+    intptr_t     slot;
+    regvm_kind_t kind;
+    size_t       start; // Live range, in half instructions
+    size_t       end;
+    regvm_reg_t  reg;
+} regvm_vreg_t;
+
+typedef DA(regvm_vreg_t) regvm_vregs_t;
+
+typedef struct _regvm_lowering {
+    ir_generator_t *gen;
+    regvm_code_t   *code;
+    operations_t   *ops;
+    bool            function;
+    regvm_vregs_t   vregs;
+    regvm_entries_t stack;
+    regvm_labels_t  labels; // Indexed by operation
+    uint64s         ips;    // Instruction index of every operation
+    bool            reachable;
+    regvm_reg_t     result;
+} regvm_lowering_t;
+
+typedef DA(regvm_reg_t *) regvm_operands_t;
+
+static bool regvm_unsupported(regvm_lowering_t *l, char const *why)
+{
+    trace("regvm: `" SL "` runs on the stack VM: %s", SLARG(regvm_node_name(l->gen, l->code->ir)), why);
+    return false;
+}
+
+static regvm_reg_t regvm_new_reg(regvm_lowering_t *l, regvm_kind_t kind)
+{
+    if (l->vregs.len >= REGVM_NO_REG) {
+        return REGVM_NO_REG;
+    }
+    dynarr_append_s(regvm_vreg_t, &l->vregs, .kind = kind, .start = SIZE_MAX, .reg = REGVM_NO_REG);
+    return l->vregs.len - 1;
+}
+
+// Returns the register of the local variable in `slot`. Blocks that are
+// not nested in each other share slots, so a slot can hold variables of
+// different kinds.
+static regvm_reg_t regvm_local(regvm_lowering_t *l, intptr_t slot, regvm_kind_t kind)
+{
+    for (size_t ix = 0; ix < l->vregs.len; ++ix) {
+        regvm_vreg_t *vreg = l->vregs.items + ix;
+        if (vreg->local && vreg->slot == slot && vreg->kind == kind) {
+            return ix;
+        }
+    }
+    regvm_reg_t ret = regvm_new_reg(l, kind);
+    if (ret != REGVM_NO_REG) {
+        l->vregs.items[ret].local = true;
+        l->vregs.items[ret].slot = slot;
+    }
+    return ret;
+}
+
+static void regvm_emit(regvm_lowering_t *l, regvm_instr_t instr)
+{
+    dynarr_append(&l->code->instrs, instr);
+}
+
+static bool regvm_push(regvm_lowering_t *l, regvm_kind_t kind, regvm_reg_t reg)
+{
+    if (kind == RVK_Void) {
+        dynarr_append_s(regvm_entry_t, &l->stack, .type = RVE_Void);
+        return true;
+    }
+    if (reg == REGVM_NO_REG) {
+        return regvm_unsupported(l, "too many virtual registers");
+    }
+    dynarr_append_s(regvm_entry_t, &l->stack, .type = RVE_Value, .reg = reg);
+    return true;
+}
+
+static bool regvm_pop(regvm_lowering_t *l, regvm_entry_t *entry)
+{
+    if (l->stack.len == 0) {
+        return regvm_unsupported(l, "stack underflow");
+    }
+    *entry = dynarr_popback(regvm_entry_t, &l->stack);
+    return true;
+}
+
+static bool regvm_pop_value(regvm_lowering_t *l, regvm_reg_t *reg)
+{
+    regvm_entry_t entry;
+    if (!regvm_pop(l, &entry)) {
+        return false;
+    }
+    if (entry.type != RVE_Value) {
+        return regvm_unsupported(l, "expected a value on the stack");
+    }
+    *reg = entry.reg;
+    return true;
+}
+
+// Copies values on the stack that are still in the register of local
+// `reg` to temporaries, before the local is overwritten or the values
+// are merged at a label.
+static bool regvm_detach(regvm_lowering_t *l, regvm_entry_t *entry)
+{
+    regvm_vreg_t *vreg = l->vregs.items + entry->reg;
+    if (!vreg->local) {
+        return true;
+    }
+    regvm_reg_t temp = regvm_new_reg(l, vreg->kind);
+    if (temp == REGVM_NO_REG) {
+        return regvm_unsupported(l, "too many virtual registers");
+    }
+    regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Move, .dst = temp, .lhs = entry->reg });
+    entry->reg = temp;
+    return true;
+}
+
+static bool regvm_variable(regvm_lowering_t *l, var_path_t *var, regvm_entry_t *entry)
+{
+    if (!var->resolved) {
+        return regvm_unsupported(l, "unresolved variable");
+    }
+    if (l->function && var->depth == 0) {
+        if (var->offset != 0) {
+            return regvm_unsupported(l, "access to a member of a local");
+        }
+        *entry = (regvm_entry_t) { .type = RVE_Local, .offset = var->slot };
+        return true;
+    }
+    // Functions don't have a frame on the stack, so their depth counts
+    // from the module.
+    uint32_t depth = (l->function) ? var->depth - 1 : var->depth;
+    if (depth >= REGVM_MAX_DEPTH) {
+        return regvm_unsupported(l, "variable too many frames up");
+    }
+    l->code->depth = MAX(l->code->depth, depth + 1);
+    *entry = (regvm_entry_t) { .type = RVE_Memory, .depth = depth, .offset = var->slot + var->offset };
+    return true;
+}
+
+// Pushes the value of the variable `entry` refers to.
+static bool regvm_dereference(regvm_lowering_t *l, regvm_entry_t entry, nodeptr type)
+{
+    regvm_kind_t kind = regvm_kind_of(type);
+    if (kind == RVK_Invalid) {
+        return regvm_unsupported(l, "variable type");
+    }
+    if (kind == RVK_Void) {
+        return regvm_push(l, kind, REGVM_NO_REG);
+    }
+    switch (entry.type) {
+    case RVE_Local:
+        return regvm_push(l, kind, regvm_local(l, entry.offset, kind));
+    case RVE_Memory: {
+        regvm_reg_t dst = regvm_new_reg(l, kind);
+        regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Load, .kind = kind, .dst = dst, .var = { entry.depth, entry.offset } });
+        return regvm_push(l, kind, dst);
+    }
+    default:
+        return regvm_unsupported(l, "dereference of a value");
+    }
+}
+
+static bool regvm_assign(regvm_lowering_t *l, nodeptr type)
+{
+    regvm_entry_t target, value;
+    if (!regvm_pop(l, &target) || !regvm_pop(l, &value)) {
+        return false;
+    }
+    regvm_kind_t kind = regvm_kind_of(type);
+    if (kind == RVK_Invalid) {
+        return regvm_unsupported(l, "variable type");
+    }
+    if (kind == RVK_Void) {
+        return true;
+    }
+    if (value.type != RVE_Value) {
+        return regvm_unsupported(l, "assignment of an address");
+    }
+    switch (target.type) {
+    case RVE_Local: {
+        regvm_reg_t local = regvm_local(l, target.offset, kind);
+        if (local == REGVM_NO_REG) {
+            return regvm_unsupported(l, "too many virtual registers");
+        }
+        for (size_t ix = 0; ix < l->stack.len; ++ix) {
+            regvm_entry_t *entry = l->stack.items + ix;
+            if (entry->type == RVE_Value && entry->reg == local && !regvm_detach(l, entry)) {
+                return false;
+            }
+        }
+        if (value.reg != local) {
+            regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Move, .dst = local, .lhs = value.reg });
+        }
+        return true;
+    }
+    case RVE_Memory:
+        regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Store, .kind = kind, .lhs = value.reg, .var = { target.depth, target.offset } });
+        return true;
+    default:
+        return regvm_unsupported(l, "assignment to a value");
+    }
+}
+
+static bool regvm_binary(regvm_lowering_t *l, binary_op_t *op)
+{
+    regvm_reg_t lhs, rhs;
+    if (!regvm_pop_value(l, &rhs) || !regvm_pop_value(l, &lhs)) {
+        return false;
+    }
+    binary_op_fncs_t const *fncs = binary_op_functions(op->op);
+    if (fncs == NULL || op->lhs.value != op->rhs.value) {
+        return regvm_unsupported(l, "binary operator");
+    }
+    regvm_kind_t  kind = regvm_kind_of(op->lhs);
+    regvm_instr_t instr = { .kind = kind, .dst = regvm_new_reg(l, kind), .lhs = lhs, .rhs = rhs, .op = op->op };
+    type_t       *t = get_type(op->lhs);
+    switch (t->kind) {
+    case TYPK_IntType:
+        if (t->int_type.is_signed && fncs->int_fnc != NULL) {
+            instr.opcode = RVO_IntOp;
+            instr.int_op.fnc = fncs->int_fnc;
+            instr.int_op.min = t->int_type.min_value;
+            instr.int_op.max = t->int_type.max_value;
+            break;
+        }
+        if (!t->int_type.is_signed && fncs->uint_fnc != NULL) {
+            instr.opcode = RVO_UIntOp;
+            instr.uint_op.fnc = fncs->uint_fnc;
+            instr.uint_op.max = t->int_type.max_value;
+            break;
+        }
+        return regvm_unsupported(l, "integer operator");
+    case TYPK_FloatType:
+        if (fncs->double_fnc == NULL) {
+            return regvm_unsupported(l, "float operator");
+        }
+        instr.opcode = RVO_FloatOp;
+        instr.float_op = fncs->double_fnc;
+        break;
+    case TYPK_BoolType:
+        if (fncs->bool_fnc == NULL) {
+            return regvm_unsupported(l, "bool operator");
+        }
+        instr.opcode = RVO_BoolOp;
+        instr.bool_op = fncs->bool_fnc;
+        break;
+    default:
+        return regvm_unsupported(l, "operand type");
+    }
+    regvm_emit(l, instr);
+    return regvm_push(l, kind, instr.dst);
+}
+
+static bool regvm_unary(regvm_lowering_t *l, unary_op_t *op)
+{
+    regvm_reg_t operand;
+    if (!regvm_pop_value(l, &operand)) {
+        return false;
+    }
+    unary_op_fncs_t const *fncs = unary_op_functions(op->op);
+    if (fncs == NULL) {
+        return regvm_unsupported(l, "unary operator");
+    }
+    regvm_kind_t  kind = regvm_kind_of(op->operand);
+    regvm_instr_t instr = { .kind = kind, .dst = regvm_new_reg(l, kind), .lhs = operand, .op = op->op };
+    type_t       *t = get_type(op->operand);
+    if (t->kind == TYPK_IntType && t->int_type.is_signed && fncs->int_fnc != NULL) {
+        instr.opcode = RVO_IntUnary;
+        instr.int_unary = fncs->int_fnc;
+    } else if (t->kind == TYPK_IntType && !t->int_type.is_signed && fncs->uint_fnc != NULL) {
+        instr.opcode = RVO_UIntUnary;
+        instr.uint_unary = fncs->uint_fnc;
+    } else if (t->kind == TYPK_FloatType && fncs->double_fnc != NULL) {
+        instr.opcode = RVO_FloatUnary;
+        instr.float_unary = fncs->double_fnc;
+    } else {
+        return regvm_unsupported(l, "unary operator");
+    }
+    regvm_emit(l, instr);
+    return regvm_push(l, kind, instr.dst);
+}
+
+static bool regvm_call(regvm_lowering_t *l, call_op_t *call)
+{
+    if (!call->function.ok) {
+        return regvm_unsupported(l, "unresolved call");
+    }
+    regvm_kind_t ret = regvm_kind_of(call->return_type);
+    if (ret == RVK_Invalid || l->stack.len < call->parameters.len) {
+        return regvm_unsupported(l, "call");
+    }
+    size_t args = l->code->args.len;
+    size_t base = l->stack.len - call->parameters.len;
+    for (size_t ix = 0; ix < call->parameters.len; ++ix) {
+        regvm_entry_t *arg = l->stack.items + base + ix;
+        regvm_kind_t   kind = regvm_kind_of(call->parameters.items[ix].type);
+        if (arg->type != RVE_Value || kind == RVK_Invalid || kind == RVK_Void) {
+            return regvm_unsupported(l, "call argument");
+        }
+        dynarr_append_s(regvm_arg_t, &l->code->args, .reg = arg->reg, .kind = kind);
+    }
+    l->stack.len = base;
+    regvm_reg_t dst = (ret == RVK_Void) ? REGVM_NO_REG : regvm_new_reg(l, ret);
+    regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Call, .kind = ret, .dst = dst, .call = { call->function, args, call->parameters.len } });
+    return regvm_push(l, ret, dst);
+}
+
+// Makes the stack at a jump or fall through to operation `ip` match the
+// stack at that label. `cond` is the register the jump reads, if any.
+static bool regvm_merge(regvm_lowering_t *l, size_t ip, regvm_reg_t cond)
+{
+    if (l->function && ip == l->ops->len) {
+        // A return. Whatever is left on the stack is dropped.
+        return true;
+    }
+    regvm_label_t *label = l->labels.items + ip;
+    if (!label->seen) {
+        label->seen = true;
+        for (size_t ix = 0; ix < l->stack.len; ++ix) {
+            regvm_entry_t *entry = l->stack.items + ix;
+            if (entry->type == RVE_Local || entry->type == RVE_Memory) {
+                return regvm_unsupported(l, "variable address live across a jump");
+            }
+            if (entry->type == RVE_Value && !regvm_detach(l, entry)) {
+                return false;
+            }
+            dynarr_append(&label->entries, *entry);
+        }
+        return true;
+    }
+    if (label->entries.len != l->stack.len) {
+        return regvm_unsupported(l, "stack depth differs between jumps to a label");
+    }
+    for (size_t ix = 0; ix < l->stack.len; ++ix) {
+        regvm_entry_t *entry = l->stack.items + ix;
+        regvm_entry_t *target = label->entries.items + ix;
+        if (entry->type != target->type) {
+            return regvm_unsupported(l, "stack differs between jumps to a label");
+        }
+        if (entry->type != RVE_Value || entry->reg == target->reg) {
+            continue;
+        }
+        // The moves must not overwrite anything still needed.
+        if (target->reg == cond) {
+            return regvm_unsupported(l, "overlapping moves at a label");
+        }
+        for (size_t iix = ix + 1; iix < l->stack.len; ++iix) {
+            if (l->stack.items[iix].type == RVE_Value && l->stack.items[iix].reg == target->reg) {
+                return regvm_unsupported(l, "overlapping moves at a label");
+            }
+        }
+        regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Move, .dst = target->reg, .lhs = entry->reg });
+    }
+    return true;
+}
+
+static bool regvm_label(regvm_lowering_t *l, size_t ip)
+{
+    if (l->reachable) {
+        if (!regvm_merge(l, ip, REGVM_NO_REG)) {
+            return false;
+        }
+    } else if (ip < l->ops->len && !l->labels.items[ip].seen) {
+        if (!l->labels.items[ip].referenced) {
+            // Dead code, for example the scope end a return unwinds
+            // through.
+            return true;
+        }
+        // Code after a jump that is only reached by jumping back to
+        // this label.
+        l->labels.items[ip].seen = true;
+    }
+    l->stack.len = 0;
+    if (ip < l->ops->len || !l->function) {
+        regvm_label_t *label = l->labels.items + ip;
+        for (size_t ix = 0; ix < label->entries.len; ++ix) {
+            dynarr_append(&l->stack, label->entries.items[ix]);
+        }
+    }
+    l->reachable = true;
+    return true;
+}
+
+static bool regvm_jump(regvm_lowering_t *l, regvm_opcode_t opcode, size_t target)
+{
+    regvm_reg_t cond = REGVM_NO_REG;
+    if (opcode != RVO_Jump && !regvm_pop_value(l, &cond)) {
+        return false;
+    }
+    if (!regvm_merge(l, target, cond)) {
+        return false;
+    }
+    regvm_emit(l, (regvm_instr_t) { .opcode = opcode, .lhs = cond, .target = target });
+    l->reachable = (opcode != RVO_Jump);
+    return true;
+}
+
+// Works out where the unwinding started by a break ends up. Without
+// deferred statements every scope end it passes just hands it on.
+static opt_size_t regvm_break_target(operations_t *ops, break_op_t *brk)
+{
+    if (brk->scope_end_ip == brk->label_ip) {
+        return OPTVAL(size_t, brk->label_ip);
+    }
+    uint64_t depth = (brk->scope_end != 0) ? brk->depth : 0;
+    size_t   ip = brk->scope_end_ip;
+    while (true) {
+        while (ip < ops->len && ops->items[ip].type == IRO_Label) {
+            ++ip;
+        }
+        if (ip >= ops->len) {
+            return OPTVAL(size_t, ops->len);
+        }
+        if (ops->items[ip].type != IRO_ScopeEnd) {
+            return OPTNULL(size_t);
+        }
+        if (depth == 0) {
+            break;
+        }
+        --depth;
+        ip = ops->items[ip].ScopeEnd.enclosing_end_ip;
+    }
+    return OPTVAL(size_t, (brk->label_ip != 0) ? brk->label_ip : ip + 1);
+}
+
+// Blocks that are not nested in each other share frame slots, so the
+// variables of a block are cleared when it is entered, like the stack VM
+// does. Locals of functions are registers, one per slot and kind; other
+// variables are cleared in memory a word at a time.
+static bool regvm_scope_begin(regvm_lowering_t *l, scope_begin_op_t *scope)
+{
+    if (!l->function) {
+        regvm_reg_t zero = regvm_new_reg(l, RVK_U64);
+        if (zero == REGVM_NO_REG) {
+            return regvm_unsupported(l, "too many virtual registers");
+        }
+        regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Const, .kind = RVK_U64, .dst = zero, .constant = { .u64 = 0 } });
+        for (intptr_t offset = 0; offset < scope->size; offset += 8) {
+            regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Store, .kind = RVK_U64, .lhs = zero, .var = { 0, scope->base + offset } });
+        }
+        l->code->depth = MAX(l->code->depth, 1);
+        return true;
+    }
+    intptr_t slot = scope->base;
+    dynarr_foreach(name_t, var, &scope->variables)
+    {
+        regvm_kind_t kind = regvm_kind_of(var->type);
+        intptr_t     var_slot = slot;
+        slot += align_at(8, type_size_of(var->type));
+        if (kind == RVK_Invalid || kind == RVK_Void) {
+            // Never in a register; accessing it makes the lowering fail.
+            continue;
+        }
+        regvm_reg_t local = regvm_local(l, var_slot, kind);
+        if (local == REGVM_NO_REG) {
+            return regvm_unsupported(l, "too many virtual registers");
+        }
+        for (size_t ix = 0; ix < l->stack.len; ++ix) {
+            regvm_entry_t *entry = l->stack.items + ix;
+            if (entry->type == RVE_Value && entry->reg == local && !regvm_detach(l, entry)) {
+                return false;
+            }
+        }
+        regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Const, .kind = kind, .dst = local, .constant = { .u64 = 0 } });
+    }
+    return true;
+}
+
+static bool regvm_lower_operation(regvm_lowering_t *l, operation_t *op)
+{
+    switch (op->type) {
+    case IRO_DeclVar:
+    case IRO_Label:
+    case IRO_ScopeEnd:
+        return true;
+    case IRO_ScopeBegin:
+        return regvm_scope_begin(l, &op->ScopeBegin);
+    case IRO_AssignFromRef: {
+        // Loads the variable the source address points to, and assigns
+        // that like AssignValue. Declarations initialized from a variable
+        // are typed as a reference to the variable's type.
+        nodeptr       type = type_value_type(op->AssignFromRef);
+        regvm_entry_t target, source;
+        if (!regvm_pop(l, &target) || !regvm_pop(l, &source) || !regvm_dereference(l, source, type)) {
+            return false;
+        }
+        dynarr_append(&l->stack, target);
+        return regvm_assign(l, type);
+    }
+    case IRO_AssignValue:
+        return regvm_assign(l, op->AssignValue);
+    case IRO_AssignVar:
+    case IRO_AssignVarKeep: {
+        assign_var_op_t *assign = &op->AssignVar;
+        if (!regvm_lower_operation(l, &(operation_t) { .type = IRO_PushVarAddress, .PushVarAddress = assign->var })
+            || !regvm_assign(l, assign->type)) {
+            return false;
+        }
+        if (op->type == IRO_AssignVar) {
+            return true;
+        }
+        var_path_t var = assign->var;
+        var.type = assign->type;
+        return regvm_lower_operation(l, &(operation_t) { .type = IRO_PushValue, .PushValue = var });
+    }
+    case IRO_BinaryOperator:
+#undef S
+#define S(O, T) case IRO_##O:
+        INTTYPES(IRINTOPCODES)
+        FLOATTYPES(IRFLOATOPCODES)
+#undef S
+        return regvm_binary(l, &op->BinaryOperator);
+    case IRO_BinaryOperatorVarConst: {
+        var_const_op_t *fused = &op->BinaryOperatorVarConst;
+        return regvm_lower_operation(l, &(operation_t) { .type = IRO_PushValue, .PushValue = fused->var })
+            && regvm_lower_operation(l, &(operation_t) { .type = IRO_PushConstant, .PushConstant = fused->constant })
+            && regvm_binary(l, &fused->op);
+    }
+    case IRO_BinaryOperatorVarConstJumpF:
+        return regvm_lower_operation(l, &(operation_t) { .type = IRO_BinaryOperatorVarConst, .BinaryOperatorVarConst = op->BinaryOperatorVarConstJumpF.cond })
+            && regvm_jump(l, RVO_JumpF, op->BinaryOperatorVarConstJumpF.jump.target);
+    case IRO_BinaryOperatorVarVar: {
+        var_var_op_t *fused = &op->BinaryOperatorVarVar;
+        return regvm_lower_operation(l, &(operation_t) { .type = IRO_PushValue, .PushValue = fused->lhs })
+            && regvm_lower_operation(l, &(operation_t) { .type = IRO_PushValue, .PushValue = fused->rhs })
+            && regvm_binary(l, &fused->op);
+    }
+    case IRO_Break: {
+        opt_size_t target = regvm_break_target(l->ops, &op->Break);
+        if (!target.ok) {
+            return regvm_unsupported(l, "break through deferred statements");
+        }
+        return regvm_jump(l, RVO_Jump, target.value);
+    }
+    case IRO_Call:
+        return regvm_call(l, &op->Call);
+    case IRO_Dereference: {
+        regvm_entry_t entry;
+        return regvm_pop(l, &entry) && regvm_dereference(l, entry, op->Dereference);
+    }
+    case IRO_Discard: {
+        regvm_entry_t entry;
+        return regvm_pop(l, &entry);
+    }
+    case IRO_Jump:
+        return regvm_jump(l, RVO_Jump, op->Jump.target);
+    case IRO_JumpF:
+        return regvm_jump(l, RVO_JumpF, op->JumpF.target);
+    case IRO_JumpT:
+        return regvm_jump(l, RVO_JumpT, op->JumpT.target);
+    case IRO_Pop: {
+        regvm_entry_t entry;
+        if (!l->function || !regvm_pop(l, &entry)) {
+            return regvm_unsupported(l, "pop");
+        }
+        if (entry.type == RVE_Value && l->result != REGVM_NO_REG) {
+            regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Move, .dst = l->result, .lhs = entry.reg });
+        }
+        return true;
+    }
+    case IRO_PushConstant: {
+        regvm_kind_t kind = regvm_kind_of(op->PushConstant.type);
+        if (kind == RVK_Invalid) {
+            return regvm_unsupported(l, "constant type");
+        }
+        regvm_reg_t dst = REGVM_NO_REG;
+        if (kind != RVK_Void) {
+            // All value_t payloads start at the same address.
+            dst = regvm_new_reg(l, kind);
+            regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Const, .kind = kind, .dst = dst, .constant = regvm_load(kind, &op->PushConstant.u64) });
+        }
+        return regvm_push(l, kind, dst);
+    }
+    case IRO_PushValue: {
+        regvm_entry_t entry;
+        return regvm_variable(l, &op->PushValue, &entry) && regvm_dereference(l, entry, op->PushValue.type);
+    }
+    case IRO_PushVarAddress: {
+        regvm_entry_t entry;
+        if (!regvm_variable(l, &op->PushVarAddress, &entry)) {
+            return false;
+        }
+        dynarr_append(&l->stack, entry);
+        return true;
+    }
+    case IRO_UnaryOperator:
+        return regvm_unary(l, &op->UnaryOperator);
+    default:
+        return regvm_unsupported(l, "operation");
+    }
+}
+
+// Collects pointers to the registers `instr` reads.
+static void regvm_operands(regvm_code_t *code, regvm_instr_t *instr, regvm_operands_t *operands)
+{
+    operands->len = 0;
+    switch (instr->opcode) {
+    case RVO_Const:
+    case RVO_Load:
+    case RVO_Jump:
+        break;
+    case RVO_Move:
+    case RVO_Store:
+    case RVO_IntUnary:
+    case RVO_UIntUnary:
+    case RVO_FloatUnary:
+    case RVO_JumpF:
+    case RVO_JumpT:
+        dynarr_append(operands, &instr->lhs);
+        break;
+    case RVO_IntOp:
+    case RVO_UIntOp:
+    case RVO_FloatOp:
+    case RVO_BoolOp:
+        dynarr_append(operands, &instr->lhs);
+        dynarr_append(operands, &instr->rhs);
+        break;
+    case RVO_Call:
+        for (size_t ix = 0; ix < instr->call.argc; ++ix) {
+            dynarr_append(operands, &code->args.items[instr->call.args + ix].reg);
+        }
+        break;
+    case RVO_Return:
+        if (instr->lhs != REGVM_NO_REG) {
+            dynarr_append(operands, &instr->lhs);
+        }
+        break;
+    default:
+        UNREACHABLE();
+    }
+}
+
+static regvm_reg_t regvm_result_reg(regvm_instr_t *instr)
+{
+    switch (instr->opcode) {
+    case RVO_Store:
+    case RVO_Jump:
+    case RVO_JumpF:
+    case RVO_JumpT:
+    case RVO_Return:
+        return REGVM_NO_REG;
+    default:
+        return instr->dst;
+    }
+}
+
+#define regvm_bit(set, reg) (((set)[(reg) / 64] >> ((reg) % 64)) & 1)
+
+// Computes the registers live into every instruction.
+static uint64_t *regvm_liveness(regvm_code_t *code, size_t words)
+{
+    size_t           n = code->instrs.len;
+    uint64_t        *live = (uint64_t *) allocator_alloc(n * words * sizeof(uint64_t));
+    uint64_t        *out = (uint64_t *) allocator_alloc(words * sizeof(uint64_t));
+    regvm_operands_t operands = { 0 };
+    memset(live, 0, n * words * sizeof(uint64_t));
+    bool changed;
+    do {
+        changed = false;
+        for (size_t ix = n; ix > 0; --ix) {
+            regvm_instr_t *instr = code->instrs.items + (ix - 1);
+            uint64_t      *in = live + (ix - 1) * words;
+            memset(out, 0, words * sizeof(uint64_t));
+            if (instr->opcode != RVO_Jump && instr->opcode != RVO_Return && ix < n) {
+                for (size_t w = 0; w < words; ++w) {
+                    out[w] |= live[ix * words + w];
+                }
+            }
+            if (instr->opcode == RVO_Jump || instr->opcode == RVO_JumpF || instr->opcode == RVO_JumpT) {
+                for (size_t w = 0; w < words; ++w) {
+                    out[w] |= live[instr->target * words + w];
+                }
+            }
+            regvm_reg_t def = regvm_result_reg(instr);
+            if (def != REGVM_NO_REG) {
+                out[def / 64] &= ~(1ull << (def % 64));
+            }
+            regvm_operands(code, instr, &operands);
+            for (size_t op = 0; op < operands.len; ++op) {
+                out[*operands.items[op] / 64] |= 1ull << (*operands.items[op] % 64);
+            }
+            if (memcmp(in, out, words * sizeof(uint64_t)) != 0) {
+                memcpy(in, out, words * sizeof(uint64_t));
+                changed = true;
+            }
+        }
+    } while (changed);
+    dynarr_free(&operands);
+    allocator_free((char *) out);
+    return live;
+}
+
+typedef struct _regvm_interval {
+    size_t      start;
+    size_t      end;
+    regvm_reg_t vreg;
+} regvm_interval_t;
+
+typedef DA(regvm_interval_t) regvm_intervals_t;
+
+static int regvm_interval_cmp(void const *a, void const *b)
+{
+    regvm_interval_t const *i1 = a;
+    regvm_interval_t const *i2 = b;
+    if (i1->start != i2->start) {
+        return (i1->start < i2->start) ? -1 : 1;
+    }
+    return (int) i1->vreg - (int) i2->vreg;
+}
+
+static void regvm_extend(regvm_vreg_t *vreg, size_t pos)
+{
+    vreg->start = MIN(vreg->start, pos);
+    vreg->end = MAX(vreg->end, pos);
+}
+
+// Assigns the virtual registers to registers in the window of the code by
+// a linear scan over their live ranges. The window can always grow, so
+// nothing is ever spilled.
+static bool regvm_allocate(regvm_lowering_t *l)
+{
+    regvm_code_t *code = l->code;
+    size_t        words = (l->vregs.len + 63) / 64;
+    uint64_t     *live = regvm_liveness(code, words);
+
+    // A register is live into an instruction at position 2 * ix, and is
+    // written by it at 2 * ix + 1. An instruction reads its operands
+    // before it writes its result, so the two can share a register.
+    regvm_operands_t operands = { 0 };
+    for (size_t ix = 0; ix < code->instrs.len; ++ix) {
+        regvm_reg_t def = regvm_result_reg(code->instrs.items + ix);
+        if (def != REGVM_NO_REG) {
+            regvm_extend(l->vregs.items + def, 2 * ix + 1);
+        }
+        for (size_t reg = 0; reg < l->vregs.len; ++reg) {
+            if (regvm_bit(live + ix * words, reg)) {
+                regvm_extend(l->vregs.items + reg, 2 * ix);
+            }
+        }
+    }
+    regvm_intervals_t intervals = { 0 };
+    for (size_t reg = 0; reg < l->vregs.len; ++reg) {
+        if (l->vregs.items[reg].start != SIZE_MAX) {
+            dynarr_append_s(regvm_interval_t, &intervals, .start = l->vregs.items[reg].start, .end = l->vregs.items[reg].end, .vreg = reg);
+        }
+    }
+    qsort(intervals.items, intervals.len, sizeof(regvm_interval_t), regvm_interval_cmp);
+
+    bool              ok = true;
+    bool              in_use[REGVM_MAX_REGS] = { 0 };
+    regvm_intervals_t active = { 0 }; // Sorted by end
+    for (size_t ix = 0; ok && ix < intervals.len; ++ix) {
+        regvm_interval_t *interval = intervals.items + ix;
+        size_t            expired = 0;
+        while (expired < active.len && active.items[expired].end < interval->start) {
+            in_use[l->vregs.items[active.items[expired].vreg].reg] = false;
+            ++expired;
+        }
+        memmove(active.items, active.items + expired, (active.len - expired) * sizeof(regvm_interval_t));
+        active.len -= expired;
+
+        regvm_reg_t reg = 0;
+        while (reg < REGVM_MAX_REGS && in_use[reg]) {
+            ++reg;
+        }
+        if (reg == REGVM_MAX_REGS) {
+            ok = regvm_unsupported(l, "too many registers");
+            break;
+        }
+        in_use[reg] = true;
+        l->vregs.items[interval->vreg].reg = reg;
+        code->num_regs = MAX(code->num_regs, (size_t) reg + 1);
+
+        size_t pos = active.len;
+        while (pos > 0 && active.items[pos - 1].end > interval->end) {
+            --pos;
+        }
+        dynarr_append(&active, *interval);
+        memmove(active.items + pos + 1, active.items + pos, (active.len - 1 - pos) * sizeof(regvm_interval_t));
+        active.items[pos] = *interval;
+    }
+
+    if (ok) {
+        for (size_t ix = 0; ix < code->instrs.len; ++ix) {
+            regvm_instr_t *instr = code->instrs.items + ix;
+            regvm_operands(code, instr, &operands);
+            for (size_t op = 0; op < operands.len; ++op) {
+                *operands.items[op] = l->vregs.items[*operands.items[op]].reg;
+            }
+            if (regvm_result_reg(instr) != REGVM_NO_REG) {
+                instr->dst = l->vregs.items[instr->dst].reg;
+            }
+        }
+        for (size_t ix = 0; ix < code->params.len; ++ix) {
+            regvm_arg_t *param = code->params.items + ix;
+            param->reg = (code->instrs.len > 0 && regvm_bit(live, param->reg)) ? l->vregs.items[param->reg].reg : REGVM_NO_REG;
+        }
+    }
+    dynarr_free(&operands);
+    dynarr_free(&intervals);
+    dynarr_free(&active);
+    allocator_free((char *) live);
+    return ok;
+}
+
+// Drops the moves the allocation turned into no-ops, and jumps to the
+// next instruction.
+static void regvm_compact(regvm_code_t *code)
+{
+    uint64s index = { 0 };
+    size_t  len = 0;
+    for (size_t ix = 0; ix < code->instrs.len; ++ix) {
+        regvm_instr_t *instr = code->instrs.items + ix;
+        dynarr_append(&index, len);
+        if ((instr->opcode == RVO_Move && instr->dst == instr->lhs) || (instr->opcode == RVO_Jump && instr->target == ix + 1)) {
+            continue;
+        }
+        code->instrs.items[len++] = *instr;
+    }
+    dynarr_append(&index, len);
+    code->instrs.len = len;
+    for (size_t ix = 0; ix < code->instrs.len; ++ix) {
+        regvm_instr_t *instr = code->instrs.items + ix;
+        if (instr->opcode == RVO_Jump || instr->opcode == RVO_JumpF || instr->opcode == RVO_JumpT) {
+            instr->target = index.items[instr->target];
+        }
+    }
+    dynarr_free(&index);
+}
+
+static bool regvm_lower_node(regvm_lowering_t *l)
+{
+    ir_node_t    *node = l->gen->ir_nodes.items + l->code->ir.value;
+    operations_t *ops = l->ops;
+    for (size_t ix = 0; ix < ops->len; ++ix) {
+        if (ops->items[ix].type == IRO_ScopeEnd && ops->items[ix].ScopeEnd.has_defers) {
+            return regvm_unsupported(l, "deferred statements");
+        }
+    }
+    for (size_t ix = 0; ix <= ops->len; ++ix) {
+        dynarr_append_s(regvm_label_t, &l->labels, .seen = false);
+        dynarr_append(&l->ips, 0);
+    }
+    for (size_t ix = 0; ix < ops->len; ++ix) {
+        operation_t *op = ops->items + ix;
+        switch (op->type) {
+        case IRO_Jump:
+        case IRO_JumpF:
+        case IRO_JumpT:
+            l->labels.items[op->Jump.target].referenced = true;
+            break;
+        case IRO_BinaryOperatorVarConstJumpF:
+            l->labels.items[op->BinaryOperatorVarConstJumpF.jump.target].referenced = true;
+            break;
+        case IRO_Break: {
+            opt_size_t target = regvm_break_target(ops, &op->Break);
+            if (target.ok) {
+                l->labels.items[target.value].referenced = true;
+            }
+        } break;
+        default:
+            break;
+        }
+    }
+
+    l->result = REGVM_NO_REG;
+    if (l->function) {
+        l->code->result = regvm_kind_of(node->function.return_type);
+        intptr_t slot = 0;
+        for (size_t ix = 0; ix < node->function.parameters.len; ++ix) {
+            nodeptr      type = node->function.parameters.items[ix].type;
+            regvm_kind_t kind = regvm_kind_of(type);
+            if (kind == RVK_Invalid || kind == RVK_Void) {
+                return regvm_unsupported(l, "parameter type");
+            }
+            dynarr_append_s(regvm_arg_t, &l->code->params, .reg = regvm_local(l, slot, kind), .kind = kind);
+            slot += align_at(8, type_size_of(type));
+        }
+        if (l->code->result != RVK_Void) {
+            l->result = regvm_new_reg(l, l->code->result);
+        }
+    } else {
+        l->code->result = regvm_kind_of(node->bound_type);
+    }
+    if (l->code->result == RVK_Invalid) {
+        return regvm_unsupported(l, "result type");
+    }
+
+    for (size_t ip = 0; ip < ops->len; ++ip) {
+        operation_t *op = ops->items + ip;
+        if (op->type == IRO_Label && !regvm_label(l, ip)) {
+            return false;
+        }
+        l->ips.items[ip] = l->code->instrs.len;
+        if (l->reachable && !regvm_lower_operation(l, op)) {
+            return false;
+        }
+    }
+    if (!regvm_label(l, ops->len)) {
+        return false;
+    }
+    l->ips.items[ops->len] = l->code->instrs.len;
+    regvm_reg_t result = l->result;
+    if (!l->function && l->code->result != RVK_Void) {
+        if (!regvm_pop_value(l, &result)) {
+            return false;
+        }
+    }
+    regvm_emit(l, (regvm_instr_t) { .opcode = RVO_Return, .lhs = result });
+
+    for (size_t ix = 0; ix < l->code->instrs.len; ++ix) {
+        regvm_instr_t *instr = l->code->instrs.items + ix;
+        if (instr->opcode == RVO_Jump || instr->opcode == RVO_JumpF || instr->opcode == RVO_JumpT) {
+            instr->target = l->ips.items[instr->target];
+        }
+    }
+    if (l->vregs.len >= REGVM_NO_REG) {
+        return regvm_unsupported(l, "too many virtual registers");
+    }
+    if (!regvm_allocate(l)) {
+        return false;
+    }
+    regvm_compact(l->code);
+    return true;
+}
+
+static char const *regvm_opcode_names[] = {
+#undef S
+#define S(O) [RVO_##O] = #O,
+    REGVM_OPCODES(S)
+#undef S
+};
+
+static void regvm_list(FILE *f, ir_generator_t *gen, regvm_code_t *code)
+{
+    fprintf(f, "== [R] = " SL " (%zu registers) ===\n", SLARG(regvm_node_name(gen, code->ir)), code->num_regs);
+    for (size_t ix = 0; ix < code->params.len; ++ix) {
+        fprintf(f, "    param %zu: r%d\n", ix, (int) code->params.items[ix].reg);
+    }
+    for (size_t ix = 0; ix < code->instrs.len; ++ix) {
+        regvm_instr_t *instr = code->instrs.items + ix;
+        fprintf(f, "%4zu  %-10s ", ix, regvm_opcode_names[instr->opcode]);
+        switch (instr->opcode) {
+        case RVO_Const:
+            fprintf(f, "r%d, %lld\n", instr->dst, (long long) instr->constant.i64);
+            break;
+        case RVO_Move:
+        case RVO_IntUnary:
+        case RVO_UIntUnary:
+        case RVO_FloatUnary:
+            fprintf(f, "r%d, r%d\n", instr->dst, instr->lhs);
+            break;
+        case RVO_Load:
+            fprintf(f, "r%d, [%u:%ld]\n", instr->dst, instr->var.depth, (long) instr->var.offset);
+            break;
+        case RVO_Store:
+            fprintf(f, "[%u:%ld], r%d\n", instr->var.depth, (long) instr->var.offset, instr->lhs);
+            break;
+        case RVO_IntOp:
+        case RVO_UIntOp:
+        case RVO_FloatOp:
+        case RVO_BoolOp:
+            fprintf(f, "r%d, r%d, r%d\n", instr->dst, instr->lhs, instr->rhs);
+            break;
+        case RVO_Jump:
+            fprintf(f, "%zu\n", instr->target);
+            break;
+        case RVO_JumpF:
+        case RVO_JumpT:
+            fprintf(f, "r%d, %zu\n", instr->lhs, instr->target);
+            break;
+        case RVO_Call:
+            fprintf(f, "r%d, " SL "(", instr->dst, SLARG(regvm_node_name(gen, instr->call.function)));
+            for (size_t arg = 0; arg < instr->call.argc; ++arg) {
+                fprintf(f, "%sr%d", (arg > 0) ? ", " : "", code->args.items[instr->call.args + arg].reg);
+            }
+            fprintf(f, ")\n");
+            break;
+        case RVO_Return:
+            fprintf(f, "r%d\n", instr->lhs);
+            break;
+        default:
+            UNREACHABLE();
+        }
+    }
+}
+
+static bool regvm_lower(ir_generator_t *gen, regvm_code_t *code)
+{
+    ir_node_t       *node = gen->ir_nodes.items + code->ir.value;
+    regvm_lowering_t l = {
+        .gen = gen,
+        .code = code,
+        .ops = ir_node_operations(node),
+        .function = node->type == IRN_Function,
+        .reachable = true,
+    };
+    bool ok = regvm_lower_node(&l);
+    for (size_t ix = 0; ix < l.labels.len; ++ix) {
+        dynarr_free(&l.labels.items[ix].entries);
+    }
+    dynarr_free(&l.labels);
+    dynarr_free(&l.ips);
+    dynarr_free(&l.stack);
+    dynarr_free(&l.vregs);
+    if (!ok) {
+        dynarr_free(&code->instrs);
+        dynarr_free(&code->args);
+        dynarr_free(&code->params);
+        return false;
+    }
+    if (do_trace) {
+        regvm_list(stderr, gen, code);
+    }
+    return true;
+}
+
+// Execution -----------------------------------------------------------------
+
+static regvm_code_t *regvm_lookup(interpreter_t *interpreter, nodeptr ir)
+{
+    regvm_t *vm = interpreter->regvm;
+    // A comptime session adds IR nodes between runs. The first lookup after
+    // that comes before any code runs, so the codes can still move.
+    while (vm->codes.len < vm->gen->ir_nodes.len) {
+        dynarr_append_s(regvm_code_t, &vm->codes, .ir = nodeptr_ptr(vm->codes.len));
+    }
+    regvm_code_t *code = vm->codes.items + ir.value;
+    if (code->status == RVC_Unknown) {
+        code->status = regvm_lower(interpreter->regvm->gen, code) ? RVC_Lowered : RVC_Unsupported;
+    }
+    return (code->status == RVC_Lowered) ? code : NULL;
+}
+
+static void regvm_check_depth(interpreter_t *interpreter, nodeptr function)
+{
+    if (interpreter->call_stack.len + interpreter->regvm->depth >= INTERPRETER_MAX_CALL_DEPTH) {
+        fatal("Interpreter call stack overflow calling `" SL "`", SLARG(regvm_node_name(interpreter->gen, function)));
+    }
+}
+
+// Claims a zeroed register window for `code` at the top of the register
+// file.
+static regvm_value_t *regvm_enter(interpreter_t *interpreter, regvm_code_t *code)
+{
+    regvm_t *vm = interpreter->regvm;
+    regvm_check_depth(interpreter, code->ir);
+    if (code->num_regs > vm->registers.capacity - vm->registers.len) {
+        fatal("Register VM register file overflow calling `" SL "`", SLARG(regvm_node_name(interpreter->gen, code->ir)));
+    }
+    regvm_value_t *ret = vm->registers.items + vm->registers.len;
+    memset(ret, 0, code->num_regs * sizeof(regvm_value_t));
+    vm->registers.len += code->num_regs;
+    ++vm->depth;
+    return ret;
+}
+
+static void regvm_leave(interpreter_t *interpreter, regvm_code_t *code)
+{
+    interpreter->regvm->registers.len -= code->num_regs;
+    --interpreter->regvm->depth;
+}
+
+// Functions don't have a frame on the stack. Their variable accesses that
+// aren't local start at the frame of their module.
+static void regvm_frame_bases(regvm_frame_t *frame)
+{
+    regvm_code_t  *code = frame->code;
+    interpreter_t *interpreter = frame->interpreter;
+    if (code->depth == 0) {
+        return;
+    }
+    ir_node_t *node = interpreter->gen->ir_nodes.items + code->ir.value;
+    scope_t   *s = NULL;
+    if (node->type == IRN_Function) {
+        for (size_t ix = interpreter->scopes.len; s == NULL && ix > 0; --ix) {
+            if (interpreter->scopes.items[ix - 1].ir.value == node->function.module.value) {
+                s = interpreter->scopes.items + (ix - 1);
+            }
+        }
+        assert(s != NULL);
+    } else {
+        s = dynarr_back(&interpreter->scopes);
+    }
+    for (uint32_t depth = 0; depth < code->depth; ++depth) {
+        frame->bases[depth] = interpreter->stack.base + s->bp;
+        if (depth + 1 < code->depth) {
+            assert(s->parent.ok);
+            s = interpreter->scopes.items + s->parent.value;
+        }
+    }
+}
+
+static regvm_value_t regvm_run(interpreter_t *interpreter, regvm_code_t *code, regvm_value_t *regs);
+
+#undef S
+#define S(O) static size_t regvm_execute_##O(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip);
+REGVM_OPCODES(S)
+#undef S
+
+size_t regvm_execute_Const(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    frame->regs[instr->dst] = instr->constant;
+    return ip + 1;
+}
+
+size_t regvm_execute_Move(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    frame->regs[instr->dst] = frame->regs[instr->lhs];
+    return ip + 1;
+}
+
+size_t regvm_execute_Load(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    frame->regs[instr->dst] = regvm_load(instr->kind, frame->bases[instr->var.depth] + instr->var.offset);
+    return ip + 1;
+}
+
+size_t regvm_execute_Store(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    regvm_store(instr->kind, frame->regs[instr->lhs], frame->bases[instr->var.depth] + instr->var.offset);
+    return ip + 1;
+}
+
+size_t regvm_execute_IntOp(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    int64_t res = instr->int_op.fnc(frame->regs[instr->lhs].i64, frame->regs[instr->rhs].i64);
+    if (res < instr->int_op.min || (res > 0 && (uint64_t) res > instr->int_op.max)) {
+        fprintf(stderr, "Integer overflow\n");
+        abort();
+    }
+    frame->regs[instr->dst].i64 = res;
+    return ip + 1;
+}
+
+size_t regvm_execute_UIntOp(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    uint64_t res = instr->uint_op.fnc(frame->regs[instr->lhs].u64, frame->regs[instr->rhs].u64);
+    if (res > instr->uint_op.max) {
+        fprintf(stderr, "Integer overflow\n");
+        abort();
+    }
+    frame->regs[instr->dst].u64 = res;
+    return ip + 1;
+}
+
+size_t regvm_execute_FloatOp(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    double res = instr->float_op(frame->regs[instr->lhs].f64, frame->regs[instr->rhs].f64);
+    frame->regs[instr->dst].f64 = (instr->kind == RVK_F32) ? (float) res : res;
+    return ip + 1;
+}
+
+size_t regvm_execute_BoolOp(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    frame->regs[instr->dst].u64 = instr->bool_op(frame->regs[instr->lhs].u64 != 0, frame->regs[instr->rhs].u64 != 0);
+    return ip + 1;
+}
+
+size_t regvm_execute_IntUnary(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    regvm_value_t res = { .i64 = instr->int_unary(frame->regs[instr->lhs].i64) };
+    frame->regs[instr->dst] = regvm_normalize(instr->kind, res);
+    return ip + 1;
+}
+
+size_t regvm_execute_UIntUnary(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    regvm_value_t res = { .u64 = instr->uint_unary(frame->regs[instr->lhs].u64) };
+    frame->regs[instr->dst] = regvm_normalize(instr->kind, res);
+    return ip + 1;
+}
+
+size_t regvm_execute_FloatUnary(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    double res = instr->float_unary(frame->regs[instr->lhs].f64);
+    frame->regs[instr->dst].f64 = (instr->kind == RVK_F32) ? (float) res : res;
+    return ip + 1;
+}
+
+size_t regvm_execute_Jump(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    (void) frame;
+    (void) ip;
+    return instr->target;
+}
+
+size_t regvm_execute_JumpF(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    return (frame->regs[instr->lhs].u64 == 0) ? instr->target : ip + 1;
+}
+
+size_t regvm_execute_JumpT(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    return (frame->regs[instr->lhs].u64 != 0) ? instr->target : ip + 1;
+}
+
+size_t regvm_execute_Call(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    interpreter_t *interpreter = frame->interpreter;
+    regvm_arg_t   *args = frame->code->args.items + instr->call.args;
+    regvm_code_t  *callee = regvm_lookup(interpreter, instr->call.function);
+    regvm_value_t  ret;
+    if (callee != NULL) {
+        regvm_value_t *window = regvm_enter(interpreter, callee);
+        for (size_t ix = 0; ix < instr->call.argc; ++ix) {
+            regvm_reg_t param = callee->params.items[ix].reg;
+            if (param != REGVM_NO_REG) {
+                window[param] = frame->regs[args[ix].reg];
+            }
+        }
+        ret = regvm_run(interpreter, callee, window);
+        regvm_leave(interpreter, callee);
+    } else {
+        // The stack machine takes its arguments from the stack.
+        regvm_check_depth(interpreter, instr->call.function);
+        size_t pushed = 0;
+        for (size_t ix = 0; ix < instr->call.argc; ++ix) {
+            regvm_value_t buf;
+            regvm_store(args[ix].kind, frame->regs[args[ix].reg], &buf);
+            stack_push(&interpreter->stack, &buf, regvm_kind_size(args[ix].kind));
+            pushed += align_at(8, regvm_kind_size(args[ix].kind));
+        }
+        interpreter_call(interpreter, instr->call.function, pushed);
+        ret = regvm_load(instr->kind, interpreter->registers);
+    }
+    if (instr->dst != REGVM_NO_REG) {
+        frame->regs[instr->dst] = ret;
+    }
+    return ip + 1;
+}
+
+size_t regvm_execute_Return(regvm_frame_t *frame, regvm_instr_t *instr, size_t ip)
+{
+    (void) ip;
+    if (instr->lhs != REGVM_NO_REG) {
+        frame->result = frame->regs[instr->lhs];
+    }
+    return frame->code->instrs.len;
+}
+
+void regvm_jit_call(regvm_frame_t *frame, regvm_instr_t *instr)
+{
+    regvm_execute_Call(frame, instr, 0);
+}
+
+// Runs `code` as native code once it has run `jit_threshold` times, if
+// it can be compiled.
+static regvm_value_t regvm_run(interpreter_t *interpreter, regvm_code_t *code, regvm_value_t *regs)
+{
+    regvm_frame_t frame = { .interpreter = interpreter, .code = code, .regs = regs };
+    regvm_frame_bases(&frame);
+    if (interpreter->regvm->jit && !code->jit_tried && code->calls++ >= interpreter->regvm->jit_threshold) {
+        code->jit_tried = true;
+        jit_compile(code, regvm_node_name(interpreter->gen, code->ir));
+    }
+    if (code->jit != NULL) {
+        code->jit(&frame);
+        return frame.result;
+    }
+    regvm_instr_t *instrs = code->instrs.items;
+    size_t         len = code->instrs.len;
+    size_t         ip = 0;
+#ifdef THREADED_DISPATCH
+    static void *dispatch[] = {
+#undef S
+#define S(O) [RVO_##O] = &&do_##O,
+        REGVM_OPCODES(S)
+#undef S
+    };
+#define NEXT()                             \
+    do {                                   \
+        if (ip >= len) {                   \
+            return frame.result;           \
+        }                                  \
+        goto *dispatch[instrs[ip].opcode]; \
+    } while (0)
+
+    NEXT();
+#undef S
+#define S(O)                                           \
+    do_##O:                                            \
+    ip = regvm_execute_##O(&frame, instrs + ip, ip); \
+    NEXT();
+    REGVM_OPCODES(S)
+#undef S
+#undef NEXT
+#else
+    while (ip < len) {
+        regvm_instr_t *instr = instrs + ip;
+        switch (instr->opcode) {
+#undef S
+#define S(O)                                           \
+    case RVO_##O:                                      \
+        ip = regvm_execute_##O(&frame, instr, ip); \
+        break;
+            REGVM_OPCODES(S)
+#undef S
+        default:
+            UNREACHABLE();
+        }
+    }
+    return frame.result;
+#endif
+}
+
+static void regvm_push_result(interpreter_t *interpreter, regvm_kind_t kind, regvm_value_t value)
+{
+    if (kind != RVK_Void) {
+        regvm_value_t buf;
+        regvm_store(kind, value, &buf);
+        stack_push(&interpreter->stack, &buf, regvm_kind_size(kind));
+    }
+}
+
+regvm_t *regvm_create(ir_generator_t *gen)
+{
+    regvm_t *ret = (regvm_t *) allocator_alloc(sizeof(regvm_t));
+    memset(ret, 0, sizeof(regvm_t));
+    ret->gen = gen;
+    dynarr_ensure(&ret->registers, REGVM_REGISTER_FILE_SIZE);
+    return ret;
+}
+
+void regvm_free(regvm_t *regvm)
+{
+    for (size_t ix = 0; ix < regvm->codes.len; ++ix) {
+        regvm_code_t *code = regvm->codes.items + ix;
+        dynarr_free(&code->instrs);
+        dynarr_free(&code->args);
+        dynarr_free(&code->params);
+        jit_release(code);
+    }
+    dynarr_free(&regvm->codes);
+    dynarr_free(&regvm->registers);
+    allocator_free((char *) regvm);
+}
+
+// Compiles functions and modules to native code once they have run
+// `threshold` times on the register VM.
+void regvm_enable_jit(regvm_t *regvm, uint64_t threshold)
+{
+    regvm->jit = true;
+    regvm->jit_threshold = threshold;
+}
+
+// Runs `function` on the register VM if it can be lowered, taking its
+// `pushed` bytes of arguments off the stack and pushing the return value.
+bool regvm_execute_function(interpreter_t *interpreter, nodeptr function, size_t pushed)
+{
+    regvm_code_t *code = regvm_lookup(interpreter, function);
+    if (code == NULL) {
+        return false;
+    }
+    regvm_value_t *window = regvm_enter(interpreter, code);
+    char          *arg = interpreter->stack.top - pushed;
+    for (size_t ix = 0; ix < code->params.len; ++ix) {
+        regvm_arg_t *param = code->params.items + ix;
+        if (param->reg != REGVM_NO_REG) {
+            window[param->reg] = regvm_load(param->kind, arg);
+        }
+        arg += align_at(8, regvm_kind_size(param->kind));
+    }
+    stack_discard(&interpreter->stack, pushed);
+    regvm_value_t ret = regvm_run(interpreter, code, window);
+    regvm_leave(interpreter, code);
+    regvm_push_result(interpreter, code->result, ret);
+    return true;
+}
+
+// Runs the operations of `module`, whose frame has been set up, on the
+// register VM if they can be lowered. The module's value is pushed.
+bool regvm_execute_module(interpreter_t *interpreter, nodeptr module)
+{
+    regvm_code_t *code = regvm_lookup(interpreter, module);
+    if (code == NULL) {
+        return false;
+    }
+    regvm_value_t *window = regvm_enter(interpreter, code);
+    regvm_value_t  ret = regvm_run(interpreter, code, window);
+    regvm_leave(interpreter, code);
+    regvm_push_result(interpreter, code->result, ret);
+    return true;
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef __REGVM_H__
+#define __REGVM_H__
+
+#include <stdint.h>
+
+#include "da.h"
+#include "interpreter.h"
+#include "ir.h"
+#include "operators.h"
+#include "slice.h"
+#include "type.h"
+
+// The three-address code of the register VM, shared by the VM in regvm.c
+// and the native code compiler in jit.c.
+
+// Maximum number of registers in the window of one function or module.
+#define REGVM_MAX_REGS 1024
+
+// Maximum number of frames a variable access walks up.
+#define REGVM_MAX_DEPTH 8
+
+typedef uint16_t regvm_reg_t;
+#define REGVM_NO_REG UINT16_MAX
+
+// Integers are widened to 64 bits, bools are 0 or 1, and floats are held
+// as doubles.
+typedef union _regvm_value {
+    int64_t  i64;
+    uint64_t u64;
+    double   f64;
+    slice_t  slice;
+} regvm_value_t;
+
+typedef DA(regvm_value_t) regvm_values_t;
+
+typedef enum _regvm_kind {
+    RVK_Invalid,
+    RVK_Void,
+    RVK_Bool,
+#undef S
+#define S(W, T) RVK_##W,
+    INTTYPES(S)
+#undef S
+#define S(W, T) RVK_F##W,
+        FLOATTYPES(S)
+#undef S
+            RVK_Slice,
+} regvm_kind_t;
+
+#define REGVM_OPCODES(S) \
+    S(Const)             \
+    S(Move)              \
+    S(Load)              \
+    S(Store)             \
+    S(IntOp)             \
+    S(UIntOp)            \
+    S(FloatOp)           \
+    S(BoolOp)            \
+    S(IntUnary)          \
+    S(UIntUnary)         \
+    S(FloatUnary)        \
+    S(Jump)              \
+    S(JumpF)             \
+    S(JumpT)             \
+    S(Call)              \
+    S(Return)
+
+typedef enum _regvm_opcode {
+#undef S
+#define S(O) RVO_##O,
+    REGVM_OPCODES(S)
+#undef S
+} regvm_opcode_t;
+
+typedef struct _regvm_arg {
+    regvm_reg_t  reg;
+    regvm_kind_t kind;
+} regvm_arg_t;
+
+typedef DA(regvm_arg_t) regvm_args_t;
+
+typedef struct _regvm_instr {
+    regvm_opcode_t opcode;
+    regvm_kind_t   kind;
+    regvm_reg_t    dst;
+    regvm_reg_t    lhs;
+    regvm_reg_t    rhs;
+    operator_t     op; // Operators and unary operators
+    union {
+        regvm_value_t constant;
+        struct {
+            uint32_t depth;
+            intptr_t offset;
+        } var;
+        struct {
+            int_binary_op_fnc_t fnc;
+            int64_t             min;
+            uint64_t            max;
+        } int_op;
+        struct {
+            uint_binary_op_fnc_t fnc;
+            uint64_t             max;
+        } uint_op;
+        double_binary_op_fnc_t float_op;
+        bool_binary_op_fnc_t   bool_op;
+        int_unary_op_fnc_t     int_unary;
+        uint_unary_op_fnc_t    uint_unary;
+        double_unary_op_fnc_t  float_unary;
+        size_t                 target;
+        struct {
+            nodeptr function;
+            size_t  args;
+            size_t  argc;
+        } call;
+    };
+} regvm_instr_t;
+
+typedef DA(regvm_instr_t) regvm_instrs_t;
+
+typedef enum _regvm_status {
+    RVC_Unknown,
+    RVC_Lowered,
+    RVC_Unsupported,
+} regvm_status_t;
+
+typedef struct _regvm_frame regvm_frame_t;
+
+// Native code compiled from the instructions of a regvm_code_t. See jit.c.
+typedef void (*regvm_jit_fnc_t)(regvm_frame_t *frame);
+
+typedef struct _regvm_code {
+    regvm_status_t  status;
+    nodeptr         ir;
+    regvm_instrs_t  instrs;
+    regvm_args_t    args;      // Arguments of all calls
+    regvm_args_t    params;    // REGVM_NO_REG for parameters that are never read
+    regvm_kind_t    result;    // Kind of the return value or the module's value
+    size_t          num_regs;  // Size of the register window
+    uint32_t        depth;     // Number of frames accessed through the stack
+    uint64_t        calls;     // Number of times the code ran
+    bool            jit_tried; // Compiling to native code has been attempted
+    regvm_jit_fnc_t jit;       // NULL unless compiled to native code
+    size_t          jit_size;  // Size of the mapping holding `jit`
+} regvm_code_t;
+
+typedef DA(regvm_code_t) regvm_codes_t;
+
+struct _regvm_frame {
+    interpreter_t *interpreter;
+    regvm_code_t  *code;
+    regvm_value_t *regs;
+    char          *bases[REGVM_MAX_DEPTH];
+    regvm_value_t  result;
+};
+
+// Runs the call `instr` of the code running in `frame`. Native code calls
+// back into the VM for calls.
+void regvm_jit_call(regvm_frame_t *frame, regvm_instr_t *instr);
+
+bool jit_compile(regvm_code_t *code, slice_t name);
+void jit_release(regvm_code_t *code);
+
+#endif /* __REGVM_H__ */
@@ -32,17 +32,9 @@ typedef struct _dl_error {
 typedef RES(lib_handle_t, dl_error_t) lib_handle_result_t;
 typedef RES(void_t, dl_error_t) function_result_t;
 
-typedef struct _resolve_function {
-    slice_t name;
-    void_t  function;
-} resolve_function_t;
-
-typedef DA(resolve_function_t) resolve_functions_t;
-
 typedef struct _library {
     lib_handle_result_t handle;
     slice_t             image;
-    resolve_functions_t functions;
 } library_t;
 
 typedef DA(library_t) libraries_t;
@@ -61,9 +53,68 @@ function_result_t resolve_function(slice_t name);
 #ifndef RESOLVE_IMPLEMENTED
 
 #include <dlfcn.h>
+#include <pthread.h>
 
 #include "type.h"
 
+// @comptime blocks running on different threads share the resolver.
+static pthread_mutex_t resolve_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Results of resolve_function, keyed by the qualified `lib:symbol` name.
+// Misses are cached as well, as a NULL function or as the error of the
+// library, so a symbol that isn't there is only looked for once. The table
+// uses open addressing with linear probing, and is kept at most half full.
+typedef struct _resolve_entry {
+    slice_t           name;
+    uint64_t          hash;
+    function_result_t result;
+} resolve_entry_t;
+
+typedef struct _resolve_cache {
+    resolve_entry_t *entries;
+    size_t           capacity;
+    size_t           len;
+} resolve_cache_t;
+
+static resolve_cache_t resolve_cache = { 0 };
+
+static uint64_t resolve_hash(slice_t name)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t ix = 0; ix < name.len; ++ix) {
+        hash ^= (uint8_t) name.items[ix];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static resolve_entry_t *resolve_cache_slot(resolve_entry_t *entries, size_t capacity, slice_t name, uint64_t hash)
+{
+    size_t ix = hash & (capacity - 1);
+    while (entries[ix].name.items != NULL) {
+        if (entries[ix].hash == hash && slice_eq(entries[ix].name, name)) {
+            break;
+        }
+        ix = (ix + 1) & (capacity - 1);
+    }
+    return entries + ix;
+}
+
+static void resolve_cache_grow()
+{
+    size_t           capacity = (resolve_cache.capacity == 0) ? 64 : 2 * resolve_cache.capacity;
+    resolve_entry_t *entries = (resolve_entry_t *) allocator_alloc(capacity * sizeof(resolve_entry_t));
+    for (size_t ix = 0; ix < resolve_cache.capacity; ++ix) {
+        resolve_entry_t *e = resolve_cache.entries + ix;
+        if (e->name.items != NULL) {
+            *resolve_cache_slot(entries, capacity, e->name, e->hash) = *e;
+        }
+    }
+    allocator_free((char *) resolve_cache.entries);
+    resolve_cache.entries = entries;
+    resolve_cache.capacity = capacity;
+}
+
 /* ------------------------------------------------------------------------ */
 
 path_t platform_image(slice_t image)
@@ -175,12 +226,6 @@ function_result_t library_get_function(library_t *lib, slice_t function_name)
     if (!lib->handle.ok) {
         return RESERR(function_result_t, lib->handle.error);
     }
-    for (size_t ix = 0; ix < lib->functions.len; ++ix) {
-        resolve_function_t *f = lib->functions.items + ix;
-        if (slice_eq(f->name, function_name)) {
-            return RESVAL(function_result_t, f->function);
-        }
-    }
     dlerror();
     size_t      cp = temp_save();
     char const *fnc = function_name.items;
@@ -202,7 +247,6 @@ function_result_t library_get_function(library_t *lib, slice_t function_name)
             return RESERR(function_result_t, (dl_error_t) { .message = err });
         }
     }
-    dynarr_append_s(resolve_function_t, &lib->functions, .name = function_name, .function = function);
     return RESVAL(function_result_t, function);
 }
 
@@ -257,14 +301,37 @@ function_result_t resolve_function(slice_t func_name)
         function = slice_tail(s, colon.value + 1);
     }
 
-    resolve_t *resolve = get_resolver();
-    nodeptr    p = resolve_open(lib_name);
-    assert(p.ok);
-    library_t *lib = resolve->items + p.value;
-    if (!lib->handle.ok) {
-        return RESERR(function_result_t, lib->handle.error);
+    char    qualified[lib_name.len + function.len + 2];
+    slice_t key = { .items = qualified, .len = lib_name.len + function.len + 1 };
+    snprintf(qualified, sizeof(qualified), SL ":" SL, SLARG(lib_name), SLARG(function));
+    uint64_t hash = resolve_hash(key);
+
+    pthread_mutex_lock(&resolve_mutex);
+    if (2 * (resolve_cache.len + 1) > resolve_cache.capacity) {
+        resolve_cache_grow();
+    }
+    resolve_entry_t *entry = resolve_cache_slot(resolve_cache.entries, resolve_cache.capacity, key, hash);
+    if (entry->name.items == NULL) {
+        resolve_t *resolve = get_resolver();
+        nodeptr    p = resolve_open(lib_name);
+        assert(p.ok);
+        library_t        *lib = resolve->items + p.value;
+        function_result_t ret = RESERR(function_result_t, lib->handle.error);
+        if (lib->handle.ok) {
+            ret = library_get_function(lib, function);
+        }
+        char *name = allocator_alloc(key.len + 1);
+        memcpy(name, key.items, key.len);
+        *entry = (resolve_entry_t) {
+            .name = { .items = name, .len = key.len },
+            .hash = hash,
+            .result = ret,
+        };
+        ++resolve_cache.len;
     }
-    return library_get_function(lib, function);
+    function_result_t ret = entry->result;
+    pthread_mutex_unlock(&resolve_mutex);
+    return ret;
 }
 
 resolve_t *get_resolver()
@@ -283,6 +350,17 @@ int main()
 {
     function_result_t res = resolve_function(C("libelrrt:elrond$putln"));
     assert(res.ok && res.success != NULL);
+
+    function_result_t strlen_res = resolve_function(C("strlen"));
+    assert(strlen_res.ok && strlen_res.success != NULL);
+    assert(resolve_function(C(" :strlen ")).success == strlen_res.success);
+
+    size_t            cached = resolve_cache.len;
+    function_result_t missing = resolve_function(C("elrond$no_such_function"));
+    assert(missing.ok && missing.success == NULL);
+    missing = resolve_function(C("elrond$no_such_function"));
+    assert(missing.ok && missing.success == NULL);
+    assert(resolve_cache.len == cached + 1);
 }
 
 #endif
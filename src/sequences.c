@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2025, Jan de Visser <jan@finiandarcy.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "da.h"
+#include "interpreter.h"
+#include "ir.h"
+
+// Mines the execution traces of the interpreter for sequences of
+// operations that are candidates for superinstructions. Only sequences
+// executed in a straight line, without a jump or a label in between,
+// can be fused.
+
+#define SEQUENCE_MAX_LEN 4
+#define SEQUENCE_REPORT_MAX 20
+
+typedef struct _sequence {
+    ir_operation_type_t ops[SEQUENCE_MAX_LEN];
+    size_t              len;
+    uint64_t            count;
+} sequence_t;
+
+typedef DA(sequence_t) sequences_t;
+
+typedef struct _sequence_window {
+    nodeptr             ir;
+    uint64_t            ip;
+    ir_operation_type_t ops[SEQUENCE_MAX_LEN];
+    size_t              len;
+} sequence_window_t;
+
+static sequences_t       sequences = { 0 };
+static sequence_window_t window = { 0 };
+
+static void sequence_count(ir_operation_type_t const *ops, size_t len)
+{
+    for (size_t ix = 0; ix < sequences.len; ++ix) {
+        sequence_t *seq = sequences.items + ix;
+        if (seq->len == len && memcmp(seq->ops, ops, len * sizeof(ir_operation_type_t)) == 0) {
+            ++seq->count;
+            return;
+        }
+    }
+    sequence_t seq = { .len = len, .count = 1 };
+    memcpy(seq.ops, ops, len * sizeof(ir_operation_type_t));
+    dynarr_append(&sequences, seq);
+}
+
+// Interpreter callback recording every operation executed. Install it
+// as the interpreter's callback.
+bool sequences_callback(interpreter_callback_type_t type, interpreter_t *interpreter, interpreter_callback_payload_t payload)
+{
+    if (type != ICT_BeforeOperation) {
+        return true;
+    }
+    interpreter_context_t *ctx = dynarr_back(&interpreter->call_stack);
+    if (payload.op.type == IRO_Label || window.len == 0 || ctx->ir.value != window.ir.value || ctx->ip != window.ip + 1) {
+        window.len = 0;
+    }
+    window.ir = ctx->ir;
+    window.ip = ctx->ip;
+    if (payload.op.type == IRO_Label) {
+        return true;
+    }
+    if (window.len == SEQUENCE_MAX_LEN) {
+        memmove(window.ops, window.ops + 1, (SEQUENCE_MAX_LEN - 1) * sizeof(ir_operation_type_t));
+        --window.len;
+    }
+    window.ops[window.len++] = payload.op.type;
+    for (size_t len = 2; len <= window.len; ++len) {
+        sequence_count(window.ops + window.len - len, len);
+    }
+    return true;
+}
+
+// Fusing a sequence of n operations saves n - 1 dispatches every time
+// it is executed.
+static int sequence_cmp(void const *a, void const *b)
+{
+    sequence_t const *s1 = a;
+    sequence_t const *s2 = b;
+    uint64_t          saved1 = s1->count * (s1->len - 1);
+    uint64_t          saved2 = s2->count * (s2->len - 1);
+    if (saved1 != saved2) {
+        return (saved1 > saved2) ? -1 : 1;
+    }
+    return (int) s2->len - (int) s1->len;
+}
+
+// Lists the sequences that would save the most dispatches if they were
+// fused.
+void sequences_report(FILE *f)
+{
+    qsort(sequences.items, sequences.len, sizeof(sequence_t), sequence_cmp);
+    fprintf(f, "%12s %12s  %s\n", "saved", "executed", "sequence");
+    for (size_t ix = 0; ix < sequences.len && ix < SEQUENCE_REPORT_MAX; ++ix) {
+        sequence_t *seq = sequences.items + ix;
+        fprintf(f, "%12llu %12llu  ", (unsigned long long) (seq->count * (seq->len - 1)), (unsigned long long) seq->count);
+        for (size_t op = 0; op < seq->len; ++op) {
+            fprintf(f, "%s" SL, (op > 0) ? "; " : "", SLARG(operation_type_name(seq->ops[op])));
+        }
+        fprintf(f, "\n");
+    }
+}
@@ -4,129 +4,121 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <errno.h>
 #include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "interpreter.h"
 #include "node.h"
 #include "type.h"
 
-typedef int64_t (*int_unary_op_fnc_t)(int64_t);
-typedef uint64_t (*uint_unary_op_fnc_t)(uint64_t);
-typedef double (*double_unary_op_fnc_t)(double);
-typedef bool (*bool_unary_op_fnc_t)(bool);
-typedef int64_t (*int_binary_op_fnc_t)(int64_t, int64_t);
-typedef uint64_t (*uint_binary_op_fnc_t)(uint64_t, uint64_t);
-typedef double (*double_binary_op_fnc_t)(double, double);
-typedef bool (*bool_binary_op_fnc_t)(bool, bool);
-
-typedef struct _unary_up_fncs {
-    int_unary_op_fnc_t    int_fnc;
-    uint_unary_op_fnc_t   uint_fnc;
-    double_unary_op_fnc_t double_fnc;
-    bool_unary_op_fnc_t   bool_fnc;
-} unary_op_fncs_t;
-
-typedef struct _binary_op_fncs {
-    int_binary_op_fnc_t    int_fnc;
-    uint_binary_op_fnc_t   uint_fnc;
-    double_binary_op_fnc_t double_fnc;
-    bool_binary_op_fnc_t   bool_fnc;
-} binary_op_fncs_t;
+interp_stack_t stack_create(size_t size)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size = align_at(page, size);
+    char *base = mmap(NULL, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        fatal("Could not allocate interpreter stack: %s", strerror(errno));
+    }
+    // Anything that gets past the overflow checks faults on the guard page
+    // instead of scribbling over other memory.
+    if (mprotect(base + size, page, PROT_NONE) != 0) {
+        fatal("Could not protect interpreter stack guard page: %s", strerror(errno));
+    }
+    return (interp_stack_t) { .base = base, .top = base, .limit = base + size };
+}
 
-intptr_t stack_reserve(interp_stack_t *stack, size_t size)
+void stack_free(interp_stack_t *stack)
 {
-    dynarr_ensure(stack, size);
-    intptr_t ret = stack->len;
-    stack->len = size;
+    if (stack->base != NULL) {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        munmap(stack->base, (stack->limit - stack->base) + page);
+    }
+    *stack = (interp_stack_t) { 0 };
+}
+
+static char *stack_grow(interp_stack_t *stack, size_t size)
+{
+    char  *ret = stack->top;
+    size_t aligned = align_at(sizeof(intptr_t), size);
+    if (aligned > (size_t) (stack->limit - ret)) {
+        fatal("Interpreter stack overflow: %zu bytes in use, %zu more requested", stack_size(stack), aligned);
+    }
+    stack->top = ret + aligned;
     return ret;
 }
 
+intptr_t stack_reserve(interp_stack_t *stack, size_t size)
+{
+    char *p = stack_grow(stack, size);
+    memset(p, 0, stack->top - p);
+    return p - stack->base;
+}
+
 intptr_t stack_push(interp_stack_t *stack, void *ptr, size_t size)
 {
-    intptr_t *p = (intptr_t *) ptr;
-    size_t    pushed = 0;
-    intptr_t  offset = stack->len * sizeof(intptr_t);
-    while (pushed < size) {
-        dynarr_append(stack, *p);
-        ++p;
-        pushed += sizeof(intptr_t);
+    char *p = stack_grow(stack, size);
+    if (size % sizeof(intptr_t) != 0) {
+        ((intptr_t *) stack->top)[-1] = 0;
     }
-    return offset;
+    memcpy(p, ptr, size);
+    return p - stack->base;
 }
 
 void stack_store(interp_stack_t *stack, void *src, intptr_t offset, size_t size)
 {
-    intptr_t *p = (intptr_t *) src;
-    size_t    stored = 0;
-    offset /= sizeof(intptr_t);
-    size_t cap = ((offset + size) % sizeof(intptr_t) != 0)
-        ? (offset + size) / sizeof(intptr_t) + 1
-        : (offset + size) / sizeof(intptr_t);
-    dynarr_ensure(stack, cap);
-    while (stored < size) {
-        stack->items[offset] = *p;
-        ++p;
-        ++offset;
-        stored += sizeof(intptr_t);
-    }
+    assert(offset + size <= stack_size(stack));
+    memcpy(stack->base + offset, src, size);
 }
 
 void stack_load(interp_stack_t *stack, void *dest, intptr_t offset, size_t size)
 {
-    assert(offset + size <= stack->len * sizeof(intptr_t));
-    intptr_t *p = (intptr_t *) dest;
-    size_t    loaded = 0;
-    offset /= sizeof(intptr_t);
-    while (loaded < size) {
-        stack->items[offset] = *p;
-        ++p;
-        ++offset;
-        loaded += sizeof(intptr_t);
-    }
+    assert(offset + size <= stack_size(stack));
+    memcpy(dest, stack->base + offset, size);
 }
 
-void stack_discard(interp_stack_t *stack, size_t bp)
+// Drops the top `size` bytes, rounded up to whole stack words.
+void stack_discard(interp_stack_t *stack, size_t size)
 {
-    assert(bp <= stack->len * sizeof(intptr_t));
-    if (bp < stack->len * sizeof(intptr_t)) {
-        size_t diff = (bp % sizeof(intptr_t) != 0)
-            ? bp / sizeof(intptr_t) + 1
-            : bp / sizeof(intptr_t);
-        stack->len -= diff;
-    }
+    size_t aligned = align_at(sizeof(intptr_t), size);
+    assert(aligned <= stack_size(stack));
+    stack->top -= aligned;
 }
 
 void stack_pop(interp_stack_t *stack, void *dest, size_t size)
 {
-    size_t offset = stack->len - align_at(sizeof(intptr_t), size) / sizeof(intptr_t);
-    stack_load(stack, dest, offset, size);
-    stack->len = offset;
+    stack_discard(stack, size);
+    memcpy(dest, stack->top, size);
 }
 
 void stack_copy(interp_stack_t *stack, intptr_t dest, intptr_t src, size_t size)
 {
-    stack_load(stack, (void *) (stack->items + dest / sizeof(intptr_t)), src, size);
+    assert(dest + size <= stack_size(stack));
+    assert(src + size <= stack_size(stack));
+    memmove(stack->base + dest, stack->base + src, size);
 }
 
 void stack_copy_and_pop(interp_stack_t *stack, intptr_t dest, size_t size)
 {
-    size_t offset = stack->len - align_at(sizeof(intptr_t), size) / sizeof(intptr_t);
-    stack_copy(stack, dest, offset * sizeof(intptr_t), size);
-    stack->len = offset;
+    stack_discard(stack, size);
+    assert(dest + size <= stack_size(stack));
+    memmove(stack->base + dest, stack->top, size);
 }
 
 void stack_push_copy(interp_stack_t *stack, intptr_t src, size_t size)
 {
-    stack_push(stack, stack->items + src / sizeof(intptr_t), size);
+    intptr_t dest = stack_reserve(stack, size);
+    memcpy(stack->base + dest, stack->base + src, size);
 }
 
 intptr_t stack_push_value(interp_stack_t *stack, value_t val)
 {
     type_t  *type = get_type(val.type);
-    intptr_t ret = stack->len * sizeof(intptr_t);
+    intptr_t ret = stack_size(stack);
     switch (type->kind) {
     case TYPK_IntType:
         switch (type->int_type.code) {
@@ -187,7 +179,7 @@ intptr_t stack_push_value(interp_stack_t *stack, value_t val)
 intptr_t evaluate_AddressOf(interp_stack_t *stack, nodeptr t1)
 {
     (void) t1;
-    return (stack->len - 1) * sizeof(intptr_t);
+    return stack_size(stack) - sizeof(intptr_t);
 }
 
 intptr_t evaluate_Length(interp_stack_t *stack, nodeptr t1)
@@ -298,7 +290,7 @@ INT_OP_DIVZERO(Divide, /)
 NUMERIC_BOOL_OP(Equals, ==)
 NUMERIC_OP(Greater, >)
 NUMERIC_OP(GreaterEqual, >=)
-NUMERIC_OP(Less, >)
+NUMERIC_OP(Less, <)
 NUMERIC_OP(LessEqual, <=)
 BOOL_OP(LogicalAnd, &&)
 BOOL_OP(LogicalOr, ||)
@@ -344,6 +336,22 @@ binary_op_fncs_t binary_op_fncs[] = {
     [OP_Subtract] = { .int_fnc = int_Subtract, .uint_fnc = uint_Subtract, .double_fnc = double_Subtract, .bool_fnc = NULL },
 };
 
+binary_op_fncs_t const *binary_op_functions(operator_t op)
+{
+    if (op >= sizeof(binary_op_fncs) / sizeof(binary_op_fncs_t)) {
+        return NULL;
+    }
+    return binary_op_fncs + op;
+}
+
+unary_op_fncs_t const *unary_op_functions(operator_t op)
+{
+    if (op >= sizeof(unary_op_fncs) / sizeof(unary_op_fncs_t)) {
+        return NULL;
+    }
+    return unary_op_fncs + op;
+}
+
 intptr_t evaluate_Int_BinOp(interp_stack_t *stack, type_t *lhs_type, operator_t op)
 {
     assert(op < sizeof(binary_op_fncs) / sizeof(binary_op_fncs_t));
@@ -362,7 +370,7 @@ intptr_t evaluate_Int_BinOp(interp_stack_t *stack, type_t *lhs_type, operator_t
         }
         assert(binary_op_fncs[op].int_fnc != NULL);
         int64_t res = binary_op_fncs[op].int_fnc(lhs, rhs);
-        if (res < lhs_type->int_type.min_value || (uint64_t) res > lhs_type->int_type.max_value) {
+        if (res < lhs_type->int_type.min_value || (res > 0 && (uint64_t) res > lhs_type->int_type.max_value)) {
             fprintf(stderr, "Integer overflow\n");
             abort();
         }
@@ -479,6 +487,17 @@ intptr_t evaluate_Float_BinOp(interp_stack_t *stack, type_t *lhs_type, operator_
     }
     assert(binary_op_fncs[op].double_fnc != NULL);
     double res = binary_op_fncs[op].double_fnc(lhs, rhs);
+    switch (op) {
+    case OP_Equals:
+    case OP_NotEqual:
+    case OP_Less:
+    case OP_LessEqual:
+    case OP_Greater:
+    case OP_GreaterEqual:
+        return stack_push_T(bool, stack, res != 0);
+    default:
+        break;
+    }
     switch (lhs_type->float_width) {
 #undef S
 #define S(W, T)                                 \
@@ -81,12 +81,17 @@ typedef struct _type_name {
     nodeptr type;
 } type_name_t;
 
+// @comptime blocks run on several threads, and only read the type
+// registry. Types are not made while the registry is frozen, and a type's
+// name is made together with the type.
 #define make_type(k, ...)                                                          \
     (                                                                              \
         {                                                                          \
+            assert(!type_registry_frozen);                                         \
             type_t __t = { .kind = (k), .str = { 0 }, __VA_ARGS__ };               \
             dynarr_append(&type_registry, __t);                                    \
             nodeptr __ret = OPTVAL(size_t, type_registry.len - 1);                 \
+            type_to_string(__ret);                                                 \
             trace("Created type %zu: %d " SL,                                      \
                 __ret.value, get_type(__ret)->kind, SLARG(type_kind_name(__ret))); \
             __ret;                                                                 \
@@ -94,6 +99,7 @@ typedef struct _type_name {
 
 static DA(type_t) type_registry = { 0 };
 static DA(type_name_t) type_by_name = { 0 };
+static bool type_registry_frozen = false;
 
 /* ------------------------------------------------------------------------ */
 
@@ -794,6 +800,14 @@ void type_registry_init()
                                                          .parameters = { 0 },
                                                          .result = Void,
                                                      });
+    for (size_t ix = 0; ix < type_registry.len; ++ix) {
+        type_to_string(nodeptr_ptr(ix));
+    }
+}
+
+void type_registry_freeze(bool frozen)
+{
+    type_registry_frozen = frozen;
 }
 
 #define GETTYPE(p) (type_registry.items + (p).value)
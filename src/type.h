@@ -206,6 +206,7 @@ nodeptr  struct_of(struct_fields_t fields);
 type_t  *get_type_file_line(nodeptr p, char const *file, int line);
 nodeptr  find_type(slice_t name);
 void     type_registry_init();
+void     type_registry_freeze(bool frozen);
 
 #define get_type(type) (get_type_file_line(type, __FILE__, __LINE__))
 #define type_kind(type) (get_type_file_line((type), __FILE__, __LINE__)->kind)